@@ -1,8 +1,10 @@
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <getopt.h>
 #include <pthread.h>
 #include <unistd.h>
 
@@ -11,9 +13,21 @@
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 
-#include "hashtable.h"
+#include "build_cmd.h"
+#include "conntable.h"
+#include "coro.h"
+#include "hist.h"
+#include "servers.h"
+#include "trace.h"
+#include "wr_id.h"
 
 #define BUFF_SIZE 4096
+#define MAX_CONNS 1024
+#define RATE_STEPS 10   /* an open-loop sweep goes up to -R in this many steps */
+#define CLIENTS_MAX 65536   /* -n, per thread */
+#define REGMEM_OPS 9    /* the commands of the cycle, a workload is get and set of them */
+
+enum { OUTPUT_TEXT, OUTPUT_JSON, OUTPUT_CSV };
 
 /***************************************************************************//**
  * Relative resources around connection
@@ -33,7 +47,22 @@ struct thread_context {
     struct event_base           *base;
     struct event                poll_event;
 
-    hashtable_t                 *qp_hash;
+    conntable_t                 *conns;
+    struct rdma_conn            **conn_list;
+    int                         nconns;
+
+    /* the run of a test, over every connection of the thread */
+    int                         running;    /* connections not done yet */
+    int                         ready;      /* connections able to start */
+    uint64_t                    start_ns;
+    uint64_t                    end_ns;     /* nothing is sent after, 0 if the run ends on -r */
+    int                         warming;    /* the run before the first, not reported */
+    int                         step;       /* of a rate sweep, the rate is -R * step / RATE_STEPS */
+    struct event                timer;      /* open-loop, the next request due */
+    uint64_t                    timer_ns;   /* when timer fires, 0 if not pending */
+    struct hist                 *op_hist;   /* of latencies, REGMEM_OPS of them */
+    uint64_t                    *ticks;     /* the replies in each interval of the run */
+    size_t                      nticks;
 
     size_t                      rsize;
     size_t                      buff_list_size;     
@@ -43,11 +72,21 @@ struct thread_context {
     struct ibv_wc               *poll_wc;
     size_t                      ack_events;
 
+    struct ibv_mr               *arena_mr;  /* workload_arena, see -k */
+    struct trace_rec            *recs;      /* -W, the requests of the last run */
+    size_t                      nrecs;
+    size_t                      recs_size;
+    size_t                      recs_missed;    /* sent once recs was full */
+
     int                         thread_id;
 };
 
 struct rdma_conn {
     struct rdma_cm_id   *id;
+    int                 slot;
+    int                 server;     /* in servers */
+
+    struct thread_context   *ctx;
 
     size_t  total_recv;
 
@@ -55,6 +94,7 @@ struct rdma_conn {
     void (*handle_send) (struct ibv_wc*, struct rdma_conn*);
     void (*handle_read) (struct ibv_wc*, struct rdma_conn*);
     void (*handle_write) (struct ibv_wc*, struct rdma_conn*);
+    void (*handle_atomic) (struct ibv_wc*, struct rdma_conn*);
 
     void *context;
 };
@@ -68,10 +108,10 @@ void cc_poll_event_handler(int fd, short libevent_event, void *arg);
 
 static struct thread_context* init_rdma_thread_resources();
 static int init_and_dispatch_event(struct thread_context *ctx);
-static struct rdma_conn* build_connection(struct thread_context *ctx);
+static struct rdma_conn* build_connection(struct thread_context *ctx, int server);
 static void handle_work_complete(struct ibv_wc *wc, struct rdma_conn *c);
 
-static int send_mr(struct rdma_cm_id *id, struct ibv_mr *mr);
+static int send_mr(struct rdma_conn *c, struct ibv_mr *mr, uint32_t index);
 
 static void test_with_regmem(struct thread_context *ctx);
 
@@ -81,6 +121,9 @@ static void test_with_regmem(struct thread_context *ctx);
  ******************************************************************************/
 static char     *pstr_server = "127.0.0.1";
 static char     *pstr_port = "11211";
+static struct server_addr servers[SERVERS_MAX];
+static int      nservers = 0;
+static int      conns_per_thread = 1;
 static int      thread_number = 1;
 static int      request_number = 10000;
 static int      verbose = 0;
@@ -91,6 +134,44 @@ static int      max_sge = 16;
 static int      buff_per_thread = 128;
 static int      poll_wc_size = 128;
 static size_t   ack_events = 16;
+static int      if_binary = 0;
+static int      atomic_counter = 0;
+static int      depth = 1;          /* requests in flight per connection */
+static int      sweep = 0;          /* run depth 1, 2, 4 ... up to depth, or the rates up to -R */
+static double   rate = 0;           /* open-loop, requests per second over every connection */
+static int      poisson = 1;        /* open-loop arrivals, exponential gaps or constant ones */
+static double   slo_us = 1000;      /* the p99 a rate sweep holds to */
+static int      workload = 0;       /* the requests of init_workload() rather than the cycle of 9 */
+static int      open_loop = 0;      /* requests go when due, -R or -P */
+static char     *trace_out = NULL;  /* -W, record the requests sent */
+static struct trace replay;         /* -P, the trace replayed */
+static double   speed = 1;          /* of a replay, 2 is twice as fast */
+static size_t   req_stride = 1;     /* a replay deals the requests round the connections */
+static int      output = OUTPUT_TEXT;   /* -O, the results as text, json or csv */
+static FILE     *text_out;          /* the text of a run, stderr unless -O text */
+static uint64_t interval_ns = 1000000000;   /* the throughput of a run is counted over these */
+static double   warmup = 0;         /* secs, sent before the first run and not reported */
+static double   duration = 0;       /* secs, of a run, rather than -r requests per connection */
+static int      nclients = 0;       /* -n, clients per thread, each a coroutine with one request out */
+static double   think_us = 0;       /* the mean pause of a client between a reply and its next request */
+
+/* the records of every thread, written once they are done */
+static struct trace_rec *all_recs;
+static size_t           all_nrecs;
+
+/* the runs of threads add up here, a run ends on every thread before the
+ * next starts */
+static pthread_mutex_t  all_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t all_barrier;
+static struct hist      all_hist;
+static double           all_ops;
+static double           all_secs;   /* of the longest thread */
+static struct hist      all_op_hist[REGMEM_OPS];
+static uint64_t         *all_ticks;
+static size_t           all_nticks;
+static int              all_runs;
+static double           slo_ops;    /* the best throughput whose p99 met slo_us */
+static double           slo_rate;
 
 /***************************************************************************//**
  * Testing message
@@ -129,7 +210,9 @@ init_rdma_thread_resources() {
 
     struct thread_context *ctx = calloc(1, sizeof(struct thread_context));
 
-    ctx->qp_hash = hashtable_create(1024);
+    if ( !(ctx->conns = conntable_create(MAX_CONNS)) ) {
+        return NULL;
+    }
 
     int num_device;
     if ( !(ctx->device_ctx_list = rdma_get_devices(&num_device)) ) {
@@ -138,7 +221,7 @@ init_rdma_thread_resources() {
     }
     ctx->device_ctx = *ctx->device_ctx_list;
     if (verbose) {
-        printf("Get device: %d\n", num_device); 
+        fprintf(text_out, "Get device: %d\n", num_device);
     }
 
     if ( !(ctx->pd = ibv_alloc_pd(ctx->device_ctx)) ) {
@@ -209,6 +292,13 @@ init_rdma_thread_resources() {
         return NULL;
     }
 
+    /* timers may be added before the loop runs, the open-loop one needs
+     * better than the millisecond of epoll */
+    struct event_config *cfg = event_config_new();
+    event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+    ctx->base = event_base_new_with_config(cfg);
+    event_config_free(cfg);
+
     struct ibv_recv_wr *bad = NULL;
     struct ibv_sge sge;
     struct ibv_recv_wr rwr;
@@ -219,7 +309,7 @@ init_rdma_thread_resources() {
         sge.length = ctx->rsize;
         sge.lkey = ctx->rmr_list[i]->lkey;
 
-        rwr.wr_id = (uintptr_t)ctx->rmr_list[i];
+        rwr.wr_id = WR_ID_MAKE(WR_OP_RECV, 0, i);
         rwr.next = NULL;
         rwr.sg_list = &sge;
         rwr.num_sge = 1;
@@ -237,7 +327,6 @@ init_rdma_thread_resources() {
  *  
  ******************************************************************************/
 static int init_and_dispatch_event(struct thread_context *ctx) {
-    ctx->base = event_base_new();
     event_set(&ctx->poll_event, ctx->comp_channel->fd, EV_READ | EV_PERSIST,
             cc_poll_event_handler, ctx);
     event_base_set(ctx->base, &ctx->poll_event);
@@ -256,8 +345,10 @@ static int init_and_dispatch_event(struct thread_context *ctx) {
  *
  ******************************************************************************/
 static struct rdma_conn *
-build_connection(struct thread_context *ctx) {
+build_connection(struct thread_context *ctx, int server) {
     struct rdma_conn *c = calloc(1, sizeof(struct rdma_conn));
+    c->ctx = ctx;
+    c->server = server;
 
     if (0 != rdma_create_id(NULL, &c->id, c, RDMA_PS_TCP)) {
         perror("rdma_create_id()");
@@ -265,7 +356,7 @@ build_connection(struct thread_context *ctx) {
     }
     struct rdma_addrinfo    hints = { .ai_port_space = RDMA_PS_TCP },
                             *res = NULL;
-    if (0 != rdma_getaddrinfo(pstr_server, pstr_port, &hints, &res)) {
+    if (0 != rdma_getaddrinfo(servers[server].host, servers[server].port, &hints, &res)) {
         perror("rdma_getaddrinfo()");
         return NULL;
     }
@@ -283,7 +374,7 @@ build_connection(struct thread_context *ctx) {
 
     struct ibv_qp_init_attr qp_attr;
     memset(&qp_attr, 0, sizeof(struct ibv_qp_init_attr));
-    qp_attr.cap.max_send_wr = 8;
+    qp_attr.cap.max_send_wr = depth > 8 ? depth : 8;
     qp_attr.cap.max_recv_wr = wr_size;
     qp_attr.cap.max_send_sge = max_sge;
     qp_attr.cap.max_recv_sge = max_sge;
@@ -307,8 +398,12 @@ build_connection(struct thread_context *ctx) {
     c->id->send_cq = ctx->send_cq;
     c->id->srq = ctx->srq;
 
-    if (0 != hashtable_insert(ctx->qp_hash, c->id->qp->qp_num, c)) {
-        fprintf(stderr, "hashtable insert error!\n");
+    /* sends carry the slot in wr_id, receives from the srq only carry qp_num */
+    if (-1 == (c->slot = conntable_insert(ctx->conns, c))) {
+        return NULL;
+    }
+    if (0 != conntable_bind_qp(ctx->conns, c->id->qp->qp_num, c->slot)) {
+        fprintf(stderr, "conntable bind qp error!\n");
         return NULL;
     }
 
@@ -319,8 +414,9 @@ build_connection(struct thread_context *ctx) {
  * send mr
  ******************************************************************************/
 static int 
-send_mr(struct rdma_cm_id *id, struct ibv_mr *mr) {
-    return rdma_post_send(id, mr, mr->addr, mr->length, mr, 0);
+send_mr(struct rdma_conn *c, struct ibv_mr *mr, uint32_t index) {
+    return rdma_post_send(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_SEND, c->slot, index),
+            mr->addr, mr->length, mr, 0);
 }
 
 /***************************************************************************//**
@@ -349,6 +445,7 @@ cc_poll_event_handler(int fd, short libevent_event, void *arg) {
     /* poll complete queue */
     int cqe = 0, i = 0;
     struct rdma_conn *c = NULL;
+    struct ibv_wc *wc = NULL;
     do {
         if ( (cqe = ibv_poll_cq(cq, poll_wc_size, ctx->poll_wc)) < 0) {
             perror("ibv_poll_cq()");
@@ -356,8 +453,15 @@ cc_poll_event_handler(int fd, short libevent_event, void *arg) {
         }
 
         for (i = 0; i < cqe; ++i) {
-            c = hashtable_search(ctx->qp_hash, ctx->poll_wc[i].qp_num);
-            handle_work_complete(ctx->poll_wc + i, c);
+            wc = ctx->poll_wc + i;
+            if (WR_OP_RECV == WR_ID_OP(wc->wr_id)) {
+                c = conntable_find_qp(ctx->conns, wc->qp_num);
+            } else {
+                c = conntable_get(ctx->conns, WR_ID_SLOT(wc->wr_id));
+            }
+            if (c) {
+                handle_work_complete(wc, c);
+            }
         }
     } while (cqe == poll_wc_size);
 
@@ -389,6 +493,10 @@ handle_work_complete(struct ibv_wc *wc, struct rdma_conn *c) {
         case IBV_WC_RDMA_READ:
             c->handle_read(wc, c);
             break;
+        case IBV_WC_FETCH_ADD:
+        case IBV_WC_COMP_SWAP:
+            c->handle_atomic(wc, c);
+            break;
         default:
             fprintf(stderr, "unhandled event [%d]\n", (int)wc->opcode);
             break;
@@ -400,79 +508,890 @@ handle_work_complete(struct ibv_wc *wc, struct rdma_conn *c) {
  *
  ******************************************************************************/
 
+#define REGMEM_SET  1
+#define REGMEM_INCR 5
+#define REGMEM_DECR 6
+#define REGMEM_GET  7
+
+/* the commands in the order of the cycle */
+static const char *regmem_ops[REGMEM_OPS] = {
+    "add", "set", "replace", "append", "prepend", "incr", "decr", "get", "delete"
+};
+
+static const char *
+regmem_op_name(int op) {
+    return REGMEM_GET == op && mget_fanout > 0 ? "mget" : regmem_ops[op];
+}
+
+/* a client of the application, it sends a request, waits for the reply and
+ * thinks a while before the next, as if it had a thread of its own */
+struct app_client {
+    struct coro         co;
+    struct rdma_conn    *c;
+    struct event        think;
+};
+
 struct test_regmem_context {
     struct ibv_mr *mr[9];
     size_t  index;
+
+    /* the window of this run, the server answers a connection in order so
+     * the reply to the i-th request is the i-th receive */
+    int             depth;
+    size_t          posted;
+    uint64_t        *sent_ns;   /* depth of them, request i at i % depth */
+    uint8_t         *sent_op;   /* and its command, in regmem_ops */
+
+    /* -n, the window is the clients of the connection, the reply to request
+     * i resumes the client waiting at i % depth */
+    struct app_client   *clients;
+    struct app_client   **waiting;
+    int                 active;     /* clients not done with the run */
+    struct hist     hist;       /* of latencies */
+
+    int             conn;       /* in the conn_list of the thread */
+    size_t          next_req;   /* in workload_reqs */
+
+    /* open-loop, a request is due at next_ns whether or not the replies
+     * keep up, its latency counts from then rather than from its send */
+    uint64_t        next_ns;
+    double          gap_ns;     /* the mean between two requests */
+    unsigned short  seed[3];
+
+    /* -A, incr and decr are atomics on the counter bound by "counter" */
+    int             bound;
+    uint64_t        addr;
+    uint32_t        rkey;
+    uint64_t        value;      /* the last value seen */
+    uint64_t        *result;    /* a atomic returns the old value here */
+    struct ibv_mr   *result_mr;
 };
 
-void handle_recv_regmem(struct ibv_wc *wc, struct rdma_conn *c) {
-    if (c->total_recv == request_number) {
-        exit(0);
+static char counter_cmd[] = "counter async:counter 0\r\n";
+
+static uint64_t
+now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+post_atomic(struct rdma_conn *c, enum ibv_wr_opcode opcode, uint64_t compare_add, uint64_t swap) {
+    struct test_regmem_context *regmem_ctx = c->context;
+    struct ibv_sge sge = { (uintptr_t)regmem_ctx->result, sizeof(uint64_t), regmem_ctx->result_mr->lkey };
+    struct ibv_send_wr wr, *bad = NULL;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = WR_ID_MAKE(WR_OP_ATOMIC, c->slot, 0);
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = opcode;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.atomic.remote_addr = regmem_ctx->addr;
+    wr.wr.atomic.rkey = regmem_ctx->rkey;
+    wr.wr.atomic.compare_add = compare_add;
+    wr.wr.atomic.swap = swap;
+    return ibv_post_send(c->id->qp, &wr, &bad);
+}
+
+/* decr stops at 0 like the command does, so it is a compare-and-swap */
+static int
+post_decr(struct rdma_conn *c) {
+    struct test_regmem_context *regmem_ctx = c->context;
+    uint64_t old = regmem_ctx->value;
+    return post_atomic(c, IBV_WR_ATOMIC_CMP_AND_SWP, old, old ? old - 1 : 0);
+}
+
+/* the request at index, or its atomic, its latency counts from stamp */
+static void
+regmem_next(struct rdma_conn *c, uint64_t stamp) {
+    struct test_regmem_context *regmem_ctx = c->context;
+    size_t index = regmem_ctx->index;
+    size_t slot = regmem_ctx->posted++ % regmem_ctx->depth;
+
+    regmem_ctx->sent_ns[slot] = stamp;
+    if (workload) {
+        struct workload_req *r = &workload_reqs[regmem_ctx->next_req % workload_nreqs];
+        regmem_ctx->next_req += req_stride;
+        regmem_ctx->sent_op[slot] = WORKLOAD_GET == r->op ? REGMEM_GET : REGMEM_SET;
+        if (c->ctx->recs && c->ctx->nrecs == c->ctx->recs_size) {
+            c->ctx->recs_missed += 1;
+        } else if (c->ctx->recs) {
+            c->ctx->recs[c->ctx->nrecs++] = (struct trace_rec){
+                .ns = stamp,
+                .key_hash = r->key_hash,
+                .nvalue = r->nvalue,
+                .op = r->op,
+                .nkey = r->nkey,
+            };
+        }
+        rdma_post_send(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_SEND, c->slot, 0),
+                workload_arena + r->off, r->len, c->ctx->arena_mr, 0);
         return;
     }
+    /* ascii sends a second decr in the place of get */
+    regmem_ctx->sent_op[slot] = REGMEM_GET == index && !if_binary && 0 == mget_fanout ? REGMEM_DECR : index;
+    if (atomic_counter && REGMEM_INCR == index) {
+        post_atomic(c, IBV_WR_ATOMIC_FETCH_AND_ADD, 1, 0);
+    } else if (atomic_counter && REGMEM_DECR == index) {
+        post_decr(c);
+    } else {
+        send_mr(c, regmem_ctx->mr[index], index);
+    }
 
-    struct ibv_mr *mr = (struct ibv_mr*)(uintptr_t)wc->wr_id;
+    if ( ++(regmem_ctx->index) == 9) {
+        regmem_ctx->index = 0;
+    }
+}
+
+/* the rate of this run over every connection */
+static double
+run_rate(struct thread_context *ctx) {
+    return rate * ctx->step / RATE_STEPS;
+}
+
+/* whether a connection sends a request due at when in this run, a warmup
+ * goes on for its time whatever -r is but a replay has only its records */
+static int
+regmem_more(struct rdma_conn *c, uint64_t when) {
+    struct test_regmem_context *regmem_ctx = c->context;
+
+    if (c->ctx->end_ns && when >= c->ctx->end_ns) {
+        return 0;
+    }
+    return (c->ctx->warming && !replay.recs) || regmem_ctx->posted < request_number;
+}
+
+/* make room for n intervals, the new ones empty */
+static void
+grow_ticks(uint64_t **ticks, size_t *nticks, size_t n) {
+    if (n <= *nticks) return;
+    *ticks = realloc(*ticks, n * sizeof(uint64_t));
+    memset(*ticks + *nticks, 0, (n - *nticks) * sizeof(uint64_t));
+    *nticks = n;
+}
+
+/* a reply counts in the interval of the run it came in */
+static void
+count_tick(struct thread_context *ctx, uint64_t now) {
+    size_t i = (now - ctx->start_ns) / interval_ns;
+
+    if (i >= ctx->nticks) {
+        grow_ticks(&ctx->ticks, &ctx->nticks, 2 * i + 1);
+    }
+    ctx->ticks[i] += 1;
+}
+
+/* when the request after the one due at last is due */
+static uint64_t
+regmem_due(struct rdma_conn *c, uint64_t last) {
+    struct test_regmem_context *regmem_ctx = c->context;
+
+    if (replay.recs) {
+        return regmem_ctx->next_req < replay.count
+            ? c->ctx->start_ns + (uint64_t)(replay.recs[regmem_ctx->next_req].ns / speed) : last;
+    }
+    return last + (poisson
+            ? (uint64_t)(-log(1.0 - erand48(regmem_ctx->seed)) * regmem_ctx->gap_ns)
+            : (uint64_t)regmem_ctx->gap_ns);
+}
+
+/* open-loop, post what is due while the window has room, the rest waits
+ * for a reply or the timer */
+static void
+regmem_pump(struct rdma_conn *c, uint64_t now) {
+    struct test_regmem_context *regmem_ctx = c->context;
+
+    while (regmem_ctx->next_ns <= now && regmem_more(c, regmem_ctx->next_ns)
+            && regmem_ctx->posted - c->total_recv < regmem_ctx->depth) {
+        regmem_next(c, regmem_ctx->next_ns);
+        regmem_ctx->next_ns = regmem_due(c, regmem_ctx->next_ns);
+    }
+}
+
+/* set the timer for the earliest request due on a connection with room */
+static void
+regmem_arm(struct thread_context *ctx, uint64_t now) {
+    uint64_t due = UINT64_MAX;
+    int i = 0;
+
+    for (i = 0; i < ctx->nconns; ++i) {
+        struct rdma_conn *c = ctx->conn_list[i];
+        struct test_regmem_context *regmem_ctx = c->context;
+        if (regmem_more(c, regmem_ctx->next_ns)
+                && regmem_ctx->posted - c->total_recv < regmem_ctx->depth
+                && regmem_ctx->next_ns < due) {
+            due = regmem_ctx->next_ns;
+        }
+    }
+    if (UINT64_MAX == due || (ctx->timer_ns && ctx->timer_ns <= due)) {
+        return;
+    }
+
+    uint64_t wait = due > now ? due - now : 0;
+    struct timeval tv = { wait / 1000000000, wait % 1000000000 / 1000 };
+    ctx->timer_ns = due;
+    evtimer_add(&ctx->timer, &tv);
+}
+
+static void
+regmem_tick(int fd, short libevent_event, void *arg) {
+    struct thread_context *ctx = arg;
+    uint64_t now = now_ns();
+    int i = 0;
+
+    ctx->timer_ns = 0;
+    for (i = 0; i < ctx->nconns; ++i) {
+        regmem_pump(ctx->conn_list[i], now);
+    }
+    regmem_arm(ctx, now);
+}
+
+static void regmem_report(struct thread_context *ctx);
+
+/* a pause of think_us on average, the timer resumes the client, 0 if the
+ * pause outlasts the run */
+static int
+client_think(struct app_client *cl) {
+    struct test_regmem_context *regmem_ctx = cl->c->context;
+    uint64_t wait = (uint64_t)(-log(1.0 - erand48(regmem_ctx->seed)) * think_us * 1000);
+    struct timeval tv = { wait / 1000000000, wait % 1000000000 / 1000 };
+
+    if (cl->c->ctx->end_ns && now_ns() + wait >= cl->c->ctx->end_ns) {
+        return 0;
+    }
+    evtimer_add(&cl->think, &tv);
+    return 1;
+}
+
+/* the loop of a client, it yields on every pause until the timer fires and
+ * on every request until the reply is in. It pauses first, so the clients
+ * do not all start at once. */
+static int
+client_body(struct app_client *cl) {
+    struct rdma_conn *c = cl->c;
+    struct test_regmem_context *regmem_ctx = c->context;
+
+    CORO_BEGIN(&cl->co);
+    for (;;) {
+        if (think_us > 0) {
+            if (!client_think(cl)) break;
+            CORO_YIELD(&cl->co);
+        }
+        if (!regmem_more(c, now_ns())) break;
+        regmem_ctx->waiting[regmem_ctx->posted % regmem_ctx->depth] = cl;
+        regmem_next(c, now_ns());
+        CORO_YIELD(&cl->co);
+    }
+    CORO_END(&cl->co);
+}
+
+/* run a client to its next yield, the last client done ends the run of the
+ * connection */
+static void
+client_resume(struct app_client *cl) {
+    struct test_regmem_context *regmem_ctx = cl->c->context;
+
+    if (0 == client_body(cl) && 0 == --regmem_ctx->active && 0 == --cl->c->ctx->running) {
+        regmem_report(cl->c->ctx);
+    }
+}
+
+static void
+client_wake(int fd, short libevent_event, void *arg) {
+    client_resume(arg);
+}
+
+/* fill the window of a connection, or start its schedule or its clients */
+static void
+regmem_start(struct rdma_conn *c, int window) {
+    struct test_regmem_context *regmem_ctx = c->context;
+    int i = 0;
+
+    regmem_ctx->depth = window;
+    regmem_ctx->posted = 0;
+    hist_reset(&regmem_ctx->hist);
+    c->total_recv = 0;
+    if (replay.recs) {
+        /* connection g of N takes the records g, g + N ... */
+        regmem_ctx->next_req = c->ctx->thread_id * conns_per_thread + regmem_ctx->conn;
+        regmem_ctx->next_ns = c->ctx->start_ns + (uint64_t)(replay.recs[regmem_ctx->next_req].ns / speed);
+        return;
+    }
+    if (open_loop) {
+        regmem_ctx->gap_ns = 1e9 * thread_number * conns_per_thread / run_rate(c->ctx);
+        regmem_ctx->next_ns = c->ctx->start_ns;
+        return;
+    }
+    if (nclients) {
+        regmem_ctx->active = window;
+        for (i = 0; i < window; ++i) {
+            CORO_INIT(&regmem_ctx->clients[i].co);
+        }
+        for (i = 0; i < window; ++i) {
+            client_resume(&regmem_ctx->clients[i]);
+        }
+        return;
+    }
+    for (i = 0; i < window && regmem_more(c, now_ns()); ++i) {
+        regmem_next(c, now_ns());
+    }
+}
+
+/* room for the records of a run, made before it starts so no timed send
+ * waits on realloc(). A open-loop run sends about its rate for its time, a
+ * closed-loop one on time is sized after the run before it. */
+static void
+reserve_recs(struct thread_context *ctx) {
+    double secs = ctx->warming ? warmup : duration;
+    size_t need = ctx->recs_size;
+
+    if (replay.recs) {
+        need = replay.count / thread_number + ctx->nconns;
+    } else if (secs <= 0) {
+        need = (size_t)request_number * ctx->nconns;
+    } else if (rate > 0) {
+        /* room for a poisson run to go over */
+        need = (size_t)(run_rate(ctx) * secs / thread_number * 1.25) + (size_t)depth * ctx->nconns;
+    } else if (ctx->recs_missed) {
+        need = 2 * (ctx->nrecs + ctx->recs_missed);
+    }
+
+    if (need > ctx->recs_size) {
+        struct trace_rec *recs = realloc(ctx->recs, need * sizeof(struct trace_rec));
+        if (recs) {
+            ctx->recs = recs;
+            ctx->recs_size = need;
+        }
+    }
+    ctx->nrecs = 0;
+    ctx->recs_missed = 0;
+}
+
+/* a run starts on every connection of the thread at once */
+static void
+regmem_start_all(struct thread_context *ctx, int window) {
+    int i = 0;
+
+    if (ctx->recs) {
+        reserve_recs(ctx);
+    }
+    ctx->running = ctx->nconns;
+    ctx->start_ns = now_ns();
+    ctx->end_ns = 0;
+    if (ctx->warming || duration > 0) {
+        ctx->end_ns = ctx->start_ns + (uint64_t)((ctx->warming ? warmup : duration) * 1e9);
+    }
+    for (i = 0; i < REGMEM_OPS; ++i) {
+        hist_reset(&ctx->op_hist[i]);
+    }
+    if (ctx->end_ns) {
+        /* a timed run counts no reply into a interval it has to make */
+        grow_ticks(&ctx->ticks, &ctx->nticks, (ctx->end_ns - ctx->start_ns) / interval_ns + 2);
+    }
+    memset(ctx->ticks, 0, ctx->nticks * sizeof(uint64_t));
+    for (i = 0; i < ctx->nconns; ++i) {
+        regmem_start(ctx->conn_list[i], window);
+    }
+    if (open_loop) {
+        regmem_tick(-1, 0, ctx);
+    }
+}
+
+static void
+print_latency(const struct hist *h, double secs) {
+    fprintf(text_out, "%llu requests in %.3f secs, %.0f ops/s, p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+            (unsigned long long)h->count, secs, h->count / secs, hist_quantile(h, 0.5) / 1000.0,
+            hist_quantile(h, 0.99) / 1000.0, hist_quantile(h, 0.999) / 1000.0);
+}
+
+/* the latencies of the connections to server, or of all if server is -1 */
+static void
+report_line(struct thread_context *ctx, int server, struct hist *h, double secs) {
+    int window = ((struct test_regmem_context *)ctx->conn_list[0]->context)->depth;
+    int i = 0;
+
+    hist_reset(h);
+    for (i = 0; i < ctx->nconns; ++i) {
+        struct rdma_conn *c = ctx->conn_list[i];
+        if (-1 == server || c->server == server) {
+            hist_merge(h, &((struct test_regmem_context *)c->context)->hist);
+        }
+    }
+    if (0 == h->count) return;
+
+    if (-1 != server) {
+        fprintf(text_out, "[%d]   %s:%s: ", ctx->thread_id, servers[server].host, servers[server].port);
+    } else if (replay.recs) {
+        fprintf(text_out, "[%d] replay x%.2f, depth %d, %d conns: ", ctx->thread_id, speed, window, ctx->nconns);
+    } else if (nclients) {
+        fprintf(text_out, "[%d] %d clients, %d conns: ", ctx->thread_id, window * ctx->nconns, ctx->nconns);
+    } else if (rate > 0) {
+        fprintf(text_out, "[%d] rate %.0f/s, depth %d, %d conns: ", ctx->thread_id, run_rate(ctx), window, ctx->nconns);
+    } else {
+        fprintf(text_out, "[%d] depth %d, %d conns: ", ctx->thread_id, window, ctx->nconns);
+    }
+    print_latency(h, secs);
+}
+
+/* the min, p50, p90, p99, p999 and max of h in us */
+static void
+latency_us(const struct hist *h, double us[6]) {
+    us[0] = h->count ? h->min / 1000.0 : 0;
+    us[1] = hist_quantile(h, 0.5) / 1000.0;
+    us[2] = hist_quantile(h, 0.9) / 1000.0;
+    us[3] = hist_quantile(h, 0.99) / 1000.0;
+    us[4] = hist_quantile(h, 0.999) / 1000.0;
+    us[5] = h->max / 1000.0;
+}
+
+/* the length of interval i of the total, the last one runs to the end */
+static double
+tick_secs(size_t i) {
+    double step = interval_ns / 1e9;
+    return i + 1 == all_nticks ? all_secs - i * step : step;
+}
+
+static double
+tick_ops(size_t i) {
+    double secs = tick_secs(i);
+    return secs > 0 ? all_ticks[i] / secs : 0;
+}
+
+/* a run has the whole intervals of its nominal length, which is --duration
+ * unless it ran out of requests before. The replies after them, of a part
+ * interval or of the drain past the deadline, go into the last, so no rate
+ * is made of a few replies over a short time. */
+static void
+fold_ticks(void) {
+    double nominal = duration > 0 && duration < all_secs ? duration : all_secs;
+    size_t n = (size_t)(nominal * 1e9 / interval_ns + 1e-6);
+    size_t i = 0;
+
+    if (0 == n) n = 1;
+    if (n >= all_nticks) return;
+    for (i = n; i < all_nticks; ++i) {
+        all_ticks[n - 1] += all_ticks[i];
+    }
+    all_nticks = n;
+}
+
+static void
+print_text(void) {
+    size_t i = 0;
+
+    for (i = 0; i < REGMEM_OPS; ++i) {
+        if (all_op_hist[i].count) {
+            fprintf(text_out, "[all]   %s: ", regmem_op_name(i));
+            print_latency(&all_op_hist[i], all_secs);
+        }
+    }
+    if (all_nticks > 1) {
+        fprintf(text_out, "[all]   ops/s every %.3g secs:", interval_ns / 1e9);
+        for (i = 0; i < all_nticks; ++i) {
+            fprintf(text_out, " %.0f", tick_ops(i));
+        }
+        fprintf(text_out, "\n");
+    }
+}
+
+static void
+print_json_latency(const struct hist *h) {
+    double us[6];
+
+    latency_us(h, us);
+    printf("\"latency_us\":{\"min\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+            us[0], us[1], us[2], us[3], us[4], us[5]);
+}
+
+/* a run as one line of JSON */
+static void
+print_json(int window, double offered) {
+    size_t i = 0;
+    int first = 1;
+
+    printf("{\"run\":%d,\"threads\":%d,\"conns\":%d,\"depth\":%d,\"rate\":%.0f,\"speed\":%.2f,"
+            "\"requests\":%llu,\"secs\":%.6f,\"ops_per_sec\":%.0f,",
+            all_runs, thread_number, thread_number * conns_per_thread, window, offered,
+            replay.recs ? speed : 0, (unsigned long long)all_hist.count, all_secs, all_ops);
+    print_json_latency(&all_hist);
+    printf(",\"ops\":{");
+    for (i = 0; i < REGMEM_OPS; ++i) {
+        if (0 == all_op_hist[i].count) continue;
+        printf("%s\"%s\":{\"requests\":%llu,\"ops_per_sec\":%.0f,", first ? "" : ",",
+                regmem_op_name(i), (unsigned long long)all_op_hist[i].count, all_op_hist[i].count / all_secs);
+        print_json_latency(&all_op_hist[i]);
+        printf("}");
+        first = 0;
+    }
+    printf("},\"interval_secs\":%.3f,\"intervals\":[", interval_ns / 1e9);
+    for (i = 0; i < all_nticks; ++i) {
+        printf("%s%.0f", i ? "," : "", tick_ops(i));
+    }
+    printf("]}\n");
+}
+
+/* a row of CSV, an interval row has no latencies */
+static void
+print_csv_row(int window, double offered, const char *scope, double t,
+        uint64_t count, double secs, const struct hist *h) {
+    double us[6];
+
+    printf("%d,%d,%d,%d,%.0f,%s,%.3f,%llu,%.6f,%.0f", all_runs, thread_number,
+            thread_number * conns_per_thread, window, offered, scope, t,
+            (unsigned long long)count, secs, secs > 0 ? count / secs : 0);
+    if (h) {
+        latency_us(h, us);
+        printf(",%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", us[0], us[1], us[2], us[3], us[4], us[5]);
+    } else {
+        printf(",,,,,,\n");
+    }
+}
+
+/* a run as rows of CSV, the total, every command, then every interval */
+static void
+print_csv(int window, double offered) {
+    double step = interval_ns / 1e9;
+    size_t i = 0;
+
+    if (0 == all_runs) {
+        printf("run,threads,conns,depth,rate,scope,t,requests,secs,ops_per_sec,"
+                "min_us,p50_us,p90_us,p99_us,p999_us,max_us\n");
+    }
+    print_csv_row(window, offered, "all", 0, all_hist.count, all_secs, &all_hist);
+    for (i = 0; i < REGMEM_OPS; ++i) {
+        if (all_op_hist[i].count) {
+            print_csv_row(window, offered, regmem_op_name(i), 0, all_op_hist[i].count, all_secs, &all_op_hist[i]);
+        }
+    }
+    for (i = 0; i < all_nticks; ++i) {
+        print_csv_row(window, offered, "interval", i * step, all_ticks[i], tick_secs(i), NULL);
+    }
+}
+
+/* add the run of a thread to the total, thread 0 reports it once every
+ * thread is in */
+static void
+report_all(struct thread_context *ctx, const struct hist *h, double secs) {
+    int window = ((struct test_regmem_context *)ctx->conn_list[0]->context)->depth;
+    size_t nticks = (size_t)ceil(secs * 1e9 / interval_ns);
+    size_t i = 0;
+
+    grow_ticks(&ctx->ticks, &ctx->nticks, nticks);
+    pthread_mutex_lock(&all_lock);
+    hist_merge(&all_hist, h);
+    all_ops += h->count / secs;
+    all_secs = secs > all_secs ? secs : all_secs;
+    for (i = 0; i < REGMEM_OPS; ++i) {
+        hist_merge(&all_op_hist[i], &ctx->op_hist[i]);
+    }
+    grow_ticks(&all_ticks, &all_nticks, nticks);
+    for (i = 0; i < nticks; ++i) {
+        all_ticks[i] += ctx->ticks[i];
+    }
+    pthread_mutex_unlock(&all_lock);
+
+    pthread_barrier_wait(&all_barrier);
+    if (0 == ctx->thread_id) {
+        double p99_us = hist_quantile(&all_hist, 0.99) / 1000.0;
+        fold_ticks();
+        double offered = rate > 0 ? run_rate(ctx) : 0;
+        if (thread_number > 1) {
+            fprintf(text_out, "[all] %d threads: %llu requests, %.0f ops/s, p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+                    thread_number, (unsigned long long)all_hist.count, all_ops,
+                    hist_quantile(&all_hist, 0.5) / 1000.0, p99_us, hist_quantile(&all_hist, 0.999) / 1000.0);
+        }
+        print_text();
+        if (OUTPUT_JSON == output) {
+            print_json(window, offered);
+        } else if (OUTPUT_CSV == output) {
+            print_csv(window, offered);
+        }
+        if (rate > 0 && p99_us <= slo_us && all_ops > slo_ops) {
+            slo_ops = all_ops;
+            slo_rate = offered;
+        }
+        if (rate > 0 && sweep && RATE_STEPS == ctx->step) {
+            if (slo_ops > 0) {
+                fprintf(text_out, "[all] at p99 <= %.1f us: %.0f ops/s, offered %.0f/s\n", slo_us, slo_ops, slo_rate);
+            } else {
+                fprintf(text_out, "[all] no rate held p99 <= %.1f us\n", slo_us);
+            }
+        }
+        fflush(stdout);
+        fflush(text_out);
+        hist_reset(&all_hist);
+        all_ops = 0;
+        all_secs = 0;
+        for (i = 0; i < REGMEM_OPS; ++i) {
+            hist_reset(&all_op_hist[i]);
+        }
+        all_nticks = 0;
+        all_runs += 1;
+    }
+    pthread_barrier_wait(&all_barrier);
+}
+
+/* report a run, then start the next step of a sweep or stop */
+static void
+regmem_report(struct thread_context *ctx) {
+    int window = ((struct test_regmem_context *)ctx->conn_list[0]->context)->depth;
+    double secs = (now_ns() - ctx->start_ns) / 1e9;
+    struct hist *h = NULL;
+    int i = 0;
+
+    if (ctx->warming) {
+        ctx->warming = 0;
+        regmem_start_all(ctx, window);
+        return;
+    }
+    h = malloc(2 * sizeof(struct hist));
+    report_line(ctx, -1, h, secs);
+    for (i = 0; nservers > 1 && i < nservers; ++i) {
+        report_line(ctx, i, h + 1, secs);
+    }
+    fflush(text_out);
+    report_all(ctx, h, secs);
+    free(h);
+
+    if (sweep && rate > 0 && ctx->step < RATE_STEPS) {
+        ctx->step += 1;
+        regmem_start_all(ctx, window);
+        return;
+    }
+    if (sweep && !open_loop && window < depth) {
+        regmem_start_all(ctx, window * 2 < depth ? window * 2 : depth);
+        return;
+    }
+    event_base_loopbreak(ctx->base);
+}
+
+static void
+regmem_done(struct rdma_conn *c) {
+    struct test_regmem_context *regmem_ctx = c->context;
+    size_t i = c->total_recv++;
+    uint64_t now = now_ns();
+    uint64_t latency = now - regmem_ctx->sent_ns[i % regmem_ctx->depth];
+
+    hist_record(&regmem_ctx->hist, latency);
+    hist_record(&c->ctx->op_hist[regmem_ctx->sent_op[i % regmem_ctx->depth]], latency);
+    count_tick(c->ctx, now);
+    if (nclients) {
+        client_resume(regmem_ctx->waiting[i % regmem_ctx->depth]);
+        return;
+    }
+    if (open_loop) {
+        regmem_pump(c, now);
+        regmem_arm(c->ctx, now);
+    } else if (regmem_more(c, now)) {
+        regmem_next(c, now);
+        return;
+    }
+    if (c->total_recv == regmem_ctx->posted && !regmem_more(c, open_loop ? regmem_ctx->next_ns : now)
+            && 0 == --c->ctx->running) {
+        regmem_report(c->ctx);
+    }
+}
+
+static int
+bind_counter(struct rdma_conn *c, const char *reply) {
+    struct test_regmem_context *regmem_ctx = c->context;
+    unsigned long long addr = 0, value = 0;
+
+    if (3 != sscanf(reply, "COUNTER %llu %u %llu", &addr, &regmem_ctx->rkey, &value)
+            || 0 == regmem_ctx->rkey) {
+        fprintf(stderr, "no counter: %s", reply);
+        return -1;
+    }
+    regmem_ctx->addr = addr;
+    regmem_ctx->value = value;
+    regmem_ctx->bound = 1;
+    return 0;
+}
+
+void handle_recv_regmem(struct ibv_wc *wc, struct rdma_conn *c) {
+    struct ibv_mr *mr = c->ctx->rmr_list[WR_ID_INDEX(wc->wr_id)];
     struct test_regmem_context *regmem_ctx = c->context;
 
     if (verbose) {
         fprintf(stderr, "RECV, length: %d:\n%s\n", wc->byte_len, (char*)mr->addr);
     }
 
-    if ( ++(regmem_ctx->index) == 9) {
-        regmem_ctx->index = 0;
+    if (atomic_counter && !regmem_ctx->bound) {
+        ((char *)mr->addr)[wc->byte_len < mr->length ? wc->byte_len : mr->length - 1] = '\0';
+        if (0 != bind_counter(c, mr->addr)) {
+            exit(1);
+        }
+        rdma_post_recv(c->id, (void *)(uintptr_t)wc->wr_id, mr->addr, mr->length, mr);
+        if (++c->ctx->ready == c->ctx->nconns) {
+            regmem_start_all(c->ctx, sweep && !open_loop ? 1 : depth);
+        }
+        return;
     }
 
-    if (0 != rdma_post_recv(c->id, mr, mr->addr, mr->length, mr)) {
+    if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)wc->wr_id, mr->addr, mr->length, mr)) {
         perror("rdma_post_recv()");
         return;
     }
 
-    send_mr(c->id, regmem_ctx->mr[regmem_ctx->index]);
-
-    c->total_recv += 1;
-    if (c->total_recv % 10000 == 0) {
+    if ((c->total_recv + 1) % 10000 == 0) {
         fprintf(stderr, "RECV, length: %d:\n%s\n", wc->byte_len, (char*)mr->addr);
     }
+    regmem_done(c);
+}
+
+void handle_atomic_regmem(struct ibv_wc *wc, struct rdma_conn *c) {
+    struct test_regmem_context *regmem_ctx = c->context;
+    uint64_t old = *regmem_ctx->result;
+
+    if (IBV_WC_FETCH_ADD == wc->opcode) {
+        regmem_ctx->value = old + 1;
+    } else if (old != regmem_ctx->value) {
+        /* another client changed it, retry with the value found */
+        regmem_ctx->value = old;
+        post_decr(c);
+        return;
+    } else {
+        regmem_ctx->value = old ? old - 1 : 0;
+    }
+    regmem_done(c);
 }
 
 void handle_send_regmem(struct ibv_wc *wc, struct rdma_conn *c) {
-    struct ibv_mr *mr = (struct ibv_mr*)(uintptr_t)wc->wr_id;
+    struct test_regmem_context *regmem_ctx = c->context;
+    struct ibv_mr *mr = regmem_ctx->mr[WR_ID_INDEX(wc->wr_id)];
     if (verbose) {
         fprintf(stderr, "SEND, length: %d:\n%s\n", mr->length, (char*)mr->addr);
     }
 }
 
-static void 
-test_with_regmem(struct thread_context *ctx) {
+/* a connection with the requests of the cycle, -A sends "counter" first */
+static struct rdma_conn *
+regmem_conn(struct thread_context *ctx, int server) {
     struct rdma_conn *c = NULL;
-    struct timespec start, finish;
+    int i = 0;
 
-    clock_gettime(CLOCK_REALTIME, &start);
-    if ( !(c = build_connection(ctx)) ) {
-        return;
+    if ( !(c = build_connection(ctx, server)) ) {
+        return NULL;
     }
 
     struct test_regmem_context *regmem_ctx = calloc(1, sizeof(struct test_regmem_context));
+    regmem_ctx->sent_ns = calloc(depth, sizeof(uint64_t));
+    regmem_ctx->sent_op = calloc(depth, sizeof(uint8_t));
+    if (nclients) {
+        regmem_ctx->clients = calloc(depth, sizeof(struct app_client));
+        regmem_ctx->waiting = calloc(depth, sizeof(struct app_client *));
+        for (i = 0; i < depth; ++i) {
+            regmem_ctx->clients[i].c = c;
+            evtimer_set(&regmem_ctx->clients[i].think, client_wake, &regmem_ctx->clients[i]);
+            event_base_set(ctx->base, &regmem_ctx->clients[i].think);
+        }
+    }
+    regmem_ctx->seed[0] = ctx->thread_id;
+    regmem_ctx->seed[1] = ctx->nconns;
+    regmem_ctx->seed[2] = 0x330e;
+    regmem_ctx->conn = ctx->nconns;
+    /* the connections start at even spaces of the cycle */
+    regmem_ctx->next_req = (size_t)(ctx->thread_id * conns_per_thread + ctx->nconns) * workload_nreqs
+        / (thread_number * conns_per_thread);
     c->context = regmem_ctx;
     c->handle_recv = handle_recv_regmem;
     c->handle_send = handle_send_regmem;
+    c->handle_atomic = handle_atomic_regmem;
+
+    if (if_binary) {
+        /* the requests of build_cmd.c, which carry the hash of key */
+        regmem_ctx->mr[0] = rdma_reg_msgs(c->id, add_bin, add_bin_len);
+        regmem_ctx->mr[1] = rdma_reg_msgs(c->id, set_bin, set_bin_len);
+        regmem_ctx->mr[2] = rdma_reg_msgs(c->id, replace_bin, replace_bin_len);
+        regmem_ctx->mr[3] = rdma_reg_msgs(c->id, append_bin, append_bin_len);
+        regmem_ctx->mr[4] = rdma_reg_msgs(c->id, prepend_bin, prepend_bin_len);
+        regmem_ctx->mr[5] = rdma_reg_msgs(c->id, incr_bin, incr_bin_len);
+        regmem_ctx->mr[6] = rdma_reg_msgs(c->id, decr_bin, decr_bin_len);
+        regmem_ctx->mr[7] = rdma_reg_msgs(c->id, get_bin, get_bin_len);
+        regmem_ctx->mr[8] = rdma_reg_msgs(c->id, delete_bin, delete_bin_len);
+    } else {
+        regmem_ctx->mr[0] = rdma_reg_msgs(c->id, add_reply, sizeof(add_reply));
+        regmem_ctx->mr[1] = rdma_reg_msgs(c->id, set_reply, sizeof(set_reply));
+        regmem_ctx->mr[2] = rdma_reg_msgs(c->id, replace_reply, sizeof(replace_reply));
+        regmem_ctx->mr[3] = rdma_reg_msgs(c->id, append_reply, sizeof(append_reply));
+        regmem_ctx->mr[4] = rdma_reg_msgs(c->id, prepend_reply, sizeof(prepend_reply));
+        regmem_ctx->mr[5] = rdma_reg_msgs(c->id, incr_reply, sizeof(incr_reply));
+        regmem_ctx->mr[6] = rdma_reg_msgs(c->id, decr_reply, sizeof(decr_reply));
+        //regmem_ctx->mr[7] = rdma_reg_msgs(c->id, get_reply, sizeof(get_reply));
+        regmem_ctx->mr[7] = rdma_reg_msgs(c->id, decr_reply, sizeof(decr_reply));
+        regmem_ctx->mr[8] = rdma_reg_msgs(c->id, delete_reply, sizeof(delete_reply));
+    }
+    if (mget_fanout > 0) {
+        /* the multi-get of build_cmd.c takes the place of GET, or of the
+         * second decr in ascii */
+        regmem_ctx->mr[7] = rdma_reg_msgs(c->id, mget_msg, mget_len);
+    }
+
+    /* bind the counter first, its reply starts the cycle */
+    if (atomic_counter) {
+        regmem_ctx->result = malloc(sizeof(uint64_t));
+        regmem_ctx->result_mr = rdma_reg_msgs(c->id, regmem_ctx->result, sizeof(uint64_t));
+        send_mr(c, rdma_reg_msgs(c->id, counter_cmd, strlen(counter_cmd)), 0);
+    } else {
+        ctx->ready += 1;
+    }
+    return c;
+}
+
+/* conns_per_thread connections over the CQs and SRQ of the thread, thread
+ * t takes the servers from t * conns_per_thread on */
+static void 
+test_with_regmem(struct thread_context *ctx) {
+    int i = 0;
+
+    if (if_binary || mget_fanout > 0) {
+        init_message(if_binary);
+    }
+    if (workload && !(ctx->arena_mr = ibv_reg_mr(ctx->pd, workload_arena, workload_arena_len,
+                    IBV_ACCESS_LOCAL_WRITE))) {
+        perror("ibv_reg_mr()");
+        return;
+    }
+    if (trace_out) {
+        /* grown by reserve_recs() before each run */
+        ctx->recs_size = 65536;
+        ctx->recs = malloc(ctx->recs_size * sizeof(struct trace_rec));
+    }
+
+    ctx->op_hist = malloc(REGMEM_OPS * sizeof(struct hist));
+
+    ctx->conn_list = calloc(conns_per_thread, sizeof(struct rdma_conn *));
+    for (i = 0; i < conns_per_thread; ++i) {
+        int server = (ctx->thread_id * conns_per_thread + i) % nservers;
+        if ( !(ctx->conn_list[i] = regmem_conn(ctx, server)) ) {
+            return;
+        }
+        ctx->nconns += 1;
+    }
 
-    regmem_ctx->mr[0] = rdma_reg_msgs(c->id, add_reply, sizeof(add_reply));
-    regmem_ctx->mr[1] = rdma_reg_msgs(c->id, set_reply, sizeof(set_reply));
-    regmem_ctx->mr[2] = rdma_reg_msgs(c->id, replace_reply, sizeof(replace_reply));
-    regmem_ctx->mr[3] = rdma_reg_msgs(c->id, append_reply, sizeof(append_reply));
-    regmem_ctx->mr[4] = rdma_reg_msgs(c->id, prepend_reply, sizeof(prepend_reply));
-    regmem_ctx->mr[5] = rdma_reg_msgs(c->id, incr_reply, sizeof(incr_reply));
-    regmem_ctx->mr[6] = rdma_reg_msgs(c->id, decr_reply, sizeof(decr_reply));
-    //regmem_ctx->mr[7] = rdma_reg_msgs(c->id, get_reply, sizeof(get_reply));
-    regmem_ctx->mr[7] = rdma_reg_msgs(c->id, decr_reply, sizeof(decr_reply));
-    regmem_ctx->mr[8] = rdma_reg_msgs(c->id, delete_reply, sizeof(delete_reply));
-    
-    send_mr(c->id, regmem_ctx->mr[0]);
+    evtimer_set(&ctx->timer, regmem_tick, ctx);
+    event_base_set(ctx->base, &ctx->timer);
+    ctx->step = sweep ? 1 : RATE_STEPS;
+    ctx->warming = warmup > 0;
 
+    if (ctx->ready == ctx->nconns) {
+        regmem_start_all(ctx, sweep && !open_loop ? 1 : depth);
+    }
     init_and_dispatch_event(ctx);
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    if (ctx->recs_missed) {
+        fprintf(stderr, "[%d] %zu requests past the %zu recorded are not in the trace\n",
+                ctx->thread_id, ctx->recs_missed, ctx->nrecs);
+    }
+    if (ctx->recs) {
+        pthread_mutex_lock(&all_lock);
+        all_recs = realloc(all_recs, (all_nrecs + ctx->nrecs) * sizeof(struct trace_rec));
+        memcpy(all_recs + all_nrecs, ctx->recs, ctx->nrecs * sizeof(struct trace_rec));
+        all_nrecs += ctx->nrecs;
+        pthread_mutex_unlock(&all_lock);
+    }
 }
 
 /***************************************************************************//**
@@ -494,6 +1413,12 @@ thread_run(void *arg) {
     return NULL;
 }
 
+static int
+by_rec_ns(const void *a, const void *b) {
+    uint64_t x = ((const struct trace_rec *)a)->ns, y = ((const struct trace_rec *)b)->ns;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
 /***************************************************************************//**
  * main
  *
@@ -501,14 +1426,42 @@ thread_run(void *arg) {
 int 
 main(int argc, char *argv[]) {
     char        c = '\0';
-    while (-1 != (c = getopt(argc, argv,
+    char        *replay_path = NULL;
+    int         i = 0;
+    static struct option long_options[] = {
+        { "warmup",     required_argument,  NULL,   'U' },  /* secs sent before the first run */
+        { "duration",   required_argument,  NULL,   'D' },  /* secs of a run, rather than -r */
+        { NULL,         0,                  NULL,   0 }
+    };
+    while (-1 != (c = getopt_long(argc, argv,
             "t:"    /* thread number */
-            "r:"    /* request number per thread */
+            "r:"    /* request number per connection */
             "p:"    /* listening port */
-            "s:"    /* server ip */
+            "s:"    /* server ip[:port], a list separated by ',' */
             "v"     /* verbose */
             "b:"
-    ))) {
+            "B"     /* binary protocol */
+            "m:"    /* binary request size */
+            "A"     /* incr and decr by RDMA atomics, the server needs -C */
+            "g:"    /* multi-get fan-out */
+            "d:"    /* requests in flight per connection */
+            "c:"    /* connections per thread */
+            "S"     /* sweep the depth 1, 2, 4 ... up to -d, or the rate up to -R */
+            "R:"    /* open-loop at this many requests per second in total */
+            "a:"    /* open-loop arrivals, poisson or constant */
+            "L:"    /* the p99 in us a rate sweep holds to */
+            "k:"    /* key popularity, uniform, zipf[:theta] or hot[:fraction[:share]] */
+            "K:"    /* number of keys */
+            "V:"    /* value size, fixed[:size], uniform:min:max, bimodal:small:large[:p] or etc */
+            "G:"    /* the share of gets, the rest are sets */
+            "W:"    /* record the requests of a workload to a trace */
+            "P:"    /* replay a trace */
+            "x:"    /* the speed of a replay */
+            "O:"    /* the results as text, json or csv */
+            "I:"    /* secs, the throughput is counted over intervals of this */
+            "n:"    /* clients per thread, coroutines over its connections */
+            "z:"    /* us, the mean think time of a client */
+            , long_options, NULL))) {
         switch (c) {
             case 't':
                 thread_number = atoi(optarg);
@@ -528,6 +1481,96 @@ main(int argc, char *argv[]) {
             case 'b':
                 buff_per_thread = atoi(optarg);
                 break;
+            case 'B':
+                if_binary = 1;
+                break;
+            case 'm':
+                request_size = atoi(optarg);
+                break;
+            case 'A':
+                atomic_counter = 1;
+                break;
+            case 'g':
+                mget_fanout = atoi(optarg);
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            case 'c':
+                conns_per_thread = atoi(optarg);
+                break;
+            case 'S':
+                sweep = 1;
+                break;
+            case 'R':
+                rate = atof(optarg);
+                break;
+            case 'a':
+                poisson = 0 == strcmp("poisson", optarg);
+                if (!poisson && 0 != strcmp("constant", optarg)) {
+                    fprintf(stderr, "-a takes poisson or constant\n");
+                    return -1;
+                }
+                break;
+            case 'L':
+                slo_us = atof(optarg);
+                break;
+            case 'k':
+                if (0 != workload_key_dist(optarg)) return -1;
+                workload = 1;
+                break;
+            case 'K':
+                workload_keys = atoi(optarg);
+                workload = 1;
+                break;
+            case 'V':
+                if (0 != workload_value_dist(optarg)) return -1;
+                workload = 1;
+                break;
+            case 'G':
+                workload_get_ratio = atof(optarg);
+                workload = 1;
+                break;
+            case 'W':
+                trace_out = optarg;
+                break;
+            case 'P':
+                replay_path = optarg;
+                break;
+            case 'x':
+                speed = atof(optarg);
+                break;
+            case 'O':
+                if (0 == strcmp("text", optarg)) {
+                    output = OUTPUT_TEXT;
+                } else if (0 == strcmp("json", optarg)) {
+                    output = OUTPUT_JSON;
+                } else if (0 == strcmp("csv", optarg)) {
+                    output = OUTPUT_CSV;
+                } else {
+                    fprintf(stderr, "-O takes text, json or csv\n");
+                    return -1;
+                }
+                break;
+            case 'I':
+                if (atof(optarg) <= 0) {
+                    fprintf(stderr, "-I takes secs above 0\n");
+                    return -1;
+                }
+                interval_ns = atof(optarg) * 1e9;
+                break;
+            case 'n':
+                nclients = atoi(optarg);
+                break;
+            case 'z':
+                think_us = atof(optarg);
+                break;
+            case 'U':
+                warmup = atof(optarg);
+                break;
+            case 'D':
+                duration = atof(optarg);
+                break;
             case 'w':
                 poll_wc_size = atoi(optarg);
             default:
@@ -535,9 +1578,90 @@ main(int argc, char *argv[]) {
         }
     }
 
+    /* the results alone go to stdout if they are to be read by a program */
+    text_out = OUTPUT_TEXT == output ? stdout : stderr;
+    if (-1 == (nservers = servers_parse(pstr_server, pstr_port, servers, SERVERS_MAX))) {
+        return -1;
+    }
+    if (nclients) {
+        /* the clients are spread evenly, a window of them per connection */
+        if (nclients < 0 || nclients > CLIENTS_MAX || nclients % conns_per_thread
+                || rate > 0 || replay_path || think_us < 0) {
+            fprintf(stderr, "-n takes a multiple of -c up to %d clients, and neither -R nor -P\n", CLIENTS_MAX);
+            return -1;
+        }
+        depth = nclients / conns_per_thread;
+        /* the SRQ and CQs of a thread hold a receive and a send of every client */
+        if (nclients > srq_size) {
+            srq_size = cq_size = nclients;
+        }
+    }
+    /* the receives of every connection of a thread come from one SRQ */
+    if (depth < 1 || conns_per_thread < 1 || depth * conns_per_thread > srq_size) {
+        fprintf(stderr, "-d times -c must be in [1, %d]\n", srq_size);
+        return -1;
+    }
+    if (atomic_counter && depth > 1) {
+        /* a decr is a compare-and-swap against the last value seen */
+        fprintf(stderr, "-A keeps one request in flight\n");
+        return -1;
+    }
+    if (warmup < 0 || duration < 0) {
+        fprintf(stderr, "--warmup and --duration take secs\n");
+        return -1;
+    }
+    if (buff_per_thread < depth * conns_per_thread) {
+        buff_per_thread = depth * conns_per_thread;
+    }
+    if (replay_path) {
+        if (rate > 0 || sweep || workload || speed <= 0) {
+            fprintf(stderr, "-P takes a speed above 0 and none of -R, -S, -k, -K, -V, -G\n");
+            return -1;
+        }
+        if (0 != trace_open(&replay, replay_path)) {
+            return -1;
+        }
+        /* the records are dealt round the connections, what is left over is not sent */
+        req_stride = (size_t)thread_number * conns_per_thread;
+        request_number = replay.count / req_stride;
+        if (0 == request_number || replay.count > INT32_MAX) {
+            fprintf(stderr, "%s: %llu records for %zu connections\n", replay_path,
+                    (unsigned long long)replay.count, req_stride);
+            return -1;
+        }
+        workload = 1;
+    }
+    open_loop = rate > 0 || replay.recs;
+    if (duration > 0 && !replay.recs) {
+        /* a run ends on time, a replay also when its records run out */
+        request_number = INT32_MAX;
+    }
+    if (trace_out && !workload) {
+        fprintf(stderr, "-W records a workload, of -k, -K, -V, -G or -P\n");
+        return -1;
+    }
+    if (workload && (atomic_counter || mget_fanout > 0 || workload_keys < 1)) {
+        fprintf(stderr, "a workload takes neither -A nor -g, and at least one key\n");
+        return -1;
+    }
+    if (workload) {
+        /* a request and the reply to a get both fit a receive buffer */
+        workload_value_max = BUFF_SIZE - 512;
+        if (replay.recs) {
+            init_workload_trace(if_binary, replay.recs, replay.count);
+        } else {
+            init_workload(if_binary, 1);
+        }
+    }
+    pthread_barrier_init(&all_barrier, NULL, thread_number);
+    hist_reset(&all_hist);
+    for (i = 0; i < REGMEM_OPS; ++i) {
+        hist_reset(&all_op_hist[i]);
+    }
+
     struct timespec start,
                     finish;
-    clock_gettime(CLOCK_REALTIME, &start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
 
     pthread_t *threads = calloc(thread_number, sizeof(pthread_t));
@@ -551,7 +1675,7 @@ main(int argc, char *argv[]) {
     } else {
         int i = 0;
         for (i = 0; i < thread_number; ++i) {
-            printf("Thread %d\n begin\n", i);
+            fprintf(text_out, "Thread %d\n begin\n", i);
 
             int *thread_id = malloc(sizeof(int));
             *thread_id = i;
@@ -562,13 +1686,21 @@ main(int argc, char *argv[]) {
 
         for (i = 0; i < thread_number; ++i) {
             pthread_join(threads[i], NULL);
-            printf("Thread %d terminated.\n", i);
+            fprintf(text_out, "Thread %d terminated.\n", i);
         }
     }
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    if (trace_out) {
+        qsort(all_recs, all_nrecs, sizeof(struct trace_rec), by_rec_ns);
+        if (0 != trace_write(trace_out, all_recs, all_nrecs)) {
+            return -1;
+        }
+        fprintf(text_out, "%zu requests recorded to %s\n", all_nrecs, trace_out);
+    }
 
-    printf("MAIN Cost time: %lf secs\n", (double)(finish.tv_sec-start.tv_sec + 
+    fprintf(text_out, "MAIN Cost time: %lf secs\n", (double)(finish.tv_sec-start.tv_sec + 
                 (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
     return 0;
 }
@@ -3,20 +3,31 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <math.h>
 
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <endian.h>
 
 #include "build_cmd.h"
+#include "hash.h"
 #include "protocol_binary.h"
+#include "trace.h"
 
 #define bool int
 #define true (1)
 #define false (0)
 
 int 	request_size = 100;
+int 	bin_key_hash = 1;
+
+int 	mget_fanout = 0;
+void 	*mget_msg;
+int 	mget_len;
+void 	*mget_set_msg;
+int 	mget_set_len;
 
 /*******************************************************************************
  * Ascii message
@@ -84,6 +95,19 @@ int incr_bin_len;
 int decr_bin_len;
 int delete_bin_len;
 
+void 	*getq_bin;
+void 	*addq_bin;
+void 	*setq_bin;
+void 	*replaceq_bin;
+void 	*appendq_bin;
+void 	*prependq_bin;
+void 	*incrq_bin;
+void 	*decrq_bin;
+void 	*deleteq_bin;
+void 	*noop_bin;
+
+int noop_bin_len;
+
 
 static void alloc_message_space(int if_binary)
 {
@@ -224,49 +248,42 @@ static void init_ascii_message(void)
  * ***************************************************************************************/
 static void build_bin_cmd(void *cmd_cache, protocol_binary_command cmd, int* request_len)
 {
-    int keylen, valuelen, i;
+    int keylen, valuelen;
     protocol_binary_request_header *tmp_hd;
     void *body_ptr; // point to the position after the header
     void *cache_header = cmd_cache;
     const int HEADER_LENGTH = 24;
+    const int HASH_LENGTH = bin_key_hash ? 8 : 0; // the key hash leads the extras
+    uint8_t extras[20];
+    int extlen;
 
     tmp_hd = (protocol_binary_request_header *)cmd_cache;
+    memset(extras, 0, sizeof(extras));
 
     switch (cmd) {
 	case PROTOCOL_BINARY_CMD_GET:
-	    tmp_hd->request.extlen = 0;
-
-	    keylen = request_size - HEADER_LENGTH - tmp_hd->request.extlen; // for the reason of memory align, do not use sizeof(protocol_binary_request_header)!!!!!
-	    body_ptr = cmd_cache + HEADER_LENGTH + tmp_hd ->request.extlen;
-	    
+	    extlen = 0;
+	    keylen = request_size - HEADER_LENGTH - HASH_LENGTH - extlen; // for the reason of memory align, do not use sizeof(protocol_binary_request_header)!!!!!
 	    keylen = keylen > 250 ? 250 : keylen;
 	    valuelen = 0;
-
 	    break;
 	case PROTOCOL_BINARY_CMD_ADD:
 	case PROTOCOL_BINARY_CMD_SET:
 	case PROTOCOL_BINARY_CMD_REPLACE:
-	    tmp_hd->request.extlen = 8;
-
-	    keylen = request_size - HEADER_LENGTH - tmp_hd->request.extlen; // see above
-	    body_ptr = cmd_cache + HEADER_LENGTH + tmp_hd->request.extlen;
-	    ((protocol_binary_request_set *)tmp_hd)->message.body.flags = 0;
-	    ((protocol_binary_request_set *)tmp_hd)->message.body.expiration = 0;
+	    extlen = 8; // flags and expiration, both 0
+	    keylen = request_size - HEADER_LENGTH - HASH_LENGTH - extlen; // see above
 
 	    if (keylen > 250)
 		valuelen = keylen - 250;
 	    else
 		valuelen = 1;
 	    keylen -= valuelen;
-
 	    break;
 	case PROTOCOL_BINARY_CMD_APPEND:
 	case PROTOCOL_BINARY_CMD_PREPEND:
 	case PROTOCOL_BINARY_CMD_DELETE:
-	    tmp_hd->request.extlen = 0;
-
-	    keylen = request_size - HEADER_LENGTH - tmp_hd->request.extlen; // see above
-	    body_ptr = cmd_cache + HEADER_LENGTH + tmp_hd->request.extlen;
+	    extlen = 0;
+	    keylen = request_size - HEADER_LENGTH - HASH_LENGTH - extlen; // see above
 
 	    if (cmd == PROTOCOL_BINARY_CMD_DELETE) {
 		keylen = keylen > 250 ? 250 : keylen;
@@ -278,21 +295,18 @@ static void build_bin_cmd(void *cmd_cache, protocol_binary_command cmd, int* req
 		    valuelen = 1;
 		keylen -= valuelen;
 	    }
-
 	    break;
 	case PROTOCOL_BINARY_CMD_INCREMENT:
-	case PROTOCOL_BINARY_CMD_DECREMENT:
-	    tmp_hd->request.extlen = 20;
-
-	    keylen = request_size - HEADER_LENGTH - tmp_hd->request.extlen; // see above
-	    body_ptr = cmd_cache + HEADER_LENGTH + tmp_hd->request.extlen;
-	    ((protocol_binary_request_incr *)tmp_hd)->message.body.delta = 1;
-	    ((protocol_binary_request_incr *)tmp_hd)->message.body.initial = 0;
-	    ((protocol_binary_request_incr *)tmp_hd)->message.body.expiration = 0;
+	case PROTOCOL_BINARY_CMD_DECREMENT: {
+	    uint64_t delta = htobe64(1); // initial 0, expiration 0
+	    extlen = 20;
+	    memcpy(extras, &delta, sizeof(delta));
 
+	    keylen = request_size - HEADER_LENGTH - HASH_LENGTH - extlen; // see above
 	    keylen = keylen > 250 ? 250 : keylen;
 	    valuelen = 0;
 	    break;
+	}
 	default:
 	    assert(0);
     }
@@ -300,18 +314,36 @@ static void build_bin_cmd(void *cmd_cache, protocol_binary_command cmd, int* req
     tmp_hd->request.magic = PROTOCOL_BINARY_REQ;
     tmp_hd->request.opcode = cmd;
     tmp_hd->request.keylen = htons(keylen);
-    tmp_hd->request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-    tmp_hd->request.bodylen = htonl(tmp_hd->request.extlen + keylen + valuelen);
+    tmp_hd->request.extlen = HASH_LENGTH + extlen;
+    tmp_hd->request.datatype = bin_key_hash ? PROTOCOL_BINARY_KEY_HASH : PROTOCOL_BINARY_RAW_BYTES;
+    tmp_hd->request.bodylen = htonl(HASH_LENGTH + extlen + keylen + valuelen);
     tmp_hd->request.reserved = tmp_hd->request.opaque = tmp_hd->request.cas = 0;
 
-    for (i = 0 ; i < keylen + valuelen; i++)
-	write_to_buff(&body_ptr, "1", 1);
+    /* the key is all '1', so is the value */
+    char *key = (char *)cmd_cache + HEADER_LENGTH + HASH_LENGTH + extlen;
+    memset(key, '1', keylen + valuelen);
+    if (bin_key_hash) {
+	uint64_t hv = htobe64(hash64(key, keylen));
+	memcpy((char *)cmd_cache + HEADER_LENGTH, &hv, sizeof(hv));
+    }
+    memcpy((char *)cmd_cache + HEADER_LENGTH + HASH_LENGTH, extras, extlen);
 
+    body_ptr = key + keylen + valuelen;
     *request_len = body_ptr - cache_header;
 
     return;
 }
 
+/* the same request with the quiet opcode */
+static void *quiet_copy(void *loud, int len, protocol_binary_command cmd)
+{
+    void *quiet = malloc(request_size);
+
+    memcpy(quiet, loud, len);
+    ((protocol_binary_request_header *)quiet)->request.opcode = cmd;
+    return quiet;
+}
+
 static void init_binary_message(void)
 {
     build_bin_cmd( 	get_bin, 	PROTOCOL_BINARY_CMD_GET, 	&get_bin_len);
@@ -324,10 +356,111 @@ static void init_binary_message(void)
     build_bin_cmd( 	decr_bin, 	PROTOCOL_BINARY_CMD_DECREMENT, 	&decr_bin_len);
     build_bin_cmd( 	delete_bin, 	PROTOCOL_BINARY_CMD_DELETE, 	&delete_bin_len);
 
+    getq_bin = 		quiet_copy( 	get_bin, 	get_bin_len, 		PROTOCOL_BINARY_CMD_GETQ);
+    addq_bin = 		quiet_copy( 	add_bin, 	add_bin_len, 		PROTOCOL_BINARY_CMD_ADDQ);
+    setq_bin = 		quiet_copy( 	set_bin, 	set_bin_len, 		PROTOCOL_BINARY_CMD_SETQ);
+    replaceq_bin = 	quiet_copy( 	replace_bin, 	replace_bin_len, 	PROTOCOL_BINARY_CMD_REPLACEQ);
+    appendq_bin = 	quiet_copy( 	append_bin, 	append_bin_len, 	PROTOCOL_BINARY_CMD_APPENDQ);
+    prependq_bin = 	quiet_copy( 	prepend_bin, 	prepend_bin_len, 	PROTOCOL_BINARY_CMD_PREPENDQ);
+    incrq_bin = 	quiet_copy( 	incr_bin, 	incr_bin_len, 		PROTOCOL_BINARY_CMD_INCREMENTQ);
+    decrq_bin = 	quiet_copy( 	decr_bin, 	decr_bin_len, 		PROTOCOL_BINARY_CMD_DECREMENTQ);
+    deleteq_bin = 	quiet_copy( 	delete_bin, 	delete_bin_len, 	PROTOCOL_BINARY_CMD_DELETEQ);
+
+    /* a bare header */
+    noop_bin = calloc(1, sizeof(protocol_binary_request_header));
+    ((protocol_binary_request_header *)noop_bin)->request.magic = PROTOCOL_BINARY_REQ;
+    ((protocol_binary_request_header *)noop_bin)->request.opcode = PROTOCOL_BINARY_CMD_NOOP;
+    noop_bin_len = sizeof(protocol_binary_request_header);
+
     return;
 }
 
 
+/******************************************************************************************
+ * Build multi-get
+ *
+ * ***************************************************************************************/
+
+/* key 0 is the GET key, the others end with "-<i>" */
+static void mget_key(char *key, int keylen, int i)
+{
+    char tail[16];
+    int len;
+
+    memset(key, '1', keylen);
+    if (i > 0) {
+	len = snprintf(tail, sizeof(tail), "-%d", i);
+	memcpy(key + keylen - len, tail, len);
+    }
+}
+
+static int build_bin_key_cmd(void *cmd_cache, protocol_binary_command cmd, const char *key, int keylen,
+	const void *extras, int extlen, const char *value, int valuelen, uint32_t opaque)
+{
+    protocol_binary_request_header *tmp_hd = (protocol_binary_request_header *)cmd_cache;
+    const int HEADER_LENGTH = 24;
+    const int HASH_LENGTH = (bin_key_hash && keylen > 0) ? 8 : 0;
+    char *p = (char *)cmd_cache + HEADER_LENGTH;
+
+    memset(tmp_hd, 0, HEADER_LENGTH);
+    tmp_hd->request.magic = PROTOCOL_BINARY_REQ;
+    tmp_hd->request.opcode = cmd;
+    tmp_hd->request.keylen = htons(keylen);
+    tmp_hd->request.extlen = HASH_LENGTH + extlen;
+    tmp_hd->request.datatype = HASH_LENGTH ? PROTOCOL_BINARY_KEY_HASH : PROTOCOL_BINARY_RAW_BYTES;
+    tmp_hd->request.bodylen = htonl(HASH_LENGTH + extlen + keylen + valuelen);
+    tmp_hd->request.opaque = opaque;
+
+    if (HASH_LENGTH) {
+	uint64_t hv = htobe64(hash64(key, keylen));
+	write_to_buff((void**)&p, &hv, sizeof(hv));
+    }
+    write_to_buff((void**)&p, (void *)extras, extlen);
+    write_to_buff((void**)&p, (void *)key, keylen);
+    write_to_buff((void**)&p, (void *)value, valuelen);
+
+    return p - (char *)cmd_cache;
+}
+
+static void init_mget_message(int if_binary)
+{
+    char key[256];
+    int keylen, i;
+    char *p, *set_p;
+
+    if (if_binary == 0) {
+	keylen = get_ascii_reply_len - 6; // "get " and "\r\n"
+	mget_msg = p = calloc(1, 5 + mget_fanout * (keylen + 1));
+	mget_set_msg = set_p = calloc(mget_fanout, keylen + 20);
+
+	write_to_buff((void**)&p, "get", 3);
+	for (i = 0; i < mget_fanout; i++) {
+	    mget_key(key, keylen, i);
+	    write_to_buff((void**)&p, " ", 1);
+	    write_to_buff((void**)&p, key, keylen);
+	    mget_set_len = sprintf(set_p, "set %.*s 0 0 1\r\n1\r\n", keylen, key);
+	    set_p += mget_set_len;
+	}
+	write_to_buff((void**)&p, "\r\n", 2);
+    } else {
+	uint8_t extras[8];
+	keylen = ntohs(((protocol_binary_request_header *)get_bin)->request.keylen);
+	mget_msg = p = calloc(mget_fanout + 1, 24 + 8 + keylen);
+	mget_set_msg = set_p = calloc(mget_fanout, 24 + 8 + 8 + keylen + 1);
+	memset(extras, 0, sizeof(extras)); // flags and expiration
+
+	for (i = 0; i < mget_fanout; i++) {
+	    mget_key(key, keylen, i);
+	    p += build_bin_key_cmd(p, PROTOCOL_BINARY_CMD_GETKQ, key, keylen, "", 0, "", 0, i);
+	    mget_set_len = build_bin_key_cmd(set_p, PROTOCOL_BINARY_CMD_SET, key, keylen, extras, 8, "1", 1, i);
+	    set_p += mget_set_len;
+	}
+	p += build_bin_key_cmd(p, PROTOCOL_BINARY_CMD_NOOP, "", 0, "", 0, "", 0, mget_fanout);
+    }
+    mget_len = p - (char *)mget_msg;
+}
+
+
 void init_message(int if_binary)
 {
     alloc_message_space(if_binary);
@@ -336,5 +469,254 @@ void init_message(int if_binary)
 	init_ascii_message();
     else 
 	init_binary_message();
+
+    if (mget_fanout > 0)
+	init_mget_message(if_binary);
 }
 
+
+
+/******************************************************************************************
+ * Build workload
+ *
+ * ***************************************************************************************/
+
+enum { DIST_UNIFORM, DIST_ZIPF, DIST_HOT, DIST_FIXED, DIST_BIMODAL, DIST_ETC };
+
+int 	workload_keys = 100000;
+int 	workload_key_size = 16;
+int 	workload_value_max = MEMCACHED_MAX_REQUEST;
+double 	workload_get_ratio = 0.9;
+int 	workload_nreqs = 65536;
+
+char 	*workload_arena;
+size_t 	workload_arena_len;
+struct workload_req *workload_reqs;
+
+static int 	key_dist = DIST_UNIFORM;
+static double 	key_param[2];
+static int 	value_dist = DIST_FIXED;
+static double 	value_param[3] = { 100, 0, 0 };
+
+static double 	*zipf_cdf;
+
+int workload_key_dist(const char *spec)
+{
+    if (strcmp(spec, "uniform") == 0) {
+	key_dist = DIST_UNIFORM;
+	return 0;
+    } else if (strncmp(spec, "zipf", 4) == 0) {
+	key_dist = DIST_ZIPF;
+	key_param[0] = 0.99;
+	if (spec[4] == '\0' || (spec[4] == ':' && sscanf(spec + 5, "%lf", &key_param[0]) == 1
+		    && key_param[0] > 0))
+	    return 0;
+    } else if (strncmp(spec, "hot", 3) == 0) {
+	key_dist = DIST_HOT;
+	key_param[0] = 0.2;
+	key_param[1] = 0.8;
+	if (spec[3] == '\0' || (spec[3] == ':' && sscanf(spec + 4, "%lf:%lf", &key_param[0], &key_param[1]) >= 1
+		    && key_param[0] > 0 && key_param[0] <= 1 && key_param[1] >= 0 && key_param[1] <= 1))
+	    return 0;
+    }
+    fprintf(stderr, "bad key distribution \"%s\"\n", spec);
+    return -1;
+}
+
+int workload_value_dist(const char *spec)
+{
+    if (strncmp(spec, "fixed", 5) == 0) {
+	value_dist = DIST_FIXED;
+	if (spec[5] == '\0' || (spec[5] == ':' && sscanf(spec + 6, "%lf", &value_param[0]) == 1
+		    && value_param[0] >= 0))
+	    return 0;
+    } else if (strncmp(spec, "uniform:", 8) == 0) {
+	value_dist = DIST_UNIFORM;
+	if (sscanf(spec + 8, "%lf:%lf", &value_param[0], &value_param[1]) == 2
+		&& value_param[0] >= 0 && value_param[0] <= value_param[1])
+	    return 0;
+    } else if (strncmp(spec, "bimodal:", 8) == 0) {
+	value_dist = DIST_BIMODAL;
+	value_param[2] = 0.9;
+	if (sscanf(spec + 8, "%lf:%lf:%lf", &value_param[0], &value_param[1], &value_param[2]) >= 2
+		&& value_param[0] >= 0 && value_param[1] >= 0 && value_param[2] >= 0 && value_param[2] <= 1)
+	    return 0;
+    } else if (strcmp(spec, "etc") == 0) {
+	value_dist = DIST_ETC;
+	return 0;
+    }
+    fprintf(stderr, "bad value distribution \"%s\"\n", spec);
+    return -1;
+}
+
+/* P(rank i) is proportional to 1 / (i + 1)^theta */
+static void init_zipf(void)
+{
+    double sum = 0;
+    int i;
+
+    zipf_cdf = realloc(zipf_cdf, workload_keys * sizeof(double));
+    for (i = 0; i < workload_keys; i++) {
+	sum += 1.0 / pow(i + 1, key_param[0]);
+	zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < workload_keys; i++)
+	zipf_cdf[i] /= sum;
+}
+
+static int draw_key(unsigned short seed[3])
+{
+    double u = erand48(seed);
+    int n = workload_keys, nhot, lo, hi, mid;
+
+    switch (key_dist) {
+	case DIST_ZIPF:
+	    /* the first rank whose cdf reaches u */
+	    lo = 0;
+	    hi = n - 1;
+	    while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (zipf_cdf[mid] < u)
+		    lo = mid + 1;
+		else
+		    hi = mid;
+	    }
+	    return lo;
+	case DIST_HOT:
+	    nhot = (int)(key_param[0] * n);
+	    nhot = nhot < 1 ? 1 : nhot;
+	    if (u < key_param[1] || nhot >= n)
+		return (int)(erand48(seed) * nhot);
+	    return nhot + (int)(erand48(seed) * (n - nhot));
+	default:
+	    return (int)(u * n);
+    }
+}
+
+static int draw_value_size(unsigned short seed[3])
+{
+    double u = erand48(seed), size;
+
+    switch (value_dist) {
+	case DIST_UNIFORM:
+	    size = value_param[0] + u * (value_param[1] - value_param[0] + 1);
+	    break;
+	case DIST_BIMODAL:
+	    size = u < value_param[2] ? value_param[0] : value_param[1];
+	    break;
+	case DIST_ETC:
+	    /* location 15, scale 214.476, shape 0.348238, Atikoglu et al. 2012 */
+	    size = 15 + 214.476 * (pow(1 - u, -0.348238) - 1) / 0.348238;
+	    break;
+	default:
+	    size = value_param[0];
+	    break;
+    }
+    return size > workload_value_max ? workload_value_max : (int)size;
+}
+
+/* the key of request i */
+typedef int (*key_fn)(const void *arg, int i, char *key);
+
+static int generated_key(const void *arg, int i, char *key)
+{
+    int keylen = snprintf(key, 256, "key:%0*d", workload_key_size > 4 ? workload_key_size - 4 : 0,
+	    ((const int *)arg)[i]);
+    return keylen > 250 ? 250 : keylen;
+}
+
+/* a key as long as the traced one, out of its hash */
+static int traced_key(const void *arg, int i, char *key)
+{
+    const struct trace_rec *r = (const struct trace_rec *)arg + i;
+    char hex[17];
+    int j, keylen = r->nkey ? r->nkey : 1;
+
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)r->key_hash);
+    for (j = 0; j < keylen; j++)
+	key[j] = j < 16 ? hex[j] : '0';
+    return keylen;
+}
+
+/* write the requests whose op and nvalue are set into the arena */
+static void build_workload(int if_binary, key_fn key_of, const void *arg)
+{
+    char key[256], *p, *value;
+    int keylen, i;
+    uint32_t maxlen = 0;
+    size_t len = 0;
+
+    for (i = 0; i < workload_nreqs; i++) {
+	maxlen = workload_reqs[i].nvalue > maxlen ? workload_reqs[i].nvalue : maxlen;
+	len += 24 + 8 + 8 + 32 + 250 + workload_reqs[i].nvalue; // header, hash, extras, ascii line, key
+    }
+    workload_arena = p = malloc(len);
+    value = malloc(maxlen + 1);
+    memset(value, 'v', maxlen + 1);
+
+    for (i = 0; i < workload_nreqs; i++) {
+	struct workload_req *r = &workload_reqs[i];
+	int valuelen = r->nvalue;
+
+	keylen = key_of(arg, i, key);
+	r->nkey = keylen;
+	r->key_hash = hash64(key, keylen);
+	r->off = p - workload_arena;
+
+	if (if_binary == 0 && r->op == WORKLOAD_GET) {
+	    p += sprintf(p, "get %.*s\r\n", keylen, key);
+	} else if (if_binary == 0) {
+	    p += sprintf(p, "set %.*s 0 0 %d\r\n", keylen, key, valuelen);
+	    write_to_buff((void**)&p, value, valuelen);
+	    write_to_buff((void**)&p, "\r\n", 2);
+	} else if (r->op == WORKLOAD_GET) {
+	    p += build_bin_key_cmd(p, PROTOCOL_BINARY_CMD_GET, key, keylen, "", 0, "", 0, i);
+	} else {
+	    uint8_t extras[8]; // flags and expiration
+	    memset(extras, 0, sizeof(extras));
+	    p += build_bin_key_cmd(p, PROTOCOL_BINARY_CMD_SET, key, keylen, extras, 8, value, valuelen, i);
+	}
+	r->len = p - (workload_arena + r->off);
+    }
+    workload_arena_len = p - workload_arena;
+    free(value);
+}
+
+void init_workload(int if_binary, unsigned short seed)
+{
+    unsigned short xsubi[3] = { seed, seed >> 8, 0x330e };
+    int *key_ids, i;
+
+    if (key_dist == DIST_ZIPF)
+	init_zipf();
+    workload_reqs = calloc(workload_nreqs, sizeof(struct workload_req));
+    key_ids = calloc(workload_nreqs, sizeof(int));
+
+    /* draw first, then size the arena */
+    for (i = 0; i < workload_nreqs; i++) {
+	key_ids[i] = draw_key(xsubi);
+	if (erand48(xsubi) < workload_get_ratio) {
+	    workload_reqs[i].op = WORKLOAD_GET;
+	} else {
+	    workload_reqs[i].op = WORKLOAD_SET;
+	    workload_reqs[i].nvalue = draw_value_size(xsubi);
+	}
+    }
+    build_workload(if_binary, generated_key, key_ids);
+    free(key_ids);
+}
+
+void init_workload_trace(int if_binary, const struct trace_rec *recs, int count)
+{
+    int i;
+
+    workload_nreqs = count;
+    workload_reqs = calloc(count, sizeof(struct workload_req));
+    for (i = 0; i < count; i++) {
+	workload_reqs[i].op = recs[i].op == WORKLOAD_SET ? WORKLOAD_SET : WORKLOAD_GET;
+	if (workload_reqs[i].op == WORKLOAD_SET)
+	    workload_reqs[i].nvalue = recs[i].nvalue > (uint32_t)workload_value_max
+		? (uint32_t)workload_value_max : recs[i].nvalue;
+    }
+    build_workload(if_binary, traced_key, recs);
+}
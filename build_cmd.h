@@ -69,13 +69,84 @@ extern int incr_bin_len;
 extern int decr_bin_len;
 extern int delete_bin_len;
 
+/* the quiet variants, as long as the loud ones: only errors are answered,
+ * and GETQ hits. NOOP is answered after everything sent before it. */
+extern void 	*getq_bin;
+extern void 	*addq_bin;
+extern void 	*setq_bin;
+extern void 	*replaceq_bin;
+extern void 	*appendq_bin;
+extern void 	*prependq_bin;
+extern void 	*incrq_bin;
+extern void 	*decrq_bin;
+extern void 	*deleteq_bin;
+extern void 	*noop_bin;
+
+extern int noop_bin_len;
+
 
 #define ASCII_MIX_REQUEST (28)
-#define BINARY_MIX_REQUEST (45)
+#define BINARY_MIX_REQUEST (53)
 #define MEMCACHED_MAX_REQUEST (1048537)
 
 extern void init_message(int if_binary);
 
+/* with a fan-out, init_message() also builds a multi-get of mget_fanout keys,
+ * "get <key>*" or GETKQ ... NOOP, and the sets storing its keys, one after
+ * another, mget_set_len each */
+extern int 	mget_fanout;
+extern void 	*mget_msg;
+extern int 	mget_len;
+extern void 	*mget_set_msg;
+extern int 	mget_set_len;
+
 extern int request_size;
 
+/* binary requests carry the hash of key, see PROTOCOL_BINARY_KEY_HASH */
+extern int bin_key_hash;
+
+/******************************************************************************
+ * Workload, a cycle of gets and sets with keys and value sizes drawn from
+ * distributions, built once into one arena so that a client registers it
+ * once and sends request i from workload_arena + workload_reqs[i].off
+ * ****************************************************************************/
+#define WORKLOAD_GET 	0
+#define WORKLOAD_SET 	1
+
+struct workload_req {
+    size_t 	off;
+    uint32_t 	len;
+    uint8_t 	op;
+    uint8_t 	nkey;
+    uint32_t 	nvalue; 	/* of a set */
+    uint64_t 	key_hash; 	/* hash64() of key, what a trace keeps */
+};
+
+extern int 	workload_keys;		/* keys "key:<i>", i in [0, workload_keys) */
+extern int 	workload_key_size; 	/* padded to this length */
+extern int 	workload_value_max; 	/* a drawn size is cut to this */
+extern double 	workload_get_ratio;
+extern int 	workload_nreqs; 	/* the length of the cycle */
+
+extern char 	*workload_arena;
+extern size_t 	workload_arena_len;
+extern struct workload_req *workload_reqs;
+
+/* "uniform", "zipf[:theta]" or "hot[:fraction[:share]]", share of the
+ * requests go to fraction of the keys; 0 on success, -1 if malformed */
+extern int workload_key_dist(const char *spec);
+
+/* "fixed[:size]", "uniform:min:max", "bimodal:small:large[:p_small]" or
+ * "etc", the generalized Pareto of the ETC pool measured at Facebook;
+ * 0 on success, -1 if malformed */
+extern int workload_value_dist(const char *spec);
+
+/* build the cycle with the distributions set, the same seed gives the same
+ * requests */
+extern void init_workload(int if_binary, unsigned short seed);
+
+/* build the requests of a trace instead, one per record, see trace.h */
+struct trace_rec;
+extern void init_workload_trace(int if_binary, const struct trace_rec *recs, int count);
+
 #endif
@@ -9,6 +9,8 @@
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 
+#include "wr_id.h"
+
 #include "protocol_binary.h"
 #include "build_cmd.h"
 
@@ -25,12 +27,14 @@ static char     *pstr_server = "127.0.0.1";
 static char     *pstr_port = "11211";
 static int      thread_number = 1;
 static int      request_number = 10000;
-static int      last_time = 1000;    /* secs */
+static double   last_time = 0;      /* secs of a test, rather than -r rounds */
 static int      verbose = 0;
 static int      cq_size = 1024;
 static int      wr_size = 1024;
 static int      max_sge = 8;
 static int 	if_binary = 0;
+static int      atomic_counter = 0;
+static int      quiet = 0;
 
 /***************************************************************************//**
  * Relative resources around connection
@@ -50,8 +54,6 @@ struct rdma_context {
 
 } rdma_ctx;
 
-struct wr_context;
-
 struct rdma_conn {
     struct rdma_cm_id   *id;
 
@@ -64,16 +66,10 @@ struct rdma_conn {
 
     struct ibv_mr           **rmr_list;
     char                    **rbuf_list;
-    struct wr_context       *wr_ctx_list;
     size_t                  rsize; 
     size_t                  buff_list_size;
 };
 
-struct wr_context {
-    struct rdma_conn       *c;
-    struct ibv_mr           *mr;
-};
-
 /***************************************************************************//**
  * Description 
  * Init rdma global resources
@@ -172,15 +168,13 @@ build_connection() {
     c->rsize = BUFF_SIZE;
     c->rbuf_list = calloc(c->buff_list_size, sizeof(char*));
     c->rmr_list = calloc(c->buff_list_size, sizeof(struct ibv_mr*));
-    c->wr_ctx_list = calloc(c->buff_list_size, sizeof(struct wr_context));
 
     int i = 0;
     for (i = 0; i < c->buff_list_size; ++i) {
         c->rbuf_list[i] = malloc(c->rsize);
         c->rmr_list[i] = rdma_reg_msgs(c->id, c->rbuf_list[i], c->rsize);
-        c->wr_ctx_list[i].c = c;
-        c->wr_ctx_list[i].mr = c->rmr_list[i];
-        if (0 != rdma_post_recv(c->id, &c->wr_ctx_list[i], c->rmr_list[i]->addr, c->rmr_list[i]->length, c->rmr_list[i])) {
+        if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_RECV, 0, i),
+                    c->rmr_list[i]->addr, c->rmr_list[i]->length, c->rmr_list[i])) {
             perror("rdma_post_recv()");
             return NULL;
         }
@@ -194,7 +188,7 @@ build_connection() {
  ******************************************************************************/
 int 
 send_mr(struct rdma_cm_id *id, struct ibv_mr *mr) {
-    if (0 != rdma_post_send(id, id->context, mr->addr, mr->length, mr, 0)) {
+    if (0 != rdma_post_send(id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_SEND, 0, 0), mr->addr, mr->length, mr, 0)) {
         perror("rdma_post_send()");
         return -1;
     }
@@ -228,10 +222,13 @@ recv_msg(struct rdma_conn *c) {
         return -1;
     }
     
-    struct wr_context *wr_ctx = (struct wr_context*)(uintptr_t)wc.wr_id;
-    struct ibv_mr *mr = wr_ctx->mr;
+    struct ibv_mr *mr = c->rmr_list[WR_ID_INDEX(wc.wr_id)];
+
+    if (verbose) {
+        printf("RECV, length: %d:\n%.*s\n", wc.byte_len, (int)wc.byte_len, (char*)mr->addr);
+    }
     
-    if (0 != rdma_post_recv(c->id, wr_ctx, mr->addr, mr->length, mr)) {
+    if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)wc.wr_id, mr->addr, mr->length, mr)) {
         perror("rdma_post_recv()");
         return -1;
     }
@@ -239,6 +236,150 @@ recv_msg(struct rdma_conn *c) {
     return 0;
 }
 
+/***************************************************************************//**
+ * Receive up to the NOOP response which flushes quiet requests, the other
+ * responses are errors
+ *
+ ******************************************************************************/
+static int
+recv_until_noop(struct rdma_conn *c) {
+    protocol_binary_response_header *h = NULL;
+    struct ibv_wc wc;
+    int cqe = 0, errors = 0;
+
+    do {
+        while (0 == (cqe = ibv_poll_cq(rdma_ctx.recv_cq, 1, &wc))) ;
+        if (cqe < 0) {
+            return -1;
+        }
+
+        struct ibv_mr *mr = c->rmr_list[WR_ID_INDEX(wc.wr_id)];
+        h = mr->addr;
+        if (PROTOCOL_BINARY_CMD_NOOP != h->response.opcode) {
+            errors += 1;
+            if (verbose) {
+                printf("quiet request %#x failed: %u\n", h->response.opcode, ntohs(h->response.status));
+            }
+        }
+        if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)wc.wr_id, mr->addr, mr->length, mr)) {
+            perror("rdma_post_recv()");
+            return -1;
+        }
+    } while (PROTOCOL_BINARY_CMD_NOOP != h->response.opcode);
+
+    return errors;
+}
+
+/***************************************************************************//**
+ * With -A incr and decr are RDMA atomics on a counter of server instead of
+ * requests, "counter" binds the key once and tells where its word is
+ *
+ ******************************************************************************/
+struct remote_counter {
+    uint64_t        addr;
+    uint32_t        rkey;
+    uint64_t        value;      /* the last value seen */
+    uint64_t        *result;    /* a atomic returns the old value here */
+    struct ibv_mr   *mr;
+};
+
+static char counter_cmd[] = "counter rdma:counter 0\r\n";
+
+static int
+bind_counter(struct rdma_conn *c, struct remote_counter *rc) {
+    struct ibv_mr *cmd_mr = rdma_reg_msgs(c->id, counter_cmd, strlen(counter_cmd));
+    unsigned long long addr = 0, value = 0;
+    struct ibv_wc wc;
+    int cqe = 0;
+
+    rc->result = malloc(sizeof(uint64_t));
+    rc->mr = rdma_reg_msgs(c->id, rc->result, sizeof(uint64_t));
+    if (!cmd_mr || !rc->mr || 0 != send_mr(c->id, cmd_mr)) {
+        return -1;
+    }
+
+    while (0 == (cqe = ibv_poll_cq(rdma_ctx.recv_cq, 1, &wc))) ;
+    if (cqe < 0 || IBV_WC_SUCCESS != wc.status) {
+        return -1;
+    }
+    struct ibv_mr *mr = c->rmr_list[WR_ID_INDEX(wc.wr_id)];
+    ((char *)mr->addr)[wc.byte_len < mr->length ? wc.byte_len : mr->length - 1] = '\0';
+    int n = sscanf(mr->addr, "COUNTER %llu %u %llu", &addr, &rc->rkey, &value);
+    if (3 != n || 0 == rc->rkey) {
+        fprintf(stderr, "no counter: %s", (char *)mr->addr);
+    }
+    rdma_post_recv(c->id, (void *)(uintptr_t)wc.wr_id, mr->addr, mr->length, mr);
+
+    rc->addr = addr;
+    rc->value = value;
+    return 3 == n && rc->rkey ? 0 : -1;
+}
+
+static int
+post_atomic(struct rdma_conn *c, struct remote_counter *rc, enum ibv_wr_opcode opcode,
+        uint64_t compare_add, uint64_t swap) {
+    struct ibv_sge sge = { (uintptr_t)rc->result, sizeof(uint64_t), rc->mr->lkey };
+    struct ibv_send_wr wr, *bad = NULL;
+    struct ibv_wc wc;
+    int cqe = 0;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = WR_ID_MAKE(WR_OP_ATOMIC, 0, 0);
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = opcode;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.atomic.remote_addr = rc->addr;
+    wr.wr.atomic.rkey = rc->rkey;
+    wr.wr.atomic.compare_add = compare_add;
+    wr.wr.atomic.swap = swap;
+
+    if (0 != ibv_post_send(c->id->qp, &wr, &bad)) {
+        perror("ibv_post_send()");
+        return -1;
+    }
+    while (0 == (cqe = ibv_poll_cq(rdma_ctx.send_cq, 1, &wc))) ;
+    if (cqe < 0 || IBV_WC_SUCCESS != wc.status) {
+        fprintf(stderr, "atomic: %s\n", cqe < 0 ? "poll failed" : "bad wc");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+counter_incr(struct rdma_conn *c, struct remote_counter *rc) {
+    if (0 != post_atomic(c, rc, IBV_WR_ATOMIC_FETCH_AND_ADD, 1, 0)) return -1;
+    rc->value = *rc->result + 1;
+    return 0;
+}
+
+/* decr stops at 0 like the command does, so it is a compare-and-swap, retried
+ * with the value found if another client got there first */
+static int
+counter_decr(struct rdma_conn *c, struct remote_counter *rc) {
+    for (;;) {
+        uint64_t old = rc->value, val = old ? old - 1 : 0;
+        if (0 != post_atomic(c, rc, IBV_WR_ATOMIC_CMP_AND_SWP, old, val)) return -1;
+        if (*rc->result == old) {
+            rc->value = val;
+            return 0;
+        }
+        rc->value = *rc->result;
+    }
+}
+
+/* a test runs -r rounds, or for -t secs if given */
+static int
+test_running(int round, const struct timespec *start) {
+    struct timespec now;
+
+    if (last_time <= 0) {
+        return round < request_number;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) / 1e9 < last_time;
+}
+
 /***************************************************************************//**
  * Test command with registered memory
  *
@@ -256,6 +397,11 @@ test_with_regmem(void *arg) {
 
     init_message(if_binary);
 
+    struct remote_counter counter;
+    if (atomic_counter && 0 != bind_counter(c, &counter)) {
+        return NULL;
+    }
+
     if (if_binary == 1) {
 	struct ibv_mr 	*get_mr = 	rdma_reg_msgs( 	c->id, 	get_bin, 	request_size);
 	struct ibv_mr   *add_mr = 	rdma_reg_msgs( 	c->id, 	add_bin, 	request_size);
@@ -269,9 +415,9 @@ test_with_regmem(void *arg) {
 
 	printf("Binary protocol:\n");
 
-	clock_gettime(CLOCK_REALTIME, &start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	
-	for (i = 0; i < request_number; ++i) {
+	for (i = 0; test_running(i, &start); ++i) {
 	    send_mr(c->id, get_mr);
 	    recv_msg(c);
 	    send_mr(c->id, add_mr);
@@ -284,17 +430,64 @@ test_with_regmem(void *arg) {
 	    recv_msg(c);
 	    send_mr(c->id, prepend_mr);
 	    recv_msg(c);
-	    send_mr(c->id, incr_mr);
-	    recv_msg(c);
-	    send_mr(c->id, decr_mr);
-	    recv_msg(c);
+	    if (atomic_counter) {
+		counter_incr(c, &counter);
+		counter_decr(c, &counter);
+	    } else {
+		send_mr(c->id, incr_mr);
+		recv_msg(c);
+		send_mr(c->id, decr_mr);
+		recv_msg(c);
+	    }
 	    send_mr(c->id, delete_mr);
 	    recv_msg(c);
 	}
 
-	clock_gettime(CLOCK_REALTIME, &finish);
-	printf("Binary protocol(with GET command) cost time: %lf secs\n\n", (double)(finish.tv_sec-start.tv_sec +
-	            (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	printf("Binary protocol(with GET command) cost time: %lf secs, %d rounds\n\n", (double)(finish.tv_sec-start.tv_sec +
+	            (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ), i);
+
+	if (quiet) {
+	    struct ibv_mr 	*getq_mr = 	rdma_reg_msgs( 	c->id, 	getq_bin, 	get_bin_len);
+	    struct ibv_mr   *addq_mr = 	rdma_reg_msgs( 	c->id, 	addq_bin, 	add_bin_len);
+	    struct ibv_mr   *setq_mr = 	rdma_reg_msgs( 	c->id, 	setq_bin, 	set_bin_len);
+	    struct ibv_mr   *replaceq_mr = 	rdma_reg_msgs( 	c->id, 	replaceq_bin, 	replace_bin_len);
+	    struct ibv_mr   *appendq_mr = 	rdma_reg_msgs( 	c->id, 	appendq_bin, 	append_bin_len);
+	    struct ibv_mr   *prependq_mr = 	rdma_reg_msgs( 	c->id, 	prependq_bin, 	prepend_bin_len);
+	    struct ibv_mr   *incrq_mr = 	rdma_reg_msgs( 	c->id, 	incrq_bin, 	incr_bin_len);
+	    struct ibv_mr   *decrq_mr = 	rdma_reg_msgs( 	c->id, 	decrq_bin, 	decr_bin_len);
+	    struct ibv_mr   *deleteq_mr = 	rdma_reg_msgs( 	c->id, 	deleteq_bin, 	delete_bin_len);
+	    struct ibv_mr   *noop_mr = 	rdma_reg_msgs( 	c->id, 	noop_bin, 	noop_bin_len);
+	    int errors = 0;
+
+	    printf("Binary quiet:\n");
+
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+
+	    // one round trip per cycle, the NOOP flushes it
+	    for (i = 0; test_running(i, &start); ++i) {
+		send_mr(c->id, getq_mr);
+		send_mr(c->id, addq_mr);
+		send_mr(c->id, setq_mr);
+		send_mr(c->id, replaceq_mr);
+		send_mr(c->id, appendq_mr);
+		send_mr(c->id, prependq_mr);
+		if (atomic_counter) {
+		    counter_incr(c, &counter);
+		    counter_decr(c, &counter);
+		} else {
+		    send_mr(c->id, incrq_mr);
+		    send_mr(c->id, decrq_mr);
+		}
+		send_mr(c->id, deleteq_mr);
+		send_mr(c->id, noop_mr);
+		errors += recv_until_noop(c);
+	    }
+
+	    clock_gettime(CLOCK_MONOTONIC, &finish);
+	    printf("Binary quiet(with GETQ command) cost time: %lf secs, %d rounds, %d errors\n\n", (double)(finish.tv_sec-start.tv_sec +
+	                (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ), i, errors);
+	}
     } else {
 	printf("Ascii noreply:\n");
 	struct ibv_mr   *add_nr_mr 	= 	rdma_reg_msgs( c->id, 	add_ascii_noreply, 	request_size);
@@ -316,16 +509,21 @@ test_with_regmem(void *arg) {
 	struct ibv_mr   *decr_r_mr 	=       rdma_reg_msgs( c->id, 	decr_ascii_reply, 	decr_ascii_reply_len);
 	struct ibv_mr   *delete_r_mr 	=       rdma_reg_msgs( c->id, 	delete_ascii_reply,     delete_ascii_reply_len);
 
-	clock_gettime(CLOCK_REALTIME, &start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	for (i = 0; i < request_number; i++) {
+	for (i = 0; test_running(i, &start); i++) {
 	    send_mr(c->id, add_nr_mr);
 	    send_mr(c->id, set_nr_mr);
 	    send_mr(c->id, replace_nr_mr);
 	    send_mr(c->id, append_nr_mr);
 	    send_mr(c->id, prepend_nr_mr);
-	    send_mr(c->id, incr_nr_mr);
-	    send_mr(c->id, decr_nr_mr);
+	    if (atomic_counter) {
+		counter_incr(c, &counter);
+		counter_decr(c, &counter);
+	    } else {
+		send_mr(c->id, incr_nr_mr);
+		send_mr(c->id, decr_nr_mr);
+	    }
 	    send_mr(c->id, delete_nr_mr);
 	}
 	
@@ -333,9 +531,9 @@ test_with_regmem(void *arg) {
 	send_mr(c->id, get_r_mr);
 	recv_msg(c);
 
-	clock_gettime(CLOCK_REALTIME, &finish);
-	printf("Ascii noreply(without GET command) cost time: %lf secs\n\n", (double)(finish.tv_sec-start.tv_sec +
-	            (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	printf("Ascii noreply(without GET command) cost time: %lf secs, %d rounds\n\n", (double)(finish.tv_sec-start.tv_sec +
+	            (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ), i);
 
 	printf("Ascii reply:\n");
 	
@@ -351,9 +549,9 @@ test_with_regmem(void *arg) {
 	puts(delete_ascii_reply);
 */
 
-	clock_gettime(CLOCK_REALTIME, &start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	for (i = 0; i < request_number; i++) {
+	for (i = 0; test_running(i, &start); i++) {
 	    send_mr(c->id, get_r_mr);
 	    recv_msg(c);
 	    send_mr(c->id, add_r_mr);
@@ -366,17 +564,47 @@ test_with_regmem(void *arg) {
 	    recv_msg(c);
 	    send_mr(c->id, prepend_r_mr);
 	    recv_msg(c);
-	    send_mr(c->id, incr_r_mr);
+	    if (atomic_counter) {
+		counter_incr(c, &counter);
+		counter_decr(c, &counter);
+	    } else {
+		send_mr(c->id, incr_r_mr);
+		recv_msg(c);
+		send_mr(c->id, decr_r_mr);
+		recv_msg(c);
+	    }
+	    send_mr(c->id, delete_r_mr);
 	    recv_msg(c);
-	    send_mr(c->id, decr_r_mr);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	printf("Ascii reply(with GET command) cost time: %lf secs, %d rounds\n\n", (double)(finish.tv_sec-start.tv_sec +
+	            (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ), i);
+    }
+
+    if (mget_fanout > 0) {
+	struct ibv_mr   *mget_mr = rdma_reg_msgs(c->id, mget_msg, mget_len);
+
+	printf("Multi-get, fan-out %d:\n", mget_fanout);
+
+	// store the keys first, so every key is a hit
+	for (i = 0; i < mget_fanout; i++) {
+	    struct ibv_mr *set_mr = rdma_reg_msgs(c->id, (char *)mget_set_msg + i * mget_set_len, mget_set_len);
+	    send_mr(c->id, set_mr);
 	    recv_msg(c);
-	    send_mr(c->id, delete_r_mr);
+	    rdma_dereg_mr(set_mr);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; test_running(i, &start); i++) {
+	    send_mr(c->id, mget_mr);
 	    recv_msg(c);
 	}
 
-	clock_gettime(CLOCK_REALTIME, &finish);
-	printf("Ascii reply(with GET command) cost time: %lf secs\n\n", (double)(finish.tv_sec-start.tv_sec +
-	            (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	printf("Multi-get(fan-out %d) cost time: %lf secs, %d rounds\n\n", mget_fanout, (double)(finish.tv_sec-start.tv_sec +
+	            (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ), i);
     }
 
     return NULL;
@@ -392,13 +620,17 @@ main(int argc, char *argv[]) {
     while (-1 != (c = getopt(argc, argv,
             "c:"    /* thread number */
             "r:"    /* request number per thread */
-            "t:"    /* last time, secs */
+            "t:"    /* secs of a test, rather than -r rounds */
             "p:"    /* listening port */
             "s:"    /* server ip */
 	    "m:"    /* request size */
             "R"     /* whether receive message from server */
             "v"     /* verbose */
 	    "b"     /* binary protocol */
+	    "k"     /* binary requests without the key hash */
+	    "A"     /* incr and decr by RDMA atomics, the server needs -C */
+	    "g:"    /* multi-get fan-out */
+	    "q"     /* binary quiet requests too, flushed by NOOP */
     ))) {
         switch (c) {
             case 'c':
@@ -408,7 +640,7 @@ main(int argc, char *argv[]) {
                 request_number = atoi(optarg);
                 break;
             case 't':
-                last_time = atoi(optarg);
+                last_time = atof(optarg);
                 break;
             case 'p':
                 pstr_port = optarg;
@@ -425,6 +657,18 @@ main(int argc, char *argv[]) {
 	    case 'b':
 	        if_binary = 1;
 		break;
+	    case 'k':
+	        bin_key_hash = 0;
+		break;
+	    case 'A':
+	        atomic_counter = 1;
+		break;
+	    case 'g':
+	        mget_fanout = atoi(optarg);
+		break;
+	    case 'q':
+	        quiet = 1;
+		break;
             default:
                 assert(0);
         }
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <pthread.h>
 #include <unistd.h>
@@ -14,6 +15,8 @@
 
 #include "protocol_binary.h"
 #include "build_cmd.h"
+#include "hist.h"
+#include "trace.h"
 
 #define BUFF_SIZE 1048576
 
@@ -29,6 +32,9 @@ static int 	if_binary = 0;
 static int      last_time = 1000;    /* secs */
 static int      verbose = 0;
 static int 	sock = 0;
+static int 	quiet = 0;
+static struct trace replay;
+static double 	speed = 1;
 
 
 
@@ -43,6 +49,103 @@ int socket_build_connection(void)
 }
 
 
+/* a reply may come in pieces, read up to "END" or the NOOP response which
+ * ends a multi-get and flushes quiet requests */
+static int recv_until_end(char *buff)
+{
+    int len = 0, n = 0, off = 0;
+
+    while ((n = recv(sock, buff + len, BUFF_SIZE - len, 0)) > 0) {
+	len += n;
+	if (if_binary == 0) {
+	    if (len >= 5 && 0 == memcmp(buff + len - 5, "END\r\n", 5))
+		return len;
+	    continue;
+	}
+	for (;;) {
+	    protocol_binary_response_header *h = (protocol_binary_response_header *)(buff + off);
+	    if (len - off < sizeof(*h) || len - off < sizeof(*h) + ntohl(h->response.bodylen))
+		break;
+	    if (PROTOCOL_BINARY_CMD_NOOP == h->response.opcode)
+		return len;
+	    off += sizeof(*h) + ntohl(h->response.bodylen);
+	}
+    }
+    return -1;
+}
+
+/* the reply to one request of the workload, a get ends in "END", a set in
+ * its status line */
+static int recv_reply(char *buff, int op)
+{
+    int len = 0, n = 0;
+
+    while ((n = recv(sock, buff + len, BUFF_SIZE - len, 0)) > 0) {
+	len += n;
+	if (if_binary == 0) {
+	    if (op == WORKLOAD_GET ? len >= 5 && 0 == memcmp(buff + len - 5, "END\r\n", 5)
+		    : len >= 2 && 0 == memcmp(buff + len - 2, "\r\n", 2))
+		return len;
+	    continue;
+	}
+	protocol_binary_response_header *h = (protocol_binary_response_header *)buff;
+	if (len >= sizeof(*h) && len >= sizeof(*h) + ntohl(h->response.bodylen))
+	    return len;
+    }
+    return -1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/***************************************************************************//**
+ * Replay a trace over the one connection, each request goes out at its time
+ * or as soon as the reply before it is in, its latency counts from its time
+ * so a late start is not hidden
+ *
+ ******************************************************************************/
+void
+test_replay(void) {
+    char *recv_buff = malloc(BUFF_SIZE);
+    static struct hist hist;
+    uint64_t start = 0, due = 0, i = 0;
+    double secs = 0;
+
+    if (socket_build_connection()) {
+	printf("Build connection fail!\n");
+	return;
+    }
+    hist_reset(&hist);
+
+    start = now_ns();
+    for (i = 0; i < replay.count; ++i) {
+	struct workload_req *r = &workload_reqs[i];
+
+	due = start + (uint64_t)(replay.recs[i].ns / speed);
+	if (now_ns() < due) {
+	    struct timespec ts = { due / 1000000000, due % 1000000000 };
+	    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	send(sock, workload_arena + r->off, r->len, 0);
+	if (recv_reply(recv_buff, r->op) < 0) {
+	    printf("Reply lost\n");
+	    break;
+	}
+	hist_record(&hist, now_ns() - due);
+    }
+
+    secs = (now_ns() - start) / 1e9;
+    printf("replay x%.2f: %llu requests in %.3f secs, %.0f ops/s, p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+	    speed, (unsigned long long)hist.count, secs, hist.count / secs,
+	    hist_quantile(&hist, 0.5) / 1e3, hist_quantile(&hist, 0.99) / 1e3,
+	    hist_quantile(&hist, 0.999) / 1e3);
+    free(recv_buff);
+}
+
 /***************************************************************************//**
  * Test command with registered memory
  *
@@ -62,7 +165,7 @@ test_with_regmem(void *arg) {
     init_message(if_binary);
 
     if (if_binary == 0) {
-	clock_gettime(CLOCK_REALTIME, &start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	printf("Ascii noreply:\n");
 	
@@ -81,7 +184,7 @@ test_with_regmem(void *arg) {
 	send(sock, get_ascii_reply, get_ascii_reply_len, 0);
 	recv(sock, recv_buff, BUFF_SIZE, 0);
 	
-	clock_gettime(CLOCK_REALTIME, &finish);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
 	printf("Ascii noreply(without GET command) cost time: %lf secs\n\n", (double)(finish.tv_sec-start.tv_sec + 
                 (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
 
@@ -99,7 +202,7 @@ test_with_regmem(void *arg) {
 	puts(delete_ascii_reply);
 */
 
-	clock_gettime(CLOCK_REALTIME, &start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	for (i = 0; i < request_number; ++i) {
 	    send(sock, get_ascii_reply, 	get_ascii_reply_len, 	0);
 	    recv(sock, recv_buff, BUFF_SIZE, 0);
@@ -129,13 +232,13 @@ test_with_regmem(void *arg) {
 	    recv(sock, recv_buff, BUFF_SIZE, 0);
 	}
 	
-	clock_gettime(CLOCK_REALTIME, &finish);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
 	printf("Ascii reply(with GET command) cost time: %lf secs\n\n", (double)(finish.tv_sec-start.tv_sec + 
                 (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
     } else {
 
 	printf("Binary protocol:\n");
-	clock_gettime(CLOCK_REALTIME, &start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	for (i = 0; i < request_number; ++i){
 	    send(sock, get_bin, 	get_bin_len, 		0);
@@ -166,9 +269,64 @@ test_with_regmem(void *arg) {
 	    recv(sock, recv_buff, BUFF_SIZE, 0);
 	}
 
-	clock_gettime(CLOCK_REALTIME, &finish);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
 	printf("Binary protocol(with GET command) cost time: %lf secs\n\n", (double)(finish.tv_sec-start.tv_sec +
 		(double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
+
+	if (quiet) {
+	    // the cycle goes out in one write, as pipelining clients do
+	    char *cycle = malloc(9 * request_size + noop_bin_len), *p = cycle;
+	    memcpy(p, getq_bin, get_bin_len); 		p += get_bin_len;
+	    memcpy(p, addq_bin, add_bin_len); 		p += add_bin_len;
+	    memcpy(p, setq_bin, set_bin_len); 		p += set_bin_len;
+	    memcpy(p, replaceq_bin, replace_bin_len); 	p += replace_bin_len;
+	    memcpy(p, appendq_bin, append_bin_len); 	p += append_bin_len;
+	    memcpy(p, prependq_bin, prepend_bin_len); 	p += prepend_bin_len;
+	    memcpy(p, incrq_bin, incr_bin_len); 	p += incr_bin_len;
+	    memcpy(p, decrq_bin, decr_bin_len); 	p += decr_bin_len;
+	    memcpy(p, deleteq_bin, delete_bin_len); 	p += delete_bin_len;
+	    memcpy(p, noop_bin, noop_bin_len); 		p += noop_bin_len;
+
+	    printf("Binary quiet:\n");
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+
+	    // one round trip per cycle, the NOOP flushes it
+	    for (i = 0; i < request_number; ++i) {
+		send(sock, cycle, p - cycle, 0);
+		if (recv_until_end(recv_buff) < 0) {
+		    printf("NOOP reply lost\n");
+		    break;
+		}
+	    }
+
+	    clock_gettime(CLOCK_MONOTONIC, &finish);
+	    printf("Binary quiet(with GETQ command) cost time: %lf secs\n\n", (double)(finish.tv_sec-start.tv_sec +
+		    (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
+	    free(cycle);
+	}
+    }
+
+    if (mget_fanout > 0) {
+	printf("Multi-get, fan-out %d:\n", mget_fanout);
+
+	// store the keys first, so every key is a hit
+	for (i = 0; i < mget_fanout; ++i) {
+	    send(sock, (char *)mget_set_msg + i * mget_set_len, mget_set_len, 0);
+	    recv(sock, recv_buff, BUFF_SIZE, 0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < request_number; ++i) {
+	    send(sock, mget_msg, mget_len, 0);
+	    if (recv_until_end(recv_buff) < 0) {
+		printf("Multi-get reply lost\n");
+		break;
+	    }
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	printf("Multi-get(fan-out %d) cost time: %lf secs\n\n", mget_fanout, (double)(finish.tv_sec-start.tv_sec +
+		(double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
     }
 
     return NULL;
@@ -203,6 +361,10 @@ main(int argc, char *argv[]) {
             "R"     /* whether receive message from server */
             "v"     /* verbose */
 	    "b"     /* binary protocol */
+	    "g:"    /* multi-get fan-out */
+	    "q"     /* binary quiet requests too, flushed by NOOP */
+	    "P:"    /* replay a trace */
+	    "x:"    /* the speed of a replay */
     ))) {
         switch (c) {
             case 'c':
@@ -229,6 +391,19 @@ main(int argc, char *argv[]) {
 	    case 'b':
 	    	if_binary = 1;
 		break;
+	    case 'g':
+	    	mget_fanout = atoi(optarg);
+		break;
+	    case 'q':
+	    	quiet = 1;
+		break;
+	    case 'P':
+	    	if (0 != trace_open(&replay, optarg))
+		    return 0;
+		break;
+	    case 'x':
+	    	speed = atof(optarg);
+		break;
             default:
                 assert(0);
         }
@@ -258,6 +433,18 @@ main(int argc, char *argv[]) {
 	return 0;
     }
 
+    if (replay.recs) {
+	if (speed <= 0 || replay.count > INT32_MAX) {
+	    printf("bad speed or trace.\n");
+	    return 0;
+	}
+	/* a trace is cut to what fits a receive buffer of async-client */
+	workload_value_max = 4096 - 512;
+	init_workload_trace(if_binary, replay.recs, replay.count);
+	test_replay();
+	return 0;
+    }
+
     test_with_regmem(NULL);
 
     return 0;
@@ -3,12 +3,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <netdb.h>
 #include <pthread.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 
+#include "hash.h"
+#include "mclient.h"
+#include "protocol_binary.h"
+#include "servers.h"
+#include "ud.h"
+#include "wr_id.h"
+
 #define HEAD_READ '\x88'
 #define HEAD_RWITE 'x99'
 #define HEAD_READ '\x88'
@@ -20,6 +29,9 @@
  ******************************************************************************/
 static char     *pstr_server = "127.0.0.1";
 static char     *pstr_port = "11211";
+static struct server_addr servers[SERVERS_MAX];
+static int      nservers = 0;
+static int      conns_per_thread = 1;
 static int      thread_number = 1;
 static int      request_number = 10000;
 static int      verbose = 0;
@@ -36,6 +48,15 @@ static int      test_read = 0;
 static int      test_write = 0;
 static int      test_conns = 0;
 static int      test_three = 0;
+static int      test_ud = 0;
+static int      test_partition = 0;
+static int      test_hot = 0;
+static int      test_mget = 0;
+static int      test_lib = 0;
+static int      test_ketama = 0;
+static int      test_tcp = 0;
+static int      ud_timeout_us = 1000;
+static int      ud_retries = 8;
 
 /***************************************************************************//**
  * Testing message
@@ -79,8 +100,6 @@ struct thread_context {
     int                         thread_id;
 };
 
-struct wr_context;
-
 struct rdma_conn {
     struct rdma_cm_id   *id;
 
@@ -93,16 +112,10 @@ struct rdma_conn {
 
     struct ibv_mr           **rmr_list;
     char                    **rbuf_list;
-    struct wr_context       *wr_ctx_list;
     size_t                  rsize; 
     size_t                  buff_list_size;
 };
 
-struct wr_context {
-    struct rdma_conn       *c;
-    struct ibv_mr           *mr;
-};
-
 /***************************************************************************//**
  * Description 
  * Init rdma global resources
@@ -147,7 +160,7 @@ init_rdma_thread_resources() {
  *
  ******************************************************************************/
 static struct rdma_conn *
-build_connection(struct thread_context *ctx) {
+connect_port(struct thread_context *ctx, const char *host, const char *port) {
     struct rdma_conn *c = calloc(1, sizeof(struct rdma_conn));
 
     if (0 != rdma_create_id(NULL, &c->id, c, RDMA_PS_TCP)) {
@@ -156,7 +169,7 @@ build_connection(struct thread_context *ctx) {
     }
     struct rdma_addrinfo    hints = { .ai_port_space = RDMA_PS_TCP },
                             *res = NULL;
-    if (0 != rdma_getaddrinfo(pstr_server, pstr_port, &hints, &res)) {
+    if (0 != rdma_getaddrinfo(host, port, &hints, &res)) {
         perror("rdma_getaddrinfo()");
         return NULL;
     }
@@ -200,15 +213,13 @@ build_connection(struct thread_context *ctx) {
     c->rsize = buff_size;
     c->rbuf_list = calloc(c->buff_list_size, sizeof(char*));
     c->rmr_list = calloc(c->buff_list_size, sizeof(struct ibv_mr*));
-    c->wr_ctx_list = calloc(c->buff_list_size, sizeof(struct wr_context));
 
     int i = 0;
     for (i = 0; i < c->buff_list_size; ++i) {
         c->rbuf_list[i] = malloc(c->rsize);
         c->rmr_list[i] = rdma_reg_msgs(c->id, c->rbuf_list[i], c->rsize);
-        c->wr_ctx_list[i].c = c;
-        c->wr_ctx_list[i].mr = c->rmr_list[i];
-        if (0 != rdma_post_recv(c->id, &c->wr_ctx_list[i], c->rmr_list[i]->addr, c->rmr_list[i]->length, c->rmr_list[i])) {
+        if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_RECV, 0, i),
+                    c->rmr_list[i]->addr, c->rmr_list[i]->length, c->rmr_list[i])) {
             perror("rdma_post_recv()");
             return NULL;
         }
@@ -217,12 +228,18 @@ build_connection(struct thread_context *ctx) {
     return c;
 }
 
+static struct rdma_conn *
+build_connection(struct thread_context *ctx) {
+    struct server_addr *s = &servers[ctx->thread_id % nservers];
+    return connect_port(ctx, s->host, s->port);
+}
+
 /***************************************************************************//**
  * send mr
  ******************************************************************************/
 static int 
 send_mr(struct rdma_cm_id *id, struct ibv_mr *mr) {
-    if (0 != rdma_post_send(id, NULL, mr->addr, mr->length, mr, 0)) {
+    if (0 != rdma_post_send(id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_SEND, 0, 0), mr->addr, mr->length, mr, 0)) {
         perror("rdma_post_send()");
         return -1;
     }
@@ -238,7 +255,7 @@ send_mr(struct rdma_cm_id *id, struct ibv_mr *mr) {
     } else {
         if (IBV_WC_SUCCESS != wc.status) {
             printf("BAD WC [%d]\n", wc.status);
-            if (0 != rdma_post_send(id, NULL, mr->addr, mr->length, mr, 0)) {
+            if (0 != rdma_post_send(id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_SEND, 0, 0), mr->addr, mr->length, mr, 0)) {
                 perror("rdma_post_send()");
                 return -1;
             }
@@ -270,14 +287,13 @@ recv_msg(struct rdma_conn *c) {
         return -1;
     }
     
-    struct wr_context *wr_ctx = (struct wr_context*)(uintptr_t)wc.wr_id;
-    struct ibv_mr *mr = wr_ctx->mr;
+    struct ibv_mr *mr = c->rmr_list[WR_ID_INDEX(wc.wr_id)];
 
     if (verbose) {
         printf("CLIENT RECV, length %d:\n%s\n", wc.byte_len, (char*)mr->addr);
     }
     
-    if (0 != rdma_post_recv(c->id, wr_ctx, mr->addr, mr->length, mr)) {
+    if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)wc.wr_id, mr->addr, mr->length, mr)) {
         perror("rdma_post_recv()");
         return -1;
     }
@@ -286,24 +302,30 @@ recv_msg(struct rdma_conn *c) {
 }
 
 /***************************************************************************//**
- * Test command with registered memory
+ * Test command with registered memory, the requests go round the
+ * conns_per_thread connections of the thread
  *
  ******************************************************************************/
 static char kValue[] = "VALUE ";
 static void
 test_with_regmem(struct thread_context *ctx) {
-    struct rdma_conn *c = NULL;
+    struct rdma_conn **conns = calloc(conns_per_thread, sizeof(struct rdma_conn *)),
+                     *c = NULL;
     struct timespec start,
                     finish;
-    int i = 0;
+    int i = 0, j = 0;
 
-    clock_gettime(CLOCK_REALTIME, &start);
-    if ( !(c = build_connection(ctx)) ) {
-        return;
+    for (j = 0; j < conns_per_thread; ++j) {
+        struct server_addr *s = &servers[(ctx->thread_id * conns_per_thread + j) % nservers];
+        if ( !(conns[j] = connect_port(ctx, s->host, s->port)) ) {
+            return;
+        }
     }
+    c = conns[0];
 
     printf("[%d] noreply:\n", ctx->thread_id);
 
+    /* the connections of a thread share the PD, one registration serves them all */
     struct ibv_mr   *mr = rdma_reg_msgs(c->id, kValue, 6);
     if (!mr) {
         perror("rdma_reg_msgs()");
@@ -318,7 +340,9 @@ test_with_regmem(struct thread_context *ctx) {
     struct ibv_mr   *decr_noreply_mr = rdma_reg_msgs(c->id, decr_noreply, sizeof(decr_noreply));
     struct ibv_mr   *delete_noreply_mr = rdma_reg_msgs(c->id, delete_noreply, sizeof(delete_noreply));
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     for (i = 0; i < request_number; ++i) {
+        c = conns[i % conns_per_thread];
         send_mr(c->id, add_noreply_mr);
         send_mr(c->id, set_noreply_mr);
         send_mr(c->id, replace_noreply_mr);
@@ -329,12 +353,11 @@ test_with_regmem(struct thread_context *ctx) {
         send_mr(c->id, delete_noreply_mr);
     }
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
     printf("[%d] Cost time: %lf secs\n", ctx->thread_id, 
         (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
 
     printf("[%d] reply:\n", ctx->thread_id);
-    clock_gettime(CLOCK_REALTIME, &start);
 
     struct ibv_mr   *add_reply_mr = rdma_reg_msgs(c->id, add_reply, sizeof(add_reply));
     struct ibv_mr   *set_reply_mr = rdma_reg_msgs(c->id, set_reply, sizeof(set_reply));
@@ -346,7 +369,9 @@ test_with_regmem(struct thread_context *ctx) {
     struct ibv_mr   *get_reply_mr = rdma_reg_msgs(c->id, get_reply, sizeof(get_reply));
     struct ibv_mr   *delete_reply_mr = rdma_reg_msgs(c->id, delete_reply, sizeof(delete_reply));
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     for (i = 0; i < request_number; ++i) {
+        c = conns[i % conns_per_thread];
         send_mr(c->id, add_reply_mr);
         recv_msg(c);
         send_mr(c->id, set_reply_mr);
@@ -369,7 +394,7 @@ test_with_regmem(struct thread_context *ctx) {
         recv_msg(c);
     }
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
     printf("[%d] Cost time: %lf secs\n", ctx->thread_id, 
             (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
 }
@@ -388,7 +413,6 @@ test_add_get(struct thread_context *ctx) {
                     finish;
     int i = 0;
 
-    clock_gettime(CLOCK_REALTIME, &start);
     if ( !(c = build_connection(ctx)) ) {
         return;
     }
@@ -406,6 +430,7 @@ test_add_get(struct thread_context *ctx) {
     struct ibv_mr   *get_reply_mr = rdma_reg_msgs(c->id, get_reply, sizeof(get_reply));
     struct ibv_mr   *delete_reply_mr = rdma_reg_msgs(c->id, delete_reply, sizeof(delete_reply));
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     for (i = 0; i < request_number; ++i) {
         send_mr(c->id, add_reply_mr);
         recv_msg(c);
@@ -415,7 +440,7 @@ test_add_get(struct thread_context *ctx) {
         recv_msg(c);
     }
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
     printf("[%d] Cost time: %lf secs\n", ctx->thread_id, 
             (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
 }
@@ -548,14 +573,14 @@ test_rdma_read(struct thread_context *ctx) {
     struct timespec start,
                     finish;
 
-    clock_gettime(CLOCK_REALTIME, &start);
     if ( !(c = build_connection(ctx)) ) {
         return;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     test_rdma_read_request(c);
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
     printf("[%d] Cost time: %lf secs\n", ctx->thread_id, 
         (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
 }
@@ -566,14 +591,14 @@ test_rdma_write(struct thread_context *ctx) {
     struct timespec start,
                     finish;
 
-    clock_gettime(CLOCK_REALTIME, &start);
     if ( !(c = build_connection(ctx)) ) {
         return;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     test_rdma_write_request(c);
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
     printf("[%d] Cost time: %lf secs\n", ctx->thread_id, 
         (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
 }
@@ -584,18 +609,818 @@ test_read_write(struct thread_context *ctx) {
     struct timespec start,
                     finish;
 
-    clock_gettime(CLOCK_REALTIME, &start);
     if ( !(c = build_connection(ctx)) ) {
         return;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     test_rdma_read_write(c);
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
     printf("[%d] Cost time: %lf secs\n", ctx->thread_id, 
         (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
 }
 
+/***************************************************************************//**
+ * Partitions, worker i of server owns the keys of partition i and listens on
+ * port + i. The map comes from "stats", then every request is sent on the
+ * connection of its owner.
+ *
+ ******************************************************************************/
+#define PARTITION_MAX   64
+#define CMD_SIZE        512
+
+static int
+request_reply(struct rdma_conn *c, struct ibv_mr *mr, size_t len, char *reply, size_t size) {
+    struct ibv_wc wc;
+    int cqe = 0;
+
+    if (0 != rdma_post_send(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_SEND, 0, 0),
+                mr->addr, len, mr, 0)) {
+        perror("rdma_post_send()");
+        return -1;
+    }
+    while (0 == (cqe = ibv_poll_cq(c->id->send_cq, 1, &wc))) ;
+    if (cqe < 0 || IBV_WC_SUCCESS != wc.status) {
+        fprintf(stderr, "send: %s\n", cqe < 0 ? "poll failed" : "bad wc");
+        return -1;
+    }
+
+    while (0 == (cqe = ibv_poll_cq(c->id->recv_cq, 1, &wc))) ;
+    if (cqe < 0 || IBV_WC_SUCCESS != wc.status) {
+        fprintf(stderr, "recv: %s\n", cqe < 0 ? "poll failed" : "bad wc");
+        return -1;
+    }
+
+    struct ibv_mr *rmr = c->rmr_list[WR_ID_INDEX(wc.wr_id)];
+    size_t n = wc.byte_len < size ? wc.byte_len : size - 1;
+    memcpy(reply, rmr->addr, n);
+    reply[n] = '\0';
+    if (verbose) {
+        printf("%s", reply);
+    }
+
+    return rdma_post_recv(c->id, (void *)(uintptr_t)wc.wr_id, rmr->addr, rmr->length, rmr);
+}
+
+void
+test_partition_request(struct thread_context *ctx) {
+    struct rdma_conn *conns[PARTITION_MAX];
+    struct timespec start,
+                    finish;
+    char cmd[CMD_SIZE], reply[CMD_SIZE], key[32], port[16];
+    unsigned int nparts = 0;
+    int i = 0, errors = 0;
+
+    if ( !(conns[0] = build_connection(ctx)) ) {
+        return;
+    }
+    struct ibv_mr *mr = rdma_reg_msgs(conns[0]->id, cmd, CMD_SIZE);
+
+    int len = snprintf(cmd, CMD_SIZE, "stats\r\n");
+    if (0 != request_reply(conns[0], mr, len, reply, CMD_SIZE)) return;
+    char *p = strstr(reply, "STAT partitions ");
+    if (!p || 1 != sscanf(p, "STAT partitions %u", &nparts) || 0 == nparts || nparts > PARTITION_MAX) {
+        fprintf(stderr, "no partition map in stats\n");
+        return;
+    }
+    for (i = 1; i < (int)nparts; ++i) {
+        struct server_addr *s = &servers[ctx->thread_id % nservers];
+        snprintf(port, sizeof(port), "%d", atoi(s->port) + i);
+        if ( !(conns[i] = connect_port(ctx, s->host, port)) ) {
+            return;
+        }
+    }
+    printf("[%d] %u partitions\n", ctx->thread_id, nparts);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < request_number; ++i) {
+        int nkey = snprintf(key, sizeof(key), "key:%d:%d", ctx->thread_id, i % 1024);
+        struct rdma_conn *c = conns[hash_partition(hash64(key, nkey), nparts)];
+
+        len = snprintf(cmd, CMD_SIZE, "set %s 0 0 1\r\n1\r\n", key);
+        if (0 != request_reply(c, mr, len, reply, CMD_SIZE)) return;
+        errors += 0 != strcmp(reply, "STORED\r\n");
+
+        len = snprintf(cmd, CMD_SIZE, "get %s\r\n", key);
+        if (0 != request_reply(c, mr, len, reply, CMD_SIZE)) return;
+        errors += 0 != strncmp(reply, kValue, sizeof(kValue) - 1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    printf("[%d] Cost time: %lf secs, %d errors\n", ctx->thread_id,
+        (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ),
+        errors);
+}
+
+/***************************************************************************//**
+ * Hot key, a burst of GETs of one key with a SET in the middle reaches the
+ * server in one batch. The GETs before the SET share one lookup and those
+ * after it another, every reply must show the value of its own turn.
+ *
+ ******************************************************************************/
+#define HOT_BURST   7   /* the client QP has 8 send WRs */
+#define HOT_SET     3   /* the place of SET in a burst */
+
+void
+test_hot_request(struct thread_context *ctx) {
+    struct rdma_conn *c = NULL;
+    struct timespec start,
+                    finish;
+    char cmds[HOT_BURST][CMD_SIZE], expect[CMD_SIZE];
+    size_t lens[HOT_BURST];
+    struct ibv_wc wc;
+    int i = 0, j = 0, cqe = 0, errors = 0;
+
+    if ( !(c = build_connection(ctx)) ) {
+        return;
+    }
+    struct ibv_mr *mr = rdma_reg_msgs(c->id, cmds, sizeof(cmds));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < request_number; ++i) {
+        for (j = 0; j < HOT_BURST; ++j) {
+            if (HOT_SET == j) {
+                lens[j] = snprintf(cmds[j], CMD_SIZE, "set hot:%d 0 0 8\r\n%08d\r\n",
+                        ctx->thread_id, i);
+            } else {
+                lens[j] = snprintf(cmds[j], CMD_SIZE, "get hot:%d\r\n", ctx->thread_id);
+            }
+        }
+        for (j = 0; j < HOT_BURST; ++j) {
+            if (0 != rdma_post_send(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_SEND, 0, j),
+                        cmds[j], lens[j], mr, 0)) {
+                perror("rdma_post_send()");
+                return;
+            }
+        }
+        for (j = 0; j < HOT_BURST; ++j) {
+            while (0 == (cqe = ibv_poll_cq(c->id->send_cq, 1, &wc))) ;
+            if (cqe < 0 || IBV_WC_SUCCESS != wc.status) {
+                fprintf(stderr, "send: %s\n", cqe < 0 ? "poll failed" : "bad wc");
+                return;
+            }
+        }
+
+        for (j = 0; j < HOT_BURST; ++j) {
+            while (0 == (cqe = ibv_poll_cq(c->id->recv_cq, 1, &wc))) ;
+            if (cqe < 0 || IBV_WC_SUCCESS != wc.status) {
+                fprintf(stderr, "recv: %s\n", cqe < 0 ? "poll failed" : "bad wc");
+                return;
+            }
+            struct ibv_mr *rmr = c->rmr_list[WR_ID_INDEX(wc.wr_id)];
+
+            if (HOT_SET == j) {
+                snprintf(expect, CMD_SIZE, "STORED\r\n");
+            } else if (j > HOT_SET) {
+                snprintf(expect, CMD_SIZE, "VALUE hot:%d 0 8\r\n%08d\r\nEND\r\n", ctx->thread_id, i);
+            } else if (i > 0) {
+                snprintf(expect, CMD_SIZE, "VALUE hot:%d 0 8\r\n%08d\r\nEND\r\n", ctx->thread_id, i - 1);
+            } else {
+                expect[0] = '\0';
+            }
+            if (expect[0] && (wc.byte_len != strlen(expect) || 0 != memcmp(rmr->addr, expect, wc.byte_len))) {
+                errors += 1;
+                if (verbose) {
+                    printf("%.*s", (int)wc.byte_len, (char *)rmr->addr);
+                }
+            }
+            if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)wc.wr_id, rmr->addr, rmr->length, rmr)) {
+                perror("rdma_post_recv()");
+                return;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    printf("[%d] Cost time: %lf secs, %d errors\n", ctx->thread_id,
+        (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ),
+        errors);
+}
+
+/***************************************************************************//**
+ * Multi-get, the keys of one "get" are stored with the value of this turn but
+ * one which is deleted, the reply must hold the others in order
+ *
+ ******************************************************************************/
+#define MGET_KEYS   8
+#define MGET_MISS   5   /* the key deleted in each turn */
+
+void
+test_mget_request(struct thread_context *ctx) {
+    struct rdma_conn *c = NULL;
+    struct timespec start,
+                    finish;
+    char cmd[CMD_SIZE], reply[CMD_SIZE], expect[CMD_SIZE];
+    int i = 0, j = 0, len = 0, elen = 0, errors = 0;
+
+    if ( !(c = build_connection(ctx)) ) {
+        return;
+    }
+    struct ibv_mr *mr = rdma_reg_msgs(c->id, cmd, CMD_SIZE);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < request_number; ++i) {
+        for (j = 0; j < MGET_KEYS; ++j) {
+            if (MGET_MISS == j) {
+                len = snprintf(cmd, CMD_SIZE, "delete mget:%d:%d\r\n", ctx->thread_id, j);
+            } else {
+                len = snprintf(cmd, CMD_SIZE, "set mget:%d:%d 0 0 8\r\n%08d\r\n", ctx->thread_id, j, i);
+            }
+            if (0 != request_reply(c, mr, len, reply, CMD_SIZE)) return;
+        }
+
+        len = snprintf(cmd, CMD_SIZE, "get");
+        elen = 0;
+        for (j = 0; j < MGET_KEYS; ++j) {
+            len += snprintf(cmd + len, CMD_SIZE - len, " mget:%d:%d", ctx->thread_id, j);
+            if (MGET_MISS != j) {
+                elen += snprintf(expect + elen, CMD_SIZE - elen, "VALUE mget:%d:%d 0 8\r\n%08d\r\n",
+                        ctx->thread_id, j, i);
+            }
+        }
+        len += snprintf(cmd + len, CMD_SIZE - len, "\r\n");
+        snprintf(expect + elen, CMD_SIZE - elen, "END\r\n");
+
+        if (0 != request_reply(c, mr, len, reply, CMD_SIZE)) return;
+        errors += 0 != strcmp(reply, expect);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    printf("[%d] Cost time: %lf secs, %d errors\n", ctx->thread_id,
+        (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ),
+        errors);
+}
+
+/***************************************************************************//**
+ * The client library, each turn posts sets, gets, incrs and deletes of
+ * LIB_KEYS keys without waiting, up to buff_per_conn are in flight. Every
+ * callback checks its own reply, the last get of a turn is a future.
+ *
+ ******************************************************************************/
+#define LIB_KEYS    64
+#define LIB_OPS     (3 * LIB_KEYS + 2)
+
+struct lib_expect {
+    int         *errors;
+    uint16_t    status;
+    uint64_t    number;
+    char        value[16];
+    size_t      nvalue;
+};
+
+static void
+lib_check(void *arg, const mclient_reply_t *r) {
+    struct lib_expect *e = arg;
+
+    if (r->status != e->status || r->number != e->number
+            || (e->nvalue && (r->nvalue != e->nvalue || 0 != memcmp(r->value, e->value, e->nvalue)))) {
+        *e->errors += 1;
+        if (verbose) {
+            printf("opcode %d status %d: %.*s\n", r->opcode, r->status, (int)r->nvalue, r->value);
+        }
+    }
+}
+
+static struct lib_expect *
+lib_expect(struct lib_expect *ex, int *n, int *errors, uint16_t status) {
+    struct lib_expect *e = &ex[(*n)++];
+
+    memset(e, 0, sizeof(*e));
+    e->errors = errors;
+    e->status = status;
+    return e;
+}
+
+void
+test_lib_request(struct thread_context *ctx) {
+    struct lib_expect ex[LIB_OPS], *e = NULL;
+    mclient_future_t f;
+    struct timespec start,
+                    finish;
+    char key[32], counter[32], value[16], fbuf[16];
+    int i = 0, j = 0, n = 0, nkey = 0, ncounter = 0, errors = 0;
+    size_t max_inflight = 0;
+    unsigned long long strays = 0;
+    mclient_t *cl = NULL;
+
+    mclient_shards_t *sh = mclient_shards_create(servers, nservers, buff_per_conn, 64);
+    if (!sh) {
+        return;
+    }
+    ncounter = snprintf(counter, sizeof(counter), "lib:%d:n", ctx->thread_id);
+
+    /* the key goes to the client of its server */
+#define LIB_POST(k, nk, call) do { \
+        cl = mclient_shard(sh, k, nk); \
+        if (0 != (call)) return; \
+        if (cl->inflight > max_inflight) max_inflight = cl->inflight; \
+    } while (0)
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < request_number / LIB_KEYS; ++i) {
+        n = 0;
+
+        /* the counter restarts, a missing one is created with 0 */
+        LIB_POST(counter, ncounter, mclient_delete(cl, counter, ncounter, NULL, NULL));
+
+        for (j = 0; j < LIB_KEYS; ++j) {
+            nkey = snprintf(key, sizeof(key), "lib:%d:%d", ctx->thread_id, j);
+            snprintf(value, sizeof(value), "%08d", i * LIB_KEYS + j);
+            e = lib_expect(ex, &n, &errors, 0);
+            LIB_POST(key, nkey, mclient_set(cl, key, nkey, value, 8, 0, 0, lib_check, e));
+        }
+        for (j = 0; j < LIB_KEYS; ++j) {
+            nkey = snprintf(key, sizeof(key), "lib:%d:%d", ctx->thread_id, j);
+            e = lib_expect(ex, &n, &errors, 0);
+            e->nvalue = snprintf(e->value, sizeof(e->value), "%08d", i * LIB_KEYS + j);
+            LIB_POST(key, nkey, mclient_get(cl, key, nkey, lib_check, e));
+        }
+        for (j = 0; j < LIB_KEYS; ++j) {
+            e = lib_expect(ex, &n, &errors, 0);
+            e->number = j;
+            LIB_POST(counter, ncounter, mclient_incr(cl, counter, ncounter, 1, 0, lib_check, e));
+        }
+
+        nkey = snprintf(key, sizeof(key), "lib:%d:%d", ctx->thread_id, 0);
+        e = lib_expect(ex, &n, &errors, 0);
+        LIB_POST(key, nkey, mclient_delete(cl, key, nkey, lib_check, e));
+        e = lib_expect(ex, &n, &errors, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+        LIB_POST(key, nkey, mclient_get(cl, key, nkey, lib_check, e));
+
+        nkey = snprintf(key, sizeof(key), "lib:%d:%d", ctx->thread_id, 1);
+        mclient_future_init(&f, fbuf, sizeof(fbuf));
+        LIB_POST(key, nkey, mclient_get(cl, key, nkey, mclient_future_cb, &f));
+        snprintf(value, sizeof(value), "%08d", i * LIB_KEYS + 1);
+        if (0 != mclient_wait(cl, &f) || 8 != f.reply.nvalue || 0 != memcmp(f.reply.value, value, 8)) {
+            errors += 1;
+        }
+
+        if (0 != mclient_shards_drain(sh)) return;
+    }
+#undef LIB_POST
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    for (i = 0; i < sh->n; ++i) {
+        strays += sh->clients[i]->strays;
+    }
+    printf("[%d] Cost time: %lf secs, %d servers, %d errors, %zu in flight at most, %llu strays\n",
+        ctx->thread_id,
+        (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ),
+        sh->n, errors, max_inflight, strays);
+    mclient_shards_free(sh);
+}
+
+/***************************************************************************//**
+ * The ketama ring over the server list, no connection is made. Times
+ * request_number lookups, then drops the last server and counts the keys
+ * which move: only the keys of that server may, about 1/N of all.
+ *
+ ******************************************************************************/
+static double
+elapsed_ns(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+void
+test_ketama_request(struct thread_context *ctx) {
+    struct ketama ring, less;
+    struct timespec t0, t1, t2;
+    int i = 0, errors = 0, moved = 0;
+
+    /* the keys are made and the arrays touched before the clock starts */
+    char *keys = malloc(request_number * 32);
+    int *nkeys = malloc(request_number * sizeof(int));
+    uint64_t *hv = calloc(request_number, sizeof(uint64_t));
+    int *owner = calloc(request_number, sizeof(int));
+    if (!keys || !nkeys || !hv || !owner || 0 != ketama_build(&ring, servers, nservers)) {
+        return;
+    }
+    for (i = 0; i < request_number; ++i) {
+        nkeys[i] = snprintf(keys + i * 32, 32, "key:%d:%d", ctx->thread_id, i);
+        owner[i] = hv[i] = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < request_number; ++i) {
+        hv[i] = hash64(keys + i * 32, nkeys[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (i = 0; i < request_number; ++i) {
+        owner[i] = ketama_find(&ring, ketama_point(hv[i]));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    printf("[%d] %d servers, %u points, hash64 %.1f ns, ring %.1f ns per key\n",
+        ctx->thread_id, nservers, ring.npoints,
+        elapsed_ns(&t0, &t1) / request_number, elapsed_ns(&t1, &t2) / request_number);
+
+    if (nservers > 1 && 0 == ketama_build(&less, servers, nservers - 1)) {
+        for (i = 0; i < request_number; ++i) {
+            int now = ketama_find(&less, ketama_point(hv[i]));
+            moved += now != owner[i];
+            errors += now != owner[i] && owner[i] != nservers - 1;
+        }
+        printf("[%d] without %s:%s, %.2f%% of keys moved, 1/N is %.2f%%, %d errors\n",
+            ctx->thread_id, servers[nservers - 1].host, servers[nservers - 1].port,
+            100.0 * moved / request_number, 100.0 / nservers, errors);
+        ketama_free(&less);
+    }
+    ketama_free(&ring);
+    free(keys);
+    free(nkeys);
+    free(hv);
+    free(owner);
+}
+
+/***************************************************************************//**
+ * UD, the server answers rdma_cm with the address of its UD QP and every
+ * request is one datagram
+ *
+ ******************************************************************************/
+#define UD_RECV_BUFFERS 16
+#define UD_RECV_SIZE    (UD_GRH_SIZE + UD_MTU_MAX)
+
+struct ud_conn {
+    struct rdma_event_channel   *channel;
+    struct rdma_cm_id           *id;
+    struct ibv_ah               *ah;
+    uint32_t                    qpn;
+    size_t                      mtu;        /* the active MTU of port */
+
+    char                        *sbuf;
+    struct ibv_mr               *smr;
+    char                        *rbuf;
+    struct ibv_mr               *rmr;
+    char                        *reply;     /* the last reply, out of its receive buffer */
+
+    uint64_t                    next_id;
+    long                        retransmits;
+};
+
+static int
+wait_cm_event(struct ud_conn *c, enum rdma_cm_event_type type, struct rdma_ud_param *ud) {
+    struct rdma_cm_event *event = NULL;
+    if (0 != rdma_get_cm_event(c->channel, &event)) {
+        perror("rdma_get_cm_event()");
+        return -1;
+    }
+    int ret = type == event->event ? 0 : -1;
+    if (0 != ret) {
+        fprintf(stderr, "expect %s, get %s\n", rdma_event_str(type), rdma_event_str(event->event));
+    } else if (ud) {
+        *ud = event->param.ud;
+    }
+    rdma_ack_cm_event(event);
+    return ret;
+}
+
+static struct ud_conn *
+build_ud_connection(struct thread_context *ctx) {
+    struct ud_conn *c = calloc(1, sizeof(struct ud_conn));
+
+    if ( !(c->channel = rdma_create_event_channel()) ) {
+        perror("rdma_create_event_channel()");
+        return NULL;
+    }
+    if (0 != rdma_create_id(c->channel, &c->id, c, RDMA_PS_UDP)) {
+        perror("rdma_create_id()");
+        return NULL;
+    }
+    struct rdma_addrinfo    hints = { .ai_port_space = RDMA_PS_UDP },
+                            *res = NULL;
+    struct server_addr *s = &servers[ctx->thread_id % nservers];
+    if (0 != rdma_getaddrinfo(s->host, s->port, &hints, &res)) {
+        perror("rdma_getaddrinfo()");
+        return NULL;
+    }
+
+    int ret = rdma_resolve_addr(c->id, NULL, res->ai_dst_addr, 100);
+    rdma_freeaddrinfo(res);
+    if (0 != ret || 0 != wait_cm_event(c, RDMA_CM_EVENT_ADDR_RESOLVED, NULL) ||
+            0 != rdma_resolve_route(c->id, 100) ||
+            0 != wait_cm_event(c, RDMA_CM_EVENT_ROUTE_RESOLVED, NULL)) {
+        perror("Error on resolving addr or route");
+        return NULL;
+    }
+
+    struct ibv_qp_init_attr qp_attr;
+    memset(&qp_attr, 0, sizeof(struct ibv_qp_init_attr));
+    qp_attr.cap.max_send_wr = 8;
+    qp_attr.cap.max_recv_wr = UD_RECV_BUFFERS;
+    qp_attr.cap.max_send_sge = 1;
+    qp_attr.cap.max_recv_sge = 1;
+    qp_attr.sq_sig_all = 1;
+    qp_attr.qp_type = IBV_QPT_UD;
+    qp_attr.send_cq = ctx->send_cq;
+    qp_attr.recv_cq = ctx->recv_cq;
+
+    if (0 != rdma_create_qp(c->id, ctx->pd, &qp_attr)) {
+        perror("rdma_create_qp()");
+        return NULL;
+    }
+    c->id->recv_cq = ctx->recv_cq;
+    c->id->send_cq = ctx->send_cq;
+
+    struct rdma_ud_param ud;
+    if (0 != rdma_connect(c->id, NULL) ||
+            0 != wait_cm_event(c, RDMA_CM_EVENT_ESTABLISHED, &ud)) {
+        perror("rdma_connect()");
+        return NULL;
+    }
+    if ( !(c->ah = ibv_create_ah(ctx->pd, &ud.ah_attr)) ) {
+        perror("ibv_create_ah()");
+        return NULL;
+    }
+    c->qpn = ud.qp_num;
+
+    if (0 == (c->mtu = ud_port_mtu(c->id->verbs, c->id->port_num))) {
+        perror("ibv_query_port()");
+        return NULL;
+    }
+
+    c->sbuf = malloc(UD_MTU_MAX);
+    c->smr = rdma_reg_msgs(c->id, c->sbuf, UD_MTU_MAX);
+    c->rbuf = malloc(UD_RECV_BUFFERS * UD_RECV_SIZE);
+    c->rmr = rdma_reg_msgs(c->id, c->rbuf, UD_RECV_BUFFERS * UD_RECV_SIZE);
+    c->reply = malloc(UD_RECV_SIZE);
+
+    int i = 0;
+    for (i = 0; i < UD_RECV_BUFFERS; ++i) {
+        if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_RECV, 0, i),
+                    c->rbuf + i * UD_RECV_SIZE, UD_RECV_SIZE, c->rmr)) {
+            perror("rdma_post_recv()");
+            return NULL;
+        }
+    }
+
+    if (verbose) {
+        printf("UD server qp %u\n", c->qpn);
+    }
+    return c;
+}
+
+static long
+elapsed_us(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/* send cmd until its reply comes back, the reply length or -1 */
+static int
+ud_request(struct ud_conn *c, const char *cmd, size_t len) {
+    struct ud_hdr *hdr = (struct ud_hdr *)c->sbuf;
+    struct ibv_wc wc;
+    int attempt = 0, cqe = 0;
+
+    if (len > UD_PAYLOAD_MAX(c->mtu)) {
+        fprintf(stderr, "a request of %zu bytes is over the UD payload of %zu\n",
+                len, UD_PAYLOAD_MAX(c->mtu));
+        return -1;
+    }
+    hdr->req_id = ++c->next_id;
+    memcpy(c->sbuf + sizeof(struct ud_hdr), cmd, len);
+
+    for (attempt = 0; attempt < ud_retries; ++attempt) {
+        if (0 != attempt) {
+            c->retransmits += 1;
+        }
+        if (0 != rdma_post_ud_send(c->id, NULL, c->sbuf, sizeof(struct ud_hdr) + len, c->smr,
+                    0, c->ah, c->qpn)) {
+            perror("rdma_post_ud_send()");
+            return -1;
+        }
+        while (0 == (cqe = ibv_poll_cq(c->id->send_cq, 1, &wc))) ;
+        if (cqe < 0 || IBV_WC_SUCCESS != wc.status) {
+            fprintf(stderr, "send: %s\n", cqe < 0 ? "poll failed" : "bad wc");
+            return -1;
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (elapsed_us(&start) < ud_timeout_us) {
+            if (0 == (cqe = ibv_poll_cq(c->id->recv_cq, 1, &wc))) continue;
+            if (cqe < 0 || IBV_WC_SUCCESS != wc.status) {
+                fprintf(stderr, "recv: %s\n", cqe < 0 ? "poll failed" : "bad wc");
+                return -1;
+            }
+
+            uint32_t index = WR_ID_INDEX(wc.wr_id);
+            char *buf = c->rbuf + index * UD_RECV_SIZE;
+            struct ud_hdr *reply = (struct ud_hdr *)(buf + UD_GRH_SIZE);
+            int reply_len = (int)(wc.byte_len - UD_GRH_SIZE - sizeof(struct ud_hdr));
+            uint64_t req_id = reply->req_id;
+            if (req_id == hdr->req_id) {
+                memcpy(c->reply, reply + 1, reply_len);
+                if (verbose) printf("%.*s", reply_len, c->reply);
+            }
+            rdma_post_recv(c->id, (void *)(uintptr_t)wc.wr_id, buf, UD_RECV_SIZE, c->rmr);
+
+            /* otherwise a late reply of a request sent before */
+            if (req_id == hdr->req_id) return reply_len;
+        }
+    }
+
+    fprintf(stderr, "no reply after %d sends\n", ud_retries);
+    return -1;
+}
+
+/* a value over the UD payload, built by appends, is refused in the protocol
+ * of the request reading it. The number of wrong replies. */
+static int
+ud_check_too_large(struct ud_conn *c) {
+    size_t chunk = UD_PAYLOAD_MAX(c->mtu) / 2;
+    char *cmd = malloc(chunk + 64);
+    int i = 0, len = 0, errors = 0;
+
+    for (i = 0; i < 3; ++i) {
+        len = sprintf(cmd, "%s ud_large 0 0 %zu\r\n", 0 == i ? "set" : "append", chunk);
+        memset(cmd + len, 'u', chunk);
+        memcpy(cmd + len + chunk, "\r\n", 2);
+        len += chunk + 2;
+        if (ud_request(c, cmd, len) < 0 || 0 != strncmp(c->reply, "STORED\r\n", 8)) {
+            free(cmd);
+            return 1;
+        }
+    }
+
+    len = ud_request(c, "get ud_large\r\n", 14);
+    errors += len < 12 || 0 != strncmp(c->reply, "SERVER_ERROR", 12);
+
+    protocol_binary_request_header *h = (protocol_binary_request_header *)cmd;
+    memset(h, 0, sizeof(*h));
+    h->request.magic = PROTOCOL_BINARY_REQ;
+    h->request.opcode = PROTOCOL_BINARY_CMD_GET;
+    h->request.keylen = htons(8);
+    h->request.bodylen = htonl(8);
+    h->request.opaque = 0x5a5a1234;
+    memcpy(h + 1, "ud_large", 8);
+    len = ud_request(c, cmd, sizeof(*h) + 8);
+
+    protocol_binary_response_header *r = (protocol_binary_response_header *)c->reply;
+    errors += len < (int)sizeof(*r) || PROTOCOL_BINARY_RES != r->response.magic
+        || PROTOCOL_BINARY_CMD_GET != r->response.opcode || 0x5a5a1234 != r->response.opaque
+        || PROTOCOL_BINARY_RESPONSE_E2BIG != ntohs(r->response.status);
+
+    free(cmd);
+    return errors;
+}
+
+void
+test_ud_request(struct thread_context *ctx) {
+    struct ud_conn *c = NULL;
+    struct timespec start,
+                    finish;
+
+    if ( !(c = build_ud_connection(ctx)) ) {
+        return;
+    }
+
+    int i = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < request_number; ++i) {
+        if (ud_request(c, set_reply, sizeof(set_reply) - 1) < 0 ||
+                ud_request(c, get_reply, sizeof(get_reply) - 1) < 0 ||
+                ud_request(c, delete_reply, sizeof(delete_reply) - 1) < 0) {
+            break;
+        }
+    }
+    int errors = ud_check_too_large(c);
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    printf("[%d] Cost time: %lf secs, %ld retransmits, %d errors\n", ctx->thread_id,
+        (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ),
+        c->retransmits, errors);
+}
+
+/***************************************************************************//**
+ * Binary requests over TCP whose framing needs more than the head the server
+ * looks at: a large SET, and a run of GETKQ ended by a NOOP
+ *
+ ******************************************************************************/
+static int
+tcp_connect(struct server_addr *s) {
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM },
+                    *res = NULL;
+    int fd = -1;
+
+    if (0 != getaddrinfo(s->host, s->port, &hints, &res)) {
+        fprintf(stderr, "getaddrinfo() failed for %s:%s\n", s->host, s->port);
+        return -1;
+    }
+    if (-1 == (fd = socket(res->ai_family, res->ai_socktype, 0)) ||
+            0 != connect(fd, res->ai_addr, res->ai_addrlen)) {
+        perror("connect()");
+        if (-1 != fd) close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int
+tcp_full_read(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/* the next response, its body in body of size bytes, or -1 */
+static int
+tcp_bin_response(int fd, protocol_binary_response_header *r, char *body, size_t size) {
+    if (0 != tcp_full_read(fd, r, sizeof(*r))) return -1;
+    size_t bodylen = ntohl(r->response.bodylen);
+    if (bodylen > size || 0 != tcp_full_read(fd, body, bodylen)) return -1;
+    return 0;
+}
+
+/* the request header at buf, the body follows it */
+static size_t
+tcp_bin_request(char *buf, uint8_t opcode, uint32_t opaque, uint8_t extlen,
+        const char *key, uint16_t nkey, uint32_t vlen) {
+    protocol_binary_request_header *h = (protocol_binary_request_header *)buf;
+    memset(h, 0, sizeof(*h) + extlen);
+    h->request.magic = PROTOCOL_BINARY_REQ;
+    h->request.opcode = opcode;
+    h->request.keylen = htons(nkey);
+    h->request.extlen = extlen;
+    h->request.bodylen = htonl(extlen + nkey + vlen);
+    h->request.opaque = opaque;
+    memcpy(buf + sizeof(*h) + extlen, key, nkey);
+    return sizeof(*h) + extlen + nkey + vlen;
+}
+
+void
+test_tcp_request(struct thread_context *ctx) {
+    enum { VALUE_SIZE = 10000, NRUN = 300 };
+    static const char key[] = "tcp_large";
+    protocol_binary_response_header r;
+    struct timespec start,
+                    finish;
+    char *buf = malloc(NRUN * 64 + VALUE_SIZE);
+    char *body = malloc(VALUE_SIZE + 256);
+    int i = 0, errors = 0, fd = -1;
+
+    if (-1 == (fd = tcp_connect(&servers[ctx->thread_id % nservers]))) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < request_number && errors < 10; ++i) {
+        /* a SET of more than the head, flags and exptime as extras */
+        size_t len = tcp_bin_request(buf, PROTOCOL_BINARY_CMD_SET, i, 8,
+                key, sizeof(key) - 1, VALUE_SIZE);
+        memset(buf + len - VALUE_SIZE, 'a' + i % 26, VALUE_SIZE);
+        if (len != (size_t)write(fd, buf, len) || 0 != tcp_bin_response(fd, &r, body, VALUE_SIZE + 256)) {
+            errors += 1;
+            break;
+        }
+        errors += PROTOCOL_BINARY_RESPONSE_SUCCESS != ntohs(r.response.status) || (uint32_t)i != r.response.opaque;
+
+        /* GETKQ of misses around the key, over several heads, then a NOOP */
+        len = 0;
+        int j = 0, hits = 0;
+        for (j = 0; j < NRUN; ++j) {
+            char miss[32];
+            if (0 == j % 100) {
+                len += tcp_bin_request(buf + len, PROTOCOL_BINARY_CMD_GETKQ, j, 0, key, sizeof(key) - 1, 0);
+            } else {
+                int nmiss = sprintf(miss, "tcp_miss_%d", j);
+                len += tcp_bin_request(buf + len, PROTOCOL_BINARY_CMD_GETKQ, j, 0, miss, nmiss, 0);
+            }
+        }
+        len += tcp_bin_request(buf + len, PROTOCOL_BINARY_CMD_NOOP, NRUN, 0, NULL, 0, 0);
+        if (len != (size_t)write(fd, buf, len)) {
+            errors += 1;
+            break;
+        }
+        do {
+            if (0 != tcp_bin_response(fd, &r, body, VALUE_SIZE + 256)) {
+                errors += 1;
+                break;
+            }
+            if (PROTOCOL_BINARY_CMD_GETKQ == r.response.opcode) {
+                hits += 1;
+                size_t off = r.response.extlen + ntohs(r.response.keylen);
+                errors += 0 != r.response.opaque % 100 || body[off] != 'a' + i % 26;
+            }
+        } while (PROTOCOL_BINARY_CMD_NOOP != r.response.opcode);
+        errors += NRUN / 100 != hits;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    printf("[%d] Cost time: %lf secs, %d errors\n", ctx->thread_id,
+        (double)(finish.tv_sec-start.tv_sec + (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ),
+        errors);
+    close(fd);
+    free(buf);
+    free(body);
+}
+
 /***************************************************************************//**
  * thread run
  *
@@ -619,6 +1444,20 @@ thread_run(void *arg) {
         test_add_get(ctx);
     } else if (test_large) {
         test_read_write(ctx);
+    } else if (test_ud) {
+        test_ud_request(ctx);
+    } else if (test_partition) {
+        test_partition_request(ctx);
+    } else if (test_hot) {
+        test_hot_request(ctx);
+    } else if (test_mget) {
+        test_mget_request(ctx);
+    } else if (test_lib) {
+        test_lib_request(ctx);
+    } else if (test_ketama) {
+        test_ketama_request(ctx);
+    } else if (test_tcp) {
+        test_tcp_request(ctx);
     } else {
         test_with_regmem(ctx);
     }
@@ -637,12 +1476,14 @@ main(int argc, char *argv[]) {
             "t:"    /* thread number */
             "r:"    /* request number per thread */
             "p:"    /* listening port */
-            "s:"    /* server ip */
+            "s:"    /* server ip[:port], a list separated by ',' */
+            "c:"    /* connections per thread, the default test */
             "v"     /* verbose */
             "b:"
             "T:"    /* testing type */
             "m:"    /* the size of large memory */
             "K:" 
+            "U:"    /* UD retransmission timeout, us */
     ))) {
         switch (c) {
             case 't':
@@ -678,6 +1519,20 @@ main(int argc, char *argv[]) {
                     test_three = 1;
                 } else if (0 == strcmp("test_large", optarg)) {
                     test_large = 1;
+                } else if (0 == strcmp("test_ud", optarg)) {
+                    test_ud = 1;
+                } else if (0 == strcmp("test_partition", optarg)) {
+                    test_partition = 1;
+                } else if (0 == strcmp("test_hot", optarg)) {
+                    test_hot = 1;
+                } else if (0 == strcmp("test_mget", optarg)) {
+                    test_mget = 1;
+                } else if (0 == strcmp("test_lib", optarg)) {
+                    test_lib = 1;
+                } else if (0 == strcmp("test_ketama", optarg)) {
+                    test_ketama = 1;
+                } else if (0 == strcmp("test_tcp", optarg)) {
+                    test_tcp = 1;
                 } else {
                     fprintf(stderr, "Wrong parameter!\n");
                     return -1;
@@ -686,24 +1541,36 @@ main(int argc, char *argv[]) {
             case 'm':
                 large_memory_size = atoi(optarg);
                 break;
+            case 'c':
+                conns_per_thread = atoi(optarg);
+                break;
             case 'K':
                 buff_size = atoi(optarg);
                 break;
+            case 'U':
+                ud_timeout_us = atoi(optarg);
+                break;
             default:
                 assert(0);
         }
     }
 
+    if (-1 == (nservers = servers_parse(pstr_server, pstr_port, servers, SERVERS_MAX))) {
+        return -1;
+    }
+
     struct timespec start,
                     finish;
-    clock_gettime(CLOCK_REALTIME, &start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
 
     pthread_t *threads = calloc(thread_number, sizeof(pthread_t));
 
     if (1 == thread_number) {
         /* use main thread by default */
-        thread_run(NULL);
+        int *pi = malloc(sizeof(int));
+        *pi = 0;
+        thread_run(pi);
 
     } else {
         int i = 0;
@@ -723,7 +1590,7 @@ main(int argc, char *argv[]) {
         }
     }
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
 
     printf("MAIN Cost time: %lf secs\n", (double)(finish.tv_sec-start.tv_sec + 
                 (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
@@ -0,0 +1,146 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "conntable.h"
+
+/*******************************************************************************/
+
+static size_t qp_home(conntable_t *t, uint32_t qp_num) {
+    return (qp_num * 2654435761U) & t->qp_mask;
+}
+
+conntable_t* conntable_create(size_t size) {
+    conntable_t *t = NULL;
+    if (size > CONNTABLE_MAX_SIZE) {
+        fprintf(stderr, "conntable_create(): %zu slots, at most %u\n", size, CONNTABLE_MAX_SIZE);
+        return NULL;
+    }
+    if ( !(t = calloc(1, sizeof(conntable_t))) ) {
+        fprintf(stderr, "out of memory in conntable_create()\n");
+        return NULL;
+    }
+
+    /* keep the qp index at most half full */
+    size_t qp_size = 2;
+    while (qp_size < size * 2) qp_size <<= 1;
+
+    t->size = size;
+    t->qp_mask = qp_size - 1;
+    t->conns = calloc(size, sizeof(void*));
+    t->gens = calloc(size, sizeof(uint8_t));
+    t->slot_qp = calloc(size, sizeof(uint32_t));
+    t->free_list = calloc(size, sizeof(uint32_t));
+    t->qp_keys = calloc(qp_size, sizeof(uint32_t));
+    t->qp_slots = calloc(qp_size, sizeof(uint32_t));
+    if (!t->conns || !t->gens || !t->slot_qp || !t->free_list || !t->qp_keys || !t->qp_slots) {
+        conntable_free(t);
+        fprintf(stderr, "out of memory in conntable_create()\n");
+        return NULL;
+    }
+
+    /* hand out low slots first */
+    size_t i = 0;
+    for (i = 0; i < size; ++i) {
+        t->free_list[i] = i;
+    }
+    t->free_count = size;
+
+    return t;
+}
+
+void conntable_free(conntable_t *t) {
+    if (t) {
+        free(t->conns);
+        free(t->gens);
+        free(t->slot_qp);
+        free(t->free_list);
+        free(t->qp_keys);
+        free(t->qp_slots);
+        free(t);
+    }
+}
+
+int conntable_insert(conntable_t *t, void *conn) {
+    if (0 == t->free_count) {
+        fprintf(stderr, "the connection table is full\n");
+        return -1;
+    }
+
+    uint32_t slot = t->free_list[t->free_head];
+    t->free_head = (t->free_head + 1) % t->size;
+    t->free_count -= 1;
+    t->conns[slot] = conn;
+    t->used += 1;
+    return (int)((uint32_t)t->gens[slot] << CONNTABLE_SLOT_BITS | slot);
+}
+
+static void unbind_qp(conntable_t *t, uint32_t qp_num) {
+    size_t i = qp_home(t, qp_num);
+    while (t->qp_keys[i] != qp_num + 1) {
+        if (0 == t->qp_keys[i]) return;
+        i = (i + 1) & t->qp_mask;
+    }
+
+    /* backward shift deletion, keep every probe sequence unbroken */
+    size_t j = i;
+    for (;;) {
+        t->qp_keys[i] = 0;
+        for (;;) {
+            j = (j + 1) & t->qp_mask;
+            if (0 == t->qp_keys[j]) return;
+
+            size_t k = qp_home(t, t->qp_keys[j] - 1);
+            if ( (i <= j) ? (i < k && k <= j) : (i < k || k <= j) ) continue;
+            break;
+        }
+        t->qp_keys[i] = t->qp_keys[j];
+        t->qp_slots[i] = t->qp_slots[j];
+        i = j;
+    }
+}
+
+void conntable_remove(conntable_t *t, int handle) {
+    if (handle < 0 || !conntable_get(t, handle)) return;
+    uint32_t slot = handle & CONNTABLE_SLOT_MASK;
+
+    if (t->slot_qp[slot]) {
+        unbind_qp(t, t->slot_qp[slot] - 1);
+        t->slot_qp[slot] = 0;
+    }
+
+    /* the completions still queued for the old handle find nothing */
+    t->gens[slot] += 1;
+    t->conns[slot] = NULL;
+    t->free_list[(t->free_head + t->free_count) % t->size] = slot;
+    t->free_count += 1;
+    t->used -= 1;
+}
+
+int conntable_bind_qp(conntable_t *t, uint32_t qp_num, int handle) {
+    if (handle < 0 || !conntable_get(t, handle)) return -1;
+    uint32_t slot = handle & CONNTABLE_SLOT_MASK;
+    if (t->slot_qp[slot]) return -1;
+
+    size_t i = qp_home(t, qp_num);
+    while (t->qp_keys[i]) {
+        if (t->qp_keys[i] == qp_num + 1) return -1;
+        i = (i + 1) & t->qp_mask;
+    }
+
+    t->qp_keys[i] = qp_num + 1;
+    t->qp_slots[i] = slot;
+    t->slot_qp[slot] = qp_num + 1;
+    return 0;
+}
+
+void *conntable_find_qp(conntable_t *t, uint32_t qp_num) {
+    size_t i = qp_home(t, qp_num);
+
+    while (t->qp_keys[i]) {
+        if (t->qp_keys[i] == qp_num + 1) {
+            return t->conns[t->qp_slots[i]];
+        }
+        i = (i + 1) & t->qp_mask;
+    }
+    return NULL;
+}
@@ -0,0 +1,101 @@
+/*
+ * Description: a dense connection table indexed by slot, with a direct-mapped
+ *              qp_num -> slot index for completions that carry no slot
+ *              (e.g. receives from a shared receive queue)
+ *
+ *              A connection is known by a handle, its slot and the generation
+ *              of the slot, which goes up on every release. A completion of
+ *              a destroyed QP carrying an old handle finds no connection even
+ *              once the slot is taken again. Free slots are reused oldest
+ *              first, so a generation wraps only after 256 times the table
+ *              size releases.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONNTABLE_SLOT_BITS 16
+#define CONNTABLE_SLOT_MASK ((1U << CONNTABLE_SLOT_BITS) - 1)
+#define CONNTABLE_MAX_SIZE  (1U << CONNTABLE_SLOT_BITS)
+
+/* the struct of connection table */
+typedef struct conntable_s {
+    size_t      size;       /* the number of slots */
+    size_t      used;
+    void        **conns;    /* slot -> connection */
+
+    uint8_t     *gens;      /* slot -> generation */
+    uint32_t    *slot_qp;   /* slot -> qp_num + 1, 0 means unbound */
+    uint32_t    *free_list; /* ring of free slots, the oldest released first */
+    size_t      free_head;
+    size_t      free_count;
+
+    size_t      qp_mask;    /* qp index size - 1, the size is power of two */
+    uint32_t    *qp_keys;   /* qp_num + 1, 0 means empty */
+    uint32_t    *qp_slots;
+} conntable_t;
+
+/* fetch the connection of a handle, NULL if its slot was released since */
+static inline void *conntable_get(conntable_t *t, uint32_t handle) {
+    uint32_t slot = handle & CONNTABLE_SLOT_MASK;
+    return t->gens[slot] == (uint8_t)(handle >> CONNTABLE_SLOT_BITS) ? t->conns[slot] : NULL;
+}
+
+/***************************************************************************//**
+ * Create a empty connection table
+ *
+ * @param[in] size  the max number of connections, up to CONNTABLE_MAX_SIZE
+ * @return          the pointer to connection table, NULL on failure
+ *
+ ******************************************************************************/
+conntable_t* conntable_create(size_t size);
+
+/***************************************************************************//**
+ * Free the connection table, the connections themselves are not freed
+ *
+ * @param[in] t     the pointer to connection table
+ *
+ ******************************************************************************/
+void conntable_free(conntable_t *t);
+
+/***************************************************************************//**
+ * Put a connection into a free slot
+ *
+ * @param[in] t     the pointer to connection table
+ * @param[in] conn  the connection
+ * @return          the handle on success, -1 if the table is full
+ *
+ ******************************************************************************/
+int conntable_insert(conntable_t *t, void *conn);
+
+/***************************************************************************//**
+ * Release a slot, and drop its qp_num binding if there is one
+ *
+ * @param[in] t         the pointer to connection table
+ * @param[in] handle    the handle returned by conntable_insert()
+ *
+ ******************************************************************************/
+void conntable_remove(conntable_t *t, int handle);
+
+/***************************************************************************//**
+ * Bind a qp_num to a slot, so conntable_find_qp() can resolve it
+ *
+ * @param[in] t         the pointer to connection table
+ * @param[in] qp_num    the qp number
+ * @param[in] handle    the handle of the connection owning the qp
+ * @return              0 on success, -1 on failure
+ *
+ ******************************************************************************/
+int conntable_bind_qp(conntable_t *t, uint32_t qp_num, int handle);
+
+/***************************************************************************//**
+ * Find the connection owning a qp
+ *
+ * @param[in] t         the pointer to connection table
+ * @param[in] qp_num    the qp number
+ * @return              the connection, NULL if the qp is unknown
+ *
+ ******************************************************************************/
+void *conntable_find_qp(conntable_t *t, uint32_t qp_num);
@@ -0,0 +1,24 @@
+/*
+ * Description: stackless coroutines in the manner of protothreads. A
+ *              coroutine is a function which keeps its place in a struct
+ *              coro and the rest of its state in the struct around it, so a
+ *              switch is a call and a jump rather than a stack of its own,
+ *              and thousands of them cost a few bytes each. It may yield only
+ *              in its own body, not in a function it calls, its locals do not
+ *              live across a yield, and its body holds no switch of its own.
+ */
+
+#pragma once
+
+struct coro {
+    int     line;   /* where to resume, 0 at the start and -1 once done */
+};
+
+#define CORO_INIT(co)   ((co)->line = 0)
+#define CORO_DONE(co)   (-1 == (co)->line)
+
+/* the body of a coroutine is within CORO_BEGIN and CORO_END, it returns 1
+ * when it yields and 0 once it is done */
+#define CORO_BEGIN(co)  switch ((co)->line) { case 0:
+#define CORO_YIELD(co)  do { (co)->line = __LINE__; return 1; case __LINE__:; } while (0)
+#define CORO_END(co)    } (co)->line = -1; return 0
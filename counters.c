@@ -0,0 +1,71 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "counters.h"
+
+/*******************************************************************************/
+
+counters_t* counters_create(size_t size) {
+    counters_t *cs = calloc(1, sizeof(counters_t));
+    if (!cs) goto fail;
+
+    /* keep the index at most half full */
+    size_t index_size = 2;
+    while (index_size < size * 2) index_size <<= 1;
+
+    cs->size = size;
+    cs->index_mask = index_size - 1;
+    if (0 != posix_memalign((void **)&cs->words, sysconf(_SC_PAGESIZE), size * sizeof(uint64_t))) {
+        cs->words = NULL;
+        goto fail;
+    }
+    memset(cs->words, 0, size * sizeof(uint64_t));
+
+    cs->index = calloc(index_size, sizeof(uint32_t));
+    cs->hvs = calloc(size, sizeof(uint64_t));
+    cs->nkeys = calloc(size, sizeof(uint16_t));
+    cs->keys = malloc(size * KEY_MAX_LENGTH);
+    if (!cs->index || !cs->hvs || !cs->nkeys || !cs->keys) goto fail;
+
+    return cs;
+
+fail:
+    fprintf(stderr, "out of memory in counters_create()\n");
+    if (cs) {
+        free(cs->words);
+        free(cs->index);
+        free(cs->hvs);
+        free(cs->nkeys);
+        free(cs->keys);
+        free(cs);
+    }
+    return NULL;
+}
+
+uint64_t *counters_bind(counters_t *cs, const char *key, size_t nkey, uint64_t hv,
+        uint64_t initial) {
+    size_t i = hv & cs->index_mask;
+
+    if (nkey > KEY_MAX_LENGTH) return NULL;
+
+    for (; cs->index[i]; i = (i + 1) & cs->index_mask) {
+        size_t w = cs->index[i] - 1;
+        if (cs->hvs[w] == hv && cs->nkeys[w] == nkey
+                && 0 == memcmp(cs->keys + w * KEY_MAX_LENGTH, key, nkey)) {
+            return &cs->words[w];
+        }
+    }
+
+    if (cs->used == cs->size) return NULL;
+
+    size_t w = cs->used++;
+    cs->hvs[w] = hv;
+    cs->nkeys[w] = nkey;
+    memcpy(cs->keys + w * KEY_MAX_LENGTH, key, nkey);
+    __atomic_store_n(&cs->words[w], initial, __ATOMIC_RELEASE);
+    cs->index[i] = w + 1;
+
+    return &cs->words[w];
+}
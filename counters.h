@@ -0,0 +1,51 @@
+/*
+ * Description: counters clients update with RDMA atomics. Each counter is an
+ *              aligned 8-byte word of one region registered for remote
+ *              atomics, a key is bound to a word once and keeps it until the
+ *              server exits. Counters are apart from items, incr and decr do
+ *              not see them.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "items.h"
+
+/* the struct of counter region */
+typedef struct counters_s {
+    uint64_t    *words;     /* page aligned, registered by the RDMA transport */
+    size_t      size;       /* the number of words */
+    size_t      used;
+
+    /* key -> word, open addressing, only the owning worker writes it */
+    size_t      index_mask;
+    uint32_t    *index;     /* word + 1, 0 means empty */
+    uint64_t    *hvs;       /* word -> the hash of its key */
+    uint16_t    *nkeys;
+    char        *keys;      /* word -> KEY_MAX_LENGTH bytes */
+} counters_t;
+
+/***************************************************************************//**
+ * Create a counter region
+ *
+ * @param[in] size  the number of counters
+ * @return          the pointer to counter region, NULL on failure
+ *
+ ******************************************************************************/
+counters_t* counters_create(size_t size);
+
+/***************************************************************************//**
+ * Find the counter of a key, binding a free word to it if it has none
+ *
+ * @param[in] cs        the pointer to counter region
+ * @param[in] key       the key
+ * @param[in] nkey      the length of key
+ * @param[in] hv        the hash value of key
+ * @param[in] initial   the value of a new counter
+ * @return              the word of counter, NULL if the region is full
+ *
+ ******************************************************************************/
+uint64_t *counters_bind(counters_t *cs, const char *key, size_t nkey, uint64_t hv,
+        uint64_t initial);
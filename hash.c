@@ -0,0 +1,47 @@
+
+#include <string.h>
+#include "hash.h"
+
+/*******************************************************************************/
+
+/* MurmurHash64A by Austin Appleby, placed in the public domain */
+uint64_t hash64(const void *key, size_t nkey) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const uint64_t seed = 0x5bd1e995;
+
+    uint64_t h = seed ^ (nkey * m);
+
+    const unsigned char *data = key;
+    const unsigned char *end = data + (nkey & ~(size_t)7);
+
+    while (data != end) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+        data += 8;
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (nkey & 7) {
+        case 7: h ^= (uint64_t)data[6] << 48;
+        case 6: h ^= (uint64_t)data[5] << 40;
+        case 5: h ^= (uint64_t)data[4] << 32;
+        case 4: h ^= (uint64_t)data[3] << 24;
+        case 3: h ^= (uint64_t)data[2] << 16;
+        case 2: h ^= (uint64_t)data[1] << 8;
+        case 1: h ^= (uint64_t)data[0];
+                h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
@@ -0,0 +1,31 @@
+/*
+ * Description: 64-bit key hash, shared by the server and the clients
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/***************************************************************************//**
+ * Calculate the 64-bit hash value of a key
+ *
+ * @param[in] key   the key
+ * @param[in] nkey  the length of key
+ * @return          the hash value
+ *
+ ******************************************************************************/
+uint64_t hash64(const void *key, size_t nkey);
+
+/***************************************************************************//**
+ * Find the partition owning a key, the high half of hash value is used since
+ * the buckets of a store are indexed by the low bits
+ *
+ * @param[in] hv    the hash value of key
+ * @param[in] n     the number of partitions
+ * @return          the partition in [0, n)
+ *
+ ******************************************************************************/
+static inline uint32_t hash_partition(uint64_t hv, uint32_t n) {
+    return (uint32_t)(((hv >> 32) * n) >> 32);
+}
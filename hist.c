@@ -0,0 +1,50 @@
+#include <string.h>
+
+#include "hist.h"
+
+/*******************************************************************************/
+
+void hist_reset(struct hist *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_merge(struct hist *to, const struct hist *from) {
+    int i = 0;
+
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        to->counts[i] += from->counts[i];
+    }
+    to->count += from->count;
+    if (from->min < to->min) to->min = from->min;
+    if (from->max > to->max) to->max = from->max;
+}
+
+/* the lowest and highest value of a bucket */
+static void bucket_range(int i, uint64_t *lo, uint64_t *hi) {
+    if (i < 2 * HIST_SUB) {
+        *lo = *hi = i;
+        return;
+    }
+    int shift = i / HIST_SUB - 1;
+    uint64_t sub = i % HIST_SUB + HIST_SUB;
+    *lo = sub << shift;
+    *hi = *lo + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t hist_quantile(const struct hist *h, double q) {
+    uint64_t rank = 0, seen = 0, lo = 0, hi = 0;
+    int i = 0;
+
+    if (0 == h->count) return 0;
+    rank = (uint64_t)(q * h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen > rank) break;
+    }
+    bucket_range(i, &lo, &hi);
+    lo += (hi - lo) / 2;
+    /* the ends are known exactly */
+    return lo < h->min ? h->min : (lo > h->max ? h->max : lo);
+}
@@ -0,0 +1,50 @@
+/*
+ * Description: a log-linear histogram of latencies in ns, in the manner of
+ *              HdrHistogram. A value below 128 has its own bucket, above that
+ *              every power of two is cut into 64 buckets, so a percentile is
+ *              within 1/64 of the true value at any magnitude. Recording is a
+ *              count, the histograms of threads add up into one.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS   6
+#define HIST_SUB        (1 << HIST_SUB_BITS)                  /* buckets per power of two */
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) * HIST_SUB) /* up to 2^64 */
+
+struct hist {
+    uint64_t    count;
+    uint64_t    min;
+    uint64_t    max;
+    uint64_t    counts[HIST_BUCKETS];
+};
+
+void hist_reset(struct hist *h);
+
+static inline int hist_bucket(uint64_t v) {
+    if (v < 2 * HIST_SUB) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return shift * HIST_SUB + (int)(v >> shift);
+}
+
+static inline void hist_record(struct hist *h, uint64_t v) {
+    h->counts[hist_bucket(v)] += 1;
+    h->count += 1;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+/* add from to to */
+void hist_merge(struct hist *to, const struct hist *from);
+
+/***************************************************************************//**
+ * The value at a quantile
+ *
+ * @param[in] h     the histogram
+ * @param[in] q     in [0, 1]
+ * @return          the middle of the bucket holding it, 0 if h is empty
+ *
+ ******************************************************************************/
+uint64_t hist_quantile(const struct hist *h, double q);
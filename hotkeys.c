@@ -0,0 +1,152 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hotkeys.h"
+
+/*******************************************************************************/
+
+hotkeys_t *hotkeys_create() {
+    hotkeys_t *hk = calloc(1, sizeof(hotkeys_t));
+    if (!hk) {
+        fprintf(stderr, "out of memory in hotkeys_create()\n");
+    }
+    return hk;
+}
+
+/* the rows take hv + i * (hv >> 32), the odd step keeps them apart */
+static inline uint32_t *counter(hotkeys_t *hk, int row, uint64_t hv) {
+    uint32_t h1 = (uint32_t)hv, h2 = (uint32_t)(hv >> 32) | 1;
+    return &hk->sketch[row][(h1 + row * h2) & (HOTKEYS_WIDTH - 1)];
+}
+
+/* conservative update, only the counters at the minimum grow */
+static uint32_t sketch_add(hotkeys_t *hk, uint64_t hv) {
+    uint32_t est = UINT32_MAX;
+    int i = 0;
+
+    for (i = 0; i < HOTKEYS_DEPTH; ++i) {
+        uint32_t c = *counter(hk, i, hv);
+        if (c < est) est = c;
+    }
+    est += 1;
+    for (i = 0; i < HOTKEYS_DEPTH; ++i) {
+        uint32_t *c = counter(hk, i, hv);
+        if (*c < est) *c = est;
+    }
+    return est;
+}
+
+/*******************************************************************************
+ * The min-heap of top keys
+ ******************************************************************************/
+
+static void heap_swap(hotkeys_t *hk, size_t a, size_t b) {
+    hotkey_t t;
+    memcpy(&t, &hk->heap[a], sizeof(t));
+    memcpy(&hk->heap[a], &hk->heap[b], sizeof(t));
+    memcpy(&hk->heap[b], &t, sizeof(t));
+}
+
+static void heap_up(hotkeys_t *hk, size_t i) {
+    while (i > 0 && hk->heap[(i - 1) / 2].count > hk->heap[i].count) {
+        heap_swap(hk, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(hotkeys_t *hk, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+        if (l < hk->nheap && hk->heap[l].count < hk->heap[min].count) min = l;
+        if (r < hk->nheap && hk->heap[r].count < hk->heap[min].count) min = r;
+        if (min == i) return;
+        heap_swap(hk, i, min);
+        i = min;
+    }
+}
+
+static void set_key(hotkey_t *e, const char *key, size_t nkey, uint64_t hv, uint32_t count) {
+    e->hv = hv;
+    e->count = count;
+    e->nkey = nkey;
+    memcpy(e->key, key, nkey);
+}
+
+/* halve every count, so keys which cooled down leave the top */
+static void decay(hotkeys_t *hk) {
+    size_t i = 0, j = 0;
+
+    for (i = 0; i < HOTKEYS_DEPTH; ++i) {
+        for (j = 0; j < HOTKEYS_WIDTH; ++j) {
+            hk->sketch[i][j] >>= 1;
+        }
+    }
+    for (i = 0; i < hk->nheap; ++i) {
+        hk->heap[i].count >>= 1;
+    }
+    hk->samples >>= 1;
+}
+
+void hotkeys_count(hotkeys_t *hk, const char *key, size_t nkey, uint64_t hv) {
+    size_t i = 0;
+
+    if (nkey > KEY_MAX_LENGTH) return;
+
+    if (++hk->samples >= HOTKEYS_WINDOW) decay(hk);
+    hk->total_samples += 1;
+
+    uint32_t est = sketch_add(hk, hv);
+
+    for (i = 0; i < hk->nheap; ++i) {
+        hotkey_t *e = &hk->heap[i];
+        if (e->hv == hv && e->nkey == nkey && 0 == memcmp(e->key, key, nkey)) {
+            e->count = est;
+            heap_down(hk, i);
+            return;
+        }
+    }
+
+    if (hk->nheap < HOTKEYS_TOP) {
+        set_key(&hk->heap[hk->nheap], key, nkey, hv, est);
+        heap_up(hk, hk->nheap++);
+    } else if (est > hk->heap[0].count) {
+        set_key(&hk->heap[0], key, nkey, hv, est);
+        heap_down(hk, 0);
+    }
+}
+
+static int by_count(const void *a, const void *b) {
+    uint32_t x = (*(const hotkey_t **)a)->count, y = (*(const hotkey_t **)b)->count;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+size_t hotkeys_stats(hotkeys_t *hk, char *buf, size_t size) {
+    const hotkey_t *top[HOTKEYS_TOP];
+    char key[KEY_MAX_LENGTH];
+    size_t len = 0, i = 0, j = 0;
+    int n = 0;
+
+    n = snprintf(buf, size, "STAT hotkey_samples %llu\r\n", (unsigned long long)hk->total_samples);
+    if (n < 0 || (size_t)n >= size) return 0;
+    len = n;
+
+    for (i = 0; i < hk->nheap; ++i) {
+        top[i] = &hk->heap[i];
+    }
+    qsort(top, hk->nheap, sizeof(top[0]), by_count);
+
+    for (i = 0; i < hk->nheap; ++i) {
+        /* binary keys may hold anything, keep the line parseable */
+        for (j = 0; j < top[i]->nkey; ++j) {
+            char ch = top[i]->key[j];
+            key[j] = (ch > ' ' && ch < 0x7f) ? ch : '?';
+        }
+        double share = hk->samples ? 100.0 * top[i]->count / hk->samples : 0.0;
+        n = snprintf(buf + len, size - len, "STAT hotkey_%zu %.*s %.2f\r\n",
+                i, (int)top[i]->nkey, key, share > 100.0 ? 100.0 : share);
+        if (n < 0 || (size_t)n >= size - len) break;
+        len += n;
+    }
+    return len;
+}
@@ -0,0 +1,75 @@
+/*
+ * Description: hot key detection, a count-min sketch estimates the count of
+ *              every sampled key and a min-heap keeps the top keys by that
+ *              estimate. Counts are halved every window so the top follows
+ *              the current traffic. One instance per worker, not shared.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "items.h"
+
+#define HOTKEYS_DEPTH   4           /* rows of sketch */
+#define HOTKEYS_WIDTH   2048        /* counters per row, power of two */
+#define HOTKEYS_TOP     16          /* keys kept in the heap */
+#define HOTKEYS_SAMPLE  8           /* one of every 8 requests is counted */
+#define HOTKEYS_WINDOW  (1 << 16)   /* samples between two halvings */
+
+typedef struct hotkey_s {
+    uint64_t    hv;
+    uint32_t    count;      /* the estimate of sketch */
+    uint16_t    nkey;
+    char        key[KEY_MAX_LENGTH];
+} hotkey_t;
+
+/* the struct of hot key tracker */
+typedef struct hotkeys_s {
+    uint32_t    sketch[HOTKEYS_DEPTH][HOTKEYS_WIDTH];
+    hotkey_t    heap[HOTKEYS_TOP];  /* min-heap by count */
+    size_t      nheap;
+
+    uint32_t    tick;       /* requests seen, for sampling */
+    uint32_t    samples;    /* halved with the counts */
+    uint64_t    total_samples;
+} hotkeys_t;
+
+/***************************************************************************//**
+ * Create a empty tracker
+ *
+ * @return  the tracker, NULL on failure
+ *
+ ******************************************************************************/
+hotkeys_t *hotkeys_create();
+
+/***************************************************************************//**
+ * Count a request of key, hotkeys_sample() calls it for one of every
+ * HOTKEYS_SAMPLE requests
+ *
+ * @param[in] hk    the tracker
+ * @param[in] key   the key
+ * @param[in] nkey  the length of key
+ * @param[in] hv    the hash value of key
+ *
+ ******************************************************************************/
+void hotkeys_count(hotkeys_t *hk, const char *key, size_t nkey, uint64_t hv);
+
+static inline void hotkeys_sample(hotkeys_t *hk, const char *key, size_t nkey, uint64_t hv) {
+    if (0 == (++hk->tick & (HOTKEYS_SAMPLE - 1))) {
+        hotkeys_count(hk, key, nkey, hv);
+    }
+}
+
+/***************************************************************************//**
+ * Write the "STAT name value\r\n" lines of the hot keys, hottest first, with
+ * the share of sampled requests in percent. Keys are written while they fit.
+ *
+ * @param[in] hk    the tracker
+ * @param[in] buf   the output buffer
+ * @param[in] size  the size of buffer
+ * @return          the length written
+ *
+ ******************************************************************************/
+size_t hotkeys_stats(hotkeys_t *hk, char *buf, size_t size);
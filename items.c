@@ -0,0 +1,827 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "items.h"
+
+/*******************************************************************************/
+
+#define EVICT_BATCH         64      /* items walked per lock hold */
+#define EVICT_LOW(cls)      ((cls)->perslab / 64 + 1)   /* free chunks waking the evictor */
+#define EVICT_HIGH(cls)     (EVICT_LOW(cls) * 4)        /* free chunks it stops at */
+
+#define WHEEL_MASK          (WHEEL_SLOTS - 1)
+
+/* rel_time 0 and 1 are always in the past, 1 marks a item expired at once */
+#define TIME_EXPIRED        1
+#define TIME_START          2
+
+#define ITEM_expired(st, it) ((it)->exptime && (it)->exptime <= (st)->current_time)
+
+static void *evictor_thread(void *arg);
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+store_t* store_create(size_t limit, int hashpower) {
+    store_t *st = calloc(1, sizeof(store_t));
+    if (!st) {
+        fprintf(stderr, "out of memory in store_create()\n");
+        return NULL;
+    }
+
+    st->hashmask = ((size_t)1 << hashpower) - 1;
+    st->buckets = calloc(st->hashmask + 1, sizeof(item_t*));
+    if (!st->buckets) {
+        free(st);
+        fprintf(stderr, "out of memory in store_create()\n");
+        return NULL;
+    }
+
+    if ( !(st->slabs = slabs_create(limit)) ) {
+        free(st->buckets);
+        free(st);
+        return NULL;
+    }
+
+    st->started_ns = now_ns();
+    st->process_started = time(NULL) - TIME_START;
+    st->current_time = TIME_START;
+    st->wheel_time = TIME_START;
+    st->drain_page = -1;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->evict_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return st;
+}
+
+void store_free(store_t *st) {
+    if (st) {
+        if (st->evict_running) {
+            pthread_mutex_lock(&st->lock);
+            st->evict_running = 0;
+            pthread_cond_signal(&st->evict_cond);
+            pthread_mutex_unlock(&st->lock);
+            pthread_join(st->evict_thread, NULL);
+        }
+        pthread_cond_destroy(&st->evict_cond);
+        pthread_mutex_destroy(&st->lock);
+
+        /* items live in the arena, nothing else to free */
+        slabs_free(st->slabs);
+        free(st->buckets);
+        free(st);
+    }
+}
+
+int store_start_evictor(store_t *st) {
+    st->evict_running = 1;
+    if (0 != pthread_create(&st->evict_thread, NULL, evictor_thread, st)) {
+        st->evict_running = 0;
+        fprintf(stderr, "failed to create the evictor thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* double the buckets, inline under the store lock */
+static void expand_buckets(store_t *st) {
+    size_t new_mask = (st->hashmask << 1) | 1;
+    item_t **new_buckets = calloc(new_mask + 1, sizeof(item_t*));
+    if (!new_buckets) {
+        return;
+    }
+
+    size_t i = 0;
+    for (i = 0; i <= st->hashmask; ++i) {
+        item_t *it = st->buckets[i];
+        while (it) {
+            item_t *next = it->h_next;
+            it->h_next = new_buckets[it->hv & new_mask];
+            new_buckets[it->hv & new_mask] = it;
+            it = next;
+        }
+    }
+
+    free(st->buckets);
+    st->buckets = new_buckets;
+    st->hashmask = new_mask;
+}
+
+static void do_item_unlink(store_t *st, item_t *it);
+
+/* a expired item is reclaimed when it is met, before the wheel gets to it */
+static item_t *find_item(store_t *st, const char *key, size_t nkey, uint64_t hv) {
+    item_t *it = st->buckets[hv & st->hashmask];
+
+    while (it) {
+        if (it->hv == hv && it->nkey == nkey && 0 == memcmp(ITEM_key(it), key, nkey)) {
+            if (ITEM_expired(st, it)) {
+                st->evict_stats.expired += 1;
+                do_item_unlink(st, it);
+                return NULL;
+            }
+            return it;
+        }
+        it = it->h_next;
+    }
+    return NULL;
+}
+
+static void reclaim_pages(store_t *st, int unlocked_clear);
+
+/* a page left empty is handed to the evictor, giving it back to the arena
+ * walks the free list and clears the page, too long for a request */
+static void free_item(store_t *st, item_t *it) {
+    if (!slabs_release(st->slabs, it, it->slabs_clsid)) return;
+
+    if (!st->evict_running) {
+        reclaim_pages(st, 0);
+    } else if (!st->evict_wanted) {
+        st->evict_wanted = 1;
+        pthread_cond_signal(&st->evict_cond);
+    }
+}
+
+/*******************************************************************************
+ * CLOCK
+ *
+ * The linked items of a class form a ring. A hit only sets ITEM_ACTIVE, the
+ * hand clears it when passing and evicts the first item found inactive and
+ * unreferenced. New items go right behind the hand, the last to be visited.
+ ******************************************************************************/
+
+static void clock_link(store_t *st, item_t *it) {
+    item_t **hand = &st->clock_hand[it->slabs_clsid];
+
+    if (*hand) {
+        it->next = *hand;
+        it->prev = (*hand)->prev;
+        it->prev->next = it;
+        (*hand)->prev = it;
+    } else {
+        it->next = it->prev = it;
+        *hand = it;
+    }
+    st->clock_items[it->slabs_clsid] += 1;
+}
+
+static void clock_unlink(store_t *st, item_t *it) {
+    item_t **hand = &st->clock_hand[it->slabs_clsid];
+
+    if (it->next == it) {
+        *hand = NULL;
+    } else {
+        if (*hand == it) *hand = it->next;
+        it->prev->next = it->next;
+        it->next->prev = it->prev;
+    }
+    it->next = it->prev = NULL;
+    st->clock_items[it->slabs_clsid] -= 1;
+}
+
+static void evict_item(store_t *st, item_t *it) {
+    st->evict_stats.evictions += 1;
+    st->evict_stats.evicted_bytes += st->slabs->classes[it->slabs_clsid].size;
+    do_item_unlink(st, it);
+}
+
+/* advance the hand of class id until a item is evicted, taking the items
+ * walked out of budget. 0 once one is evicted, 1 when the budget runs out
+ * first, -1 if none can go: the hand went twice round, which clears every
+ * reference bit, without evicting. */
+static int clock_evict(store_t *st, int id, size_t *budget) {
+    while (*budget > 0) {
+        item_t *it = st->clock_hand[id];
+        if (!it || st->clock_walked[id] > 2 * st->clock_items[id]) {
+            st->clock_walked[id] = 0;
+            return -1;
+        }
+        *budget -= 1;
+        st->clock_walked[id] += 1;
+
+        st->clock_hand[id] = it->next;
+        if (ITEM_expired(st, it) && 0 == it->refcount) {
+            st->evict_stats.expired += 1;
+            st->clock_walked[id] = 0;
+            do_item_unlink(st, it);
+            return 0;
+        }
+        if (it->it_flags & ITEM_ACTIVE) {
+            it->it_flags &= ~ITEM_ACTIVE;
+            continue;
+        }
+        if (it->refcount > 0) continue;     /* being sent or RDMA read */
+
+        st->clock_walked[id] = 0;
+        evict_item(st, it);
+        return 0;
+    }
+    return 1;
+}
+
+/* empty the least used page of the class holding most pages, so the page can
+ * move to class id which has nothing to evict itself. The chunks walked are
+ * taken out of budget, the page is resumed by the next call. 0 once a page is
+ * empty, 1 when the budget runs out first, -1 if no page can be emptied. */
+static int evict_page(store_t *st, int id, size_t *budget) {
+    slabs_t *s = st->slabs;
+    int victim = 0, i = 0;
+
+    if (st->drain_page >= 0 && (0 == s->page_class[st->drain_page]
+                || id == s->page_class[st->drain_page])) {
+        st->drain_page = -1;
+    }
+    if (st->drain_page < 0) {
+        for (i = 1; i <= s->nclasses; ++i) {
+            if (i != id && s->classes[i].pages > 0
+                    && (0 == victim || s->classes[i].pages > s->classes[victim].pages)) {
+                victim = i;
+            }
+        }
+        if (0 == victim) return -1;
+
+        size_t page = 0, best = s->page_count;
+        for (page = 0; page < s->next_page; ++page) {
+            if (s->page_class[page] == victim
+                    && (best == s->page_count || s->page_used[page] < s->page_used[best])) {
+                best = page;
+            }
+        }
+        if (best == s->page_count) return -1;
+        st->drain_page = best;
+        st->drain_chunk = 0;
+    }
+
+    /* released pages are zeroed, so a chunk holding ITEM_LINKED is a item */
+    size_t page = st->drain_page;
+    slabclass_t *cls = &s->classes[s->page_class[page]];
+    char *start = s->base + page * SLAB_PAGE_SIZE;
+    while (s->page_used[page] > 0 && st->drain_chunk < cls->perslab) {
+        if (0 == *budget) return 1;
+        *budget -= 1;
+
+        item_t *it = (item_t*)(start + st->drain_chunk++ * cls->size);
+        if ((it->it_flags & ITEM_LINKED) && 0 == it->refcount) {
+            evict_item(st, it);
+        }
+    }
+
+    /* a page kept by a reference is left, the next call takes another */
+    st->drain_page = -1;
+    return 0 == s->page_used[page] ? 0 : 1;
+}
+
+/*******************************************************************************
+ * the timing wheel
+ *
+ * Level L holds the items expiring within WHEEL_SLOTS slots of 2^(L*BITS)
+ * seconds. When the wheel reaches a slot of a upper level, its items cascade
+ * to lower levels, the items of the level 0 slot of this second are expired.
+ * So each item costs O(1) to add, remove and expire, with no index scan.
+ ******************************************************************************/
+
+static void wheel_link(store_t *st, item_t *it) {
+    rel_time_t t = st->wheel_time;
+    rel_time_t e = it->exptime > t ? it->exptime : t + 1;
+    rel_time_t idx = 0, cur = 0;
+    int level = 0;
+
+    for (level = 0; level < WHEEL_LEVELS; ++level) {
+        idx = e >> (level * WHEEL_BITS);
+        cur = t >> (level * WHEEL_BITS);
+        if (idx - cur < WHEEL_SLOTS) break;
+    }
+    if (WHEEL_LEVELS == level) {
+        /* beyond the wheel, park in the farthest slot and cascade again */
+        level = WHEEL_LEVELS - 1;
+        idx = cur + WHEEL_SLOTS - 1;
+    }
+
+    item_t **slot = &st->wheel[level][idx & WHEEL_MASK];
+    it->t_slot = level * WHEEL_SLOTS + (idx & WHEEL_MASK);
+    it->t_prev = NULL;
+    it->t_next = *slot;
+    if (*slot) (*slot)->t_prev = it;
+    *slot = it;
+    it->it_flags |= ITEM_TIMED;
+}
+
+static void wheel_unlink(store_t *st, item_t *it) {
+    if (it->t_prev) {
+        it->t_prev->t_next = it->t_next;
+    } else {
+        st->wheel[it->t_slot / WHEEL_SLOTS][it->t_slot % WHEEL_SLOTS] = it->t_next;
+    }
+    if (it->t_next) it->t_next->t_prev = it->t_prev;
+    it->t_prev = it->t_next = NULL;
+    it->it_flags &= ~ITEM_TIMED;
+}
+
+/* expire or cascade the items of a slot, the lock is dropped between batches;
+ * new items never go to this slot meanwhile, they are relative to wheel_time */
+static void wheel_drain(store_t *st, item_t **slot) {
+    int n = 0;
+
+    while (*slot) {
+        item_t *it = *slot;
+        wheel_unlink(st, it);
+        if (it->exptime <= st->wheel_time) {
+            st->evict_stats.expired += 1;
+            do_item_unlink(st, it);
+        } else {
+            wheel_link(st, it);
+        }
+
+        if (++n == EVICT_BATCH) {
+            n = 0;
+            pthread_mutex_unlock(&st->lock);
+            sched_yield();
+            pthread_mutex_lock(&st->lock);
+        }
+    }
+}
+
+/* catch the wheel up with the clock of store */
+static void wheel_advance(store_t *st) {
+    int level = 0;
+
+    while (st->wheel_time < st->current_time) {
+        rel_time_t t = ++st->wheel_time;
+
+        for (level = WHEEL_LEVELS - 1; level > 0; --level) {
+            if (0 == (t & ((1U << (level * WHEEL_BITS)) - 1))) {
+                wheel_drain(st, &st->wheel[level][(t >> (level * WHEEL_BITS)) & WHEEL_MASK]);
+            }
+        }
+        wheel_drain(st, &st->wheel[0][t & WHEEL_MASK]);
+    }
+}
+
+rel_time_t store_exptime(store_t *st, long long exptime) {
+    if (0 == exptime) return 0;
+    if (exptime < 0) return TIME_EXPIRED;
+
+    if (exptime > REALTIME_MAXDELTA) {
+        if (exptime <= st->process_started) return TIME_EXPIRED;
+        return (rel_time_t)(exptime - st->process_started);
+    }
+    return (rel_time_t)(exptime + st->current_time);
+}
+
+static void record_evict_run(store_t *st, uint64_t start) {
+    uint64_t t = now_ns() - start;
+
+    st->evict_stats.runs += 1;
+    st->evict_stats.time_ns += t;
+    if (t > st->evict_stats.max_time_ns) st->evict_stats.max_time_ns = t;
+}
+
+static int refill_class(store_t *st, int id, int unlocked_clear);
+
+/* the evictor is behind, evict in place what EVICT_BATCH items of the ring
+ * give. A class which needs a page of another one waits for the evictor. */
+static void *alloc_evicting(store_t *st, int id) {
+    uint64_t start = now_ns();
+    uint64_t evictions = st->evict_stats.evictions;
+    size_t budget = EVICT_BATCH;
+    void *ptr = NULL;
+
+    while (!ptr && 0 == clock_evict(st, id, &budget)) {
+        ptr = slabs_alloc(st->slabs, id);
+    }
+    if (!st->evict_running) {
+        /* nobody else would, so move the page here */
+        while (!ptr && 0 != refill_class(st, id, 0)) {
+            ptr = slabs_alloc(st->slabs, id);
+        }
+        if (!ptr) ptr = slabs_alloc(st->slabs, id);
+    } else if (!ptr && !st->evict_class[id]) {
+        st->evict_class[id] = 1;
+        st->evict_wanted = 1;
+        pthread_cond_signal(&st->evict_cond);
+    }
+
+    st->evict_stats.direct_evictions += st->evict_stats.evictions - evictions;
+    record_evict_run(st, start);
+    return ptr;
+}
+
+/* wake the evictor once the arena is full and the class runs low */
+static void check_headroom(store_t *st, int id) {
+    slabs_t *s = st->slabs;
+    slabclass_t *cls = &s->classes[id];
+
+    if (!st->evict_running || st->evict_class[id]) return;
+    if (s->next_page < s->page_count || s->free_page_top > 0) return;
+    if (cls->free_count >= EVICT_LOW(cls)) return;
+
+    st->evict_class[id] = 1;
+    st->evict_wanted = 1;
+    pthread_cond_signal(&st->evict_cond);
+}
+
+/* give the empty pages back to the arena, the evictor clears each one out of
+ * the lock */
+static void reclaim_pages(store_t *st, int unlocked_clear) {
+    slabs_t *s = st->slabs;
+    long page = 0;
+
+    while ((page = slabs_take_empty(s)) >= 0) {
+        if (unlocked_clear) pthread_mutex_unlock(&st->lock);
+        slabs_clear_page(s, page);
+        if (unlocked_clear) pthread_mutex_lock(&st->lock);
+        slabs_put_page(s, page);
+    }
+}
+
+/* move a page no chunk of which is used to the arena for class id, the
+ * evictor clears it out of the lock */
+static int move_page(store_t *st, int id, int unlocked_clear) {
+    slabs_t *s = st->slabs;
+    long page = slabs_take_unused(s, id);
+    if (page < 0) return -1;
+
+    if (unlocked_clear) pthread_mutex_unlock(&st->lock);
+    slabs_clear_page(s, page);
+    if (unlocked_clear) pthread_mutex_lock(&st->lock);
+    slabs_put_page(s, page);
+    return 0;
+}
+
+/* one step of bringing class id to EVICT_HIGH free chunks, EVICT_BATCH items
+ * or chunks walked. A class with nothing left to evict gets a page of the
+ * class holding most, emptied first if none is unused. 1 while there is more
+ * to do, 0 once done or nothing more can be done. */
+static int refill_class(store_t *st, int id, int unlocked_clear) {
+    slabs_t *s = st->slabs;
+    slabclass_t *cls = &s->classes[id];
+    size_t budget = EVICT_BATCH;
+    int ret = 0;
+
+    while (cls->free_count < EVICT_HIGH(cls) && 0 == (ret = clock_evict(st, id, &budget))) ;
+    if (cls->free_count >= EVICT_HIGH(cls) || s->free_page_top > 0) return 0;
+    if (ret > 0) return 1;
+
+    if (0 == move_page(st, id, unlocked_clear)) return 0;
+    budget = EVICT_BATCH;
+    ret = evict_page(st, id, &budget);
+    if (0 == ret) {
+        move_page(st, id, unlocked_clear);
+        return 0;
+    }
+    return ret > 0;
+}
+
+static void *evictor_thread(void *arg) {
+    store_t *st = arg;
+    slabs_t *s = st->slabs;
+    int id = 0;
+
+    pthread_mutex_lock(&st->lock);
+    while (st->evict_running) {
+        uint64_t elapsed = now_ns() - st->started_ns;
+        rel_time_t now = TIME_START + elapsed / 1000000000ULL;
+
+        if (now != st->current_time) {
+            st->current_time = now;
+            wheel_advance(st);
+            continue;
+        }
+
+        if (!st->evict_wanted) {
+            /* sleep until the next second */
+            uint64_t wake = st->started_ns + (elapsed / 1000000000ULL + 1) * 1000000000ULL;
+            struct timespec ts = { wake / 1000000000ULL, wake % 1000000000ULL };
+            pthread_cond_timedwait(&st->evict_cond, &st->lock, &ts);
+            continue;
+        }
+        st->evict_wanted = 0;
+
+        reclaim_pages(st, 1);
+
+        for (id = 1; id <= s->nclasses; ++id) {
+            if (!st->evict_class[id]) continue;
+
+            uint64_t start = now_ns();
+            uint64_t evictions = st->evict_stats.evictions;
+            if (refill_class(st, id, 1)) {
+                st->evict_wanted = 1;   /* continue after the workers had a turn */
+            } else {
+                st->evict_class[id] = 0;
+            }
+            if (st->evict_stats.evictions != evictions) record_evict_run(st, start);
+        }
+
+        pthread_mutex_unlock(&st->lock);
+        sched_yield();
+        pthread_mutex_lock(&st->lock);
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    return NULL;
+}
+
+/*******************************************************************************
+ * the store, every public function takes the store lock
+ ******************************************************************************/
+
+/* the rest of the reply line after the key, nbytes has "\r\n" */
+static int make_suffix(char *buf, uint32_t flags, size_t nbytes) {
+    return sprintf(buf, " %u %zu\r\n", flags, nbytes - 2);
+}
+
+size_t item_make_size(size_t nkey, uint32_t flags, size_t nbytes) {
+    char suffix[32];
+    return sizeof(item_t) + ITEM_PREFIX_LEN + nkey + make_suffix(suffix, flags, nbytes) + nbytes;
+}
+
+static item_t *do_item_alloc(store_t *st, const char *key, size_t nkey, uint64_t hv,
+        uint32_t flags, rel_time_t exptime, size_t nbytes) {
+    char suffix[32];
+    if (nkey > KEY_MAX_LENGTH) return NULL;
+
+    int nsuffix = make_suffix(suffix, flags, nbytes);
+    int id = slabs_clsid(st->slabs, sizeof(item_t) + ITEM_PREFIX_LEN + nkey + nsuffix + nbytes);
+    if (0 == id) return NULL;
+
+    item_t *it = slabs_alloc(st->slabs, id);
+    if (!it && !(it = alloc_evicting(st, id))) return NULL;
+    check_headroom(st, id);
+
+    it->h_next = NULL;
+    it->prev = it->next = NULL;
+    it->t_prev = it->t_next = NULL;
+    it->hv = hv;
+    it->exptime = exptime;
+    it->nbytes = nbytes;
+    it->flags = flags;
+    it->refcount = 1;
+    it->nkey = nkey;
+    it->slabs_clsid = id;
+    it->it_flags = 0;
+    it->nsuffix = nsuffix;
+    memcpy(ITEM_line(it), ITEM_PREFIX, ITEM_PREFIX_LEN);
+    memcpy(ITEM_key(it), key, nkey);
+    memcpy(ITEM_key(it) + nkey, suffix, nsuffix);
+
+    return it;
+}
+
+static void do_item_release(store_t *st, item_t *it) {
+    if (0 == --it->refcount && !(it->it_flags & ITEM_LINKED)) {
+        free_item(st, it);
+    }
+}
+
+static void link_item(store_t *st, item_t *it) {
+    item_t **bucket = &st->buckets[it->hv & st->hashmask];
+    it->h_next = *bucket;
+    *bucket = it;
+    it->it_flags |= ITEM_LINKED;
+    clock_link(st, it);
+    if (it->exptime) wheel_link(st, it);
+
+    st->curr_items += 1;
+    st->curr_bytes += ITEM_ntotal(it);
+    st->total_items += 1;
+
+    if (st->curr_items > (st->hashmask + 1) * 3 / 2) {
+        expand_buckets(st);
+    }
+}
+
+static void do_item_unlink(store_t *st, item_t *it) {
+    if (!(it->it_flags & ITEM_LINKED)) return;
+
+    item_t **prev = &st->buckets[it->hv & st->hashmask];
+    while (*prev && *prev != it) {
+        prev = &(*prev)->h_next;
+    }
+    if (*prev) {
+        *prev = it->h_next;
+    }
+    it->it_flags &= ~(ITEM_LINKED | ITEM_ACTIVE);
+    clock_unlink(st, it);
+    if (it->it_flags & ITEM_TIMED) wheel_unlink(st, it);
+
+    st->curr_items -= 1;
+    st->curr_bytes -= ITEM_ntotal(it);
+
+    if (0 == it->refcount) {
+        free_item(st, it);
+    }
+}
+
+static enum store_result do_store_item(store_t *st, item_t *it, enum store_cmd cmd) {
+    item_t *old = find_item(st, ITEM_key(it), it->nkey, it->hv);
+    item_t *new_it = NULL;
+    int held = 0;
+
+    switch (cmd) {
+        case STORE_ADD:
+            if (old) return NOT_STORED;
+            break;
+
+        case STORE_REPLACE:
+            if (!old) return NOT_STORED;
+            break;
+
+        case STORE_APPEND:
+        case STORE_PREPEND:
+            if (!old) return NOT_STORED;
+
+            /* keep old while a eviction may run in the allocation */
+            old->refcount += 1;
+            held = 1;
+
+            /* both values end with "\r\n", keep only one */
+            new_it = do_item_alloc(st, ITEM_key(it), it->nkey, it->hv, old->flags,
+                    old->exptime, old->nbytes + it->nbytes - 2);
+            if (!new_it) {
+                do_item_release(st, old);
+                return STORE_NO_MEMORY;
+            }
+
+            if (STORE_APPEND == cmd) {
+                memcpy(ITEM_data(new_it), ITEM_data(old), old->nbytes - 2);
+                memcpy(ITEM_data(new_it) + old->nbytes - 2, ITEM_data(it), it->nbytes);
+            } else {
+                memcpy(ITEM_data(new_it), ITEM_data(it), it->nbytes - 2);
+                memcpy(ITEM_data(new_it) + it->nbytes - 2, ITEM_data(old), old->nbytes);
+            }
+            it = new_it;
+            break;
+
+        case STORE_SET:
+        default:
+            break;
+    }
+
+    if (old) {
+        do_item_unlink(st, old);
+        if (held) do_item_release(st, old);
+    }
+    link_item(st, it);
+
+    if (new_it) {
+        do_item_release(st, new_it);
+    }
+    return STORED;
+}
+
+/* the evictor holds the lock for a batch at most, a wait is counted so the
+ * stats show how often the worker met it */
+static inline void store_lock(store_t *st) {
+    if (0 != pthread_mutex_trylock(&st->lock)) {
+        pthread_mutex_lock(&st->lock);
+        st->lock_waits += 1;
+    }
+}
+
+item_t *item_alloc(store_t *st, const char *key, size_t nkey, uint64_t hv,
+        uint32_t flags, rel_time_t exptime, size_t nbytes) {
+    store_lock(st);
+    item_t *it = do_item_alloc(st, key, nkey, hv, flags, exptime, nbytes);
+    pthread_mutex_unlock(&st->lock);
+    return it;
+}
+
+item_t *item_get(store_t *st, const char *key, size_t nkey, uint64_t hv) {
+    return item_get_refs(st, key, nkey, hv, 1);
+}
+
+item_t *item_get_refs(store_t *st, const char *key, size_t nkey, uint64_t hv, uint32_t refs) {
+    store_lock(st);
+    item_t *it = find_item(st, key, nkey, hv);
+    if (it) {
+        it->refcount += refs;
+        it->it_flags |= ITEM_ACTIVE;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return it;
+}
+
+void item_release(store_t *st, item_t *it) {
+    store_lock(st);
+    do_item_release(st, it);
+    pthread_mutex_unlock(&st->lock);
+}
+
+void item_unlink(store_t *st, item_t *it) {
+    store_lock(st);
+    do_item_unlink(st, it);
+    pthread_mutex_unlock(&st->lock);
+}
+
+enum store_result store_item(store_t *st, item_t *it, enum store_cmd cmd) {
+    store_lock(st);
+    enum store_result ret = do_store_item(st, it, cmd);
+    pthread_mutex_unlock(&st->lock);
+    return ret;
+}
+
+int item_delete(store_t *st, const char *key, size_t nkey, uint64_t hv) {
+    store_lock(st);
+    item_t *it = find_item(st, key, nkey, hv);
+    if (it) {
+        do_item_unlink(st, it);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return it ? 0 : -1;
+}
+
+static enum delta_result do_item_delta(store_t *st, const char *key, size_t nkey, uint64_t hv,
+        int incr, uint64_t delta, uint64_t *value) {
+    item_t *it = find_item(st, key, nkey, hv);
+    if (!it) return DELTA_NOT_FOUND;
+
+    char buf[24];
+    size_t len = it->nbytes - 2;
+    if (len == 0 || len >= sizeof(buf)) return DELTA_NON_NUMERIC;
+
+    memcpy(buf, ITEM_data(it), len);
+    buf[len] = '\0';
+
+    char *end = NULL;
+    uint64_t v = strtoull(buf, &end, 10);
+    if (*end != '\0' && *end != ' ') return DELTA_NON_NUMERIC;
+
+    if (incr) {
+        v += delta;
+    } else {
+        v = delta > v ? 0 : v - delta;
+    }
+    *value = v;
+
+    int res = snprintf(buf, sizeof(buf), "%llu\r\n", (unsigned long long)v);
+
+    /* nobody else is reading it, just overwrite */
+    if (res == it->nbytes && 0 == it->refcount) {
+        memcpy(ITEM_data(it), buf, res);
+        it->it_flags |= ITEM_ACTIVE;
+        return DELTA_OK;
+    }
+
+    it->refcount += 1;
+    item_t *new_it = do_item_alloc(st, key, nkey, hv, it->flags, it->exptime, res);
+    if (!new_it) {
+        do_item_release(st, it);
+        return DELTA_NO_MEMORY;
+    }
+
+    memcpy(ITEM_data(new_it), buf, res);
+    do_item_unlink(st, it);
+    do_item_release(st, it);
+    link_item(st, new_it);
+    do_item_release(st, new_it);
+
+    return DELTA_OK;
+}
+
+enum delta_result item_delta(store_t *st, const char *key, size_t nkey, uint64_t hv,
+        int incr, uint64_t delta, uint64_t *value) {
+    store_lock(st);
+    enum delta_result ret = do_item_delta(st, key, nkey, hv, incr, delta, value);
+    pthread_mutex_unlock(&st->lock);
+    return ret;
+}
+
+#define APPEND_STAT(fmt, ...) do { \
+    if (len < size) \
+        len += snprintf(buf + len, size - len, "STAT " fmt "\r\n", __VA_ARGS__); \
+} while (0)
+
+size_t store_stats(store_t *st, char *buf, size_t size) {
+    size_t len = 0;
+
+    store_lock(st);
+    evict_stats_t *es = &st->evict_stats;
+
+    APPEND_STAT("uptime %u", st->current_time - TIME_START);
+    APPEND_STAT("time %lld", (long long)(st->process_started + st->current_time));
+    APPEND_STAT("limit_maxbytes %zu", st->slabs->limit);
+    APPEND_STAT("bytes %zu", st->curr_bytes);
+    APPEND_STAT("curr_items %zu", st->curr_items);
+    APPEND_STAT("total_items %zu", st->total_items);
+    APPEND_STAT("evictions %llu", (unsigned long long)es->evictions);
+    APPEND_STAT("direct_evictions %llu", (unsigned long long)es->direct_evictions);
+    APPEND_STAT("reclaimed_bytes %llu", (unsigned long long)es->evicted_bytes);
+    APPEND_STAT("evict_runs %llu", (unsigned long long)es->runs);
+    APPEND_STAT("evict_avg_us %.3f", es->runs ? es->time_ns / 1000.0 / es->runs : 0.0);
+    APPEND_STAT("evict_max_us %.3f", es->max_time_ns / 1000.0);
+    APPEND_STAT("expired %llu", (unsigned long long)es->expired);
+    APPEND_STAT("lock_waits %llu", (unsigned long long)st->lock_waits);
+    pthread_mutex_unlock(&st->lock);
+
+    return len < size ? len : size - 1;
+}
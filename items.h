@@ -0,0 +1,282 @@
+/*
+ * Description: the item store, items live in slab chunks so a value can be
+ *              sent, RDMA written or RDMA read in place. Memory is bounded by
+ *              the slab arena, items are evicted by CLOCK per slab class and
+ *              expire through a hierarchical timing wheel.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "slabs.h"
+
+#define KEY_MAX_LENGTH 250
+
+/* a exptime larger than this is a absolute unix time */
+#define REALTIME_MAXDELTA (60 * 60 * 24 * 30)
+
+/* the timing wheel, levels of slots at 1 second ticks, which cover 2^24
+ * seconds together */
+#define WHEEL_LEVELS    4
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+
+/* seconds since the store was created */
+typedef uint32_t rel_time_t;
+
+/* it_flags */
+#define ITEM_LINKED 1
+#define ITEM_ACTIVE 2   /* referenced since the clock hand passed */
+#define ITEM_TIMED  4   /* in the timing wheel */
+
+/* the item in store, the header is followed by the reply line of a get,
+ * "VALUE <key> <flags> <bytes>\r\n", then the value ending with "\r\n". The
+ * line is written once by item_alloc(), so a hit is sent as it is. */
+typedef struct item_s {
+    struct item_s   *h_next;    /* hash chain */
+    struct item_s   *prev;      /* the clock ring of slab class */
+    struct item_s   *next;
+    struct item_s   *t_prev;    /* the timing wheel slot */
+    struct item_s   *t_next;
+    uint64_t        hv;         /* the hash value of key */
+    rel_time_t      exptime;    /* 0 means never */
+    uint32_t        nbytes;     /* the length of value, "\r\n" included */
+    uint32_t        flags;
+    uint32_t        refcount;   /* a hot item is shared by every reply in flight */
+    uint16_t        nkey;
+    uint16_t        t_slot;     /* level * WHEEL_SLOTS + slot */
+    uint8_t         slabs_clsid;
+    uint8_t         it_flags;
+    uint8_t         nsuffix;    /* " <flags> <bytes>\r\n" after the key */
+    char            data[];
+} item_t;
+
+#define ITEM_PREFIX     "VALUE "
+#define ITEM_PREFIX_LEN (sizeof(ITEM_PREFIX) - 1)
+
+#define ITEM_line(it)   ((it)->data)
+#define ITEM_nline(it)  (ITEM_PREFIX_LEN + (it)->nkey + (it)->nsuffix)
+#define ITEM_key(it)    ((it)->data + ITEM_PREFIX_LEN)
+#define ITEM_data(it)   ((it)->data + ITEM_nline(it))
+#define ITEM_ntotal(it) (sizeof(item_t) + ITEM_nline(it) + (it)->nbytes)
+
+/* eviction counters */
+typedef struct evict_stats_s {
+    uint64_t    evictions;
+    uint64_t    direct_evictions;   /* done by a allocation in place */
+    uint64_t    evicted_bytes;
+    uint64_t    runs;
+    uint64_t    time_ns;            /* spent in all runs */
+    uint64_t    max_time_ns;
+    uint64_t    expired;            /* reclaimed by the wheel or a lookup */
+} evict_stats_t;
+
+/* the struct of item store */
+typedef struct store_s {
+    slabs_t     *slabs;
+
+    item_t      **buckets;
+    size_t      hashmask;       /* the number of buckets - 1 */
+
+    item_t      *clock_hand[SLAB_MAX_CLASSES + 1];
+    size_t      clock_items[SLAB_MAX_CLASSES + 1];
+    size_t      clock_walked[SLAB_MAX_CLASSES + 1]; /* passed since the last eviction */
+    long        drain_page;     /* being emptied for another class, -1 if none */
+    size_t      drain_chunk;    /* the next chunk of it to look at */
+
+    item_t      *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    rel_time_t  wheel_time;     /* the last tick processed */
+    rel_time_t  current_time;           /* ticked by the evictor */
+    time_t      process_started;        /* the unix time of rel_time 0 */
+    uint64_t    started_ns;             /* CLOCK_MONOTONIC of the same */
+
+    size_t      curr_items;
+    size_t      curr_bytes;
+    size_t      total_items;
+
+    /* guards all of the above. Only the worker owning the partition and the
+     * evictor of the store take it, the worker waits only while the evictor
+     * runs a batch or ticks the clock. */
+    pthread_mutex_t lock;
+    uint64_t        lock_waits;     /* the worker found the evictor holding it */
+    pthread_cond_t  evict_cond;
+    pthread_t       evict_thread;
+    int             evict_running;
+    int             evict_wanted;
+    uint8_t         evict_class[SLAB_MAX_CLASSES + 1];
+
+    evict_stats_t   evict_stats;
+} store_t;
+
+enum store_cmd {
+    STORE_SET = 1,
+    STORE_ADD,
+    STORE_REPLACE,
+    STORE_APPEND,
+    STORE_PREPEND,
+};
+
+enum store_result {
+    STORED = 1,
+    NOT_STORED,
+    STORE_NO_MEMORY,
+};
+
+enum delta_result {
+    DELTA_OK = 1,
+    DELTA_NON_NUMERIC,
+    DELTA_NOT_FOUND,
+    DELTA_NO_MEMORY,
+};
+
+/***************************************************************************//**
+ * Create a empty item store
+ *
+ * @param[in] limit     the memory limit of items in bytes
+ * @param[in] hashpower the store starts with 2^hashpower buckets
+ * @return              the pointer to item store, NULL on failure
+ *
+ ******************************************************************************/
+store_t* store_create(size_t limit, int hashpower);
+
+/***************************************************************************//**
+ * Free the item store and all items
+ *
+ ******************************************************************************/
+void store_free(store_t *st);
+
+/***************************************************************************//**
+ * Start the background evictor, which keeps some free chunks in every class
+ * once the arena is full, so allocations seldom have to evict in place. It
+ * also ticks the clock of store and reclaims expired items every second.
+ *
+ * @return  0 on success, -1 on failure
+ *
+ ******************************************************************************/
+int store_start_evictor(store_t *st);
+
+/***************************************************************************//**
+ * Write the "STAT name value\r\n" lines of store
+ *
+ * @param[in] st    the pointer to item store
+ * @param[in] buf   the output buffer
+ * @param[in] size  the size of buffer
+ * @return          the length written
+ *
+ ******************************************************************************/
+size_t store_stats(store_t *st, char *buf, size_t size);
+
+/***************************************************************************//**
+ * Convert a exptime of protocol to the time of store
+ *
+ * @param[in] exptime   0 for never, seconds from now, or a unix time if it is
+ *                      larger than REALTIME_MAXDELTA, negative for expired
+ * @return              the exptime for item_alloc()
+ *
+ ******************************************************************************/
+rel_time_t store_exptime(store_t *st, long long exptime);
+
+/***************************************************************************//**
+ * The size of a item, which decides its slab class
+ *
+ * @param[in] nkey      the length of key
+ * @param[in] flags     the client flags
+ * @param[in] nbytes    the length of value, "\r\n" included
+ *
+ ******************************************************************************/
+size_t item_make_size(size_t nkey, uint32_t flags, size_t nbytes);
+
+/***************************************************************************//**
+ * Allocate an unlinked item holding one reference, the value is not filled
+ *
+ * @param[in] st        the pointer to item store
+ * @param[in] key       the key
+ * @param[in] nkey      the length of key
+ * @param[in] hv        the hash value of key
+ * @param[in] flags     the client flags
+ * @param[in] exptime   from store_exptime()
+ * @param[in] nbytes    the length of value, "\r\n" included
+ * @return              the item, NULL if it is too large or out of memory
+ *
+ ******************************************************************************/
+item_t *item_alloc(store_t *st, const char *key, size_t nkey, uint64_t hv,
+        uint32_t flags, rel_time_t exptime, size_t nbytes);
+
+/***************************************************************************//**
+ * Prefetch the bucket of a hash value, and in a later pass the first item
+ * of that bucket, which the bucket then holds in cache. Only the worker owning
+ * the store may call them, since only its inserts move the buckets.
+ *
+ ******************************************************************************/
+static inline void store_prefetch_bucket(store_t *st, uint64_t hv) {
+    __builtin_prefetch(&st->buckets[hv & st->hashmask]);
+}
+
+static inline void store_prefetch_item(store_t *st, uint64_t hv) {
+    item_t *it = st->buckets[hv & st->hashmask];
+    if (it) {
+        /* the header, then the key in the line which follows it */
+        __builtin_prefetch(it);
+        __builtin_prefetch((char *)it + 64);
+    }
+}
+
+/***************************************************************************//**
+ * Search a item, the caller gets a reference. Expired items are not found.
+ *
+ * @return  the item, NULL if not found
+ *
+ ******************************************************************************/
+item_t *item_get(store_t *st, const char *key, size_t nkey, uint64_t hv);
+
+/***************************************************************************//**
+ * item_get() taking refs references at once, for requests sharing a lookup
+ *
+ ******************************************************************************/
+item_t *item_get_refs(store_t *st, const char *key, size_t nkey, uint64_t hv, uint32_t refs);
+
+/***************************************************************************//**
+ * Drop a reference, the item is freed once it is unlinked and unreferenced
+ *
+ ******************************************************************************/
+void item_release(store_t *st, item_t *it);
+
+/***************************************************************************//**
+ * Remove a item from the index
+ *
+ ******************************************************************************/
+void item_unlink(store_t *st, item_t *it);
+
+/***************************************************************************//**
+ * Link a filled item according to the command
+ *
+ * @param[in] st    the pointer to item store
+ * @param[in] it    the item from item_alloc()
+ * @param[in] cmd   STORE_SET, STORE_ADD ...
+ * @return          STORED, NOT_STORED or STORE_NO_MEMORY
+ *
+ ******************************************************************************/
+enum store_result store_item(store_t *st, item_t *it, enum store_cmd cmd);
+
+/***************************************************************************//**
+ * Delete a item by key
+ *
+ * @return  0 on success, -1 if not found
+ *
+ ******************************************************************************/
+int item_delete(store_t *st, const char *key, size_t nkey, uint64_t hv);
+
+/***************************************************************************//**
+ * Increase or decrease a numeric value
+ *
+ * @param[in]  incr     1 to increase, 0 to decrease, which stops at 0
+ * @param[in]  delta    the delta
+ * @param[out] value    the new value
+ *
+ ******************************************************************************/
+enum delta_result item_delta(store_t *st, const char *key, size_t nkey, uint64_t hv,
+        int incr, uint64_t delta, uint64_t *value);
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ketama.h"
+
+/*******************************************************************************
+ * MD5, RFC 1321, only for the points of servers
+ ******************************************************************************/
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(uint32_t h[4], const uint8_t *p) {
+    uint32_t w[16], a = h[0], b = h[1], c = h[2], d = h[3];
+    int i = 0;
+
+    for (i = 0; i < 16; ++i) {
+        w[i] = p[i * 4] | p[i * 4 + 1] << 8 | p[i * 4 + 2] << 16 | (uint32_t)p[i * 4 + 3] << 24;
+    }
+    for (i = 0; i < 64; ++i) {
+        uint32_t f = 0, g = 0;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        f += a + md5_k[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+static void md5(const char *s, size_t len, uint8_t digest[16]) {
+    uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint8_t block[128];
+    size_t off = 0, tail = 0;
+    int i = 0;
+
+    for (off = 0; off + 64 <= len; off += 64) {
+        md5_block(h, (const uint8_t *)s + off);
+    }
+    /* the rest, 0x80 and the length in bits take one or two blocks */
+    tail = len - off < 56 ? 64 : 128;
+    memset(block, 0, sizeof(block));
+    memcpy(block, s + off, len - off);
+    block[len - off] = 0x80;
+    for (i = 0; i < 8; ++i) {
+        block[tail - 8 + i] = (uint8_t)((uint64_t)len * 8 >> (i * 8));
+    }
+    md5_block(h, block);
+    if (128 == tail) md5_block(h, block + 64);
+    for (i = 0; i < 16; ++i) {
+        digest[i] = (uint8_t)(h[i / 4] >> (i % 4 * 8));
+    }
+}
+
+/*******************************************************************************/
+
+struct point {
+    uint32_t    point;
+    uint16_t    owner;
+};
+
+static int by_point(const void *a, const void *b) {
+    const struct point *x = a, *y = b;
+    if (x->point != y->point) return x->point < y->point ? -1 : 1;
+    return (int)x->owner - (int)y->owner;
+}
+
+int ketama_build(struct ketama *k, const struct server_addr *servers, int n) {
+    struct point *all = NULL;
+    uint8_t digest[16];
+    char name[sizeof(servers->host) + sizeof(servers->port) + 16];
+    uint32_t i = 0, np = 0;
+    int s = 0, j = 0;
+
+    memset(k, 0, sizeof(*k));
+    if (n <= 0 || n > SERVERS_MAX) {
+        fprintf(stderr, "ketama_build(): %d servers\n", n);
+        return -1;
+    }
+    all = malloc((size_t)n * KETAMA_POINTS * sizeof(struct point));
+    k->points = malloc(((size_t)n * KETAMA_POINTS + 1) * sizeof(uint32_t));
+    k->owners = malloc(((size_t)n * KETAMA_POINTS + 1) * sizeof(uint16_t));
+    if (!all || !k->points || !k->owners) {
+        fprintf(stderr, "out of memory in ketama_build()\n");
+        free(all);
+        ketama_free(k);
+        return -1;
+    }
+
+    for (s = 0; s < n; ++s) {
+        for (j = 0; j < KETAMA_POINTS / 4; ++j) {
+            int len = snprintf(name, sizeof(name), "%s:%s-%d", servers[s].host, servers[s].port, j);
+            md5(name, len, digest);
+            for (i = 0; i < 4; ++i) {
+                all[np].point = (uint32_t)digest[i * 4 + 3] << 24 | digest[i * 4 + 2] << 16
+                              | digest[i * 4 + 1] << 8 | digest[i * 4];
+                all[np].owner = s;
+                np += 1;
+            }
+        }
+    }
+    qsort(all, np, sizeof(struct point), by_point);
+
+    for (i = 0; i < np; ++i) {
+        k->points[i] = all[i].point;
+        k->owners[i] = all[i].owner;
+    }
+    /* past the last point the ring wraps to the first */
+    k->points[np] = UINT32_MAX;
+    k->owners[np] = all[0].owner;
+    k->npoints = np;
+    free(all);
+    return 0;
+}
+
+void ketama_free(struct ketama *k) {
+    free(k->points);
+    free(k->owners);
+    k->points = NULL;
+    k->owners = NULL;
+    k->npoints = 0;
+}
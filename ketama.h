@@ -0,0 +1,64 @@
+/*
+ * Description: the ketama continuum, a key goes to the server owning the
+ *              first point at or after the point of key. Every server puts
+ *              KETAMA_POINTS points on the ring from the md5 of "host:port-i"
+ *              as libketama does, so a server joining or leaving moves only
+ *              the keys between its points and their predecessors, about 1/N
+ *              of all.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "servers.h"
+
+#define KETAMA_POINTS   160     /* per server, 40 digests of md5 and 4 points each */
+
+/* the sorted ring, points[npoints] is a sentinel of UINT32_MAX owned by the
+ * first server, so the search needs no wrap around */
+struct ketama {
+    uint32_t    *points;
+    uint16_t    *owners;        /* the index of server owning points[i] */
+    uint32_t    npoints;        /* not counting the sentinel */
+};
+
+/***************************************************************************//**
+ * Build the ring of servers
+ *
+ * @param[out] k        the ring
+ * @param[in]  servers  the servers
+ * @param[in]  n        the number of servers, up to SERVERS_MAX
+ * @return              0 on success, -1 on failure
+ *
+ ******************************************************************************/
+int ketama_build(struct ketama *k, const struct server_addr *servers, int n);
+
+void ketama_free(struct ketama *k);
+
+/***************************************************************************//**
+ * Find the server owning a point. The search halves the range a fixed number
+ * of times for a ring, the step is a conditional move rather than a branch,
+ * so a lookup costs a few nanoseconds whatever the keys are.
+ *
+ * @param[in] k     the ring
+ * @param[in] point the point of key, the high half of hash64()
+ * @return          the index of server
+ *
+ ******************************************************************************/
+static inline int ketama_find(const struct ketama *k, uint32_t point) {
+    uint64_t base = 0, n = k->npoints + 1;
+
+    while (n > 1) {
+        uint64_t half = n / 2;
+        /* the sign of the 64-bit difference is all ones if the point is
+         * before, a mask rather than a compare which gcc turns into a jump */
+        base += half & (uint64_t)((int64_t)(k->points[base + half - 1] - (uint64_t)point) >> 63);
+        n -= half;
+    }
+    return k->owners[base];
+}
+
+static inline uint32_t ketama_point(uint64_t hv) {
+    return (uint32_t)(hv >> 32);
+}
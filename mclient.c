@@ -0,0 +1,425 @@
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wr_id.h"
+#include "hash.h"
+#include "protocol_binary.h"
+#include "mclient.h"
+
+#define HEADER_SIZE     24
+#define EXTRAS_MAX      (8 + 20)    /* the key hash and the extras of incr */
+#define POLL_WC_SIZE    32
+
+/*******************************************************************************/
+
+static int post_recv(mclient_t *cl, uint32_t i) {
+    if (0 != rdma_post_recv(cl->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_RECV, 0, i),
+                cl->rbuf + (size_t)i * cl->rsize, cl->rsize, cl->rmr)) {
+        perror("rdma_post_recv()");
+        return -1;
+    }
+    return 0;
+}
+
+static int connect_server(mclient_t *cl, const char *server, const char *port) {
+    struct rdma_addrinfo hints = { .ai_port_space = RDMA_PS_TCP },
+                         *res = NULL;
+    struct ibv_qp_init_attr qp_attr;
+    size_t i = 0;
+
+    if (0 != rdma_create_id(NULL, &cl->id, cl, RDMA_PS_TCP)) {
+        perror("rdma_create_id()");
+        return -1;
+    }
+    if (0 != rdma_getaddrinfo(server, port, &hints, &res)) {
+        perror("rdma_getaddrinfo()");
+        return -1;
+    }
+    int ret = rdma_resolve_addr(cl->id, NULL, res->ai_dst_addr, 100);
+    if (0 == ret) ret = rdma_resolve_route(cl->id, 100);
+    rdma_freeaddrinfo(res);
+    if (0 != ret) {
+        perror("Error on resolving addr or route");
+        return -1;
+    }
+
+    if ( !(cl->pd = ibv_alloc_pd(cl->id->verbs)) ) {
+        perror("ibv_alloc_pd()");
+        return -1;
+    }
+    if ( !(cl->cq = ibv_create_cq(cl->id->verbs, cl->depth * 2, NULL, NULL, 0)) ) {
+        perror("ibv_create_cq()");
+        return -1;
+    }
+
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.cap.max_send_wr = cl->depth;
+    qp_attr.cap.max_recv_wr = cl->depth;
+    qp_attr.cap.max_send_sge = 1;
+    qp_attr.cap.max_recv_sge = 1;
+    qp_attr.sq_sig_all = 1;
+    qp_attr.qp_type = IBV_QPT_RC;
+    qp_attr.send_cq = cl->cq;
+    qp_attr.recv_cq = cl->cq;
+    if (0 != rdma_create_qp(cl->id, cl->pd, &qp_attr)) {
+        perror("rdma_create_qp()");
+        return -1;
+    }
+
+    cl->smr = rdma_reg_msgs(cl->id, cl->sbuf, cl->ssize * cl->depth);
+    cl->rmr = rdma_reg_msgs(cl->id, cl->rbuf, cl->rsize * cl->depth);
+    if (!cl->smr || !cl->rmr) {
+        perror("rdma_reg_msgs()");
+        return -1;
+    }
+
+    /* every reply finds a receive, at most depth of them are coming */
+    for (i = 0; i < cl->depth; ++i) {
+        if (0 != post_recv(cl, i)) return -1;
+    }
+
+    if (0 != rdma_connect(cl->id, NULL)) {
+        perror("rdma_connect()");
+        return -1;
+    }
+    return 0;
+}
+
+mclient_t *mclient_create(const char *server, const char *port, size_t depth, size_t max_value) {
+    size_t i = 0;
+
+    if (0 == depth || depth > MCLIENT_MAX_DEPTH) {
+        fprintf(stderr, "mclient_create(): depth must be in [1, %d]\n", MCLIENT_MAX_DEPTH);
+        return NULL;
+    }
+
+    mclient_t *cl = calloc(1, sizeof(mclient_t));
+    if (!cl) goto nomem;
+
+    cl->depth = depth;
+    cl->max_value = max_value;
+    cl->key_hash = 1;
+    cl->ssize = HEADER_SIZE + EXTRAS_MAX + MCLIENT_KEY_MAX + max_value;
+    cl->rsize = HEADER_SIZE + 4 + MCLIENT_KEY_MAX + max_value;
+    cl->rsize = cl->rsize < 1024 ? 1024 : cl->rsize;  /* room for the message of an error */
+    cl->sbuf = malloc(cl->ssize * depth);
+    cl->rbuf = malloc(cl->rsize * depth);
+    cl->slots = calloc(depth, sizeof(struct mclient_slot));
+    cl->free = malloc(depth * sizeof(uint32_t));
+    if (!cl->sbuf || !cl->rbuf || !cl->slots || !cl->free) goto nomem;
+
+    /* the lowest slot is taken first */
+    for (i = 0; i < depth; ++i) {
+        cl->free[i] = depth - 1 - i;
+    }
+    cl->nfree = depth;
+
+    if (0 != connect_server(cl, server, port)) {
+        mclient_free(cl);
+        return NULL;
+    }
+    return cl;
+
+nomem:
+    fprintf(stderr, "out of memory in mclient_create()\n");
+    mclient_free(cl);
+    return NULL;
+}
+
+void mclient_free(mclient_t *cl) {
+    if (!cl) return;
+
+    if (cl->id) {
+        if (cl->id->qp) {
+            rdma_disconnect(cl->id);
+            rdma_destroy_qp(cl->id);
+        }
+        if (cl->smr) rdma_dereg_mr(cl->smr);
+        if (cl->rmr) rdma_dereg_mr(cl->rmr);
+        rdma_destroy_id(cl->id);
+    }
+    if (cl->cq) ibv_destroy_cq(cl->cq);
+    if (cl->pd) ibv_dealloc_pd(cl->pd);
+    free(cl->sbuf);
+    free(cl->rbuf);
+    free(cl->slots);
+    free(cl->free);
+    free(cl);
+}
+
+/*******************************************************************************
+ * Requests
+ ******************************************************************************/
+
+static void release(mclient_t *cl, uint32_t slot) {
+    cl->free[cl->nfree++] = slot;
+}
+
+static int post(mclient_t *cl, uint8_t opcode, const char *key, size_t nkey,
+        const void *extras, uint8_t extlen, const void *value, size_t nvalue,
+        mclient_cb cb, void *arg) {
+    protocol_binary_request_header h;
+    uint8_t hlen = cl->key_hash ? 8 : 0;
+
+    if (nkey > MCLIENT_KEY_MAX || nvalue > cl->max_value) {
+        fprintf(stderr, "mclient: key or value too large\n");
+        return -1;
+    }
+    while (0 == cl->nfree) {
+        if (mclient_poll(cl) < 0) return -1;
+    }
+
+    uint32_t slot = cl->free[--cl->nfree];
+    struct mclient_slot *s = &cl->slots[slot];
+    char *buf = cl->sbuf + (size_t)slot * cl->ssize, *p = buf + HEADER_SIZE;
+
+    s->gen += 1;
+    s->cb = cb;
+    s->arg = arg;
+
+    memset(&h, 0, sizeof(h));
+    h.request.magic = PROTOCOL_BINARY_REQ;
+    h.request.opcode = opcode;
+    h.request.keylen = htons(nkey);
+    h.request.extlen = hlen + extlen;
+    h.request.datatype = hlen ? PROTOCOL_BINARY_KEY_HASH : PROTOCOL_BINARY_RAW_BYTES;
+    h.request.bodylen = htonl(hlen + extlen + nkey + nvalue);
+    h.request.opaque = (uint32_t)s->gen << 16 | slot;
+    memcpy(buf, &h, HEADER_SIZE);
+
+    if (hlen) {
+        uint64_t hv = htobe64(hash64(key, nkey));
+        memcpy(p, &hv, sizeof(hv));
+        p += sizeof(hv);
+    }
+    memcpy(p, extras, extlen);
+    p += extlen;
+    memcpy(p, key, nkey);
+    p += nkey;
+    memcpy(p, value, nvalue);
+    p += nvalue;
+
+    if (0 != rdma_post_send(cl->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_SEND, 0, slot),
+                buf, p - buf, cl->smr, 0)) {
+        perror("rdma_post_send()");
+        release(cl, slot);
+        return -1;
+    }
+    s->sending = 1;
+    s->waiting = 1;
+    cl->inflight += 1;
+    return 0;
+}
+
+int mclient_get(mclient_t *cl, const char *key, size_t nkey, mclient_cb cb, void *arg) {
+    return post(cl, PROTOCOL_BINARY_CMD_GET, key, nkey, NULL, 0, NULL, 0, cb, arg);
+}
+
+int mclient_set(mclient_t *cl, const char *key, size_t nkey, const void *value, size_t nvalue,
+        uint32_t flags, uint32_t exptime, mclient_cb cb, void *arg) {
+    uint32_t extras[2] = { htonl(flags), htonl(exptime) };
+
+    return post(cl, PROTOCOL_BINARY_CMD_SET, key, nkey, extras, sizeof(extras), value, nvalue,
+            cb, arg);
+}
+
+int mclient_delete(mclient_t *cl, const char *key, size_t nkey, mclient_cb cb, void *arg) {
+    return post(cl, PROTOCOL_BINARY_CMD_DELETE, key, nkey, NULL, 0, NULL, 0, cb, arg);
+}
+
+static int post_delta(mclient_t *cl, uint8_t opcode, const char *key, size_t nkey, uint64_t delta,
+        uint64_t initial, mclient_cb cb, void *arg) {
+    protocol_binary_request_incr body;
+
+    body.message.body.delta = htobe64(delta);
+    body.message.body.initial = htobe64(initial);
+    body.message.body.expiration = 0;
+    /* 20 bytes, the struct is padded */
+    return post(cl, opcode, key, nkey, &body.message.body, 20, NULL, 0, cb, arg);
+}
+
+int mclient_incr(mclient_t *cl, const char *key, size_t nkey, uint64_t delta, uint64_t initial,
+        mclient_cb cb, void *arg) {
+    return post_delta(cl, PROTOCOL_BINARY_CMD_INCREMENT, key, nkey, delta, initial, cb, arg);
+}
+
+int mclient_decr(mclient_t *cl, const char *key, size_t nkey, uint64_t delta, uint64_t initial,
+        mclient_cb cb, void *arg) {
+    return post_delta(cl, PROTOCOL_BINARY_CMD_DECREMENT, key, nkey, delta, initial, cb, arg);
+}
+
+/*******************************************************************************
+ * Replies
+ ******************************************************************************/
+
+static void complete(mclient_t *cl, const char *buf, size_t len) {
+    protocol_binary_response_header h;
+    mclient_reply_t r;
+
+    if (len < sizeof(h)) {
+        cl->strays += 1;
+        return;
+    }
+    memcpy(&h, buf, sizeof(h));
+
+    uint32_t slot = h.response.opaque & 0xffff;
+    size_t bodylen = ntohl(h.response.bodylen);
+    size_t skip = h.response.extlen + ntohs(h.response.keylen);
+    if (slot >= cl->depth || sizeof(h) + bodylen > len || skip > bodylen) {
+        cl->strays += 1;
+        return;
+    }
+    struct mclient_slot *s = &cl->slots[slot];
+    if (!s->waiting || s->gen != h.response.opaque >> 16) {
+        cl->strays += 1;
+        return;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.opcode = h.response.opcode;
+    r.status = ntohs(h.response.status);
+    r.value = buf + sizeof(h) + skip;
+    r.nvalue = bodylen - skip;
+    if (4 == h.response.extlen) {
+        memcpy(&r.flags, buf + sizeof(h), 4);
+        r.flags = ntohl(r.flags);
+    }
+    if (0 == r.status && 8 == r.nvalue && (PROTOCOL_BINARY_CMD_INCREMENT == r.opcode
+                || PROTOCOL_BINARY_CMD_DECREMENT == r.opcode)) {
+        memcpy(&r.number, r.value, 8);
+        r.number = be64toh(r.number);
+    }
+
+    /* the callback may post into this slot */
+    mclient_cb cb = s->cb;
+    void *arg = s->arg;
+    s->waiting = 0;
+    cl->inflight -= 1;
+    if (!s->sending) release(cl, slot);
+    if (cb) cb(arg, &r);
+}
+
+int mclient_poll(mclient_t *cl) {
+    struct ibv_wc wc[POLL_WC_SIZE];
+    int n = 0, i = 0, done = 0;
+
+    if ( (n = ibv_poll_cq(cl->cq, POLL_WC_SIZE, wc)) < 0 ) {
+        perror("ibv_poll_cq()");
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        uint32_t index = WR_ID_INDEX(wc[i].wr_id);
+
+        if (IBV_WC_SUCCESS != wc[i].status) {
+            fprintf(stderr, "mclient: %s failed, status %d\n",
+                    WR_OP_RECV == WR_ID_OP(wc[i].wr_id) ? "receive" : "send", wc[i].status);
+            return -1;
+        }
+        if (WR_OP_SEND == WR_ID_OP(wc[i].wr_id)) {
+            /* the reply may come first */
+            cl->slots[index].sending = 0;
+            if (!cl->slots[index].waiting) release(cl, index);
+            continue;
+        }
+
+        complete(cl, cl->rbuf + (size_t)index * cl->rsize, wc[i].byte_len);
+        done += 1;
+        if (0 != post_recv(cl, index)) return -1;
+    }
+    return done;
+}
+
+int mclient_drain(mclient_t *cl) {
+    while (cl->inflight) {
+        if (mclient_poll(cl) < 0) return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * Futures
+ ******************************************************************************/
+
+void mclient_future_init(mclient_future_t *f, char *buf, size_t size) {
+    memset(f, 0, sizeof(*f));
+    f->buf = buf;
+    f->size = buf ? size : 0;
+}
+
+void mclient_future_cb(void *arg, const mclient_reply_t *reply) {
+    mclient_future_t *f = arg;
+
+    f->reply = *reply;
+    f->reply.nvalue = reply->nvalue < f->size ? reply->nvalue : f->size;
+    f->reply.value = f->buf;
+    if (f->reply.nvalue) memcpy(f->buf, reply->value, f->reply.nvalue);
+    f->done = 1;
+}
+
+int mclient_wait(mclient_t *cl, mclient_future_t *f) {
+    while (!f->done) {
+        if (mclient_poll(cl) < 0) return -1;
+    }
+    return f->reply.status;
+}
+
+/*******************************************************************************
+ * Shards
+ ******************************************************************************/
+
+mclient_shards_t *mclient_shards_create(const struct server_addr *servers, int n,
+        size_t depth, size_t max_value) {
+    mclient_shards_t *sh = calloc(1, sizeof(mclient_shards_t));
+    int i = 0;
+
+    if (!sh) {
+        fprintf(stderr, "out of memory in mclient_shards_create()\n");
+        return NULL;
+    }
+    if (0 != ketama_build(&sh->ring, servers, n)) {
+        free(sh);
+        return NULL;
+    }
+    for (i = 0; i < n; ++i) {
+        if ( !(sh->clients[i] = mclient_create(servers[i].host, servers[i].port, depth, max_value)) ) {
+            mclient_shards_free(sh);
+            return NULL;
+        }
+        sh->n = i + 1;
+    }
+    return sh;
+}
+
+void mclient_shards_free(mclient_shards_t *sh) {
+    int i = 0;
+
+    if (!sh) return;
+    for (i = 0; i < sh->n; ++i) {
+        mclient_free(sh->clients[i]);
+    }
+    ketama_free(&sh->ring);
+    free(sh);
+}
+
+int mclient_shards_poll(mclient_shards_t *sh) {
+    int i = 0, n = 0, done = 0;
+
+    for (i = 0; i < sh->n; ++i) {
+        if ((n = mclient_poll(sh->clients[i])) < 0) return -1;
+        done += n;
+    }
+    return done;
+}
+
+int mclient_shards_drain(mclient_shards_t *sh) {
+    int i = 0;
+
+    for (i = 0; i < sh->n; ++i) {
+        if (0 != mclient_drain(sh->clients[i])) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Description: an asynchronous client library, binary protocol over one RC
+ *              QP. A request is posted without waiting for its reply and is
+ *              named by the opaque of its header, so up to depth requests are
+ *              in flight and replies may come in any order. Replies are handed
+ *              to a callback from mclient_poll(), a future is a callback that
+ *              keeps a copy of the reply. An instance is used by one thread.
+ *              Several servers are shared by the ketama ring of mclient_shards_t,
+ *              a key is sent through the client of the server owning it.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+
+#include "hash.h"
+#include "ketama.h"
+#include "servers.h"
+
+#define MCLIENT_KEY_MAX     250
+/* the receives a server posts per connection (REG_PER_CONN of rdma_transport.c),
+ * a request past them would find no receive; the low half of opaque is the slot */
+#define MCLIENT_MAX_DEPTH   256
+
+/* the reply to a request, valid only during the callback */
+typedef struct mclient_reply_s {
+    uint8_t         opcode;
+    uint16_t        status;     /* PROTOCOL_BINARY_RESPONSE_*, 0 on success */
+    uint32_t        flags;      /* of a hit */
+    const char      *value;     /* of a hit, or the message of an error */
+    size_t          nvalue;
+    uint64_t        number;     /* the value after incr or decr */
+} mclient_reply_t;
+
+typedef void (*mclient_cb)(void *arg, const mclient_reply_t *reply);
+
+/* a request in flight, its slot is free again once both its send has
+ * completed and its reply has come, the send buffer is in use till then */
+struct mclient_slot {
+    mclient_cb      cb;
+    void            *arg;
+    uint16_t        gen;        /* the high half of opaque, a stale reply does not match */
+    uint8_t         sending;
+    uint8_t         waiting;
+};
+
+/* the struct of client */
+typedef struct mclient_s {
+    struct rdma_cm_id   *id;
+    struct ibv_pd       *pd;
+    struct ibv_cq       *cq;        /* sends and receives */
+
+    size_t              depth;      /* requests in flight at most */
+    size_t              max_value;
+    size_t              ssize;      /* one send buffer per slot */
+    size_t              rsize;      /* one receive buffer per slot */
+    char                *sbuf;
+    char                *rbuf;
+    struct ibv_mr       *smr;
+    struct ibv_mr       *rmr;
+
+    struct mclient_slot *slots;
+    uint32_t            *free;      /* the stack of free slots */
+    size_t              nfree;
+    size_t              inflight;   /* requests waiting for a reply */
+    uint64_t            strays;     /* replies matching no request */
+
+    int                 key_hash;   /* send the hash of key, see PROTOCOL_BINARY_KEY_HASH */
+} mclient_t;
+
+/* a reply kept after its callback, the value is copied to buf */
+typedef struct mclient_future_s {
+    int             done;
+    mclient_reply_t reply;      /* reply.value is buf, nvalue at most size */
+    char            *buf;
+    size_t          size;
+} mclient_future_t;
+
+/***************************************************************************//**
+ * Connect to a server
+ *
+ * @param[in] server    the address of server
+ * @param[in] port      the port of server
+ * @param[in] depth     requests in flight at most, up to MCLIENT_MAX_DEPTH
+ * @param[in] max_value the largest value sent or received
+ * @return              the pointer to client, NULL on failure
+ *
+ ******************************************************************************/
+mclient_t *mclient_create(const char *server, const char *port, size_t depth, size_t max_value);
+
+/***************************************************************************//**
+ * Disconnect and free a client, the requests in flight are dropped without
+ * their callbacks
+ *
+ * @param[in] cl    the pointer to client
+ *
+ ******************************************************************************/
+void mclient_free(mclient_t *cl);
+
+/***************************************************************************//**
+ * Post a request, polling for replies first if every slot is in use. The key
+ * and value are copied, they may be reused once the call returns.
+ *
+ * @param[in] cl        the pointer to client
+ * @param[in] key       the key
+ * @param[in] nkey      the length of key
+ * @param[in] cb        called with the reply from mclient_poll()
+ * @param[in] arg       passed to cb
+ * @return              0 on success, -1 on failure
+ *
+ ******************************************************************************/
+int mclient_get(mclient_t *cl, const char *key, size_t nkey, mclient_cb cb, void *arg);
+
+int mclient_set(mclient_t *cl, const char *key, size_t nkey, const void *value, size_t nvalue,
+        uint32_t flags, uint32_t exptime, mclient_cb cb, void *arg);
+
+int mclient_delete(mclient_t *cl, const char *key, size_t nkey, mclient_cb cb, void *arg);
+
+/* a missing counter is created with the initial value */
+int mclient_incr(mclient_t *cl, const char *key, size_t nkey, uint64_t delta, uint64_t initial,
+        mclient_cb cb, void *arg);
+
+int mclient_decr(mclient_t *cl, const char *key, size_t nkey, uint64_t delta, uint64_t initial,
+        mclient_cb cb, void *arg);
+
+/***************************************************************************//**
+ * Run the callbacks of the replies which have come, without blocking
+ *
+ * @param[in] cl    the pointer to client
+ * @return          the number of callbacks run, -1 on failure
+ *
+ ******************************************************************************/
+int mclient_poll(mclient_t *cl);
+
+/***************************************************************************//**
+ * Poll till no request is in flight
+ *
+ * @param[in] cl    the pointer to client
+ * @return          0 on success, -1 on failure
+ *
+ ******************************************************************************/
+int mclient_drain(mclient_t *cl);
+
+/***************************************************************************//**
+ * Prepare a future, pass mclient_future_cb and the future to a request
+ *
+ * @param[in] f     the future
+ * @param[in] buf   where the value is copied to, may be NULL
+ * @param[in] size  the size of buf
+ *
+ ******************************************************************************/
+void mclient_future_init(mclient_future_t *f, char *buf, size_t size);
+
+void mclient_future_cb(void *arg, const mclient_reply_t *reply);
+
+/***************************************************************************//**
+ * Poll till a future is done
+ *
+ * @param[in] cl    the pointer to client
+ * @param[in] f     the future
+ * @return          the status of reply, -1 on failure
+ *
+ ******************************************************************************/
+int mclient_wait(mclient_t *cl, mclient_future_t *f);
+
+/*******************************************************************************
+ * Sharding over several servers
+ ******************************************************************************/
+
+/* one client per server, keys are spread by the ring */
+typedef struct mclient_shards_s {
+    struct ketama   ring;
+    mclient_t       *clients[SERVERS_MAX];
+    int             n;
+} mclient_shards_t;
+
+/***************************************************************************//**
+ * Connect to every server of a list
+ *
+ * @param[in] servers   the servers
+ * @param[in] n         the number of servers, up to SERVERS_MAX
+ * @param[in] depth     requests in flight at most, per server
+ * @param[in] max_value the largest value sent or received
+ * @return              the pointer to shards, NULL on failure
+ *
+ ******************************************************************************/
+mclient_shards_t *mclient_shards_create(const struct server_addr *servers, int n,
+        size_t depth, size_t max_value);
+
+void mclient_shards_free(mclient_shards_t *sh);
+
+/***************************************************************************//**
+ * Find the client of the server owning a key, pass it to a request
+ *
+ * @param[in] sh    the pointer to shards
+ * @param[in] key   the key
+ * @param[in] nkey  the length of key
+ * @return          the client
+ *
+ ******************************************************************************/
+static inline mclient_t *mclient_shard(mclient_shards_t *sh, const char *key, size_t nkey) {
+    return sh->clients[ketama_find(&sh->ring, ketama_point(hash64(key, nkey)))];
+}
+
+/* mclient_poll() and mclient_drain() over every server */
+int mclient_shards_poll(mclient_shards_t *sh);
+
+int mclient_shards_drain(mclient_shards_t *sh);
@@ -0,0 +1,1199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include "hash.h"
+#include "hotkeys.h"
+#include "proto.h"
+#include "protocol_binary.h"
+
+/*******************************************************************************/
+
+/* each worker owns one partition of keys and the store holding it */
+static __thread store_t     *store = NULL;
+static __thread uint32_t    partition = 0;
+static __thread uint32_t    npartitions = 1;
+static __thread hotkeys_t   *hotkeys = NULL;
+static __thread counters_t  *counters = NULL;
+
+static volatile size_t  curr_conns = 0;
+static volatile size_t  total_conns = 0;
+static uint32_t         hash_checks = 16;
+
+void proto_init(store_t *st, counters_t *cs, uint32_t part, uint32_t nparts) {
+    store = st;
+    counters = cs;
+    partition = part;
+    npartitions = nparts;
+    hotkeys = hotkeys_create();
+}
+
+void proto_set_hash_checks(uint32_t checks) {
+    hash_checks = checks;
+}
+
+void proto_conn_opened() {
+    __sync_fetch_and_add(&curr_conns, 1);
+    __sync_fetch_and_add(&total_conns, 1);
+}
+
+void proto_conn_closed() {
+    __sync_fetch_and_sub(&curr_conns, 1);
+}
+
+void proto_release(struct request *req) {
+    int i = 0;
+
+    if (req->it) {
+        item_release(store, req->it);
+        req->it = NULL;
+    }
+    for (i = 0; i < req->nmget; ++i) {
+        if (req->mget[i].it) {
+            item_release(store, req->mget[i].it);
+            req->mget[i].it = NULL;
+        }
+    }
+    req->niov = 0;
+}
+
+/***************************************************************************//**
+ * Reply helpers, the header and trailer of a reply are in the reply buffer of
+ * the request, values are gathered from the store
+ *
+ ******************************************************************************/
+static void
+add_iov(struct request *req, void *base, size_t len) {
+    req->iov[req->niov].iov_base = base;
+    req->iov[req->niov].iov_len = len;
+    req->niov += 1;
+}
+
+static void
+post_reply(struct request *req) {
+    if (req->noreply || 0 == req->niov) {
+        req->tp->finish(req);
+    } else {
+        req->tp->send_reply(req);
+    }
+}
+
+static void
+reply_str(struct request *req, const char *str) {
+    size_t len = strlen(str);
+
+    memcpy(req->rbuf, str, len);
+    add_iov(req, req->rbuf, len);
+    post_reply(req);
+}
+
+static void bin_error(struct request *req, uint16_t status, const char *msg);
+
+/* a key of another partition is refused, the client has a stale map */
+static int
+wrong_partition(struct request *req, uint64_t hv) {
+    if (1 == npartitions || hash_partition(hv, npartitions) == partition) {
+        return 0;
+    }
+    if (req->binary) {
+        bin_error(req, PROTOCOL_BINARY_RESPONSE_EINVAL, "wrong partition");
+    } else {
+        reply_str(req, "SERVER_ERROR wrong partition\r\n");
+    }
+    return 1;
+}
+
+/* a follower takes the reference its leader got for it */
+static item_t *
+lookup(struct request *req, const char *key, size_t nkey) {
+    if (req->leader) {
+        return req->leader->shared;
+    }
+    req->shared = item_get_refs(store, key, nkey, req->hv, 1 + req->followers);
+    return req->shared;
+}
+
+/***************************************************************************//**
+ * Description
+ * Split the command line by spaces, the last token is the rest of line
+ *
+ ******************************************************************************/
+static size_t
+tokenize_command(char *command, token_t *tokens, size_t max_tokens) {
+    char *s = command, *e = command;
+    size_t ntokens = 0;
+
+    for (; *e != '\0' && ntokens < max_tokens - 1; ++e) {
+        if (' ' == *e) {
+            if (s != e) {
+                tokens[ntokens].value = s;
+                tokens[ntokens].length = e - s;
+                ntokens += 1;
+            }
+            *e = '\0';
+            s = e + 1;
+        }
+    }
+
+    /* s is at the end unless max_tokens stopped the loop */
+    if ('\0' != *s) {
+        tokens[ntokens].value = s;
+        tokens[ntokens].length = strlen(s);
+        ntokens += 1;
+    }
+
+    return ntokens;
+}
+
+static int
+set_noreply(token_t *tokens, size_t ntokens) {
+    return 0 == strcmp(tokens[ntokens - 1].value, "noreply");
+}
+
+/* storage commands carry "<bytes>\r\n" of data after the command line */
+static int
+is_storage_command(const char *cmd, size_t len) {
+    return (3 == len && (0 == memcmp(cmd, "set", 3) || 0 == memcmp(cmd, "add", 3)))
+        || (6 == len && 0 == memcmp(cmd, "append", 6))
+        || (7 == len && (0 == memcmp(cmd, "replace", 7) || 0 == memcmp(cmd, "prepend", 7)));
+}
+
+static int
+is_quiet_get(uint8_t opcode) {
+    return PROTOCOL_BINARY_CMD_GETQ == opcode || PROTOCOL_BINARY_CMD_GETKQ == opcode;
+}
+
+long
+proto_request_length(const char *buf, size_t len) {
+    if (len > 0 && PROTOCOL_BINARY_REQ == (uint8_t)buf[0]) {
+        /* the header tells the length of body */
+        protocol_binary_request_header h;
+        size_t total = 0;
+        int nquiet = 0;
+        if (len < sizeof(h)) return 0;
+        do {
+            memcpy(&h, buf + total, sizeof(h));
+            uint32_t bodylen = ntohl(h.request.bodylen);
+            if (bodylen > SLAB_PAGE_SIZE) return -1;
+            total += sizeof(h) + bodylen;
+            /* a run stops at the last header in buf, the rest is framed
+             * as the next request */
+        } while (is_quiet_get(h.request.opcode) && ++nquiet < MGET_MAX_KEYS
+                && total + sizeof(h) <= len);
+        return total;
+    }
+
+    const char *start = buf;
+    const char *nl = memchr(buf, '\n', len);
+
+    if (nl && len > 0 && RDMA_HEAD == buf[0]) {
+        /* the head line, then the command line */
+        len -= nl + 1 - buf;
+        buf = nl + 1;
+        nl = memchr(buf, '\n', len);
+    }
+    if (!nl) {
+        return len > LINE_MAX_LENGTH ? -1 : 0;
+    }
+    long line = nl + 1 - start;
+
+    /* the command is the first word, the length of data is the fifth */
+    const char *p = buf, *word[5];
+    size_t wlen[5];
+    int n = 0;
+    while (p < nl && n < 5) {
+        while (p < nl && ' ' == *p) ++p;
+        if (p == nl || '\r' == *p) break;
+        word[n] = p;
+        while (p < nl && ' ' != *p && '\r' != *p) ++p;
+        wlen[n] = p - word[n];
+        ++n;
+    }
+
+    if (5 == n && is_storage_command(word[0], wlen[0])) {
+        long vlen = strtol(word[4], NULL, 10);
+        if (vlen > SLAB_PAGE_SIZE) return -1;
+        line += (vlen > 0 ? vlen : 0) + 2;
+    }
+    return line;
+}
+
+/***************************************************************************//**
+ * get <key>
+ *
+ ******************************************************************************/
+static void
+process_get(struct request *req, token_t *tokens, size_t ntokens, struct remote_mem *rm) {
+    char *key = tokens[1].value;
+    size_t nkey = tokens[1].length;
+
+    if (nkey > KEY_MAX_LENGTH) {
+        reply_str(req, "CLIENT_ERROR bad command line format\r\n");
+        return;
+    }
+
+    uint64_t hv = req->hv;
+    if (wrong_partition(req, hv)) return;
+
+    item_t *it = lookup(req, key, nkey);
+    if (!it) {
+        reply_str(req, "END\r\n");
+        return;
+    }
+    req->it = it;
+
+    /* the VALUE line is kept in the item right before the value */
+    if (rm) {
+        /* the value goes to client memory directly, the line follows it */
+        size_t length = it->nbytes < rm->length ? it->nbytes : rm->length;
+        if (!req->tp->write_remote || 0 != req->tp->write_remote(req, ITEM_data(it), length, rm)) {
+            reply_str(req, "SERVER_ERROR rdma write failed\r\n");
+            return;
+        }
+        add_iov(req, ITEM_line(it), ITEM_nline(it));
+    } else {
+        add_iov(req, ITEM_line(it), ITEM_nline(it) + it->nbytes);
+    }
+    memcpy(req->rbuf, "END\r\n", 5);
+    add_iov(req, req->rbuf, 5);
+
+    post_reply(req);
+}
+
+/***************************************************************************//**
+ * get <key>*
+ *
+ * The keys were hashed and prefetched together, each hit adds the "VALUE"
+ * line and value of its item to the reply.
+ *
+ ******************************************************************************/
+static void
+process_mget(struct request *req, struct remote_mem *rm) {
+    int i = 0;
+
+    /* client memory holds one value */
+    if (rm) {
+        reply_str(req, "CLIENT_ERROR bad command line format\r\n");
+        return;
+    }
+    for (i = 0; i < req->nmget; ++i) {
+        if (wrong_partition(req, req->mget[i].hv)) return;
+    }
+
+    for (i = 0; i < req->nmget; ++i) {
+        struct mget_key *k = &req->mget[i];
+        item_t *it = item_get(store, k->key.value, k->key.length, k->hv);
+        if (it) {
+            k->it = it;
+            add_iov(req, ITEM_line(it), ITEM_nline(it) + it->nbytes);
+        }
+    }
+    memcpy(req->rbuf, "END\r\n", 5);
+    add_iov(req, req->rbuf, 5);
+
+    post_reply(req);
+}
+
+/***************************************************************************//**
+ * set|add|replace|append|prepend <key> <flags> <exptime> <bytes> [noreply]
+ *
+ ******************************************************************************/
+static void
+reply_store_result(struct request *req, enum store_result ret) {
+    switch (ret) {
+        case STORED:
+            reply_str(req, "STORED\r\n");
+            break;
+        case NOT_STORED:
+            reply_str(req, "NOT_STORED\r\n");
+            break;
+        default:
+            reply_str(req, "SERVER_ERROR out of memory storing object\r\n");
+            break;
+    }
+}
+
+static void
+process_update(struct request *req, token_t *tokens, size_t ntokens, enum store_cmd cmd,
+        char *data, size_t data_len, struct remote_mem *rm) {
+    char *key = tokens[1].value;
+    size_t nkey = tokens[1].length;
+    char *end = NULL;
+
+    req->noreply = set_noreply(tokens, ntokens);
+
+    uint32_t flags = strtoul(tokens[2].value, &end, 10);
+    int bad = '\0' != *end;
+    long long exptime = strtoll(tokens[3].value, &end, 10);
+    bad |= '\0' != *end;
+    long vlen = strtol(tokens[4].value, &end, 10);
+    if (bad || nkey > KEY_MAX_LENGTH || vlen < 0 || '\0' != *end) {
+        reply_str(req, "CLIENT_ERROR bad command line format\r\n");
+        return;
+    }
+    vlen += 2;
+
+    uint64_t hv = req->hv;
+    if (wrong_partition(req, hv)) return;
+
+    item_t *it = item_alloc(store, key, nkey, hv, flags, store_exptime(store, exptime), vlen);
+    if (!it) {
+        if (0 == slabs_clsid(store->slabs, item_make_size(nkey, flags, vlen))) {
+            reply_str(req, "SERVER_ERROR object too large for cache\r\n");
+        } else {
+            reply_str(req, "SERVER_ERROR out of memory storing object\r\n");
+        }
+        return;
+    }
+    req->it = it;
+
+    if (rm) {
+        /* read the value from client memory right into the item */
+        if (rm->length < vlen) {
+            reply_str(req, "CLIENT_ERROR bad data chunk\r\n");
+            return;
+        }
+        req->cmd = cmd;
+        if (!req->tp->read_remote || 0 != req->tp->read_remote(req, ITEM_data(it), vlen, rm)) {
+            reply_str(req, "SERVER_ERROR rdma read failed\r\n");
+        }
+        return;
+    }
+
+    if (data_len < vlen || 0 != memcmp(data + vlen - 2, "\r\n", 2)) {
+        reply_str(req, "CLIENT_ERROR bad data chunk\r\n");
+        return;
+    }
+    memcpy(ITEM_data(it), data, vlen);
+
+    reply_store_result(req, store_item(store, it, cmd));
+}
+
+void
+proto_complete_update(struct request *req) {
+    item_t *it = req->it;
+
+    if (0 != memcmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2)) {
+        reply_str(req, "CLIENT_ERROR bad data chunk\r\n");
+        return;
+    }
+    reply_store_result(req, store_item(store, it, req->cmd));
+}
+
+/***************************************************************************//**
+ * delete <key> [noreply]
+ *
+ ******************************************************************************/
+static void
+process_delete(struct request *req, token_t *tokens, size_t ntokens) {
+    char *key = tokens[1].value;
+    size_t nkey = tokens[1].length;
+
+    req->noreply = set_noreply(tokens, ntokens);
+
+    uint64_t hv = req->hv;
+    if (wrong_partition(req, hv)) return;
+
+    if (0 == item_delete(store, key, nkey, hv)) {
+        reply_str(req, "DELETED\r\n");
+    } else {
+        reply_str(req, "NOT_FOUND\r\n");
+    }
+}
+
+/***************************************************************************//**
+ * incr|decr <key> <delta> [noreply]
+ *
+ ******************************************************************************/
+static void
+process_delta(struct request *req, token_t *tokens, size_t ntokens, int incr) {
+    char *key = tokens[1].value;
+    size_t nkey = tokens[1].length;
+    char *end = NULL;
+    uint64_t value = 0;
+    char buf[32];
+
+    req->noreply = set_noreply(tokens, ntokens);
+
+    uint64_t delta = strtoull(tokens[2].value, &end, 10);
+    if ('\0' != *end) {
+        reply_str(req, "CLIENT_ERROR invalid numeric delta argument\r\n");
+        return;
+    }
+
+    uint64_t hv = req->hv;
+    if (wrong_partition(req, hv)) return;
+
+    switch (item_delta(store, key, nkey, hv, incr, delta, &value)) {
+        case DELTA_OK:
+            snprintf(buf, sizeof(buf), "%llu\r\n", (unsigned long long)value);
+            reply_str(req, buf);
+            break;
+        case DELTA_NON_NUMERIC:
+            reply_str(req, "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+            break;
+        case DELTA_NOT_FOUND:
+            reply_str(req, "NOT_FOUND\r\n");
+            break;
+        default:
+            reply_str(req, "SERVER_ERROR out of memory\r\n");
+            break;
+    }
+}
+
+/***************************************************************************//**
+ * counter <key> [initial]
+ *
+ * Bind the key to a counter and reply "COUNTER <addr> <rkey> <value>", the
+ * client then updates it with RDMA atomics. The rkey is 0 on a transport
+ * without remote access, the value is still reported.
+ *
+ ******************************************************************************/
+static void
+process_counter(struct request *req, token_t *tokens, size_t ntokens) {
+    char *key = tokens[1].value;
+    size_t nkey = tokens[1].length;
+    char *end = NULL;
+    uint64_t initial = 0;
+
+    if (ntokens >= 3) {
+        initial = strtoull(tokens[2].value, &end, 10);
+        if ('\0' != *end) {
+            reply_str(req, "CLIENT_ERROR invalid numeric initial value\r\n");
+            return;
+        }
+    }
+    if (nkey > KEY_MAX_LENGTH) {
+        reply_str(req, "CLIENT_ERROR bad command line format\r\n");
+        return;
+    }
+    if (!counters) {
+        reply_str(req, "SERVER_ERROR counters disabled\r\n");
+        return;
+    }
+    if (wrong_partition(req, req->hv)) return;
+
+    uint64_t *word = counters_bind(counters, key, nkey, req->hv, initial);
+    if (!word) {
+        reply_str(req, "SERVER_ERROR out of counters\r\n");
+        return;
+    }
+
+    uint32_t rkey = req->tp->counters_rkey ? req->tp->counters_rkey(req) : 0;
+    int len = snprintf(req->rbuf, REPLY_SIZE, "COUNTER %llu %u %llu\r\n",
+            (unsigned long long)(uintptr_t)word, rkey,
+            (unsigned long long)__atomic_load_n(word, __ATOMIC_ACQUIRE));
+    add_iov(req, req->rbuf, len);
+    post_reply(req);
+}
+
+/***************************************************************************//**
+ * stats
+ *
+ ******************************************************************************/
+static void
+process_stats(struct request *req) {
+    char *buf = req->rbuf;
+    size_t len = 0;
+
+    len += snprintf(buf, REPLY_SIZE, "STAT curr_connections %zu\r\n"
+            "STAT total_connections %zu\r\n"
+            "STAT partition %u\r\n"
+            "STAT partitions %u\r\n", curr_conns, total_conns, partition, npartitions);
+    len += store_stats(store, buf + len, REPLY_SIZE - len - sizeof("END\r\n"));
+    len += sprintf(buf + len, "END\r\n");
+
+    add_iov(req, buf, len);
+    post_reply(req);
+}
+
+/* stats hotkeys */
+static void
+process_stats_hotkeys(struct request *req) {
+    char *buf = req->rbuf;
+    size_t len = 0;
+
+    if (hotkeys) {
+        len += hotkeys_stats(hotkeys, buf, REPLY_SIZE - sizeof("END\r\n"));
+    }
+    len += sprintf(buf + len, "END\r\n");
+
+    add_iov(req, buf, len);
+    post_reply(req);
+}
+
+/***************************************************************************//**
+ * The binary protocol, values are stored with "\r\n" like the ASCII ones so
+ * both protocols read the same items
+ *
+ ******************************************************************************/
+
+/* the response header in the reply buffer after the hits of a multi-get,
+ * the body is added after it */
+static char *
+bin_header(struct request *req, uint8_t opcode, uint32_t opaque, uint16_t status,
+        uint8_t extlen, uint16_t nkey, uint32_t vlen) {
+    protocol_binary_response_header *h = (protocol_binary_response_header *)(req->rbuf + req->rlen);
+
+    memset(h, 0, sizeof(*h));
+    h->response.magic = PROTOCOL_BINARY_RES;
+    h->response.opcode = opcode;
+    h->response.keylen = htons(nkey);
+    h->response.extlen = extlen;
+    h->response.status = htons(status);
+    h->response.bodylen = htonl(extlen + nkey + vlen);
+    h->response.opaque = opaque;
+    return (char *)(h + 1);
+}
+
+static char *
+bin_response(struct request *req, uint16_t status, uint8_t extlen, uint16_t nkey, uint32_t vlen) {
+    return bin_header(req, req->opcode, req->opaque, status, extlen, nkey, vlen);
+}
+
+/* the response is in the reply buffer up to end */
+static void
+bin_add(struct request *req, char *end) {
+    add_iov(req, req->rbuf + req->rlen, end - (req->rbuf + req->rlen));
+    req->rlen = end - req->rbuf;
+}
+
+/* the quiet commands answer only errors, GETQ and GETKQ also hits */
+static uint8_t
+bin_loud(uint8_t opcode) {
+    switch (opcode) {
+        case PROTOCOL_BINARY_CMD_GETQ:          return PROTOCOL_BINARY_CMD_GET;
+        case PROTOCOL_BINARY_CMD_GETKQ:         return PROTOCOL_BINARY_CMD_GETK;
+        case PROTOCOL_BINARY_CMD_SETQ:          return PROTOCOL_BINARY_CMD_SET;
+        case PROTOCOL_BINARY_CMD_ADDQ:          return PROTOCOL_BINARY_CMD_ADD;
+        case PROTOCOL_BINARY_CMD_REPLACEQ:      return PROTOCOL_BINARY_CMD_REPLACE;
+        case PROTOCOL_BINARY_CMD_APPENDQ:       return PROTOCOL_BINARY_CMD_APPEND;
+        case PROTOCOL_BINARY_CMD_PREPENDQ:      return PROTOCOL_BINARY_CMD_PREPEND;
+        case PROTOCOL_BINARY_CMD_DELETEQ:       return PROTOCOL_BINARY_CMD_DELETE;
+        case PROTOCOL_BINARY_CMD_INCREMENTQ:    return PROTOCOL_BINARY_CMD_INCREMENT;
+        case PROTOCOL_BINARY_CMD_DECREMENTQ:    return PROTOCOL_BINARY_CMD_DECREMENT;
+        default:                                return opcode;
+    }
+}
+
+static int
+bin_quiet_drops(uint8_t opcode, uint16_t status) {
+    if (is_quiet_get(opcode)) {
+        return PROTOCOL_BINARY_RESPONSE_KEY_ENOENT == status;
+    }
+    return bin_loud(opcode) != opcode && PROTOCOL_BINARY_RESPONSE_SUCCESS == status;
+}
+
+static void
+bin_send(struct request *req, char *end) {
+    protocol_binary_response_header *h = (protocol_binary_response_header *)(req->rbuf + req->rlen);
+
+    if (!bin_quiet_drops(req->opcode, ntohs(h->response.status))) {
+        bin_add(req, end);
+    }
+    post_reply(req);
+}
+
+static void
+bin_status(struct request *req, uint16_t status) {
+    bin_send(req, bin_response(req, status, 0, 0, 0));
+}
+
+static void
+bin_error(struct request *req, uint16_t status, const char *msg) {
+    size_t len = strlen(msg);
+    char *body = bin_response(req, status, 0, 0, len);
+
+    memcpy(body, msg, len);
+    bin_send(req, body + len);
+}
+
+/***************************************************************************//**
+ * Description
+ * Parse a binary request. With PROTOCOL_BINARY_KEY_HASH the extras start with
+ * the hash of key, which is checked for the first requests of a connection
+ * and trusted afterwards.
+ *
+ ******************************************************************************/
+static void
+bin_parse(struct request *req, char *buf, size_t len) {
+    protocol_binary_request_header h;
+
+    req->binary = 1;
+    if (len < sizeof(h)) {
+        req->opcode = PROTOCOL_BINARY_CMD_NOOP;
+        req->opaque = 0;
+        req->status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+        return;
+    }
+    memcpy(&h, buf, sizeof(h));
+    req->opcode = h.request.opcode;
+    req->opaque = h.request.opaque;
+
+    uint16_t nkey = ntohs(h.request.keylen);
+    uint32_t bodylen = ntohl(h.request.bodylen);
+    if (bodylen > len - sizeof(h) || h.request.extlen + nkey > bodylen || nkey > KEY_MAX_LENGTH) {
+        req->status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+        return;
+    }
+
+    req->extras = buf + sizeof(h);
+    req->extlen = h.request.extlen;
+    req->tokens[1].value = req->extras + req->extlen;
+    req->tokens[1].length = nkey;
+    req->data = req->tokens[1].value + nkey;
+    req->data_len = bodylen - req->extlen - nkey;
+
+    if (0 == nkey) return;
+
+    if ( !(h.request.datatype & PROTOCOL_BINARY_KEY_HASH) ) {
+        req->hv = hash64(req->tokens[1].value, nkey);
+        req->ntokens = 2;
+        return;
+    }
+
+    uint64_t client_hv = 0;
+    if (req->extlen < sizeof(client_hv)) {
+        req->status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+        return;
+    }
+    memcpy(&client_hv, req->extras, sizeof(client_hv));
+    req->extras += sizeof(client_hv);
+    req->extlen -= sizeof(client_hv);
+    req->hv = be64toh(client_hv);
+
+    uint32_t *checked = req->hashes_checked;
+    if (checked ? *checked < hash_checks : 0 != hash_checks) {
+        if (hash64(req->tokens[1].value, nkey) != req->hv) {
+            req->status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+            return;
+        }
+        if (checked) *checked += 1;
+    }
+    req->ntokens = 2;
+}
+
+/* a run of GETQ/GETKQ and the request ending it, if any. TCP splits longer
+ * runs in proto_request_length(), a RDMA message can not be split, so the
+ * first key past MGET_MAX_KEYS is answered E2BIG after the hits before it. */
+static void
+bin_parse_mget(struct request *req, char *buf, size_t len) {
+    protocol_binary_request_header h;
+
+    while (len >= sizeof(h) && is_quiet_get((uint8_t)buf[1])) {
+        if (MGET_MAX_KEYS == req->nmget) {
+            memcpy(&h, buf, sizeof(h));
+            req->binary = 1;
+            req->opcode = h.request.opcode;
+            req->opaque = h.request.opaque;
+            req->status = PROTOCOL_BINARY_RESPONSE_E2BIG;
+            return;
+        }
+        req->ntokens = 0;
+        bin_parse(req, buf, len);
+        if (req->status) return;
+        if (req->ntokens < 2) {
+            req->status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+            return;
+        }
+
+        struct mget_key *k = &req->mget[req->nmget++];
+        k->key = req->tokens[1];
+        k->hv = req->hv;
+        k->it = NULL;
+        k->opcode = req->opcode;
+        k->opaque = req->opaque;
+        if (hotkeys) hotkeys_sample(hotkeys, k->key.value, k->key.length, k->hv);
+
+        memcpy(&h, buf, sizeof(h));
+        size_t plen = sizeof(h) + ntohl(h.request.bodylen);
+        buf += plen;
+        len -= plen;
+    }
+
+    req->ntokens = 0;
+    if (len > 0) {
+        bin_parse(req, buf, len);
+    }
+}
+
+/* GETK and GETKQ return the key too, the value is sent in place */
+static void
+bin_add_hit(struct request *req, uint8_t opcode, uint32_t opaque, item_t *it) {
+    int with_key = PROTOCOL_BINARY_CMD_GETK == opcode || PROTOCOL_BINARY_CMD_GETKQ == opcode;
+    uint16_t nkey = with_key ? it->nkey : 0;
+    uint32_t flags = htonl(it->flags);
+    char *body = bin_header(req, opcode, opaque, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+            sizeof(flags), nkey, it->nbytes - 2);
+
+    memcpy(body, &flags, sizeof(flags));
+    memcpy(body + sizeof(flags), ITEM_key(it), nkey);
+    bin_add(req, body + sizeof(flags) + nkey);
+    add_iov(req, ITEM_data(it), it->nbytes - 2);
+}
+
+static void
+bin_get(struct request *req) {
+    item_t *it = lookup(req, req->tokens[1].value, req->tokens[1].length);
+    if (!it) {
+        bin_error(req, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, "Not found");
+        return;
+    }
+    req->it = it;
+
+    bin_add_hit(req, req->opcode, req->opaque, it);
+    post_reply(req);
+}
+
+/* the quiet gets before the request, a miss has no response */
+static int
+bin_mget(struct request *req) {
+    int i = 0;
+
+    for (i = 0; i < req->nmget; ++i) {
+        if (wrong_partition(req, req->mget[i].hv)) return -1;
+    }
+    for (i = 0; i < req->nmget; ++i) {
+        struct mget_key *k = &req->mget[i];
+        item_t *it = item_get(store, k->key.value, k->key.length, k->hv);
+        if (it) {
+            k->it = it;
+            bin_add_hit(req, k->opcode, k->opaque, it);
+        }
+    }
+    return 0;
+}
+
+static void
+bin_update(struct request *req, enum store_cmd cmd) {
+    uint32_t flags = 0, exptime = 0;
+
+    if (STORE_SET == cmd || STORE_ADD == cmd || STORE_REPLACE == cmd) {
+        if (8 != req->extlen) {
+            bin_error(req, PROTOCOL_BINARY_RESPONSE_EINVAL, "Invalid arguments");
+            return;
+        }
+        memcpy(&flags, req->extras, 4);
+        memcpy(&exptime, req->extras + 4, 4);
+        flags = ntohl(flags);
+        exptime = ntohl(exptime);
+    }
+
+    size_t nkey = req->tokens[1].length;
+    size_t vlen = req->data_len + 2;
+    item_t *it = item_alloc(store, req->tokens[1].value, nkey, req->hv, flags,
+            store_exptime(store, exptime), vlen);
+    if (!it) {
+        if (0 == slabs_clsid(store->slabs, item_make_size(nkey, flags, vlen))) {
+            bin_error(req, PROTOCOL_BINARY_RESPONSE_E2BIG, "Too large.");
+        } else {
+            bin_error(req, PROTOCOL_BINARY_RESPONSE_ENOMEM, "Out of memory");
+        }
+        return;
+    }
+    req->it = it;
+    memcpy(ITEM_data(it), req->data, req->data_len);
+    memcpy(ITEM_data(it) + req->data_len, "\r\n", 2);
+
+    switch (store_item(store, it, cmd)) {
+        case STORED:
+            bin_status(req, PROTOCOL_BINARY_RESPONSE_SUCCESS);
+            break;
+        case NOT_STORED:
+            if (STORE_ADD == cmd) {
+                bin_error(req, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Data exists for key.");
+            } else {
+                bin_error(req, PROTOCOL_BINARY_RESPONSE_NOT_STORED, "Not stored.");
+            }
+            break;
+        default:
+            bin_error(req, PROTOCOL_BINARY_RESPONSE_ENOMEM, "Out of memory");
+            break;
+    }
+}
+
+static void
+bin_delete(struct request *req) {
+    if (0 == item_delete(store, req->tokens[1].value, req->tokens[1].length, req->hv)) {
+        bin_status(req, PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    } else {
+        bin_error(req, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, "Not found");
+    }
+}
+
+/* a missing counter is created with the initial value, unless the
+ * expiration is 0xffffffff */
+static void
+bin_delta(struct request *req, int incr) {
+    protocol_binary_request_incr body;
+    uint64_t value = 0;
+    char buf[32];
+
+    if (20 != req->extlen) {
+        bin_error(req, PROTOCOL_BINARY_RESPONSE_EINVAL, "Invalid arguments");
+        return;
+    }
+    memcpy(&body.message.body, req->extras, 20);
+
+    char *key = req->tokens[1].value;
+    size_t nkey = req->tokens[1].length;
+    switch (item_delta(store, key, nkey, req->hv, incr, be64toh(body.message.body.delta), &value)) {
+        case DELTA_OK:
+            break;
+        case DELTA_NON_NUMERIC:
+            bin_error(req, PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL,
+                    "Non-numeric server-side value for incr or decr");
+            return;
+        case DELTA_NOT_FOUND: {
+            uint32_t exptime = ntohl(body.message.body.expiration);
+            if (0xffffffff == exptime) {
+                bin_error(req, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, "Not found");
+                return;
+            }
+            value = be64toh(body.message.body.initial);
+            int len = snprintf(buf, sizeof(buf), "%llu\r\n", (unsigned long long)value);
+            item_t *it = item_alloc(store, key, nkey, req->hv, 0, store_exptime(store, exptime), len);
+            if (!it) {
+                bin_error(req, PROTOCOL_BINARY_RESPONSE_ENOMEM, "Out of memory");
+                return;
+            }
+            req->it = it;
+            memcpy(ITEM_data(it), buf, len);
+            if (STORED != store_item(store, it, STORE_ADD)) {
+                bin_error(req, PROTOCOL_BINARY_RESPONSE_NOT_STORED, "Not stored.");
+                return;
+            }
+            break;
+        }
+        default:
+            bin_error(req, PROTOCOL_BINARY_RESPONSE_ENOMEM, "Out of memory");
+            return;
+    }
+
+    char *out = bin_response(req, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, 0, sizeof(value));
+    value = htobe64(value);
+    memcpy(out, &value, sizeof(value));
+    bin_send(req, out + sizeof(value));
+}
+
+static void
+bin_execute(struct request *req) {
+    if (req->nmget && 0 != bin_mget(req)) return;
+    if (PROTOCOL_BINARY_RESPONSE_E2BIG == req->status) {
+        bin_error(req, req->status, "Too many keys.");
+        return;
+    }
+    if (req->status) {
+        bin_error(req, req->status, "Invalid arguments");
+        return;
+    }
+
+    /* NOOP flushes, everything before it has been answered already */
+    switch (req->opcode) {
+        case PROTOCOL_BINARY_CMD_NOOP:
+            bin_status(req, PROTOCOL_BINARY_RESPONSE_SUCCESS);
+            return;
+        case PROTOCOL_BINARY_CMD_GETQ:
+        case PROTOCOL_BINARY_CMD_GETKQ:
+            /* a run of quiet gets ended by nothing, the hits are the reply */
+            post_reply(req);
+            return;
+        default:
+            break;
+    }
+
+    uint8_t cmd = bin_loud(req->opcode);
+    switch (cmd) {
+        case PROTOCOL_BINARY_CMD_GET:
+        case PROTOCOL_BINARY_CMD_GETK:
+        case PROTOCOL_BINARY_CMD_SET:
+        case PROTOCOL_BINARY_CMD_ADD:
+        case PROTOCOL_BINARY_CMD_REPLACE:
+        case PROTOCOL_BINARY_CMD_APPEND:
+        case PROTOCOL_BINARY_CMD_PREPEND:
+        case PROTOCOL_BINARY_CMD_DELETE:
+        case PROTOCOL_BINARY_CMD_INCREMENT:
+        case PROTOCOL_BINARY_CMD_DECREMENT:
+            break;
+        default:
+            bin_error(req, PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND, "Unknown command");
+            return;
+    }
+
+    /* the rest have a key */
+    if (req->ntokens < 2) {
+        bin_error(req, PROTOCOL_BINARY_RESPONSE_EINVAL, "Invalid arguments");
+        return;
+    }
+    if (wrong_partition(req, req->hv)) return;
+
+    switch (cmd) {
+        case PROTOCOL_BINARY_CMD_GET:
+        case PROTOCOL_BINARY_CMD_GETK:
+            bin_get(req);
+            break;
+        case PROTOCOL_BINARY_CMD_SET:
+            bin_update(req, STORE_SET);
+            break;
+        case PROTOCOL_BINARY_CMD_ADD:
+            bin_update(req, STORE_ADD);
+            break;
+        case PROTOCOL_BINARY_CMD_REPLACE:
+            bin_update(req, STORE_REPLACE);
+            break;
+        case PROTOCOL_BINARY_CMD_APPEND:
+            bin_update(req, STORE_APPEND);
+            break;
+        case PROTOCOL_BINARY_CMD_PREPEND:
+            bin_update(req, STORE_PREPEND);
+            break;
+        case PROTOCOL_BINARY_CMD_DELETE:
+            bin_delete(req);
+            break;
+        case PROTOCOL_BINARY_CMD_INCREMENT:
+            bin_delta(req, 1);
+            break;
+        default:
+            bin_delta(req, 0);
+            break;
+    }
+}
+
+/* "get <key>*", the keys move to req->mget */
+static void
+parse_mget(struct request *req) {
+    token_t keys[MGET_MAX_KEYS + 1];
+    size_t nkeys = req->ntokens - 1, i = 0;
+
+    memcpy(keys, req->tokens + 1, nkeys * sizeof(token_t));
+    if (MAX_TOKENS == req->ntokens) {
+        /* the last token is the rest of line */
+        nkeys -= 1;
+        nkeys += tokenize_command(keys[nkeys].value, keys + nkeys, MGET_MAX_KEYS + 1 - nkeys);
+    }
+    if (nkeys > MGET_MAX_KEYS) {
+        req->error = "SERVER_ERROR too many keys\r\n";
+        return;
+    }
+
+    for (i = 0; i < nkeys; ++i) {
+        struct mget_key *k = &req->mget[i];
+        if (keys[i].length > KEY_MAX_LENGTH) {
+            req->error = "CLIENT_ERROR bad command line format\r\n";
+            return;
+        }
+        k->key = keys[i];
+        k->hv = hash64(k->key.value, k->key.length);
+        k->it = NULL;
+        if (hotkeys) hotkeys_sample(hotkeys, k->key.value, k->key.length, k->hv);
+    }
+    req->nmget = nkeys;
+    req->ntokens = 1;
+}
+
+/***************************************************************************//**
+ * Description
+ * Parse one request, a RDMA_HEAD line may come first. The key is hashed here
+ * so a batch can prefetch before any lookup.
+ *
+ ******************************************************************************/
+void
+proto_parse(struct request *req, char *buf, size_t len) {
+    req->noreply = 0;
+    req->niov = 0;
+    req->ntokens = 0;
+    req->has_remote = 0;
+    req->error = NULL;
+    req->binary = 0;
+    req->status = 0;
+    req->leader = NULL;
+    req->followers = 0;
+    req->nmget = 0;
+    req->rlen = 0;
+
+    if (len > 0 && PROTOCOL_BINARY_REQ == (uint8_t)buf[0]) {
+        if (len >= 2 && is_quiet_get((uint8_t)buf[1])) {
+            bin_parse_mget(req, buf, len);
+        } else {
+            bin_parse(req, buf, len);
+        }
+        if (hotkeys && req->ntokens >= 2) {
+            hotkeys_sample(hotkeys, req->tokens[1].value, req->tokens[1].length, req->hv);
+        }
+        return;
+    }
+
+    if (len > 0 && RDMA_HEAD == buf[0]) {
+        /* "\x88 addr rkey length\n" then the command */
+        char *nl = memchr(buf, '\n', len);
+        unsigned long long addr = 0;
+        if (!nl || 3 != sscanf(buf + 1, "%llu %u %u", &addr, &req->remote.rkey, &req->remote.length)) {
+            req->error = "CLIENT_ERROR bad rdma head\r\n";
+            return;
+        }
+        req->remote.addr = addr;
+        req->has_remote = 1;
+        len -= nl + 1 - buf;
+        buf = nl + 1;
+    }
+
+    char *el = memchr(buf, '\n', len);
+    if (!el) {
+        req->error = "ERROR\r\n";
+        return;
+    }
+    req->data = el + 1;
+    req->data_len = len - (req->data - buf);
+    if (el > buf && '\r' == el[-1]) --el;
+    *el = '\0';
+
+    req->ntokens = tokenize_command(buf, req->tokens, MAX_TOKENS);
+    if (0 == req->ntokens) {
+        req->error = "ERROR\r\n";
+        return;
+    }
+    if (req->ntokens > 2 && 0 == strcmp(req->tokens[0].value, "get")) {
+        parse_mget(req);
+        return;
+    }
+    if (req->ntokens >= 2) {
+        req->hv = hash64(req->tokens[1].value, req->tokens[1].length);
+        if (hotkeys && 0 != strcmp(req->tokens[0].value, "stats")) {
+            hotkeys_sample(hotkeys, req->tokens[1].value, req->tokens[1].length, req->hv);
+        }
+    }
+}
+
+/* a GET whose lookup can be shared */
+static int
+is_get(struct request *req) {
+    if (req->error || req->ntokens < 2 || req->nmget) return 0;
+    if (req->binary) {
+        return PROTOCOL_BINARY_CMD_GET == req->opcode || PROTOCOL_BINARY_CMD_GETK == req->opcode;
+    }
+    return 0 == strcmp(req->tokens[0].value, "get");
+}
+
+void
+proto_coalesce(struct request **batch, int n) {
+    int i = 0, j = 0;
+
+    for (i = 1; i < n; ++i) {
+        struct request *req = batch[i];
+        if (!is_get(req)) continue;
+
+        /* the last request of the same key decides */
+        for (j = i - 1; j >= 0; --j) {
+            struct request *prev = batch[j];
+            if (prev->ntokens < 2 || prev->hv != req->hv
+                    || prev->tokens[1].length != req->tokens[1].length
+                    || 0 != memcmp(prev->tokens[1].value, req->tokens[1].value, req->tokens[1].length)) {
+                continue;
+            }
+            if (is_get(prev)) {
+                req->leader = prev->leader ? prev->leader : prev;
+                req->leader->followers += 1;
+            }
+            break;
+        }
+    }
+}
+
+void
+proto_prefetch_bucket(struct request *req) {
+    int i = 0;
+
+    for (i = 0; i < req->nmget; ++i) {
+        store_prefetch_bucket(store, req->mget[i].hv);
+    }
+    if (!req->error && req->ntokens >= 2 && !req->leader) {
+        store_prefetch_bucket(store, req->hv);
+    }
+}
+
+void
+proto_prefetch_item(struct request *req) {
+    int i = 0;
+
+    for (i = 0; i < req->nmget; ++i) {
+        store_prefetch_item(store, req->mget[i].hv);
+    }
+    if (!req->error && req->ntokens >= 2 && !req->leader) {
+        store_prefetch_item(store, req->hv);
+    }
+}
+
+void
+proto_execute(struct request *req) {
+    struct remote_mem *rm = req->has_remote ? &req->remote : NULL;
+    token_t *tokens = req->tokens;
+    size_t ntokens = req->ntokens;
+    char *data = req->data;
+    size_t data_len = req->data_len;
+
+    if (req->binary) {
+        bin_execute(req);
+        return;
+    }
+    if (req->error) {
+        reply_str(req, req->error);
+        return;
+    }
+
+    const char *cmd = tokens[0].value;
+
+    if (req->nmget) {
+        process_mget(req, rm);
+    } else if (ntokens >= 2 && 0 == strcmp(cmd, "get")) {
+        process_get(req, tokens, ntokens, rm);
+    } else if (ntokens >= 5 && 0 == strcmp(cmd, "set")) {
+        process_update(req, tokens, ntokens, STORE_SET, data, data_len, rm);
+    } else if (ntokens >= 5 && 0 == strcmp(cmd, "add")) {
+        process_update(req, tokens, ntokens, STORE_ADD, data, data_len, rm);
+    } else if (ntokens >= 5 && 0 == strcmp(cmd, "replace")) {
+        process_update(req, tokens, ntokens, STORE_REPLACE, data, data_len, rm);
+    } else if (ntokens >= 5 && 0 == strcmp(cmd, "append")) {
+        process_update(req, tokens, ntokens, STORE_APPEND, data, data_len, rm);
+    } else if (ntokens >= 5 && 0 == strcmp(cmd, "prepend")) {
+        process_update(req, tokens, ntokens, STORE_PREPEND, data, data_len, rm);
+    } else if (ntokens >= 3 && 0 == strcmp(cmd, "incr")) {
+        process_delta(req, tokens, ntokens, 1);
+    } else if (ntokens >= 3 && 0 == strcmp(cmd, "decr")) {
+        process_delta(req, tokens, ntokens, 0);
+    } else if (ntokens >= 2 && 0 == strcmp(cmd, "delete")) {
+        process_delete(req, tokens, ntokens);
+    } else if (ntokens >= 2 && 0 == strcmp(cmd, "counter")) {
+        process_counter(req, tokens, ntokens);
+    } else if (ntokens >= 2 && 0 == strcmp(cmd, "stats") && 0 == strcmp(tokens[1].value, "hotkeys")) {
+        process_stats_hotkeys(req);
+    } else if (0 == strcmp(cmd, "stats")) {
+        process_stats(req);
+    } else {
+        reply_str(req, "ERROR\r\n");
+    }
+}
+
+void
+proto_process(struct request *req, char *buf, size_t len) {
+    proto_parse(req, buf, len);
+    proto_execute(req);
+}
+
+void
+proto_reply_too_large(struct request *req, const char *what) {
+    proto_release(req);
+    req->rlen = 0;
+
+    if (req->binary) {
+        size_t len = strlen(what);
+        char *body = bin_response(req, PROTOCOL_BINARY_RESPONSE_E2BIG, 0, 0, len);
+        memcpy(body, what, len);
+        bin_add(req, body + len);
+    } else {
+        int len = snprintf(req->rbuf, REPLY_SIZE, "SERVER_ERROR %s\r\n", what);
+        add_iov(req, req->rbuf, len);
+    }
+}
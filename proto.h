@@ -0,0 +1,211 @@
+/*
+ * Description: the memcached protocol engine, ASCII and binary, shared by
+ *              the transports, so all of them run the same parser and store
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "counters.h"
+#include "items.h"
+
+#define REPLY_SIZE 4096     /* the headers and trailers of a reply */
+#define MGET_MAX_KEYS 14    /* the keys of a multi-get */
+#define REPLY_MAX_IOV (2 * MGET_MAX_KEYS + 1)   /* 30 SGEs with the UD header */
+#define LINE_MAX_LENGTH 2048
+#define RDMA_HEAD '\x88'    /* the request carries "addr rkey length" of client memory */
+#define MAX_TOKENS 8
+
+typedef struct token_s {
+    char                    *value;
+    size_t                  length;
+} token_t;
+
+/* the client memory given by a RDMA_HEAD request */
+struct remote_mem {
+    uint64_t                addr;
+    uint32_t                rkey;
+    uint32_t                length;
+};
+
+/* one key of a multi-get */
+struct mget_key {
+    token_t                 key;
+    uint64_t                hv;
+    item_t                  *it;        /* referenced until finished */
+    uint8_t                 opcode;     /* binary GETQ or GETKQ */
+    uint32_t                opaque;
+};
+
+struct request;
+
+/* what a transport does for the engine */
+struct transport {
+    const char              *name;
+
+    /* send req->iov, then call finish */
+    void    (*send_reply)(struct request *req);
+
+    /* the request is done, the transport calls proto_release() and reuses
+     * its buffers */
+    void    (*finish)(struct request *req);
+
+    /* RDMA write local memory to the client, 0 on success; NULL when the
+     * transport has no remote memory access */
+    int     (*write_remote)(struct request *req, void *src, size_t len,
+                struct remote_mem *rm);
+
+    /* RDMA read client memory, proto_complete_update() follows; NULL when
+     * the transport has no remote memory access */
+    int     (*read_remote)(struct request *req, void *dst, size_t len,
+                struct remote_mem *rm);
+
+    /* the rkey of the counter region for RDMA atomics; NULL when the
+     * transport has no remote memory access */
+    uint32_t (*counters_rkey)(struct request *req);
+};
+
+/* the state of one request, it is finished only after its reply is sent */
+struct request {
+    const struct transport  *tp;
+    void                    *conn;      /* the connection of transport */
+    uint32_t                index;      /* the buffer of connection */
+
+    char                    *rbuf;      /* REPLY_SIZE bytes for headers and trailers */
+    struct iovec            iov[REPLY_MAX_IOV];
+    int                     niov;
+
+    item_t                  *it;        /* referenced until finished */
+    enum store_cmd          cmd;        /* waiting for the remote read */
+    int                     noreply;
+
+    /* from proto_parse() to proto_execute() */
+    token_t                 tokens[MAX_TOKENS];
+    size_t                  ntokens;
+    char                    *data;      /* the data block of a update */
+    size_t                  data_len;
+    struct remote_mem       remote;
+    int                     has_remote;
+    const char              *error;     /* the reply of a malformed request */
+    uint64_t                hv;         /* the hash of key, if there is a key */
+
+    /* binary requests, the key is tokens[1] */
+    int                     binary;
+    uint8_t                 opcode;
+    uint32_t                opaque;     /* echoed as is */
+    uint16_t                status;     /* the reply of a malformed request */
+    char                    *extras;
+    uint8_t                 extlen;
+
+    /* client key hashes verified on the connection, NULL without one */
+    uint32_t                *hashes_checked;
+
+    /* GETs of one key in a batch share the lookup of the first, see
+     * proto_coalesce() */
+    struct request          *leader;    /* the GET looking up for this one */
+    uint16_t                followers;  /* the GETs sharing this lookup */
+    item_t                  *shared;    /* referenced once for each follower */
+
+    /* a multi-get, "get <key>*" or a run of binary GETQ/GETKQ, is one
+     * request answered by one reply gathering the values in place. A run
+     * ends at the next binary request, which is parsed into the fields
+     * above and replies after the hits. */
+    struct mget_key         mget[MGET_MAX_KEYS];
+    int                     nmget;
+    size_t                  rlen;       /* the reply buffer taken by the hits */
+};
+
+/***************************************************************************//**
+ * Set the store of the calling worker, the worker owns the keys whose
+ * hash_partition() is part, a request of another key is refused
+ *
+ * @param[in] store     the store of partition
+ * @param[in] counters  the counters of partition, NULL if disabled
+ * @param[in] part      the partition of worker
+ * @param[in] nparts    the number of partitions, 1 when one worker owns all
+ *
+ ******************************************************************************/
+void proto_init(store_t *store, counters_t *counters, uint32_t part, uint32_t nparts);
+
+/***************************************************************************//**
+ * Set how far binary requests carrying the client hash of key are checked.
+ * The first checks of a connection are hashed again and refused on mismatch,
+ * the rest are trusted and skip hashing.
+ *
+ * @param[in] checks    0 to trust at once, UINT32_MAX to never trust
+ *
+ ******************************************************************************/
+void proto_set_hash_checks(uint32_t checks);
+
+/***************************************************************************//**
+ * Find the length of the first request in a stream, a run of binary quiet
+ * gets takes the request ending it, up to MGET_MAX_KEYS of them. Only the
+ * head of the stream is needed: the length of a request may be over len.
+ *
+ * @param[in] buf   the head of stream
+ * @param[in] len   the length of head
+ * @return          the length of request, data block included, 0 if the
+ *                  command line or binary header is not complete yet, -1
+ *                  if the line or the data block is too long
+ *
+ ******************************************************************************/
+long proto_request_length(const char *buf, size_t len);
+
+/***************************************************************************//**
+ * Process one complete request, the buffer is modified
+ *
+ * @param[in] req   the request, set up by the transport
+ * @param[in] buf   the request
+ * @param[in] len   the length of request
+ *
+ ******************************************************************************/
+void proto_process(struct request *req, char *buf, size_t len);
+
+/***************************************************************************//**
+ * proto_process() in stages for a batch of requests: parse and hash all of
+ * them, prefetch all buckets, prefetch all items, then execute them in order.
+ * The cache misses of lookups in a batch overlap instead of stalling one
+ * after another. The buffer must stay until the request is executed.
+ *
+ ******************************************************************************/
+void proto_parse(struct request *req, char *buf, size_t len);
+void proto_prefetch_bucket(struct request *req);
+void proto_prefetch_item(struct request *req);
+void proto_execute(struct request *req);
+
+/***************************************************************************//**
+ * Let the GETs of a parsed batch share one lookup per key, a GET follows the
+ * last GET of its key unless a other command on the key comes in between.
+ * Call it after proto_parse() and before the prefetches.
+ *
+ ******************************************************************************/
+void proto_coalesce(struct request **batch, int n);
+
+/***************************************************************************//**
+ * The value of a update has been read from client memory
+ *
+ ******************************************************************************/
+void proto_complete_update(struct request *req);
+
+/***************************************************************************//**
+ * Drop the item held by a finished request
+ *
+ ******************************************************************************/
+void proto_release(struct request *req);
+
+/***************************************************************************//**
+ * Replace the reply of req, which its transport can not carry, with a error
+ * saying what in the protocol of req. The transport sends it as the reply.
+ *
+ ******************************************************************************/
+void proto_reply_too_large(struct request *req, const char *what);
+
+/***************************************************************************//**
+ * Count connections of all transports for stats
+ *
+ ******************************************************************************/
+void proto_conn_opened();
+void proto_conn_closed();
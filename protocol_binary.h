@@ -141,7 +141,11 @@ extern "C"
      * See section 3.4 Data Types
      */
     typedef enum {
-        PROTOCOL_BINARY_RAW_BYTES = 0x00
+        PROTOCOL_BINARY_RAW_BYTES = 0x00,
+        /* An extension of this server, not in the specification: the extras
+         * start with the 64-bit hash64() of the key in network byte order,
+         * computed by the client so the server can skip hashing */
+        PROTOCOL_BINARY_KEY_HASH = 0x80
     } protocol_binary_datatypes;
 
     /**
@@ -0,0 +1,695 @@
+/***************************************************************************//**
+ * @file rdma_transport.c
+ * The rdma_cm transport, requests arrive in receive buffers and values are
+ * sent, RDMA written or RDMA read in place in the registered arena
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netdb.h>
+#include <unistd.h>
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+
+#include <event.h>
+
+#include "conntable.h"
+#include "proto.h"
+#include "transport.h"
+#include "wr_id.h"
+
+/***************************************************************************//**
+ * Settings
+ *
+ ******************************************************************************/
+
+#define REG_PER_CONN 256     /* requests a pipelining client keeps in flight */
+#define CQE_PER_CONN (REG_PER_CONN * 3) /* its receives, a RDMA write and a send each */
+#define POLL_WC_SIZE 128
+#define BUFF_SIZE 4096      /* a binary multi-get of MGET_MAX_KEYS long keys */
+#define MAX_CONNS 1024
+
+struct rdma_context {
+    struct ibv_context          **device_ctx_list;
+    struct ibv_context          *device_ctx;
+    struct ibv_comp_channel     *comp_channel;
+    struct ibv_pd               *pd;
+    struct ibv_cq               *cq;
+
+    struct rdma_event_channel   *cm_channel;
+    
+    struct rdma_cm_id           *listen_id;
+
+    struct event_base           *base;
+    struct event                listen_event;
+    struct event                poll_event;
+
+    conntable_t                 *conns;
+
+    store_t                     *store;
+    struct ibv_mr               *arena_mr;  /* the whole slab arena */
+
+    counters_t                  *counters;
+    struct ibv_mr               *counters_mr;
+};
+
+/* one per worker thread, a worker only touches its own connections */
+static __thread struct rdma_context rdma_ctx;
+
+struct rdma_conn {
+    struct rdma_cm_id       *id;
+    int                     slot;
+
+    struct ibv_mr           *smr;
+    char                    *sbuf;
+    size_t                  ssize;
+
+    struct ibv_mr           **rmr_list;
+    char                    **rbuf_list;
+    size_t                  rsize; 
+    size_t                  buff_list_size;
+
+    struct request          *req_list;  /* one for each receive buffer */
+    uint32_t                hashes_checked;
+
+    int                     total_recv;
+};
+
+
+static int      backlog = 1024;
+static int      cq_size = 4 * CQE_PER_CONN;    /* grows with the connections */
+static int      max_sge = 8;
+static __thread const char *port = NULL;
+static int      verbose = 0;
+
+int init_rdma_global_resources();
+int init_rdma_listen();
+int init_rdma_event();
+void release_conn(struct rdma_conn *c);
+int handle_connect_request(struct rdma_cm_id *id);
+struct request *handle_work_complete(struct ibv_wc *wc);
+void post_larger_memory(struct rdma_conn *c, uint32_t index);
+void finish_request(struct rdma_conn *c, uint32_t index);
+
+void rdma_cm_event_handle(int fd, short lib_event, void *arg);
+void poll_event_handle(int fd, short lib_event, void *arg);
+
+static const struct transport rdma_transport;
+
+/***************************************************************************//**
+ * Description 
+ * Init rdma global resources
+ *
+ ******************************************************************************/
+int
+init_rdma_global_resources() {
+    int num_device;
+    if ( !(rdma_ctx.device_ctx_list = rdma_get_devices(&num_device)) ) {
+        perror("rdma_get_devices()");
+        return -1;
+    }
+    if (0 == num_device) {
+        fprintf(stderr, "no RDMA device found\n");
+        return -1;
+    }
+    rdma_ctx.device_ctx = *rdma_ctx.device_ctx_list;
+    printf("Get device: %d\n", num_device); 
+
+    if ( !(rdma_ctx.comp_channel = ibv_create_comp_channel(rdma_ctx.device_ctx)) ) {
+        perror("ibv_create_comp_channel");
+        return -1;
+    }
+
+    if ( !(rdma_ctx.pd = ibv_alloc_pd(rdma_ctx.device_ctx)) ) {
+        perror("ibv_alloc_pd");
+        return -1;
+    }
+
+    if ( !(rdma_ctx.cq = ibv_create_cq(rdma_ctx.device_ctx, 
+                    cq_size, NULL, rdma_ctx.comp_channel, 0)) ) {
+        perror("ibv_create_cq");
+        return -1;
+    }
+
+    if (0 != ibv_req_notify_cq(rdma_ctx.cq, 0)) {
+        perror("ibv_reg_notify_cq");
+        return -1;
+    }
+
+    if ( !(rdma_ctx.conns = conntable_create(MAX_CONNS)) ) {
+        return -1;
+    }
+
+    /* register the arena once, any item can be sent, read or written in place */
+    if ( !(rdma_ctx.arena_mr = ibv_reg_mr(rdma_ctx.pd, rdma_ctx.store->slabs->base,
+                    rdma_ctx.store->slabs->limit, IBV_ACCESS_LOCAL_WRITE |
+                    IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE)) ) {
+        perror("ibv_reg_mr");
+        return -1;
+    }
+
+    /* clients add to the counters with atomics, and may read them */
+    if (rdma_ctx.counters && !(rdma_ctx.counters_mr = ibv_reg_mr(rdma_ctx.pd,
+                    rdma_ctx.counters->words, rdma_ctx.counters->size * sizeof(uint64_t),
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC)) ) {
+        perror("ibv_reg_mr");
+        return -1;
+    }
+
+    return 0;
+}
+
+/***************************************************************************//**
+ * Return
+ * 0 on success, -1 on failure
+ *
+ * Description
+ * Init resources required for listening, and build listeninng.
+ *
+ ******************************************************************************/
+int
+init_rdma_listen() {
+    if (0 != rdma_create_id(NULL, &rdma_ctx.listen_id, NULL, RDMA_PS_TCP)) {
+        perror("rdma_create_id()");
+        return -1;
+    }
+
+    struct rdma_addrinfo    hints,
+                            *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = RAI_PASSIVE;
+    hints.ai_port_space = RDMA_PS_TCP;
+    if (0 != rdma_getaddrinfo(NULL, port, &hints, &res)) {
+        perror("rdma_addrinfo");
+        return -1;
+    }
+    int ret = rdma_bind_addr(rdma_ctx.listen_id, res->ai_src_addr);
+    rdma_freeaddrinfo(res);
+    if (0 != ret) {
+        perror("rdma_bind_addr()");
+        return -1;
+    }
+
+    if ( !(rdma_ctx.cm_channel = rdma_create_event_channel() ) ) {
+        perror("rdma_create_event_channel");
+        return -1;
+    }
+
+    if (0 != rdma_migrate_id(rdma_ctx.listen_id, rdma_ctx.cm_channel)) {
+        perror("rdma_migrate_id");
+        return -1;
+    }
+
+    if (0 != rdma_listen(rdma_ctx.listen_id, backlog)) {
+        perror("rdma_listen");
+        return -1;
+    }
+
+    printf("Listening on RDMA port %d\n", ntohs(rdma_get_src_port(rdma_ctx.listen_id)) );
+
+    return 0;
+}
+
+/***************************************************************************//**
+ * Description
+ * Watch the cm channel and the completion channel in the event loop
+ *
+ ******************************************************************************/
+int
+init_rdma_event() {
+    memset(&rdma_ctx.listen_event, 0, sizeof(struct event));
+
+    event_set(&rdma_ctx.listen_event, rdma_ctx.cm_channel->fd, EV_READ | EV_PERSIST, 
+            rdma_cm_event_handle, NULL);
+    event_base_set(rdma_ctx.base, &rdma_ctx.listen_event);
+    if (-1 == event_add(&rdma_ctx.listen_event, NULL)) {
+        perror("event_add()");
+        return -1;
+    }
+
+    /* all connections share one cq, so one event polls for all of them */
+    event_set(&rdma_ctx.poll_event, rdma_ctx.comp_channel->fd, EV_READ | EV_PERSIST, 
+            poll_event_handle, NULL);
+    event_base_set(rdma_ctx.base, &rdma_ctx.poll_event);
+    if (-1 == event_add(&rdma_ctx.poll_event, NULL)) {
+        perror("event_add()");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/***************************************************************************//**
+ * Description
+ * Release cc, pd, cq
+ *
+ ******************************************************************************/
+void
+release_conn(struct rdma_conn *c) {
+    conntable_remove(rdma_ctx.conns, c->slot);
+
+    if (c->smr) rdma_dereg_mr(c->smr);
+    if (c->sbuf) free(c->sbuf);
+
+    int i = 0;
+    for (i = 0; i < c->buff_list_size; ++i) {
+        if (c->rmr_list[i]) rdma_dereg_mr(c->rmr_list[i]);
+        free(c->rbuf_list[i]);
+        if (c->req_list) {
+            proto_release(&c->req_list[i]);
+        }
+    }
+    if (c->rmr_list) free(c->rmr_list);
+    if (c->rbuf_list) free(c->rbuf_list);
+    if (c->req_list) free(c->req_list);
+
+    free(c);
+    proto_conn_closed();
+}
+
+/***************************************************************************//**
+ * Return
+ * 0 on success, -1 if the cq can not hold another connection
+ *
+ * Description
+ * Every connection of a worker completes into its one cq, which is resized
+ * before it could overrun. It is not shrunk as connections leave.
+ *
+ ******************************************************************************/
+static int
+fit_cq(size_t nconns) {
+    int need = (int)(nconns * CQE_PER_CONN);
+    if (need <= rdma_ctx.cq->cqe) return 0;
+
+    int size = 2 * rdma_ctx.cq->cqe > need ? 2 * rdma_ctx.cq->cqe : need;
+    if (0 != ibv_resize_cq(rdma_ctx.cq, size) && 0 != ibv_resize_cq(rdma_ctx.cq, need)) {
+        fprintf(stderr, "failed to resize the cq to %d entries for %zu connections\n", need, nconns);
+        return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************//**
+ * Return
+ * 0 on success, -1 after the request is rejected and all of it released
+ *
+ * Description
+ * Create qp with id, then complete the connection 
+ *
+ ******************************************************************************/
+int 
+handle_connect_request(struct rdma_cm_id *id) {
+    struct rdma_conn *c = calloc(1, sizeof(struct rdma_conn));
+    if (!c) {
+        rdma_reject(id, NULL, 0);
+        return -1;
+    }
+    c->id = id;
+    if (-1 == (c->slot = conntable_insert(rdma_ctx.conns, c))) {
+        free(c);
+        rdma_reject(id, NULL, 0);
+        return -1;
+    }
+    id->context = c;
+    proto_conn_opened();
+
+    if (0 != fit_cq(rdma_ctx.conns->used)) {
+        goto err;
+    }
+
+    struct ibv_qp_init_attr init_qp_attr;
+    memset(&init_qp_attr, 0, sizeof(init_qp_attr)); 
+    init_qp_attr.cap.max_send_wr = REG_PER_CONN * 2; /* RDMA write and send per request */
+    init_qp_attr.cap.max_recv_wr = REG_PER_CONN;
+    init_qp_attr.cap.max_send_sge = REPLY_MAX_IOV;   /* a multi-get gathers its hits */
+    init_qp_attr.cap.max_recv_sge = max_sge;
+    init_qp_attr.sq_sig_all = 1;
+    init_qp_attr.qp_type = IBV_QPT_RC;
+    init_qp_attr.send_cq = rdma_ctx.cq;
+    init_qp_attr.recv_cq = rdma_ctx.cq;
+
+    if (0 != rdma_create_qp(id, rdma_ctx.pd, &init_qp_attr)) {
+        perror("rdma_create_qp");
+        goto err;
+    }
+
+    c->rbuf_list = calloc(REG_PER_CONN, sizeof(char*));
+    c->rmr_list = calloc(REG_PER_CONN, sizeof(struct ibv_mr*));
+    c->req_list = calloc(REG_PER_CONN, sizeof(struct request));
+    if (!c->rbuf_list || !c->rmr_list || !c->req_list) {
+        goto err;
+    }
+    c->buff_list_size = REG_PER_CONN;
+    c->rsize = BUFF_SIZE;
+
+    /* one reply buffer for each receive buffer */
+    c->ssize = REPLY_SIZE * c->buff_list_size;
+    if ( !(c->sbuf = malloc(c->ssize)) ) {
+        goto err;
+    }
+    if ( !(c->smr = rdma_reg_msgs(id, c->sbuf, c->ssize)) ) {
+        perror("rdma_reg_msgs()");
+        goto err;
+    }
+
+    /* the receives are posted before the peer may send */
+    int i = 0;
+    for (i = 0; i < c->buff_list_size; ++i) {
+        c->req_list[i].tp = &rdma_transport;
+        c->req_list[i].conn = c;
+        c->req_list[i].index = i;
+        c->req_list[i].rbuf = c->sbuf + (size_t)i * REPLY_SIZE;
+        c->req_list[i].hashes_checked = &c->hashes_checked;
+
+        if ( !(c->rbuf_list[i] = malloc(c->rsize)) ) {
+            goto err;
+        }
+        if ( !(c->rmr_list[i] = rdma_reg_msgs(id, c->rbuf_list[i], c->rsize)) ) {
+            perror("rdma_reg_msgs()");
+            goto err;
+        }
+        if (0 != rdma_post_recv(id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_RECV, c->slot, i),
+                    c->rmr_list[i]->addr, c->rmr_list[i]->length, c->rmr_list[i])) {
+            perror("rdma_post_recv()");
+            goto err;
+        }
+    }
+
+    if (0 != rdma_accept(id, NULL)) {
+        perror("rdma_accept");
+        goto err;
+    }
+
+    return 0;
+
+err:
+    /* the qp goes first, it holds the receives on the buffers */
+    rdma_destroy_qp(id);
+    id->context = NULL;
+    release_conn(c);
+    rdma_reject(id, NULL, 0);
+    return -1;
+}
+
+/***************************************************************************//**
+ * Return
+ * the parsed request of a receive, which the caller executes, NULL otherwise
+ *
+ * Description
+ * Candle "work complete"
+ *
+ ******************************************************************************/
+struct request *
+handle_work_complete(struct ibv_wc *wc) {
+    /* everything comes from the wr_id, no lookup is needed */
+    int op = WR_ID_OP(wc->wr_id);
+    uint32_t index = WR_ID_INDEX(wc->wr_id);
+    struct rdma_conn *c = conntable_get(rdma_ctx.conns, WR_ID_SLOT(wc->wr_id));
+
+    if (!c) {
+        return NULL;
+    }
+
+    if (IBV_WC_SUCCESS != wc->status) {
+        printf("BAD WC [%d], op: %d\n", (int)wc->status, op);
+        if (WR_OP_RECV == op && IBV_WC_LOC_LEN_ERR == wc->status) {
+            post_larger_memory(c, index);
+        } else if (WR_OP_SEND == op || WR_OP_READ == op) {
+            finish_request(c, index);
+        }
+        return NULL;
+    }
+
+    if (WR_OP_RECV == op) {
+        struct ibv_mr *mr = c->rmr_list[index];
+
+        c->total_recv += 1;
+        if (c->total_recv % 1000 == 0 || verbose) {
+            printf("server has received %d : %.*s\n", c->total_recv, (int)wc->byte_len, (char*)mr->addr);
+        }
+
+        proto_parse(&c->req_list[index], mr->addr, wc->byte_len);
+        return &c->req_list[index];
+    }
+
+    struct request *req = &c->req_list[index];
+
+    switch (op) {
+        case WR_OP_SEND:
+            finish_request(c, index);
+            break;
+        case WR_OP_WRITE:
+            break;
+        case WR_OP_READ:
+            proto_complete_update(req);
+            break;
+        default:
+            break;
+    }
+    return NULL;
+}
+
+/***************************************************************************//**
+ * Description
+ * Replace the receive buffer at index with a larger one, and post it again
+ *
+ ******************************************************************************/
+void
+post_larger_memory(struct rdma_conn *c, uint32_t index) {
+    size_t large_size = c->rmr_list[index]->length * 20;
+    char *buff = malloc(large_size);
+    struct ibv_mr *new_mr = rdma_reg_msgs(c->id, buff, large_size);
+    if (!new_mr) {
+        perror("rdma_reg_msgs() in post_larger_memory()");
+        free(buff);
+        return;
+    }
+
+    rdma_dereg_mr(c->rmr_list[index]);
+    free(c->rbuf_list[index]);
+    c->rbuf_list[index] = buff;
+    c->rmr_list[index] = new_mr;
+
+    if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_RECV, c->slot, index),
+                new_mr->addr, new_mr->length, new_mr)) {
+        perror("rdma_post_recv() in post_larger_memory()");
+        return;
+    }
+}
+
+/***************************************************************************//**
+ * Description
+ * Drop the item held by the request, and give the receive buffer back
+ *
+ ******************************************************************************/
+void
+finish_request(struct rdma_conn *c, uint32_t index) {
+    struct ibv_mr *mr = c->rmr_list[index];
+
+    proto_release(&c->req_list[index]);
+
+    if (0 != rdma_post_recv(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_RECV, c->slot, index),
+                mr->addr, mr->length, mr)) {
+        perror("rdma_post_recv()");
+    }
+}
+
+/***************************************************************************//**
+ * The transport for the protocol engine, reply segments in the arena use the
+ * arena key, the others lie in the reply buffer of the connection
+ *
+ ******************************************************************************/
+static uint32_t
+lkey_of(struct rdma_conn *c, void *addr) {
+    return slabs_owns(rdma_ctx.store->slabs, addr) ? rdma_ctx.arena_mr->lkey : c->smr->lkey;
+}
+
+static void
+rdma_send_reply(struct request *req) {
+    struct rdma_conn *c = req->conn;
+    struct ibv_sge sge[REPLY_MAX_IOV];
+    int i = 0;
+
+    for (i = 0; i < req->niov; ++i) {
+        sge[i].addr = (uintptr_t)req->iov[i].iov_base;
+        sge[i].length = req->iov[i].iov_len;
+        sge[i].lkey = lkey_of(c, req->iov[i].iov_base);
+    }
+
+    if (0 != rdma_post_sendv(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_SEND, c->slot, req->index),
+                sge, req->niov, 0)) {
+        perror("rdma_post_sendv()");
+        finish_request(c, req->index);
+    }
+}
+
+static void
+rdma_finish(struct request *req) {
+    finish_request(req->conn, req->index);
+}
+
+static int
+rdma_write_remote(struct request *req, void *src, size_t len, struct remote_mem *rm) {
+    struct rdma_conn *c = req->conn;
+
+    if (0 != rdma_post_write(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_WRITE, c->slot, req->index),
+                src, len, rdma_ctx.arena_mr, 0, rm->addr, rm->rkey)) {
+        perror("rdma_post_write()");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+rdma_read_remote(struct request *req, void *dst, size_t len, struct remote_mem *rm) {
+    struct rdma_conn *c = req->conn;
+
+    if (0 != rdma_post_read(c->id, (void *)(uintptr_t)WR_ID_MAKE(WR_OP_READ, c->slot, req->index),
+                dst, len, rdma_ctx.arena_mr, 0, rm->addr, rm->rkey)) {
+        perror("rdma_post_read()");
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t
+rdma_counters_rkey(struct request *req) {
+    return rdma_ctx.counters_mr ? rdma_ctx.counters_mr->rkey : 0;
+}
+
+static const struct transport rdma_transport = {
+    .name           = "rdma",
+    .send_reply     = rdma_send_reply,
+    .finish         = rdma_finish,
+    .write_remote   = rdma_write_remote,
+    .read_remote    = rdma_read_remote,
+    .counters_rkey  = rdma_counters_rkey,
+};
+
+/***************************************************************************//**
+ * Description
+ *
+ ******************************************************************************/
+void 
+poll_event_handle(int fd, short lib_event, void *arg) {
+    //struct rdma_conn        *c = arg;
+    struct ibv_cq           *cq = NULL;
+    struct ibv_wc           wc[POLL_WC_SIZE];
+    struct request          *batch[POLL_WC_SIZE], *req = NULL;
+
+    int     cqe = 0, i = 0, n = 0;
+    void    *null = NULL;
+
+    memset(&cq, 0, sizeof(cq));
+    memset(wc, 0, sizeof(wc));
+
+    if (0 != ibv_get_cq_event(rdma_ctx.comp_channel, &cq, &null)) {
+        perror("ibv_get_cq_event");
+        return;
+    }
+    ibv_ack_cq_events(cq, 1);
+
+    if (0 != ibv_req_notify_cq(cq, 0)) {
+        perror("ibv_reg_notify_cq");
+        return;
+    }
+
+    do {
+        if ( -1 == (cqe = ibv_poll_cq(cq, POLL_WC_SIZE, wc)) ) {
+            perror("ibv_poll_cq");
+            return;
+        }
+
+        /* the requests of a batch run in stages, see proto_parse() */
+        for (i = 0, n = 0; i < cqe; ++i) {
+            if ( (req = handle_work_complete(&wc[i])) ) {
+                batch[n++] = req;
+            }
+        }
+        proto_coalesce(batch, n);
+        for (i = 0; i < n; ++i) {
+            proto_prefetch_bucket(batch[i]);
+        }
+        for (i = 0; i < n; ++i) {
+            proto_prefetch_item(batch[i]);
+        }
+        for (i = 0; i < n; ++i) {
+            proto_execute(batch[i]);
+        }
+    } while (cqe == POLL_WC_SIZE);
+}
+
+/***************************************************************************//**
+ * Description
+ *
+ ******************************************************************************/
+void 
+rdma_cm_event_handle(int fd, short lib_event, void *arg) {
+    struct rdma_cm_event    *cm_event = NULL;
+    struct rdma_conn        *c = NULL;
+
+    if (0 != rdma_get_cm_event(rdma_ctx.cm_channel, &cm_event)) {
+        perror("rdma_get_cm_event");
+        return;
+    }
+    printf("%s\n", rdma_event_str(cm_event->event));
+
+    c = cm_event->id->context;
+
+    switch (cm_event->event) {
+        case RDMA_CM_EVENT_CONNECT_REQUEST:
+            handle_connect_request(cm_event->id);   /* rejects the id if it fails */
+            break;
+
+        case RDMA_CM_EVENT_ESTABLISHED:
+            break;
+
+        case RDMA_CM_EVENT_DISCONNECTED:
+            if (c) {
+                printf("total recv: %d\n", c->total_recv);
+                release_conn(c);
+            }
+            break;
+
+        case RDMA_CM_EVENT_ADDR_ERROR:
+        case RDMA_CM_EVENT_ROUTE_ERROR:
+        case RDMA_CM_EVENT_CONNECT_ERROR:
+        case RDMA_CM_EVENT_UNREACHABLE:
+        case RDMA_CM_EVENT_REJECTED:
+            printf("CM event error: %d\n", cm_event->status);
+            break;
+
+        default:
+            printf("Ingoring this event\n");
+            break;
+    }
+
+    rdma_ack_cm_event(cm_event);
+}
+
+/***************************************************************************//**
+ * Return
+ * 0 on success, -1 if RDMA is unavailable
+ *
+ * Description
+ * Listen on rdma_cm in the event loop of base
+ *
+ ******************************************************************************/
+int
+rdma_transport_init(struct event_base *base, store_t *store, counters_t *counters,
+        const char *rdma_port, int verbosity) {
+    memset(&rdma_ctx, 0, sizeof(struct rdma_context));
+    rdma_ctx.base = base;
+    rdma_ctx.store = store;
+    rdma_ctx.counters = counters;
+    port = rdma_port;
+    verbose = verbosity;
+
+    if (0 != init_rdma_global_resources()) return -1;
+    if (0 != init_rdma_listen()) return -1;
+    return init_rdma_event();
+}
@@ -0,0 +1,36 @@
+
+#include <stdio.h>
+#include <string.h>
+#include "servers.h"
+
+/*******************************************************************************/
+
+int servers_parse(const char *list, const char *port, struct server_addr *servers, int max) {
+    int n = 0;
+
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        const char *colon = memchr(list, ':', len);
+        size_t nhost = colon ? (size_t)(colon - list) : len;
+        size_t nport = colon ? len - nhost - 1 : strlen(port);
+
+        if (n == max || 0 == nhost || nhost >= sizeof(servers[n].host)
+                || 0 == nport || nport >= sizeof(servers[n].port)) {
+            fprintf(stderr, "bad server list at \"%s\"\n", list);
+            return -1;
+        }
+        memcpy(servers[n].host, list, nhost);
+        servers[n].host[nhost] = '\0';
+        memcpy(servers[n].port, colon ? colon + 1 : port, nport);
+        servers[n].port[nport] = '\0';
+        n += 1;
+
+        list += len;
+        if (',' == *list) ++list;
+    }
+    if (0 == n) {
+        fprintf(stderr, "no server given\n");
+        return -1;
+    }
+    return n;
+}
@@ -0,0 +1,25 @@
+/*
+ * Description: the servers a client spreads its connections over, given as
+ *              "host[:port][,host[:port]]*" to -s
+ */
+
+#pragma once
+
+#define SERVERS_MAX     64
+
+struct server_addr {
+    char    host[64];
+    char    port[16];
+};
+
+/***************************************************************************//**
+ * Parse a list of servers
+ *
+ * @param[in]  list     "host[:port]" separated by ','
+ * @param[in]  port     the port of a server given without one
+ * @param[out] servers  the servers
+ * @param[in]  max      the room of servers
+ * @return              the number of servers, -1 if the list is malformed
+ *
+ ******************************************************************************/
+int servers_parse(const char *list, const char *port, struct server_addr *servers, int max);
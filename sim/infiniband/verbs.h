@@ -0,0 +1,346 @@
+/*
+ * Description: the verbs of the simulated RDMA device, a subset of the
+ *              libibverbs API large enough for the server and clients here.
+ *              Build with "make SIM=1" to use it instead of libibverbs.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+
+#define SIM_VERBS 1
+
+/***************************************************************************//**
+ * Enums
+ *
+ ******************************************************************************/
+
+enum ibv_qp_type {
+    IBV_QPT_RC = 2,
+    IBV_QPT_UC,
+    IBV_QPT_UD,
+};
+
+enum ibv_access_flags {
+    IBV_ACCESS_LOCAL_WRITE   = 1,
+    IBV_ACCESS_REMOTE_WRITE  = (1 << 1),
+    IBV_ACCESS_REMOTE_READ   = (1 << 2),
+    IBV_ACCESS_REMOTE_ATOMIC = (1 << 3),
+};
+
+enum ibv_wc_status {
+    IBV_WC_SUCCESS,
+    IBV_WC_LOC_LEN_ERR,
+    IBV_WC_LOC_QP_OP_ERR,
+    IBV_WC_LOC_EEC_OP_ERR,
+    IBV_WC_LOC_PROT_ERR,
+    IBV_WC_WR_FLUSH_ERR,
+    IBV_WC_MW_BIND_ERR,
+    IBV_WC_BAD_RESP_ERR,
+    IBV_WC_LOC_ACCESS_ERR,
+    IBV_WC_REM_INV_REQ_ERR,
+    IBV_WC_REM_ACCESS_ERR,
+    IBV_WC_REM_OP_ERR,
+    IBV_WC_RETRY_EXC_ERR,
+    IBV_WC_RNR_RETRY_EXC_ERR,
+    IBV_WC_GENERAL_ERR = 21,
+};
+
+enum ibv_wc_opcode {
+    IBV_WC_SEND,
+    IBV_WC_RDMA_WRITE,
+    IBV_WC_RDMA_READ,
+    IBV_WC_COMP_SWAP,
+    IBV_WC_FETCH_ADD,
+    IBV_WC_BIND_MW,
+    IBV_WC_RECV = 1 << 7,
+    IBV_WC_RECV_RDMA_WITH_IMM,
+};
+
+enum ibv_wc_flags {
+    IBV_WC_GRH      = 1 << 0,
+    IBV_WC_WITH_IMM = 1 << 1,
+};
+
+enum ibv_wr_opcode {
+    IBV_WR_RDMA_WRITE,
+    IBV_WR_RDMA_WRITE_WITH_IMM,
+    IBV_WR_SEND,
+    IBV_WR_SEND_WITH_IMM,
+    IBV_WR_RDMA_READ,
+    IBV_WR_ATOMIC_CMP_AND_SWP,
+    IBV_WR_ATOMIC_FETCH_AND_ADD,
+};
+
+enum ibv_qp_state {
+    IBV_QPS_RESET,
+    IBV_QPS_INIT,
+    IBV_QPS_RTR,
+    IBV_QPS_RTS,
+    IBV_QPS_SQD,
+    IBV_QPS_SQE,
+    IBV_QPS_ERR,
+};
+
+enum ibv_qp_attr_mask {
+    IBV_QP_STATE        = 1 << 0,
+    IBV_QP_ACCESS_FLAGS = 1 << 3,
+    IBV_QP_PKEY_INDEX   = 1 << 4,
+    IBV_QP_PORT         = 1 << 5,
+    IBV_QP_QKEY         = 1 << 6,
+    IBV_QP_RQ_PSN       = 1 << 12,
+    IBV_QP_SQ_PSN       = 1 << 16,
+    IBV_QP_DEST_QPN     = 1 << 20,
+};
+
+enum ibv_mtu {
+    IBV_MTU_256  = 1,
+    IBV_MTU_512  = 2,
+    IBV_MTU_1024 = 3,
+    IBV_MTU_2048 = 4,
+    IBV_MTU_4096 = 5,
+};
+
+enum ibv_port_state {
+    IBV_PORT_NOP,
+    IBV_PORT_DOWN,
+    IBV_PORT_INIT,
+    IBV_PORT_ARMED,
+    IBV_PORT_ACTIVE,
+};
+
+enum ibv_send_flags {
+    IBV_SEND_FENCE     = 1 << 0,
+    IBV_SEND_SIGNALED  = 1 << 1,
+    IBV_SEND_SOLICITED = 1 << 2,
+    IBV_SEND_INLINE    = 1 << 3,
+};
+
+/***************************************************************************//**
+ * Objects, the simulator keeps its own state behind each of them
+ *
+ ******************************************************************************/
+
+struct ibv_context {
+    const char              *name;
+};
+
+struct ibv_port_attr {
+    enum ibv_port_state     state;
+    enum ibv_mtu            max_mtu;
+    enum ibv_mtu            active_mtu;
+    uint16_t                lid;
+};
+
+struct ibv_pd {
+    struct ibv_context      *context;
+    uint32_t                handle;
+};
+
+struct ibv_mr {
+    struct ibv_context      *context;
+    struct ibv_pd           *pd;
+    void                    *addr;
+    size_t                  length;
+    uint32_t                handle;
+    uint32_t                lkey;
+    uint32_t                rkey;
+};
+
+struct ibv_comp_channel {
+    struct ibv_context      *context;
+    int                     fd;
+    int                     refcnt;
+};
+
+struct ibv_cq {
+    struct ibv_context      *context;
+    struct ibv_comp_channel *channel;
+    void                    *cq_context;
+    int                     cqe;
+};
+
+struct ibv_srq {
+    struct ibv_context      *context;
+    void                    *srq_context;
+    struct ibv_pd           *pd;
+};
+
+struct ibv_qp {
+    struct ibv_context      *context;
+    void                    *qp_context;
+    struct ibv_pd           *pd;
+    struct ibv_cq           *send_cq;
+    struct ibv_cq           *recv_cq;
+    struct ibv_srq          *srq;
+    uint32_t                qp_num;
+    enum ibv_qp_type        qp_type;
+};
+
+struct ibv_ah_attr {
+    uint16_t                dlid;
+    uint8_t                 sl;
+    uint8_t                 src_path_bits;
+    uint8_t                 static_rate;
+    uint8_t                 is_global;
+    uint8_t                 port_num;
+};
+
+/* the space at the head of every UD receive buffer */
+struct ibv_grh {
+    uint32_t                version_tclass_flow;
+    uint16_t                paylen;
+    uint8_t                 next_hdr;
+    uint8_t                 hop_limit;
+    uint8_t                 sgid[16];
+    uint8_t                 dgid[16];
+};
+
+struct ibv_ah {
+    struct ibv_context      *context;
+    struct ibv_pd           *pd;
+    uint32_t                handle;
+};
+
+/***************************************************************************//**
+ * Work requests and completions
+ *
+ ******************************************************************************/
+
+struct ibv_sge {
+    uint64_t                addr;
+    uint32_t                length;
+    uint32_t                lkey;
+};
+
+struct ibv_send_wr {
+    uint64_t                wr_id;
+    struct ibv_send_wr      *next;
+    struct ibv_sge          *sg_list;
+    int                     num_sge;
+    enum ibv_wr_opcode      opcode;
+    unsigned int            send_flags;
+    uint32_t                imm_data;
+    union {
+        struct {
+            uint64_t        remote_addr;
+            uint32_t        rkey;
+        } rdma;
+        struct {
+            uint64_t        remote_addr;
+            uint64_t        compare_add;
+            uint64_t        swap;
+            uint32_t        rkey;
+        } atomic;
+        struct {
+            struct ibv_ah   *ah;
+            uint32_t        remote_qpn;
+            uint32_t        remote_qkey;
+        } ud;
+    } wr;
+};
+
+struct ibv_recv_wr {
+    uint64_t                wr_id;
+    struct ibv_recv_wr      *next;
+    struct ibv_sge          *sg_list;
+    int                     num_sge;
+};
+
+struct ibv_wc {
+    uint64_t                wr_id;
+    enum ibv_wc_status      status;
+    enum ibv_wc_opcode      opcode;
+    uint32_t                vendor_err;
+    uint32_t                byte_len;
+    uint32_t                imm_data;
+    uint32_t                qp_num;
+    uint32_t                src_qp;
+    unsigned int            wc_flags;
+    uint16_t                pkey_index;
+    uint16_t                slid;
+    uint8_t                 sl;
+    uint8_t                 dlid_path_bits;
+};
+
+struct ibv_qp_cap {
+    uint32_t                max_send_wr;
+    uint32_t                max_recv_wr;
+    uint32_t                max_send_sge;
+    uint32_t                max_recv_sge;
+    uint32_t                max_inline_data;
+};
+
+struct ibv_qp_init_attr {
+    void                    *qp_context;
+    struct ibv_cq           *send_cq;
+    struct ibv_cq           *recv_cq;
+    struct ibv_srq          *srq;
+    struct ibv_qp_cap       cap;
+    enum ibv_qp_type        qp_type;
+    int                     sq_sig_all;
+};
+
+struct ibv_qp_attr {
+    enum ibv_qp_state       qp_state;
+    uint32_t                qkey;
+    uint32_t                rq_psn;
+    uint32_t                sq_psn;
+    uint32_t                dest_qp_num;
+    int                     qp_access_flags;
+    uint16_t                pkey_index;
+    uint8_t                 port_num;
+};
+
+struct ibv_srq_attr {
+    uint32_t                max_wr;
+    uint32_t                max_sge;
+    uint32_t                srq_limit;
+};
+
+struct ibv_srq_init_attr {
+    void                    *srq_context;
+    struct ibv_srq_attr     attr;
+};
+
+/***************************************************************************//**
+ * Verbs
+ *
+ ******************************************************************************/
+
+int ibv_query_port(struct ibv_context *context, uint8_t port_num, struct ibv_port_attr *port_attr);
+
+struct ibv_pd *ibv_alloc_pd(struct ibv_context *context);
+int ibv_dealloc_pd(struct ibv_pd *pd);
+
+struct ibv_mr *ibv_reg_mr(struct ibv_pd *pd, void *addr, size_t length, int access);
+int ibv_dereg_mr(struct ibv_mr *mr);
+
+struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context);
+int ibv_destroy_comp_channel(struct ibv_comp_channel *channel);
+
+struct ibv_cq *ibv_create_cq(struct ibv_context *context, int cqe, void *cq_context,
+        struct ibv_comp_channel *channel, int comp_vector);
+int ibv_destroy_cq(struct ibv_cq *cq);
+int ibv_resize_cq(struct ibv_cq *cq, int cqe);
+int ibv_req_notify_cq(struct ibv_cq *cq, int solicited_only);
+int ibv_get_cq_event(struct ibv_comp_channel *channel, struct ibv_cq **cq, void **cq_context);
+void ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents);
+int ibv_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc);
+
+struct ibv_srq *ibv_create_srq(struct ibv_pd *pd, struct ibv_srq_init_attr *srq_init_attr);
+int ibv_destroy_srq(struct ibv_srq *srq);
+int ibv_post_srq_recv(struct ibv_srq *srq, struct ibv_recv_wr *recv_wr, struct ibv_recv_wr **bad_recv_wr);
+
+struct ibv_qp *ibv_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr);
+int ibv_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask);
+int ibv_destroy_qp(struct ibv_qp *qp);
+int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr);
+int ibv_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr);
+
+struct ibv_ah *ibv_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr);
+struct ibv_ah *ibv_create_ah_from_wc(struct ibv_pd *pd, struct ibv_wc *wc, struct ibv_grh *grh,
+        uint8_t port_num);
+int ibv_destroy_ah(struct ibv_ah *ah);
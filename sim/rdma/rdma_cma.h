@@ -0,0 +1,142 @@
+/*
+ * Description: the connection manager of the simulated RDMA device. A port
+ *              is a unix socket in the abstract namespace, so any process on
+ *              the host can connect to it, the IP address is not used.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <infiniband/verbs.h>
+
+enum rdma_port_space {
+    RDMA_PS_IPOIB = 0x0002,
+    RDMA_PS_TCP   = 0x0106,
+    RDMA_PS_UDP   = 0x0111,
+};
+
+enum rdma_cm_event_type {
+    RDMA_CM_EVENT_ADDR_RESOLVED,
+    RDMA_CM_EVENT_ADDR_ERROR,
+    RDMA_CM_EVENT_ROUTE_RESOLVED,
+    RDMA_CM_EVENT_ROUTE_ERROR,
+    RDMA_CM_EVENT_CONNECT_REQUEST,
+    RDMA_CM_EVENT_CONNECT_RESPONSE,
+    RDMA_CM_EVENT_CONNECT_ERROR,
+    RDMA_CM_EVENT_UNREACHABLE,
+    RDMA_CM_EVENT_REJECTED,
+    RDMA_CM_EVENT_ESTABLISHED,
+    RDMA_CM_EVENT_DISCONNECTED,
+    RDMA_CM_EVENT_DEVICE_REMOVAL,
+};
+
+#define RAI_PASSIVE 0x00000001
+
+/* the qkey of QPs on RDMA_PS_UDP ids */
+#define RDMA_UDP_QKEY 0x01234567
+
+struct rdma_event_channel {
+    int                         fd;
+};
+
+struct rdma_cm_id {
+    struct ibv_context          *verbs;
+    struct rdma_event_channel   *channel;
+    void                        *context;
+    struct ibv_qp               *qp;
+    enum rdma_port_space        ps;
+    uint8_t                     port_num;
+    struct ibv_comp_channel     *send_cq_channel;
+    struct ibv_cq               *send_cq;
+    struct ibv_comp_channel     *recv_cq_channel;
+    struct ibv_cq               *recv_cq;
+    struct ibv_srq              *srq;
+    struct ibv_pd               *pd;
+    enum ibv_qp_type            qp_type;
+};
+
+struct rdma_conn_param {
+    const void                  *private_data;
+    uint8_t                     private_data_len;
+    uint8_t                     responder_resources;
+    uint8_t                     initiator_depth;
+    uint8_t                     flow_control;
+    uint8_t                     retry_count;
+    uint8_t                     rnr_retry_count;
+    uint8_t                     srq;
+    uint32_t                    qp_num;
+};
+
+/* what a UDP id learns of the remote QP when it connects */
+struct rdma_ud_param {
+    const void                  *private_data;
+    uint8_t                     private_data_len;
+    struct ibv_ah_attr          ah_attr;
+    uint32_t                    qp_num;
+    uint32_t                    qkey;
+};
+
+struct rdma_cm_event {
+    struct rdma_cm_id           *id;
+    struct rdma_cm_id           *listen_id;
+    enum rdma_cm_event_type     event;
+    int                         status;
+    union {
+        struct rdma_conn_param  conn;
+        struct rdma_ud_param    ud;
+    } param;
+};
+
+struct rdma_addrinfo {
+    int                         ai_flags;
+    int                         ai_family;
+    int                         ai_qp_type;
+    int                         ai_port_space;
+    socklen_t                   ai_src_len;
+    socklen_t                   ai_dst_len;
+    struct sockaddr             *ai_src_addr;
+    struct sockaddr             *ai_dst_addr;
+    char                        *ai_src_canonname;
+    char                        *ai_dst_canonname;
+    size_t                      ai_route_len;
+    void                        *ai_route;
+    size_t                      ai_connect_len;
+    void                        *ai_connect;
+    struct rdma_addrinfo        *ai_next;
+};
+
+struct ibv_context **rdma_get_devices(int *num_devices);
+void rdma_free_devices(struct ibv_context **list);
+
+struct rdma_event_channel *rdma_create_event_channel(void);
+void rdma_destroy_event_channel(struct rdma_event_channel *channel);
+int rdma_get_cm_event(struct rdma_event_channel *channel, struct rdma_cm_event **event);
+int rdma_ack_cm_event(struct rdma_cm_event *event);
+const char *rdma_event_str(enum rdma_cm_event_type event);
+
+int rdma_create_id(struct rdma_event_channel *channel, struct rdma_cm_id **id, void *context,
+        enum rdma_port_space ps);
+int rdma_destroy_id(struct rdma_cm_id *id);
+int rdma_migrate_id(struct rdma_cm_id *id, struct rdma_event_channel *channel);
+
+int rdma_getaddrinfo(const char *node, const char *service, const struct rdma_addrinfo *hints,
+        struct rdma_addrinfo **res);
+void rdma_freeaddrinfo(struct rdma_addrinfo *res);
+
+int rdma_bind_addr(struct rdma_cm_id *id, struct sockaddr *addr);
+int rdma_listen(struct rdma_cm_id *id, int backlog);
+int rdma_resolve_addr(struct rdma_cm_id *id, struct sockaddr *src_addr, struct sockaddr *dst_addr,
+        int timeout_ms);
+int rdma_resolve_route(struct rdma_cm_id *id, int timeout_ms);
+int rdma_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr);
+void rdma_destroy_qp(struct rdma_cm_id *id);
+int rdma_connect(struct rdma_cm_id *id, struct rdma_conn_param *conn_param);
+int rdma_accept(struct rdma_cm_id *id, struct rdma_conn_param *conn_param);
+int rdma_reject(struct rdma_cm_id *id, const void *private_data, uint8_t private_data_len);
+int rdma_disconnect(struct rdma_cm_id *id);
+
+uint16_t rdma_get_src_port(struct rdma_cm_id *id);
+uint16_t rdma_get_dst_port(struct rdma_cm_id *id);
@@ -0,0 +1,137 @@
+/*
+ * Description: the rdma_cm helpers over the simulated verbs, as librdmacm
+ *              defines them over libibverbs
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <rdma/rdma_cma.h>
+
+static inline struct ibv_mr *
+rdma_reg_msgs(struct rdma_cm_id *id, void *addr, size_t length) {
+    return ibv_reg_mr(id->pd, addr, length, IBV_ACCESS_LOCAL_WRITE);
+}
+
+static inline struct ibv_mr *
+rdma_reg_read(struct rdma_cm_id *id, void *addr, size_t length) {
+    return ibv_reg_mr(id->pd, addr, length, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+}
+
+static inline struct ibv_mr *
+rdma_reg_write(struct rdma_cm_id *id, void *addr, size_t length) {
+    return ibv_reg_mr(id->pd, addr, length, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+}
+
+static inline int
+rdma_dereg_mr(struct ibv_mr *mr) {
+    return ibv_dereg_mr(mr);
+}
+
+static inline int
+rdma_post_recvv(struct rdma_cm_id *id, void *context, struct ibv_sge *sgl, int nsge) {
+    struct ibv_recv_wr wr, *bad;
+
+    wr.wr_id = (uintptr_t)context;
+    wr.next = NULL;
+    wr.sg_list = sgl;
+    wr.num_sge = nsge;
+
+    if (id->srq) return ibv_post_srq_recv(id->srq, &wr, &bad);
+    return ibv_post_recv(id->qp, &wr, &bad);
+}
+
+static inline int
+rdma_post_sendv(struct rdma_cm_id *id, void *context, struct ibv_sge *sgl, int nsge, int flags) {
+    struct ibv_send_wr wr, *bad;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)context;
+    wr.sg_list = sgl;
+    wr.num_sge = nsge;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = flags;
+
+    return ibv_post_send(id->qp, &wr, &bad);
+}
+
+static inline int
+rdma_post_readv(struct rdma_cm_id *id, void *context, struct ibv_sge *sgl, int nsge, int flags,
+        uint64_t remote_addr, uint32_t rkey) {
+    struct ibv_send_wr wr, *bad;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)context;
+    wr.sg_list = sgl;
+    wr.num_sge = nsge;
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.send_flags = flags;
+    wr.wr.rdma.remote_addr = remote_addr;
+    wr.wr.rdma.rkey = rkey;
+
+    return ibv_post_send(id->qp, &wr, &bad);
+}
+
+static inline int
+rdma_post_writev(struct rdma_cm_id *id, void *context, struct ibv_sge *sgl, int nsge, int flags,
+        uint64_t remote_addr, uint32_t rkey) {
+    struct ibv_send_wr wr, *bad;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)context;
+    wr.sg_list = sgl;
+    wr.num_sge = nsge;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = flags;
+    wr.wr.rdma.remote_addr = remote_addr;
+    wr.wr.rdma.rkey = rkey;
+
+    return ibv_post_send(id->qp, &wr, &bad);
+}
+
+static inline int
+rdma_post_recv(struct rdma_cm_id *id, void *context, void *addr, size_t length, struct ibv_mr *mr) {
+    struct ibv_sge sge = { (uintptr_t)addr, (uint32_t)length, mr ? mr->lkey : 0 };
+    return rdma_post_recvv(id, context, &sge, 1);
+}
+
+static inline int
+rdma_post_send(struct rdma_cm_id *id, void *context, void *addr, size_t length,
+        struct ibv_mr *mr, int flags) {
+    struct ibv_sge sge = { (uintptr_t)addr, (uint32_t)length, mr ? mr->lkey : 0 };
+    return rdma_post_sendv(id, context, &sge, 1, flags);
+}
+
+static inline int
+rdma_post_read(struct rdma_cm_id *id, void *context, void *addr, size_t length,
+        struct ibv_mr *mr, int flags, uint64_t remote_addr, uint32_t rkey) {
+    struct ibv_sge sge = { (uintptr_t)addr, (uint32_t)length, mr->lkey };
+    return rdma_post_readv(id, context, &sge, 1, flags, remote_addr, rkey);
+}
+
+static inline int
+rdma_post_write(struct rdma_cm_id *id, void *context, void *addr, size_t length,
+        struct ibv_mr *mr, int flags, uint64_t remote_addr, uint32_t rkey) {
+    struct ibv_sge sge = { (uintptr_t)addr, (uint32_t)length, mr ? mr->lkey : 0 };
+    return rdma_post_writev(id, context, &sge, 1, flags, remote_addr, rkey);
+}
+
+static inline int
+rdma_post_ud_send(struct rdma_cm_id *id, void *context, void *addr, size_t length,
+        struct ibv_mr *mr, int flags, struct ibv_ah *ah, uint32_t remote_qpn) {
+    struct ibv_sge sge = { (uintptr_t)addr, (uint32_t)length, mr ? mr->lkey : 0 };
+    struct ibv_send_wr wr, *bad;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)context;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = flags;
+    wr.wr.ud.ah = ah;
+    wr.wr.ud.remote_qpn = remote_qpn;
+    wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
+
+    return ibv_post_send(id->qp, &wr, &bad);
+}
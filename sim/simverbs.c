@@ -0,0 +1,1842 @@
+/*
+ * Description: a simulated RDMA device. Every QP is a unix stream socket
+ *              connected to its peer QP, in the same process or another one,
+ *              and a NIC thread per process plays the responder: it places
+ *              SENDs into posted receives, serves RDMA READ, WRITE and the
+ *              8-byte atomics against registered memory and completes the work requests of its own
+ *              QPs in order. UD QPs share one datagram socket per process,
+ *              whose number is the LID of process.
+ *
+ *              SIMVERBS_LATENCY_US and SIMVERBS_GBPS set the one way latency
+ *              and the bandwidth of the link, SIMVERBS_UD_LOSS the share of
+ *              UD datagrams dropped, all are off by default. SIMVERBS_UD_MTU
+ *              sets the active MTU of the port, 4096 by default.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include <infiniband/verbs.h>
+#include <rdma/rdma_cma.h>
+
+/*******************************************************************************/
+
+#define SIM_MAX_SGE     32
+#define SIM_MAX_QPS     4096        /* per process, the low bits of qp_num */
+#define SIM_MAX_LISTENS 64
+#define SIM_MR_BITS     20          /* the slot bits of a key, a generation above */
+#define SIM_QP_BASE     0x100       /* qp_num 0 and 1 are special in verbs */
+#define SIM_UD_MTU      4096
+#define SIM_GRH_SIZE    40
+
+#define MTU_BYTES(mtu)  (128 << (mtu))
+
+/* epoll tags, the kind in high 32 bits */
+#define TAG_TIMER       1ULL
+#define TAG_LISTEN      2ULL
+#define TAG_QP          3ULL
+#define TAG_UD          4ULL
+#define TAG(kind, n)    (((kind) << 32) | (uint32_t)(n))
+
+enum pkt_type {
+    PKT_DONE = 0,       /* an answer taken out of order, see qp_input_answers() */
+    PKT_CONN_REQ,
+    PKT_CONN_REP,
+    PKT_CONN_REJ,
+    PKT_SEND,
+    PKT_WRITE,
+    PKT_READ_REQ,
+    PKT_READ_RESP,
+    PKT_ATOMIC_REQ,     /* compare_add and swap follow, the answer is a READ_RESP */
+    PKT_ACK,
+    PKT_UD_SEND,
+};
+
+/* the header of every packet on a link, len bytes of payload follow */
+struct pkt_hdr {
+    uint32_t    type;
+    uint32_t    status;         /* ACK and READ_RESP, a ibv_wc_status */
+    uint32_t    len;
+    uint32_t    rkey;
+    uint32_t    qp_num;         /* the sender */
+    uint32_t    read_len;
+    uint64_t    remote_addr;
+    uint64_t    deliver_ns;     /* CLOCK_MONOTONIC, the link model */
+    uint32_t    dst_qpn;        /* UD and the connection manager */
+    uint32_t    qkey;
+    uint32_t    lid;            /* the sender */
+    uint32_t    atomic_op;      /* ATOMIC_REQ, a ibv_wr_opcode */
+};
+
+/* a byte queue of a socket */
+struct sim_buf {
+    char        *data;
+    size_t      head;
+    size_t      tail;
+    size_t      cap;
+};
+
+/* a posted receive */
+struct sim_wqe {
+    uint64_t    wr_id;
+    int         num_sge;
+    struct ibv_sge sge[SIM_MAX_SGE];
+};
+
+/* a receive queue of a QP or a SRQ */
+struct sim_rq {
+    struct sim_wqe  *ring;
+    uint32_t        size;
+    uint32_t        head;
+    uint32_t        count;
+};
+
+/* a work request waiting for the responder */
+struct sim_pending {
+    uint64_t        wr_id;
+    enum ibv_wc_opcode opcode;
+    int             signaled;
+    uint32_t        byte_len;
+    int             num_sge;    /* RDMA READ and atomics scatter the response */
+    struct ibv_sge  sge[SIM_MAX_SGE];
+};
+
+struct sim_cq {
+    struct ibv_cq   cq;
+    struct ibv_wc   *ring;
+    uint32_t        size;
+    uint32_t        head;
+    uint32_t        count;
+    int             armed;
+    int             overrun;    /* warned once the ring outgrew cq.cqe */
+};
+
+/* the completion channel, ibv_get_cq_event() reads one cq pointer per event */
+struct sim_comp_channel {
+    struct ibv_comp_channel channel;
+    int             wfd;
+};
+
+struct sim_srq {
+    struct ibv_srq  srq;
+    struct sim_rq   rq;
+};
+
+struct sim_id;
+
+struct sim_qp {
+    struct ibv_qp   qp;
+    struct sim_id   *id;        /* raises DISCONNECTED */
+    int             sq_sig_all;
+    int             fd;         /* -1 until connected */
+    int             polled;     /* in epoll */
+    int             pollout;    /* waiting for the socket to drain */
+    int             dead;
+    int             stalled;    /* a SEND waits for a receive */
+    uint32_t        qkey;       /* UD */
+    uint32_t        remote_qpn;
+    uint64_t        due_ns;     /* the next packet of in is not delivered yet */
+
+    struct sim_buf  in;
+    struct sim_buf  out;
+    struct sim_rq   rq;
+
+    struct sim_pending *pending;
+    uint32_t        pending_size;
+    uint32_t        pending_head;
+    uint32_t        pending_count;
+};
+
+struct sim_ah {
+    struct ibv_ah   ah;
+    uint16_t        dlid;
+};
+
+/* a datagram held by the link model */
+struct sim_dgram {
+    struct sim_dgram *next;
+    size_t          len;
+    char            data[];
+};
+
+struct sim_mr {
+    struct ibv_mr   *mr;
+    int             access;
+    uint32_t        gen;
+};
+
+struct sim_event {
+    struct rdma_cm_event    event;
+    struct sim_event        *next;
+};
+
+/* the event channel, rdma_get_cm_event() reads one byte of the pipe per event */
+struct sim_channel {
+    struct rdma_event_channel channel;
+    int                     wfd;
+    struct sim_event        *head;
+    struct sim_event        *tail;
+};
+
+struct sim_id {
+    struct rdma_cm_id       id;
+    uint16_t                port;       /* bound or resolved */
+    int                     listen;     /* the listen slot, -1 if not listening */
+    int                     lfd;
+    int                     fd;         /* accepted, given to the QP by rdma_accept */
+    uint32_t                remote_qpn;
+    int                     disconnected;
+};
+
+/* the per process device */
+static struct {
+    pthread_once_t  once;
+    pthread_mutex_t lock;       /* everything below and all objects */
+    pthread_t       thread;
+    int             epfd;
+    int             timerfd;
+    uint64_t        timer_ns;   /* 0 if not armed */
+
+    uint64_t        latency_ns;
+    double          ns_per_byte;
+    uint64_t        link_free;  /* the last byte sent leaves the link */
+
+    struct sim_qp   *qps[SIM_MAX_QPS];
+    uint32_t        qp_gen;
+    struct sim_id   *listens[SIM_MAX_LISTENS];
+
+    struct sim_mr   *mrs;
+    uint32_t        mr_size;
+    uint32_t        mr_used;
+    uint32_t        *mr_free;
+    uint32_t        mr_nfree;
+
+    int             ud_fd;      /* -1 until the first UD QP */
+    uint16_t        lid;
+    double          ud_loss;
+    enum ibv_mtu    ud_mtu;     /* the active MTU */
+    struct sim_dgram *ud_head;
+    struct sim_dgram *ud_tail;
+} nic = { .once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER, .ud_fd = -1 };
+
+static struct ibv_context sim_context = { .name = "simverbs0" };
+static struct ibv_context *sim_devices[] = { &sim_context, NULL };
+
+static void *nic_thread(void *arg);
+static void qp_input(struct sim_qp *qp, uint64_t now);
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void nic_init() {
+    const char *s;
+    if ( (s = getenv("SIMVERBS_LATENCY_US")) ) {
+        nic.latency_ns = (uint64_t)(atof(s) * 1000);
+    }
+    if ( (s = getenv("SIMVERBS_GBPS")) && atof(s) > 0) {
+        nic.ns_per_byte = 8 / atof(s);
+    }
+    if ( (s = getenv("SIMVERBS_UD_LOSS")) ) {
+        nic.ud_loss = atof(s);
+    }
+    nic.ud_mtu = IBV_MTU_4096;
+    if ( (s = getenv("SIMVERBS_UD_MTU")) ) {
+        int bytes = atoi(s);
+        while (nic.ud_mtu > IBV_MTU_256 && MTU_BYTES(nic.ud_mtu) > bytes) nic.ud_mtu -= 1;
+    }
+
+    if (-1 == (nic.epfd = epoll_create1(EPOLL_CLOEXEC)) ||
+            -1 == (nic.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))) {
+        perror("simverbs");
+        abort();
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG(TAG_TIMER, 0) };
+    epoll_ctl(nic.epfd, EPOLL_CTL_ADD, nic.timerfd, &ev);
+
+    if (0 != pthread_create(&nic.thread, NULL, nic_thread, NULL)) {
+        perror("simverbs");
+        abort();
+    }
+    pthread_detach(nic.thread);
+}
+
+static void nic_start() {
+    pthread_once(&nic.once, nic_init);
+}
+
+/* wake the NIC at ns if nothing is due earlier, under the lock */
+static void nic_timer(uint64_t ns) {
+    if (nic.timer_ns && nic.timer_ns <= ns) return;
+    nic.timer_ns = ns;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000ULL;
+    its.it_value.tv_nsec = ns % 1000000000ULL;
+    timerfd_settime(nic.timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* the link model, the time the packet of len bytes reaches the peer */
+static uint64_t link_deliver(size_t len) {
+    if (!nic.latency_ns && !nic.ns_per_byte) return 0;
+
+    uint64_t now = now_ns();
+    if (nic.link_free < now) nic.link_free = now;
+    nic.link_free += (uint64_t)(len * nic.ns_per_byte);
+    return nic.link_free + nic.latency_ns;
+}
+
+static int full_write(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int full_read(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void set_nonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* the abstract unix socket name of a port, or of the UD socket of a LID */
+static socklen_t sim_addr(struct sockaddr_un *sun, const char *space, uint16_t n) {
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    int len = snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1, "simverbs-%s:%u", space, n);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/***************************************************************************//**
+ * Byte queues
+ *
+ ******************************************************************************/
+
+/* make room for len bytes at the tail */
+static char *buf_reserve(struct sim_buf *b, size_t len) {
+    if (b->head == b->tail) b->head = b->tail = 0;
+    if (b->tail + len > b->cap) {
+        if (b->head) {
+            memmove(b->data, b->data + b->head, b->tail - b->head);
+            b->tail -= b->head;
+            b->head = 0;
+        }
+        if (b->tail + len > b->cap) {
+            size_t cap = b->cap ? b->cap : 4096;
+            while (cap < b->tail + len) cap <<= 1;
+            char *data = realloc(b->data, cap);
+            if (!data) return NULL;
+            b->data = data;
+            b->cap = cap;
+        }
+    }
+    return b->data + b->tail;
+}
+
+static void buf_free(struct sim_buf *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+/***************************************************************************//**
+ * Memory regions, a key is the slot in table and a generation
+ *
+ ******************************************************************************/
+
+static struct sim_mr *mr_lookup(uint32_t key, uint64_t addr, uint32_t len, int access) {
+    uint32_t slot = key & ((1U << SIM_MR_BITS) - 1);
+    if (slot >= nic.mr_used) return NULL;
+
+    struct sim_mr *m = &nic.mrs[slot];
+    if (!m->mr || m->gen != key >> SIM_MR_BITS) return NULL;
+    if ((m->access & access) != access) return NULL;
+
+    uint64_t base = (uintptr_t)m->mr->addr;
+    if (addr < base || addr + len > base + m->mr->length) return NULL;
+    return m;
+}
+
+/* check local sges, the total length or -1 */
+static long sge_check(struct ibv_sge *sge, int num_sge, int access) {
+    long total = 0;
+    int i = 0;
+    for (i = 0; i < num_sge; ++i) {
+        if (sge[i].length && !mr_lookup(sge[i].lkey, sge[i].addr, sge[i].length, access)) {
+            return -1;
+        }
+        total += sge[i].length;
+    }
+    return total;
+}
+
+/* scatter len bytes into sges which are checked, skipping the first skip
+ * bytes of them */
+static void sge_scatter(struct ibv_sge *sge, int num_sge, size_t skip, const char *src, size_t len) {
+    int i = 0;
+    for (i = 0; i < num_sge && len; ++i) {
+        if (skip >= sge[i].length) {
+            skip -= sge[i].length;
+            continue;
+        }
+        size_t n = sge[i].length - skip < len ? sge[i].length - skip : len;
+        memcpy((void *)(uintptr_t)(sge[i].addr + skip), src, n);
+        skip = 0;
+        src += n;
+        len -= n;
+    }
+}
+
+struct ibv_mr *ibv_reg_mr(struct ibv_pd *pd, void *addr, size_t length, int access) {
+    struct ibv_mr *mr = calloc(1, sizeof(struct ibv_mr));
+    if (!mr) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&nic.lock);
+    uint32_t slot;
+    if (nic.mr_nfree) {
+        slot = nic.mr_free[--nic.mr_nfree];
+    } else {
+        if (nic.mr_used == nic.mr_size) {
+            uint32_t size = nic.mr_size ? nic.mr_size * 2 : 1024;
+            struct sim_mr *mrs = size <= (1U << SIM_MR_BITS) ?
+                realloc(nic.mrs, size * sizeof(struct sim_mr)) : NULL;
+            uint32_t *mr_free = mrs ? realloc(nic.mr_free, size * sizeof(uint32_t)) : NULL;
+            if (mrs) nic.mrs = mrs;
+            if (!mr_free) {
+                pthread_mutex_unlock(&nic.lock);
+                free(mr);
+                errno = ENOMEM;
+                return NULL;
+            }
+            nic.mr_free = mr_free;
+            memset(nic.mrs + nic.mr_size, 0, (size - nic.mr_size) * sizeof(struct sim_mr));
+            nic.mr_size = size;
+        }
+        slot = nic.mr_used++;
+    }
+    struct sim_mr *m = &nic.mrs[slot];
+    m->gen = (m->gen + 1) & ((1U << (32 - SIM_MR_BITS)) - 1);
+    m->access = access;
+    m->mr = mr;
+    pthread_mutex_unlock(&nic.lock);
+
+    mr->context = pd->context;
+    mr->pd = pd;
+    mr->addr = addr;
+    mr->length = length;
+    mr->handle = slot;
+    mr->lkey = mr->rkey = slot | (m->gen << SIM_MR_BITS);
+    return mr;
+}
+
+int ibv_dereg_mr(struct ibv_mr *mr) {
+    pthread_mutex_lock(&nic.lock);
+    nic.mrs[mr->handle].mr = NULL;
+    nic.mr_free[nic.mr_nfree++] = mr->handle;
+    pthread_mutex_unlock(&nic.lock);
+    free(mr);
+    return 0;
+}
+
+/***************************************************************************//**
+ * Protection domains and completion channels
+ *
+ ******************************************************************************/
+
+int ibv_query_port(struct ibv_context *context, uint8_t port_num, struct ibv_port_attr *port_attr) {
+    if (1 != port_num) return EINVAL;
+    nic_start();
+
+    memset(port_attr, 0, sizeof(struct ibv_port_attr));
+    port_attr->state = IBV_PORT_ACTIVE;
+    port_attr->max_mtu = IBV_MTU_4096;
+    port_attr->active_mtu = nic.ud_mtu;
+    port_attr->lid = nic.lid;
+    return 0;
+}
+
+struct ibv_pd *ibv_alloc_pd(struct ibv_context *context) {
+    struct ibv_pd *pd = calloc(1, sizeof(struct ibv_pd));
+    if (!pd) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pd->context = context;
+    return pd;
+}
+
+int ibv_dealloc_pd(struct ibv_pd *pd) {
+    free(pd);
+    return 0;
+}
+
+struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context) {
+    struct sim_comp_channel *ch = calloc(1, sizeof(struct sim_comp_channel));
+    int fds[2];
+    if (!ch || 0 != pipe2(fds, O_CLOEXEC)) {
+        free(ch);
+        return NULL;
+    }
+    set_nonblock(fds[1]);
+    ch->channel.context = context;
+    ch->channel.fd = fds[0];
+    ch->wfd = fds[1];
+    return &ch->channel;
+}
+
+int ibv_destroy_comp_channel(struct ibv_comp_channel *channel) {
+    struct sim_comp_channel *ch = (struct sim_comp_channel *)channel;
+    close(ch->channel.fd);
+    close(ch->wfd);
+    free(ch);
+    return 0;
+}
+
+/***************************************************************************//**
+ * Completion queues
+ *
+ ******************************************************************************/
+
+struct ibv_cq *ibv_create_cq(struct ibv_context *context, int cqe, void *cq_context,
+        struct ibv_comp_channel *channel, int comp_vector) {
+    struct sim_cq *c = calloc(1, sizeof(struct sim_cq));
+    if (!c) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    c->size = cqe > 0 ? cqe : 1;
+    if ( !(c->ring = calloc(c->size, sizeof(struct ibv_wc))) ) {
+        free(c);
+        errno = ENOMEM;
+        return NULL;
+    }
+    c->cq.context = context;
+    c->cq.channel = channel;
+    c->cq.cq_context = cq_context;
+    c->cq.cqe = c->size;
+    return &c->cq;
+}
+
+int ibv_destroy_cq(struct ibv_cq *cq) {
+    struct sim_cq *c = (struct sim_cq *)cq;
+    free(c->ring);
+    free(c);
+    return 0;
+}
+
+int ibv_resize_cq(struct ibv_cq *cq, int cqe) {
+    struct sim_cq *c = (struct sim_cq *)cq;
+    int ret = 0;
+
+    nic_start();
+    pthread_mutex_lock(&nic.lock);
+    if (cqe < (int)c->count) {
+        ret = EINVAL;
+    } else if ((uint32_t)cqe > c->size) {
+        struct ibv_wc *ring = malloc(cqe * sizeof(struct ibv_wc));
+        if (!ring) {
+            ret = ENOMEM;
+        } else {
+            uint32_t i = 0;
+            for (i = 0; i < c->count; ++i) ring[i] = c->ring[(c->head + i) % c->size];
+            free(c->ring);
+            c->ring = ring;
+            c->head = 0;
+            c->size = cqe;
+        }
+    }
+    if (0 == ret) cq->cqe = cqe;
+    pthread_mutex_unlock(&nic.lock);
+    return ret;
+}
+
+/* add a completion under the lock. The queue grows instead of overrunning,
+ * but says so, as a device would put the QPs of the CQ in error. */
+static void cq_push(struct ibv_cq *cq, struct ibv_wc *wc) {
+    struct sim_cq *c = (struct sim_cq *)cq;
+    if (c->count == (uint32_t)cq->cqe && !c->overrun) {
+        c->overrun = 1;
+        fprintf(stderr, "simverbs: cq overrun, %d entries\n", cq->cqe);
+    }
+    if (c->count == c->size) {
+        struct ibv_wc *ring = malloc(2 * c->size * sizeof(struct ibv_wc));
+        if (!ring) {
+            fprintf(stderr, "simverbs: cq overrun\n");
+            return;
+        }
+        uint32_t i = 0;
+        for (i = 0; i < c->count; ++i) ring[i] = c->ring[(c->head + i) % c->size];
+        free(c->ring);
+        c->ring = ring;
+        c->head = 0;
+        c->size *= 2;
+    }
+    c->ring[(c->head + c->count++) % c->size] = *wc;
+
+    if (c->armed && cq->channel) {
+        c->armed = 0;
+        if (sizeof(cq) != write(((struct sim_comp_channel *)cq->channel)->wfd, &cq, sizeof(cq))) {
+            perror("simverbs: comp channel");
+        }
+    }
+}
+
+int ibv_req_notify_cq(struct ibv_cq *cq, int solicited_only) {
+    pthread_mutex_lock(&nic.lock);
+    ((struct sim_cq *)cq)->armed = 1;
+    pthread_mutex_unlock(&nic.lock);
+    return 0;
+}
+
+int ibv_get_cq_event(struct ibv_comp_channel *channel, struct ibv_cq **cq, void **cq_context) {
+    if (0 != full_read(channel->fd, cq, sizeof(*cq))) return -1;
+    *cq_context = (*cq)->cq_context;
+    return 0;
+}
+
+void ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents) {
+}
+
+int ibv_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc) {
+    struct sim_cq *c = (struct sim_cq *)cq;
+    int n = 0;
+
+    /* the NIC runs on the host cpus, busy pollers leave them to it */
+    if (!__atomic_load_n(&c->count, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+        return 0;
+    }
+
+    pthread_mutex_lock(&nic.lock);
+    while (n < num_entries && c->count) {
+        wc[n++] = c->ring[c->head];
+        c->head = (c->head + 1) % c->size;
+        --c->count;
+    }
+    pthread_mutex_unlock(&nic.lock);
+    return n;
+}
+
+/***************************************************************************//**
+ * Receive queues
+ *
+ ******************************************************************************/
+
+static int rq_init(struct sim_rq *rq, uint32_t size) {
+    rq->size = size ? size : 1;
+    rq->ring = calloc(rq->size, sizeof(struct sim_wqe));
+    return rq->ring ? 0 : -1;
+}
+
+static int rq_post(struct sim_rq *rq, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr) {
+    for (; wr; wr = wr->next) {
+        if (rq->count == rq->size || wr->num_sge > SIM_MAX_SGE) {
+            *bad_wr = wr;
+            return ENOMEM;
+        }
+        struct sim_wqe *w = &rq->ring[(rq->head + rq->count++) % rq->size];
+        w->wr_id = wr->wr_id;
+        w->num_sge = wr->num_sge;
+        memcpy(w->sge, wr->sg_list, wr->num_sge * sizeof(struct ibv_sge));
+    }
+    return 0;
+}
+
+/* the QPs stalled for receives retry */
+static void rq_kick(struct ibv_srq *srq) {
+    uint64_t now = now_ns();
+    int i = 0;
+    for (i = 0; i < SIM_MAX_QPS; ++i) {
+        struct sim_qp *qp = nic.qps[i];
+        if (qp && qp->stalled && qp->qp.srq == srq) qp_input(qp, now);
+    }
+}
+
+struct ibv_srq *ibv_create_srq(struct ibv_pd *pd, struct ibv_srq_init_attr *srq_init_attr) {
+    struct sim_srq *s = calloc(1, sizeof(struct sim_srq));
+    if (!s || 0 != rq_init(&s->rq, srq_init_attr->attr.max_wr)) {
+        free(s);
+        errno = ENOMEM;
+        return NULL;
+    }
+    s->srq.context = pd->context;
+    s->srq.pd = pd;
+    s->srq.srq_context = srq_init_attr->srq_context;
+    return &s->srq;
+}
+
+int ibv_destroy_srq(struct ibv_srq *srq) {
+    struct sim_srq *s = (struct sim_srq *)srq;
+    free(s->rq.ring);
+    free(s);
+    return 0;
+}
+
+int ibv_post_srq_recv(struct ibv_srq *srq, struct ibv_recv_wr *recv_wr, struct ibv_recv_wr **bad_recv_wr) {
+    pthread_mutex_lock(&nic.lock);
+    int ret = rq_post(&((struct sim_srq *)srq)->rq, recv_wr, bad_recv_wr);
+    rq_kick(srq);
+    pthread_mutex_unlock(&nic.lock);
+    return ret;
+}
+
+int ibv_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr) {
+    struct sim_qp *q = (struct sim_qp *)qp;
+
+    pthread_mutex_lock(&nic.lock);
+    int ret = rq_post(&q->rq, wr, bad_wr);
+    if (q->stalled) qp_input(q, now_ns());
+    pthread_mutex_unlock(&nic.lock);
+    return ret;
+}
+
+/***************************************************************************//**
+ * Queue pairs
+ *
+ ******************************************************************************/
+
+static struct sim_qp *qp_lookup(uint32_t qp_num) {
+    struct sim_qp *qp = nic.qps[qp_num % SIM_MAX_QPS];
+    return qp && qp->qp.qp_num == qp_num ? qp : NULL;
+}
+
+/* bind the datagram socket of process at the first free LID, under the lock */
+static int ud_open() {
+    if (-1 != nic.ud_fd) return 0;
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == fd) return -1;
+
+    /* a full socket drops datagrams as a busy port would */
+    int size = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    struct sockaddr_un sun;
+    uint16_t lid = getpid() % 0xfffe + 1;
+    int i = 0;
+    for (i = 0; i < 0xfffe; ++i, lid = lid % 0xfffe + 1) {
+        socklen_t len = sim_addr(&sun, "lid", lid);
+        if (0 == bind(fd, (struct sockaddr *)&sun, len)) break;
+        if (EADDRINUSE != errno) i = 0xfffe;
+    }
+    if (i == 0xfffe) {
+        close(fd);
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG(TAG_UD, 0) };
+    epoll_ctl(nic.epfd, EPOLL_CTL_ADD, fd, &ev);
+    nic.ud_fd = fd;
+    nic.lid = lid;
+    return 0;
+}
+
+struct ibv_qp *ibv_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr) {
+    if (IBV_QPT_RC != qp_init_attr->qp_type && IBV_QPT_UD != qp_init_attr->qp_type) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct sim_qp *q = calloc(1, sizeof(struct sim_qp));
+    if (!q) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    q->fd = -1;
+    q->sq_sig_all = qp_init_attr->sq_sig_all;
+    q->pending_size = qp_init_attr->cap.max_send_wr ? qp_init_attr->cap.max_send_wr : 1;
+    q->pending = calloc(q->pending_size, sizeof(struct sim_pending));
+    if (!q->pending || (!qp_init_attr->srq && 0 != rq_init(&q->rq, qp_init_attr->cap.max_recv_wr))) {
+        free(q->pending);
+        free(q);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    q->qp.context = pd->context;
+    q->qp.qp_context = qp_init_attr->qp_context;
+    q->qp.pd = pd;
+    q->qp.send_cq = qp_init_attr->send_cq;
+    q->qp.recv_cq = qp_init_attr->recv_cq;
+    q->qp.srq = qp_init_attr->srq;
+    q->qp.qp_type = qp_init_attr->qp_type;
+
+    nic_start();
+    pthread_mutex_lock(&nic.lock);
+    uint32_t i = 0;
+    if (IBV_QPT_UD == q->qp.qp_type && 0 != ud_open()) i = SIM_MAX_QPS;
+    for (; i < SIM_MAX_QPS; ++i) {
+        uint32_t slot = (nic.qp_gen + i) % SIM_MAX_QPS;
+        if (slot < SIM_QP_BASE || nic.qps[slot]) continue;
+        nic.qp_gen += i + 1;
+        q->qp.qp_num = ((nic.qp_gen / SIM_MAX_QPS) * SIM_MAX_QPS + slot) & 0xffffff;
+        nic.qps[slot] = q;
+        break;
+    }
+    pthread_mutex_unlock(&nic.lock);
+    if (i == SIM_MAX_QPS) {
+        free(q->rq.ring);
+        free(q->pending);
+        free(q);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return &q->qp;
+}
+
+/* only the qkey matters, a QP is ready to send once it exists */
+int ibv_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask) {
+    if (attr_mask & IBV_QP_QKEY) {
+        pthread_mutex_lock(&nic.lock);
+        ((struct sim_qp *)qp)->qkey = attr->qkey;
+        pthread_mutex_unlock(&nic.lock);
+    }
+    return 0;
+}
+
+int ibv_destroy_qp(struct ibv_qp *qp) {
+    struct sim_qp *q = (struct sim_qp *)qp;
+
+    pthread_mutex_lock(&nic.lock);
+    nic.qps[qp->qp_num % SIM_MAX_QPS] = NULL;
+    if (q->id) q->id->id.qp = NULL;
+    pthread_mutex_unlock(&nic.lock);
+
+    if (-1 != q->fd) close(q->fd);
+    buf_free(&q->in);
+    buf_free(&q->out);
+    free(q->rq.ring);
+    free(q->pending);
+    free(q);
+    return 0;
+}
+
+/* send the out queue as far as the socket takes it, under the lock */
+static void qp_flush(struct sim_qp *qp) {
+    struct sim_buf *b = &qp->out;
+    while (b->head < b->tail) {
+        ssize_t n = send(qp->fd, b->data + b->head, b->tail - b->head, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n <= 0) break;
+        b->head += n;
+    }
+    int pollout = b->head < b->tail;
+    if (!qp->polled || pollout == qp->pollout) return;
+
+    /* the NIC thread sends the rest once the peer reads */
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG(TAG_QP, qp->qp.qp_num) };
+    if (pollout) ev.events |= EPOLLOUT;
+    epoll_ctl(nic.epfd, EPOLL_CTL_MOD, qp->fd, &ev);
+    qp->pollout = pollout;
+}
+
+/* queue a packet, the payload of len bytes is filled by the caller */
+static char *qp_packet(struct sim_qp *qp, struct pkt_hdr *hdr, uint32_t len) {
+    char *p = buf_reserve(&qp->out, sizeof(*hdr) + len);
+    if (!p) return NULL;
+
+    hdr->len = len;
+    hdr->qp_num = qp->qp.qp_num;
+    hdr->deliver_ns = link_deliver(sizeof(*hdr) + len);
+    memcpy(p, hdr, sizeof(*hdr));
+    qp->out.tail += sizeof(*hdr) + len;
+    return p + sizeof(*hdr);
+}
+
+static void qp_complete(struct sim_qp *qp, struct ibv_cq *cq, uint64_t wr_id,
+        enum ibv_wc_opcode opcode, enum ibv_wc_status status, uint32_t byte_len) {
+    struct ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id = wr_id;
+    wc.status = status;
+    wc.opcode = opcode;
+    wc.byte_len = byte_len;
+    wc.qp_num = qp->qp.qp_num;
+    wc.src_qp = qp->remote_qpn;
+    cq_push(cq, &wc);
+}
+
+/***************************************************************************//**
+ * Address handles and datagrams, a UD send completes once it leaves
+ *
+ ******************************************************************************/
+
+struct ibv_ah *ibv_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr) {
+    struct sim_ah *a = calloc(1, sizeof(struct sim_ah));
+    if (!a) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    a->ah.context = pd->context;
+    a->ah.pd = pd;
+    a->dlid = attr->dlid;
+    return &a->ah;
+}
+
+struct ibv_ah *ibv_create_ah_from_wc(struct ibv_pd *pd, struct ibv_wc *wc, struct ibv_grh *grh,
+        uint8_t port_num) {
+    struct ibv_ah_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.dlid = wc->slid;
+    attr.port_num = port_num;
+    return ibv_create_ah(pd, &attr);
+}
+
+int ibv_destroy_ah(struct ibv_ah *ah) {
+    free(ah);
+    return 0;
+}
+
+static int ud_send(struct sim_qp *qp, struct ibv_send_wr *wr) {
+    static char dgram[sizeof(struct pkt_hdr) + SIM_UD_MTU];
+    struct pkt_hdr *hdr = (struct pkt_hdr *)dgram;
+
+    if (IBV_WR_SEND != wr->opcode || !wr->wr.ud.ah) return EINVAL;
+
+    int signaled = qp->sq_sig_all || (wr->send_flags & IBV_SEND_SIGNALED);
+    long len = 0;
+    int i = 0;
+    for (i = 0; i < wr->num_sge; ++i) len += wr->sg_list[i].length;
+
+    enum ibv_wc_status status = IBV_WC_SUCCESS;
+    if (len > MTU_BYTES(nic.ud_mtu)) {
+        status = IBV_WC_LOC_LEN_ERR;
+    } else if ( !(wr->send_flags & IBV_SEND_INLINE) && -1 == sge_check(wr->sg_list, wr->num_sge, 0)) {
+        status = IBV_WC_LOC_PROT_ERR;
+    }
+
+    if (IBV_WC_SUCCESS == status && !(nic.ud_loss && drand48() < nic.ud_loss)) {
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->type = PKT_UD_SEND;
+        hdr->len = len;
+        hdr->qp_num = qp->qp.qp_num;
+        hdr->dst_qpn = wr->wr.ud.remote_qpn;
+        hdr->qkey = wr->wr.ud.remote_qkey;
+        hdr->lid = nic.lid;
+        hdr->deliver_ns = link_deliver(sizeof(*hdr) + len);
+
+        char *p = dgram + sizeof(*hdr);
+        for (i = 0; i < wr->num_sge; ++i) {
+            memcpy(p, (void *)(uintptr_t)wr->sg_list[i].addr, wr->sg_list[i].length);
+            p += wr->sg_list[i].length;
+        }
+
+        /* a missing or full peer loses the datagram */
+        struct sockaddr_un sun;
+        socklen_t alen = sim_addr(&sun, "lid", ((struct sim_ah *)wr->wr.ud.ah)->dlid);
+        sendto(nic.ud_fd, dgram, sizeof(*hdr) + len, MSG_DONTWAIT, (struct sockaddr *)&sun, alen);
+    }
+
+    if (signaled || IBV_WC_SUCCESS != status) {
+        qp_complete(qp, qp->qp.send_cq, wr->wr_id, IBV_WC_SEND, status, len);
+    }
+    return 0;
+}
+
+int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr) {
+    struct sim_qp *q = (struct sim_qp *)qp;
+    int ret = 0;
+
+    pthread_mutex_lock(&nic.lock);
+    if (IBV_QPT_UD == qp->qp_type) {
+        for (; wr && !ret; wr = wr->next) {
+            if ( (ret = ud_send(q, wr)) ) *bad_wr = wr;
+        }
+        pthread_mutex_unlock(&nic.lock);
+        return ret;
+    }
+
+    for (; wr; wr = wr->next) {
+        enum pkt_type type = PKT_SEND;
+        enum ibv_wc_opcode opcode = IBV_WC_SEND;
+        switch (wr->opcode) {
+            case IBV_WR_SEND:       type = PKT_SEND;     opcode = IBV_WC_SEND;       break;
+            case IBV_WR_RDMA_WRITE: type = PKT_WRITE;    opcode = IBV_WC_RDMA_WRITE; break;
+            case IBV_WR_RDMA_READ:  type = PKT_READ_REQ; opcode = IBV_WC_RDMA_READ;  break;
+            case IBV_WR_ATOMIC_FETCH_AND_ADD:
+                type = PKT_ATOMIC_REQ; opcode = IBV_WC_FETCH_ADD; break;
+            case IBV_WR_ATOMIC_CMP_AND_SWP:
+                type = PKT_ATOMIC_REQ; opcode = IBV_WC_COMP_SWAP; break;
+            default:                ret = EINVAL;                                    break;
+        }
+        if (!ret && (wr->num_sge > SIM_MAX_SGE || -1 == q->fd)) ret = EINVAL;
+        if (!ret && q->pending_count == q->pending_size) ret = ENOMEM;
+        if (ret) {
+            *bad_wr = wr;
+            break;
+        }
+
+        /* a QP in error drops its work requests */
+        if (q->dead) continue;
+
+        int signaled = q->sq_sig_all || (wr->send_flags & IBV_SEND_SIGNALED);
+        int reads = PKT_READ_REQ == type || PKT_ATOMIC_REQ == type;
+        int inline_data = (wr->send_flags & IBV_SEND_INLINE) && !reads;
+        long len = inline_data ? 0 : sge_check(wr->sg_list, wr->num_sge,
+                reads ? IBV_ACCESS_LOCAL_WRITE : 0);
+        if (PKT_ATOMIC_REQ == type && sizeof(uint64_t) != len) len = -1;
+        if (-1 == len) {
+            qp_complete(q, qp->send_cq, wr->wr_id, opcode, IBV_WC_LOC_PROT_ERR, 0);
+            continue;
+        }
+        int i = 0;
+        if (inline_data) {
+            for (i = 0; i < wr->num_sge; ++i) len += wr->sg_list[i].length;
+        }
+
+        struct pkt_hdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.type = type;
+        hdr.remote_addr = wr->wr.rdma.remote_addr;
+        hdr.rkey = wr->wr.rdma.rkey;
+
+        char *p;
+        if (PKT_READ_REQ == type) {
+            hdr.read_len = len;
+            p = qp_packet(q, &hdr, 0);
+        } else if (PKT_ATOMIC_REQ == type) {
+            uint64_t operands[2] = { wr->wr.atomic.compare_add, wr->wr.atomic.swap };
+            hdr.remote_addr = wr->wr.atomic.remote_addr;
+            hdr.rkey = wr->wr.atomic.rkey;
+            hdr.read_len = len;
+            hdr.atomic_op = wr->opcode;
+            if ( (p = qp_packet(q, &hdr, sizeof(operands))) ) {
+                memcpy(p, operands, sizeof(operands));
+            }
+        } else {
+            p = qp_packet(q, &hdr, len);
+            for (i = 0; p && i < wr->num_sge; ++i) {
+                memcpy(p, (void *)(uintptr_t)wr->sg_list[i].addr, wr->sg_list[i].length);
+                p += wr->sg_list[i].length;
+            }
+        }
+        if (!p) {
+            *bad_wr = wr;
+            ret = ENOMEM;
+            break;
+        }
+
+        struct sim_pending *pd = &q->pending[(q->pending_head + q->pending_count++) % q->pending_size];
+        pd->wr_id = wr->wr_id;
+        pd->opcode = opcode;
+        pd->signaled = signaled;
+        pd->byte_len = len;
+        pd->num_sge = 0;
+        if (reads) {
+            pd->num_sge = wr->num_sge;
+            memcpy(pd->sge, wr->sg_list, wr->num_sge * sizeof(struct ibv_sge));
+        }
+    }
+    if (!q->dead && -1 != q->fd) qp_flush(q);
+    pthread_mutex_unlock(&nic.lock);
+    return ret;
+}
+
+/***************************************************************************//**
+ * The responder and requester sides of a QP, under the lock
+ *
+ ******************************************************************************/
+
+static void qp_ack(struct sim_qp *qp, enum pkt_type type, enum ibv_wc_status status,
+        const void *data, uint32_t len) {
+    struct pkt_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.status = status;
+    char *p = qp_packet(qp, &hdr, len);
+    if (p && len) memcpy(p, data, len);
+}
+
+/* the oldest work request is answered */
+static void qp_answer(struct sim_qp *qp, struct pkt_hdr *hdr, const char *data) {
+    if (!qp->pending_count) {
+        fprintf(stderr, "simverbs: unexpected answer on qp %u\n", qp->qp.qp_num);
+        return;
+    }
+    struct sim_pending *pd = &qp->pending[qp->pending_head];
+    qp->pending_head = (qp->pending_head + 1) % qp->pending_size;
+    --qp->pending_count;
+
+    enum ibv_wc_status status = hdr->status;
+    if (IBV_WC_SUCCESS == status && PKT_READ_RESP == hdr->type) {
+        sge_scatter(pd->sge, pd->num_sge, 0, data, hdr->len);
+    }
+    if (pd->signaled || IBV_WC_SUCCESS != status) {
+        qp_complete(qp, qp->qp.send_cq, pd->wr_id, pd->opcode, status, pd->byte_len);
+    }
+}
+
+/* place a SEND into a receive, 0 if no receive is posted */
+static int qp_receive(struct sim_qp *qp, struct pkt_hdr *hdr, const char *data) {
+    struct sim_rq *rq = qp->qp.srq ? &((struct sim_srq *)qp->qp.srq)->rq : &qp->rq;
+    if (!rq->count) return 0;
+
+    struct sim_wqe *w = &rq->ring[rq->head];
+    rq->head = (rq->head + 1) % rq->size;
+    --rq->count;
+
+    enum ibv_wc_status status = IBV_WC_SUCCESS;
+    long room = sge_check(w->sge, w->num_sge, IBV_ACCESS_LOCAL_WRITE);
+    if (-1 == room) {
+        status = IBV_WC_LOC_PROT_ERR;
+    } else if (room < hdr->len) {
+        status = IBV_WC_LOC_LEN_ERR;
+    } else {
+        sge_scatter(w->sge, w->num_sge, 0, data, hdr->len);
+    }
+    qp_complete(qp, qp->qp.recv_cq, w->wr_id, IBV_WC_RECV, status, hdr->len);
+    qp_ack(qp, PKT_ACK, IBV_WC_SUCCESS == status ? IBV_WC_SUCCESS : IBV_WC_REM_INV_REQ_ERR, NULL, 0);
+    return 1;
+}
+
+static void qp_packet_in(struct sim_qp *qp, struct pkt_hdr *hdr, char *data) {
+    struct sim_mr *m;
+
+    switch (hdr->type) {
+        case PKT_WRITE:
+            if ( (m = mr_lookup(hdr->rkey, hdr->remote_addr, hdr->len, IBV_ACCESS_REMOTE_WRITE)) ) {
+                memcpy((void *)(uintptr_t)hdr->remote_addr, data, hdr->len);
+            }
+            qp_ack(qp, PKT_ACK, m ? IBV_WC_SUCCESS : IBV_WC_REM_ACCESS_ERR, NULL, 0);
+            break;
+
+        case PKT_READ_REQ:
+            if ( (m = mr_lookup(hdr->rkey, hdr->remote_addr, hdr->read_len, IBV_ACCESS_REMOTE_READ)) ) {
+                qp_ack(qp, PKT_READ_RESP, IBV_WC_SUCCESS, (void *)(uintptr_t)hdr->remote_addr,
+                        hdr->read_len);
+            } else {
+                qp_ack(qp, PKT_READ_RESP, IBV_WC_REM_ACCESS_ERR, NULL, 0);
+            }
+            break;
+
+        case PKT_ATOMIC_REQ:
+            /* a misaligned target is a invalid request, as on hardware */
+            if (hdr->remote_addr % sizeof(uint64_t)) {
+                qp_ack(qp, PKT_READ_RESP, IBV_WC_REM_INV_REQ_ERR, NULL, 0);
+            } else if ( (m = mr_lookup(hdr->rkey, hdr->remote_addr, sizeof(uint64_t),
+                            IBV_ACCESS_REMOTE_ATOMIC)) ) {
+                uint64_t operands[2], old = 0;
+                uint64_t *target = (uint64_t *)(uintptr_t)hdr->remote_addr;
+                memcpy(operands, data, sizeof(operands));
+                if (IBV_WR_ATOMIC_FETCH_AND_ADD == hdr->atomic_op) {
+                    old = __atomic_fetch_add(target, operands[0], __ATOMIC_SEQ_CST);
+                } else {
+                    old = operands[0];
+                    __atomic_compare_exchange_n(target, &old, operands[1], 0,
+                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                }
+                qp_ack(qp, PKT_READ_RESP, IBV_WC_SUCCESS, &old, sizeof(old));
+            } else {
+                qp_ack(qp, PKT_READ_RESP, IBV_WC_REM_ACCESS_ERR, NULL, 0);
+            }
+            break;
+
+        case PKT_ACK:
+        case PKT_READ_RESP:
+            qp_answer(qp, hdr, data);
+            break;
+
+        default:
+            fprintf(stderr, "simverbs: bad packet %u on qp %u\n", hdr->type, qp->qp.qp_num);
+            break;
+    }
+}
+
+/* while the SEND at the head waits for a receive, the ACKs and READ_RESPs
+ * behind it still complete: they answer this side's own requests, which RNR
+ * on a real QP does not hold back */
+static void qp_input_answers(struct sim_qp *qp, uint64_t now) {
+    struct sim_buf *b = &qp->in;
+    struct pkt_hdr hdr;
+    size_t at = b->head;
+
+    qp->due_ns = 0;
+    memcpy(&hdr, b->data + at, sizeof(hdr));
+    at += sizeof(hdr) + hdr.len;
+    while (b->tail - at >= sizeof(hdr)) {
+        memcpy(&hdr, b->data + at, sizeof(hdr));
+        if (b->tail - at < sizeof(hdr) + hdr.len) break;
+
+        if (hdr.deliver_ns > now) {
+            qp->due_ns = hdr.deliver_ns;
+            nic_timer(hdr.deliver_ns);
+            break;
+        }
+        if (PKT_ACK == hdr.type || PKT_READ_RESP == hdr.type) {
+            qp_packet_in(qp, &hdr, b->data + at + sizeof(hdr));
+            hdr.type = PKT_DONE;
+            memcpy(b->data + at, &hdr, sizeof(hdr));
+        }
+        at += sizeof(hdr) + hdr.len;
+    }
+    qp_flush(qp);
+}
+
+/* deliver the packets arrived, in order, until one is not due or waits for a
+ * receive */
+static void qp_input(struct sim_qp *qp, uint64_t now) {
+    struct sim_buf *b = &qp->in;
+
+    qp->stalled = 0;
+    qp->due_ns = 0;
+    while (b->tail - b->head >= sizeof(struct pkt_hdr)) {
+        struct pkt_hdr hdr;
+        memcpy(&hdr, b->data + b->head, sizeof(hdr));
+        if (b->tail - b->head < sizeof(hdr) + hdr.len) break;
+
+        if (hdr.deliver_ns > now) {
+            qp->due_ns = hdr.deliver_ns;
+            nic_timer(hdr.deliver_ns);
+            break;
+        }
+
+        char *data = b->data + b->head + sizeof(hdr);
+        if (PKT_SEND == hdr.type) {
+            if (!qp_receive(qp, &hdr, data)) {
+                qp->stalled = 1;
+                qp_input_answers(qp, now);
+                return;
+            }
+        } else if (PKT_DONE != hdr.type) {
+            qp_packet_in(qp, &hdr, data);
+        }
+        b->head += sizeof(hdr) + hdr.len;
+    }
+    qp_flush(qp);
+}
+
+/***************************************************************************//**
+ * The NIC thread
+ *
+ ******************************************************************************/
+
+static struct rdma_cm_event *cm_raise(struct sim_id *sid, struct sim_id *listen,
+        enum rdma_cm_event_type type, int status);
+static void nic_accept(struct sim_id *listen);
+
+/* the peer is gone, the QP goes to error and its id is disconnected */
+static void qp_dead(struct sim_qp *qp) {
+    qp->dead = 1;
+    if (qp->polled) {
+        epoll_ctl(nic.epfd, EPOLL_CTL_DEL, qp->fd, NULL);
+        qp->polled = 0;
+    }
+    if (qp->id && !qp->id->disconnected) {
+        qp->id->disconnected = 1;
+        if (qp->id->id.channel) cm_raise(qp->id, NULL, RDMA_CM_EVENT_DISCONNECTED, 0);
+    }
+}
+
+static void nic_qp_event(struct sim_qp *qp, uint32_t events, uint64_t now) {
+    if (qp->dead) return;
+
+    if (events & EPOLLOUT) qp_flush(qp);
+    if ( !(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ) return;
+
+    for (;;) {
+        char *p = buf_reserve(&qp->in, 65536);
+        if (!p) break;
+        ssize_t n = read(qp->fd, p, 65536);
+        if (n > 0) {
+            qp->in.tail += n;
+            continue;
+        }
+        if (0 == n || (EAGAIN != errno && EINTR != errno)) {
+            qp_dead(qp);
+            return;
+        }
+        break;
+    }
+    if (!qp->stalled) {
+        qp_input(qp, now);
+    } else {
+        qp_input_answers(qp, now);
+    }
+}
+
+/* a datagram reaches its QP, or is dropped as UD does */
+static void ud_deliver(struct pkt_hdr *hdr, const char *data) {
+    struct sim_qp *qp = qp_lookup(hdr->dst_qpn);
+    if (!qp || IBV_QPT_UD != qp->qp.qp_type || qp->qkey != hdr->qkey) return;
+
+    struct sim_rq *rq = qp->qp.srq ? &((struct sim_srq *)qp->qp.srq)->rq : &qp->rq;
+    if (!rq->count) return;
+
+    struct sim_wqe *w = &rq->ring[rq->head];
+    rq->head = (rq->head + 1) % rq->size;
+    --rq->count;
+
+    /* the payload follows room for the GRH, which is not filled */
+    enum ibv_wc_status status = IBV_WC_SUCCESS;
+    long room = sge_check(w->sge, w->num_sge, IBV_ACCESS_LOCAL_WRITE);
+    if (-1 == room) {
+        status = IBV_WC_LOC_PROT_ERR;
+    } else if (room < SIM_GRH_SIZE + hdr->len) {
+        status = IBV_WC_LOC_LEN_ERR;
+    } else {
+        sge_scatter(w->sge, w->num_sge, SIM_GRH_SIZE, data, hdr->len);
+    }
+
+    struct ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id = w->wr_id;
+    wc.status = status;
+    wc.opcode = IBV_WC_RECV;
+    wc.byte_len = SIM_GRH_SIZE + hdr->len;
+    wc.qp_num = qp->qp.qp_num;
+    wc.src_qp = hdr->qp_num;
+    wc.slid = hdr->lid;
+    cq_push(qp->qp.recv_cq, &wc);
+}
+
+/* deliver the datagrams held by the link model which are due */
+static void ud_input(uint64_t now) {
+    struct sim_dgram *d;
+    while ( (d = nic.ud_head) ) {
+        struct pkt_hdr *hdr = (struct pkt_hdr *)d->data;
+        if (hdr->deliver_ns > now) {
+            nic_timer(hdr->deliver_ns);
+            break;
+        }
+        if ( !(nic.ud_head = d->next) ) nic.ud_tail = NULL;
+        ud_deliver(hdr, d->data + sizeof(*hdr));
+        free(d);
+    }
+}
+
+static void nic_ud_event(uint64_t now) {
+    static char dgram[sizeof(struct pkt_hdr) + SIM_UD_MTU];
+    struct pkt_hdr *hdr = (struct pkt_hdr *)dgram;
+    ssize_t n;
+
+    while (0 < (n = recv(nic.ud_fd, dgram, sizeof(dgram), MSG_DONTWAIT))) {
+        if (n < sizeof(*hdr) || n != sizeof(*hdr) + hdr->len) continue;
+
+        if (!nic.ud_head && hdr->deliver_ns <= now) {
+            ud_deliver(hdr, dgram + sizeof(*hdr));
+            continue;
+        }
+
+        /* keep the order behind the held ones */
+        struct sim_dgram *d = malloc(sizeof(struct sim_dgram) + n);
+        if (!d) continue;
+        d->next = NULL;
+        d->len = n;
+        memcpy(d->data, dgram, n);
+        if (nic.ud_tail) {
+            nic.ud_tail->next = d;
+        } else {
+            nic.ud_head = d;
+        }
+        nic.ud_tail = d;
+    }
+    ud_input(now);
+}
+
+static void *nic_thread(void *arg) {
+    struct epoll_event events[64];
+
+    for (;;) {
+        int n = epoll_wait(nic.epfd, events, 64, -1);
+        if (-1 == n) continue;
+
+        pthread_mutex_lock(&nic.lock);
+        uint64_t now = now_ns();
+        int i = 0;
+        for (i = 0; i < n; ++i) {
+            uint64_t kind = events[i].data.u64 >> 32;
+            uint32_t index = (uint32_t)events[i].data.u64;
+
+            if (TAG_TIMER == kind) {
+                uint64_t expirations;
+                ssize_t r = read(nic.timerfd, &expirations, sizeof(expirations));
+                (void)r;
+                nic.timer_ns = 0;
+            } else if (TAG_LISTEN == kind) {
+                if (nic.listens[index]) nic_accept(nic.listens[index]);
+            } else if (TAG_QP == kind) {
+                struct sim_qp *qp = qp_lookup(index);
+                if (qp) nic_qp_event(qp, events[i].events, now);
+            } else if (TAG_UD == kind) {
+                nic_ud_event(now);
+            }
+        }
+        ud_input(now);
+
+        /* packets held by the link model */
+        for (i = 0; i < SIM_MAX_QPS; ++i) {
+            struct sim_qp *qp = nic.qps[i];
+            if (!qp || !qp->due_ns || qp->dead) continue;
+            if (qp->due_ns <= now) {
+                if (qp->stalled) {
+                    qp_input_answers(qp, now);
+                } else {
+                    qp_input(qp, now);
+                }
+            } else {
+                nic_timer(qp->due_ns);
+            }
+        }
+        pthread_mutex_unlock(&nic.lock);
+    }
+    return NULL;
+}
+
+/***************************************************************************//**
+ * The connection manager
+ *
+ ******************************************************************************/
+
+struct ibv_context **rdma_get_devices(int *num_devices) {
+    if (num_devices) *num_devices = 1;
+    return sim_devices;
+}
+
+void rdma_free_devices(struct ibv_context **list) {
+}
+
+struct rdma_event_channel *rdma_create_event_channel(void) {
+    struct sim_channel *ch = calloc(1, sizeof(struct sim_channel));
+    int fds[2];
+    if (!ch || 0 != pipe2(fds, O_CLOEXEC)) {
+        free(ch);
+        return NULL;
+    }
+    set_nonblock(fds[1]);
+    ch->channel.fd = fds[0];
+    ch->wfd = fds[1];
+    return &ch->channel;
+}
+
+void rdma_destroy_event_channel(struct rdma_event_channel *channel) {
+    struct sim_channel *ch = (struct sim_channel *)channel;
+    while (ch->head) {
+        struct sim_event *e = ch->head;
+        ch->head = e->next;
+        free(e);
+    }
+    close(ch->channel.fd);
+    close(ch->wfd);
+    free(ch);
+}
+
+/* queue a event on the channel of id, under the lock */
+static struct rdma_cm_event *cm_raise(struct sim_id *sid, struct sim_id *listen,
+        enum rdma_cm_event_type type, int status) {
+    struct sim_channel *ch = (struct sim_channel *)(listen ? listen : sid)->id.channel;
+    struct sim_event *e = calloc(1, sizeof(struct sim_event));
+    if (!ch || !e) {
+        free(e);
+        return NULL;
+    }
+    e->event.id = &sid->id;
+    e->event.listen_id = listen ? &listen->id : NULL;
+    e->event.event = type;
+    e->event.status = status;
+
+    if (ch->tail) {
+        ch->tail->next = e;
+    } else {
+        ch->head = e;
+    }
+    ch->tail = e;
+
+    char c = 0;
+    if (1 != write(ch->wfd, &c, 1)) perror("simverbs: event channel");
+    return &e->event;
+}
+
+int rdma_get_cm_event(struct rdma_event_channel *channel, struct rdma_cm_event **event) {
+    struct sim_channel *ch = (struct sim_channel *)channel;
+    char c;
+    if (0 != full_read(channel->fd, &c, 1)) return -1;
+
+    pthread_mutex_lock(&nic.lock);
+    struct sim_event *e = ch->head;
+    if ( !(ch->head = e->next) ) ch->tail = NULL;
+    pthread_mutex_unlock(&nic.lock);
+
+    *event = &e->event;
+    return 0;
+}
+
+int rdma_ack_cm_event(struct rdma_cm_event *event) {
+    free(event);
+    return 0;
+}
+
+const char *rdma_event_str(enum rdma_cm_event_type event) {
+    static const char *names[] = {
+        "RDMA_CM_EVENT_ADDR_RESOLVED",
+        "RDMA_CM_EVENT_ADDR_ERROR",
+        "RDMA_CM_EVENT_ROUTE_RESOLVED",
+        "RDMA_CM_EVENT_ROUTE_ERROR",
+        "RDMA_CM_EVENT_CONNECT_REQUEST",
+        "RDMA_CM_EVENT_CONNECT_RESPONSE",
+        "RDMA_CM_EVENT_CONNECT_ERROR",
+        "RDMA_CM_EVENT_UNREACHABLE",
+        "RDMA_CM_EVENT_REJECTED",
+        "RDMA_CM_EVENT_ESTABLISHED",
+        "RDMA_CM_EVENT_DISCONNECTED",
+        "RDMA_CM_EVENT_DEVICE_REMOVAL",
+    };
+    if ((unsigned)event < sizeof(names) / sizeof(names[0])) return names[event];
+    return "UNKNOWN EVENT";
+}
+
+static struct sim_id *id_new(struct rdma_event_channel *channel, void *context,
+        enum rdma_port_space ps) {
+    struct sim_id *sid = calloc(1, sizeof(struct sim_id));
+    if (!sid) return NULL;
+    sid->id.verbs = &sim_context;
+    sid->id.channel = channel;
+    sid->id.context = context;
+    sid->id.ps = ps;
+    sid->id.port_num = 1;
+    sid->id.qp_type = IBV_QPT_RC;
+    sid->listen = -1;
+    sid->lfd = -1;
+    sid->fd = -1;
+    return sid;
+}
+
+int rdma_create_id(struct rdma_event_channel *channel, struct rdma_cm_id **id, void *context,
+        enum rdma_port_space ps) {
+    struct sim_id *sid = id_new(channel, context, ps);
+    if (!sid) {
+        errno = ENOMEM;
+        return -1;
+    }
+    nic_start();
+    *id = &sid->id;
+    return 0;
+}
+
+int rdma_destroy_id(struct rdma_cm_id *id) {
+    struct sim_id *sid = (struct sim_id *)id;
+
+    pthread_mutex_lock(&nic.lock);
+    if (-1 != sid->listen) nic.listens[sid->listen] = NULL;
+    if (id->qp) ((struct sim_qp *)id->qp)->id = NULL;
+    pthread_mutex_unlock(&nic.lock);
+
+    if (-1 != sid->lfd) close(sid->lfd);
+    if (-1 != sid->fd) close(sid->fd);
+    free(sid);
+    return 0;
+}
+
+int rdma_migrate_id(struct rdma_cm_id *id, struct rdma_event_channel *channel) {
+    pthread_mutex_lock(&nic.lock);
+    id->channel = channel;
+    pthread_mutex_unlock(&nic.lock);
+    return 0;
+}
+
+int rdma_getaddrinfo(const char *node, const char *service, const struct rdma_addrinfo *hints,
+        struct rdma_addrinfo **res) {
+    struct rdma_addrinfo *ai = calloc(1, sizeof(struct rdma_addrinfo));
+    struct sockaddr_in *sin = calloc(1, sizeof(struct sockaddr_in));
+    if (!ai || !sin) {
+        free(ai);
+        free(sin);
+        errno = ENOMEM;
+        return -1;
+    }
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(service ? atoi(service) : 0);
+
+    ai->ai_family = AF_INET;
+    ai->ai_qp_type = IBV_QPT_RC;
+    ai->ai_port_space = hints ? hints->ai_port_space : RDMA_PS_TCP;
+    if (hints && (hints->ai_flags & RAI_PASSIVE)) {
+        ai->ai_flags = RAI_PASSIVE;
+        ai->ai_src_addr = (struct sockaddr *)sin;
+        ai->ai_src_len = sizeof(*sin);
+    } else {
+        ai->ai_dst_addr = (struct sockaddr *)sin;
+        ai->ai_dst_len = sizeof(*sin);
+    }
+    *res = ai;
+    return 0;
+}
+
+void rdma_freeaddrinfo(struct rdma_addrinfo *res) {
+    while (res) {
+        struct rdma_addrinfo *next = res->ai_next;
+        free(res->ai_src_addr);
+        free(res->ai_dst_addr);
+        free(res);
+        res = next;
+    }
+}
+
+int rdma_bind_addr(struct rdma_cm_id *id, struct sockaddr *addr) {
+    ((struct sim_id *)id)->port = ntohs(((struct sockaddr_in *)addr)->sin_port);
+    return 0;
+}
+
+int rdma_listen(struct rdma_cm_id *id, int backlog) {
+    struct sim_id *sid = (struct sim_id *)id;
+    struct sockaddr_un sun;
+    socklen_t len = sim_addr(&sun, "port", sid->port);
+
+    if (-1 == (sid->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))) return -1;
+    if (0 != bind(sid->lfd, (struct sockaddr *)&sun, len) || 0 != listen(sid->lfd, backlog)) {
+        close(sid->lfd);
+        sid->lfd = -1;
+        return -1;
+    }
+
+    pthread_mutex_lock(&nic.lock);
+    int i = 0;
+    for (i = 0; i < SIM_MAX_LISTENS && nic.listens[i]; ++i) {}
+    if (i < SIM_MAX_LISTENS) {
+        nic.listens[i] = sid;
+        sid->listen = i;
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG(TAG_LISTEN, i) };
+        epoll_ctl(nic.epfd, EPOLL_CTL_ADD, sid->lfd, &ev);
+    }
+    pthread_mutex_unlock(&nic.lock);
+    if (i == SIM_MAX_LISTENS) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/* a connection request arrives at a listening id, under the lock */
+static void nic_accept(struct sim_id *listen) {
+    int fd;
+    while (-1 != (fd = accept4(listen->lfd, NULL, NULL, SOCK_CLOEXEC))) {
+        /* the requester sends the request right after connecting */
+        struct pkt_hdr hdr;
+        struct sim_id *sid = NULL;
+        if (0 != full_read(fd, &hdr, sizeof(hdr)) || PKT_CONN_REQ != hdr.type ||
+                !(sid = id_new(listen->id.channel, listen->id.context, listen->id.ps))) {
+            close(fd);
+            continue;
+        }
+        sid->port = listen->port;
+        sid->fd = fd;
+        sid->remote_qpn = hdr.qp_num;
+        cm_raise(sid, listen, RDMA_CM_EVENT_CONNECT_REQUEST, 0);
+    }
+}
+
+/* the QP of id takes over the connected socket, under the lock */
+static void qp_attach(struct sim_id *sid, int fd, uint32_t remote_qpn) {
+    struct sim_qp *qp = (struct sim_qp *)sid->id.qp;
+    qp->fd = fd;
+    qp->remote_qpn = remote_qpn;
+    set_nonblock(fd);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG(TAG_QP, qp->qp.qp_num) };
+    if (0 == epoll_ctl(nic.epfd, EPOLL_CTL_ADD, fd, &ev)) qp->polled = 1;
+    qp_flush(qp);
+}
+
+int rdma_resolve_addr(struct rdma_cm_id *id, struct sockaddr *src_addr, struct sockaddr *dst_addr,
+        int timeout_ms) {
+    struct sim_id *sid = (struct sim_id *)id;
+    sid->port = ntohs(((struct sockaddr_in *)dst_addr)->sin_port);
+
+    pthread_mutex_lock(&nic.lock);
+    cm_raise(sid, NULL, RDMA_CM_EVENT_ADDR_RESOLVED, 0);
+    pthread_mutex_unlock(&nic.lock);
+    return 0;
+}
+
+int rdma_resolve_route(struct rdma_cm_id *id, int timeout_ms) {
+    pthread_mutex_lock(&nic.lock);
+    cm_raise((struct sim_id *)id, NULL, RDMA_CM_EVENT_ROUTE_RESOLVED, 0);
+    pthread_mutex_unlock(&nic.lock);
+    return 0;
+}
+
+int rdma_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr) {
+    struct ibv_qp_init_attr attr = *qp_init_attr;
+
+    /* like librdmacm, a id without cqs gets its own */
+    if (!attr.send_cq) {
+        if ( !(id->send_cq = ibv_create_cq(&sim_context, attr.cap.max_send_wr, id, NULL, 0)) ) return -1;
+        attr.send_cq = id->send_cq;
+    }
+    if (!attr.recv_cq) {
+        if ( !(id->recv_cq = ibv_create_cq(&sim_context, attr.cap.max_recv_wr, id, NULL, 0)) ) return -1;
+        attr.recv_cq = id->recv_cq;
+    }
+
+    struct ibv_qp *qp = ibv_create_qp(pd, &attr);
+    if (!qp) return -1;
+
+    pthread_mutex_lock(&nic.lock);
+    if (IBV_QPT_UD == qp->qp_type) ((struct sim_qp *)qp)->qkey = RDMA_UDP_QKEY;
+    ((struct sim_qp *)qp)->id = (struct sim_id *)id;
+    id->qp = qp;
+    id->pd = pd;
+    pthread_mutex_unlock(&nic.lock);
+    return 0;
+}
+
+void rdma_destroy_qp(struct rdma_cm_id *id) {
+    if (id->qp) ibv_destroy_qp(id->qp);
+    id->qp = NULL;
+}
+
+int rdma_connect(struct rdma_cm_id *id, struct rdma_conn_param *conn_param) {
+    struct sim_id *sid = (struct sim_id *)id;
+    if (!id->qp && RDMA_PS_UDP != id->ps) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sockaddr_un sun;
+    socklen_t len = sim_addr(&sun, "port", sid->port);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (-1 == fd) return -1;
+    if (0 != connect(fd, (struct sockaddr *)&sun, len)) {
+        close(fd);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    struct pkt_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = PKT_CONN_REQ;
+    hdr.qp_num = id->qp ? id->qp->qp_num : 0;
+    if (0 != full_write(fd, &hdr, sizeof(hdr)) || 0 != full_read(fd, &hdr, sizeof(hdr)) ||
+            PKT_CONN_REP != hdr.type) {
+        close(fd);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    /* a UDP id only learns the address of the remote QP */
+    if (RDMA_PS_UDP == id->ps) {
+        close(fd);
+        pthread_mutex_lock(&nic.lock);
+        struct rdma_cm_event *e = cm_raise(sid, NULL, RDMA_CM_EVENT_ESTABLISHED, 0);
+        if (e) {
+            e->param.ud.ah_attr.dlid = hdr.lid;
+            e->param.ud.ah_attr.port_num = 1;
+            e->param.ud.qp_num = hdr.qp_num;
+            e->param.ud.qkey = hdr.qkey;
+        }
+        pthread_mutex_unlock(&nic.lock);
+        return 0;
+    }
+
+    pthread_mutex_lock(&nic.lock);
+    qp_attach(sid, fd, hdr.qp_num);
+    cm_raise(sid, NULL, RDMA_CM_EVENT_ESTABLISHED, 0);
+    pthread_mutex_unlock(&nic.lock);
+    return 0;
+}
+
+int rdma_accept(struct rdma_cm_id *id, struct rdma_conn_param *conn_param) {
+    struct sim_id *sid = (struct sim_id *)id;
+    int ud = RDMA_PS_UDP == id->ps;
+    if ((!id->qp && !(ud && conn_param)) || -1 == sid->fd) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct pkt_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = PKT_CONN_REP;
+    hdr.qp_num = id->qp ? id->qp->qp_num : conn_param->qp_num;
+    if (ud) {
+        pthread_mutex_lock(&nic.lock);
+        struct sim_qp *qp = qp_lookup(hdr.qp_num);
+        hdr.qkey = qp ? qp->qkey : RDMA_UDP_QKEY;
+        hdr.lid = nic.lid;
+        pthread_mutex_unlock(&nic.lock);
+    }
+    if (0 != full_write(sid->fd, &hdr, sizeof(hdr))) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    /* a UDP id is done, the requester sends datagrams to the QP */
+    if (ud) {
+        close(sid->fd);
+        sid->fd = -1;
+        return 0;
+    }
+
+    pthread_mutex_lock(&nic.lock);
+    qp_attach(sid, sid->fd, sid->remote_qpn);
+    sid->fd = -1;
+    cm_raise(sid, NULL, RDMA_CM_EVENT_ESTABLISHED, 0);
+    pthread_mutex_unlock(&nic.lock);
+    return 0;
+}
+
+int rdma_reject(struct rdma_cm_id *id, const void *private_data, uint8_t private_data_len) {
+    struct sim_id *sid = (struct sim_id *)id;
+    if (-1 == sid->fd) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct pkt_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = PKT_CONN_REJ;
+    full_write(sid->fd, &hdr, sizeof(hdr));
+    close(sid->fd);
+    sid->fd = -1;
+    return 0;
+}
+
+int rdma_disconnect(struct rdma_cm_id *id) {
+    struct sim_id *sid = (struct sim_id *)id;
+
+    /* a request not accepted yet is refused */
+    if (-1 != sid->fd) return rdma_reject(id, NULL, 0);
+
+    pthread_mutex_lock(&nic.lock);
+    struct sim_qp *qp = (struct sim_qp *)id->qp;
+    if (qp && -1 != qp->fd) {
+        shutdown(qp->fd, SHUT_RDWR);    /* both NICs see the end of stream */
+    }
+    pthread_mutex_unlock(&nic.lock);
+    return 0;
+}
+
+uint16_t rdma_get_src_port(struct rdma_cm_id *id) {
+    return htons(((struct sim_id *)id)->port);
+}
+
+uint16_t rdma_get_dst_port(struct rdma_cm_id *id) {
+    return htons(((struct sim_id *)id)->port);
+}
@@ -0,0 +1,219 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "slabs.h"
+
+/*******************************************************************************/
+
+#define CHUNK_ALIGN 8
+
+#define PAGE_OF(s, ptr) ((size_t)((char*)(ptr) - (s)->base) / SLAB_PAGE_SIZE)
+
+slabs_t* slabs_create(size_t limit) {
+    size_t page_count = limit / SLAB_PAGE_SIZE;
+    if (0 == page_count) {
+        fprintf(stderr, "the memory limit is smaller than a slab page\n");
+        return NULL;
+    }
+
+    slabs_t *s = calloc(1, sizeof(slabs_t));
+    if (!s) {
+        fprintf(stderr, "out of memory in slabs_create()\n");
+        return NULL;
+    }
+
+    s->page_count = page_count;
+    s->limit = page_count * SLAB_PAGE_SIZE;
+    s->page_class = calloc(page_count, sizeof(uint8_t));
+    s->page_used = calloc(page_count, sizeof(uint32_t));
+    s->free_pages = calloc(page_count, sizeof(uint32_t));
+    s->empty_pages = calloc(page_count, sizeof(uint32_t));
+    s->page_queued = calloc(page_count, sizeof(uint8_t));
+    if (!s->page_class || !s->page_used || !s->free_pages || !s->empty_pages || !s->page_queued) {
+        slabs_free(s);
+        fprintf(stderr, "out of memory in slabs_create()\n");
+        return NULL;
+    }
+
+    s->base = mmap(NULL, s->limit, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == s->base) {
+        s->base = NULL;
+        slabs_free(s);
+        perror("mmap()");
+        return NULL;
+    }
+
+    /* chunk sizes grow by the factor, the last class holds a whole page */
+    size_t size = SLAB_CHUNK_MIN;
+    int i = 1;
+    while (i < SLAB_MAX_CLASSES && size <= SLAB_PAGE_SIZE / SLAB_GROWTH_FACTOR) {
+        s->classes[i].size = size;
+        s->classes[i].perslab = SLAB_PAGE_SIZE / size;
+        size = (size_t)(size * SLAB_GROWTH_FACTOR);
+        size = (size + CHUNK_ALIGN - 1) & ~(size_t)(CHUNK_ALIGN - 1);
+        ++i;
+    }
+    s->classes[i].size = SLAB_PAGE_SIZE;
+    s->classes[i].perslab = 1;
+    s->nclasses = i;
+
+    return s;
+}
+
+void slabs_free(slabs_t *s) {
+    if (s) {
+        if (s->base) munmap(s->base, s->limit);
+        free(s->page_class);
+        free(s->page_used);
+        free(s->free_pages);
+        free(s->empty_pages);
+        free(s->page_queued);
+        free(s);
+    }
+}
+
+int slabs_clsid(slabs_t *s, size_t size) {
+    int id = 1;
+    if (0 == size || size > SLAB_PAGE_SIZE) return 0;
+
+    while (size > s->classes[id].size) ++id;
+    return id;
+}
+
+/* take a page nobody uses, -1 if the arena is exhausted */
+static long grab_page(slabs_t *s) {
+    if (s->free_page_top > 0) {
+        return s->free_pages[--s->free_page_top];
+    }
+    if (s->next_page < s->page_count) {
+        return s->next_page++;
+    }
+    return -1;
+}
+
+/* split a page into chunks of class id */
+static void carve_page(slabs_t *s, size_t page, int id) {
+    slabclass_t *cls = &s->classes[id];
+    char *start = s->base + page * SLAB_PAGE_SIZE;
+    size_t i = 0;
+
+    for (i = cls->perslab; i > 0; --i) {
+        void **chunk = (void**)(start + (i - 1) * cls->size);
+        *chunk = cls->free_chunks;
+        cls->free_chunks = chunk;
+    }
+    cls->free_count += cls->perslab;
+    cls->pages += 1;
+    s->page_class[page] = id;
+    s->page_used[page] = 0;
+}
+
+/* take a page with no chunk in use out of its class, the caller clears it */
+static void release_page(slabs_t *s, size_t page) {
+    slabclass_t *cls = &s->classes[s->page_class[page]];
+    char *start = s->base + page * SLAB_PAGE_SIZE;
+    char *end = start + SLAB_PAGE_SIZE;
+
+    void **prev = &cls->free_chunks;
+    void *chunk = cls->free_chunks;
+    while (chunk) {
+        void *next = *(void**)chunk;
+        if ((char*)chunk >= start && (char*)chunk < end) {
+            *prev = next;
+        } else {
+            prev = (void**)chunk;
+        }
+        chunk = next;
+    }
+
+    cls->free_count -= cls->perslab;
+    cls->pages -= 1;
+    s->page_class[page] = 0;
+}
+
+void slabs_clear_page(slabs_t *s, size_t page) {
+    /* the next class sees no stale headers when it walks its chunks */
+    memset(s->base + page * SLAB_PAGE_SIZE, 0, SLAB_PAGE_SIZE);
+}
+
+long slabs_take_unused(slabs_t *s, int id) {
+    size_t page = 0;
+
+    for (page = 0; page < s->next_page; ++page) {
+        int victim = s->page_class[page];
+        if (0 == victim || victim == id || 0 != s->page_used[page]) continue;
+
+        release_page(s, page);
+        s->classes[victim].pages_moved_out += 1;
+        return page;
+    }
+    return -1;
+}
+
+void *slabs_alloc(slabs_t *s, int id) {
+    if (id < 1 || id > s->nclasses) return NULL;
+    slabclass_t *cls = &s->classes[id];
+
+    if (!cls->free_chunks) {
+        int moved = s->free_page_top > 0;
+        long page = grab_page(s);
+        if (page < 0) {
+            cls->alloc_fails += 1;
+            return NULL;
+        }
+        carve_page(s, page, id);
+        if (moved) cls->pages_moved_in += 1;
+    }
+
+    void **chunk = cls->free_chunks;
+    cls->free_chunks = *chunk;
+    cls->free_count -= 1;
+    cls->used_count += 1;
+    s->page_used[PAGE_OF(s, chunk)] += 1;
+
+    return chunk;
+}
+
+int slabs_release(slabs_t *s, void *ptr, int id) {
+    slabclass_t *cls = &s->classes[id];
+    size_t page = PAGE_OF(s, ptr);
+
+    *(void**)ptr = cls->free_chunks;
+    cls->free_chunks = ptr;
+    cls->free_count += 1;
+    cls->used_count -= 1;
+
+    if (0 != --s->page_used[page] || s->page_queued[page]) return 0;
+
+    s->page_queued[page] = 1;
+    s->empty_pages[s->empty_count++] = page;
+    return 1;
+}
+
+long slabs_take_empty(slabs_t *s) {
+    while (s->empty_count > 0) {
+        size_t page = s->empty_pages[--s->empty_count];
+        s->page_queued[page] = 0;
+
+        /* the page may have been reused, or moved by slabs_take_unused(),
+         * since it was queued */
+        int id = s->page_class[page];
+        if (0 == id || 0 != s->page_used[page]) continue;
+
+        /* the class keeps another page worth of free chunks, let other
+         * classes have this one as the size mix shifts */
+        slabclass_t *cls = &s->classes[id];
+        if (cls->free_count < 2 * cls->perslab) continue;
+
+        release_page(s, page);
+        cls->pages_moved_out += 1;
+        return page;
+    }
+    return -1;
+}
+
+void slabs_put_page(slabs_t *s, size_t page) {
+    s->free_pages[s->free_page_top++] = page;
+}
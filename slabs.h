@@ -0,0 +1,143 @@
+/*
+ * Description: a size-classed slab allocator carved from one arena, so the
+ *              arena can be registered with the NIC once and every chunk is
+ *              directly usable as a RDMA source or target
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_PAGE_SIZE      (2 * 1024 * 1024)   /* holds a MEMCACHED_MAX_REQUEST value */
+#define SLAB_CHUNK_MIN      96
+#define SLAB_GROWTH_FACTOR  1.25
+#define SLAB_MAX_CLASSES    64
+
+/* one size class */
+typedef struct slabclass_s {
+    size_t      size;           /* the size of each chunk */
+    size_t      perslab;        /* chunks per page */
+
+    void        *free_chunks;   /* linked through the first word of chunk */
+    size_t      free_count;
+    size_t      used_count;
+    size_t      pages;
+
+    size_t      alloc_fails;    /* no chunk and no page could be found */
+    size_t      pages_moved_in;
+    size_t      pages_moved_out;
+} slabclass_t;
+
+/* the struct of slab allocator */
+typedef struct slabs_s {
+    char        *base;          /* the arena */
+    size_t      limit;          /* the size of arena */
+
+    size_t      page_count;
+    size_t      next_page;      /* pages never handed out start from here */
+    uint8_t     *page_class;    /* page -> class id, 0 means free */
+    uint32_t    *page_used;     /* page -> chunks in use */
+    uint32_t    *free_pages;    /* stack of pages given back by classes */
+    size_t      free_page_top;
+    uint32_t    *empty_pages;   /* pages found empty on release, still in their class */
+    size_t      empty_count;
+    uint8_t     *page_queued;   /* page -> 1 while it is in empty_pages */
+
+    int         nclasses;       /* class ids are 1..nclasses */
+    slabclass_t classes[SLAB_MAX_CLASSES + 1];
+} slabs_t;
+
+/***************************************************************************//**
+ * Create the slab allocator and its arena
+ *
+ * @param[in] limit     the size of arena in bytes, rounded down to pages
+ * @return              the pointer to slab allocator, NULL on failure
+ *
+ ******************************************************************************/
+slabs_t* slabs_create(size_t limit);
+
+/***************************************************************************//**
+ * Free the slab allocator and its arena
+ *
+ * @param[in] s     the pointer to slab allocator
+ *
+ ******************************************************************************/
+void slabs_free(slabs_t *s);
+
+/***************************************************************************//**
+ * Find the class fitting a size
+ *
+ * @param[in] s     the pointer to slab allocator
+ * @param[in] size  the size of object
+ * @return          the class id, 0 if the object is too large
+ *
+ ******************************************************************************/
+int slabs_clsid(slabs_t *s, size_t size);
+
+/***************************************************************************//**
+ * Allocate a chunk. When the class has no free chunk it takes a cleared page
+ * from the arena. Moving pages between classes is left to the caller, see
+ * slabs_take_unused(), as it walks a free list and clears a page.
+ *
+ * @param[in] s     the pointer to slab allocator
+ * @param[in] id    the class id
+ * @return          the chunk, NULL if there is no memory
+ *
+ ******************************************************************************/
+void *slabs_alloc(slabs_t *s, int id);
+
+/***************************************************************************//**
+ * Give a chunk back to its class. A page left with no chunk in use is only
+ * queued, taking it out of the class is left to slabs_take_empty().
+ *
+ * @param[in] s     the pointer to slab allocator
+ * @param[in] ptr   the chunk
+ * @param[in] id    the class id
+ * @return          1 if a page was queued, 0 otherwise
+ *
+ ******************************************************************************/
+int slabs_release(slabs_t *s, void *ptr, int id);
+
+/***************************************************************************//**
+ * Take a queued page out of its class, if it is still empty and the class
+ * keeps another page worth of free chunks. The page is not cleared, the
+ * caller clears it with slabs_clear_page(), which needs no lock as nobody
+ * else reaches the page, and hands it on with slabs_put_page().
+ *
+ * @param[in] s     the pointer to slab allocator
+ * @return          the page, -1 once the queue is drained
+ *
+ ******************************************************************************/
+long slabs_take_empty(slabs_t *s);
+
+/***************************************************************************//**
+ * Zero a page taken by slabs_take_empty() or slabs_take_unused()
+ *
+ ******************************************************************************/
+void slabs_clear_page(slabs_t *s, size_t page);
+
+/***************************************************************************//**
+ * Make a cleared page available to every class
+ *
+ ******************************************************************************/
+void slabs_put_page(slabs_t *s, size_t page);
+
+/***************************************************************************//**
+ * Take a page with no chunk in use out of a class other than id, whatever
+ * free chunks that class keeps. Like slabs_take_empty(), the page is cleared
+ * and handed on by the caller.
+ *
+ * @param[in] s     the pointer to slab allocator
+ * @param[in] id    the class id which needs a page
+ * @return          the page, -1 if no other class has a page unused
+ *
+ ******************************************************************************/
+long slabs_take_unused(slabs_t *s, int id);
+
+/***************************************************************************//**
+ * Check whether a pointer lies in the arena
+ *
+ ******************************************************************************/
+#define slabs_owns(s, ptr) \
+    ((char*)(ptr) >= (s)->base && (char*)(ptr) < (s)->base + (s)->limit)
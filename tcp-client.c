@@ -112,7 +112,7 @@ int main(int argc, char *argv[]) {
     }
     struct timespec start,
                     finish;
-    clock_gettime(CLOCK_REALTIME, &start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     int sockfd = build_connect(pstr_server, pstr_port);
     if (sockfd < 0) {
@@ -121,7 +121,7 @@ int main(int argc, char *argv[]) {
     }
     test_speed(sockfd, buff_size, request_number);
 
-    clock_gettime(CLOCK_REALTIME, &finish);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
     printf("MAIN Cost time: %lf secs\n", (double)(finish.tv_sec-start.tv_sec + 
                 (double)(finish.tv_nsec - start.tv_nsec)/1000000000 ));
 
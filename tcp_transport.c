@@ -0,0 +1,196 @@
+/***************************************************************************//**
+ * @file tcp_transport.c
+ * The TCP transport, a request is processed once it is complete in the input
+ * buffer, and its reply is copied to the output buffer right away
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "proto.h"
+#include "transport.h"
+
+/***************************************************************************//**
+ * Settings
+ *
+ ******************************************************************************/
+
+static int      backlog = 1024;
+static int      verbose = 0;
+
+struct tcp_conn {
+    struct bufferevent      *bev;
+    struct request          req;        /* one request at a time */
+    char                    rbuf[REPLY_SIZE];
+    int                     closing;    /* close once the output is sent */
+    uint32_t                hashes_checked;
+};
+
+/***************************************************************************//**
+ * The transport for the protocol engine, requests never wait for the network
+ *
+ ******************************************************************************/
+static void
+tcp_finish(struct request *req) {
+    proto_release(req);
+}
+
+static void
+tcp_send_reply(struct request *req) {
+    struct tcp_conn *c = req->conn;
+    struct evbuffer *out = bufferevent_get_output(c->bev);
+    int i = 0;
+
+    for (i = 0; i < req->niov; ++i) {
+        evbuffer_add(out, req->iov[i].iov_base, req->iov[i].iov_len);
+    }
+    tcp_finish(req);
+}
+
+static const struct transport tcp_transport = {
+    .name           = "tcp",
+    .send_reply     = tcp_send_reply,
+    .finish         = tcp_finish,
+    .write_remote   = NULL,
+    .read_remote    = NULL,
+    .counters_rkey  = NULL,
+};
+
+/***************************************************************************//**
+ * Description
+ * Release the connection
+ *
+ ******************************************************************************/
+static void
+release_conn(struct tcp_conn *c) {
+    proto_release(&c->req);
+    bufferevent_free(c->bev);
+    free(c);
+    proto_conn_closed();
+}
+
+/***************************************************************************//**
+ * Description
+ * Process every complete request in the input buffer
+ *
+ ******************************************************************************/
+static void
+read_handle(struct bufferevent *bev, void *arg) {
+    struct tcp_conn *c = arg;
+    struct evbuffer *in = bufferevent_get_input(bev);
+    size_t len = 0;
+
+    while (!c->closing && (len = evbuffer_get_length(in)) > 0) {
+        /* the command line tells the length of request */
+        size_t head = len < 2 * LINE_MAX_LENGTH ? len : 2 * LINE_MAX_LENGTH;
+        long total = proto_request_length((char*)evbuffer_pullup(in, head), head);
+
+        if (total < 0) {
+            evbuffer_add_printf(bufferevent_get_output(bev), "SERVER_ERROR request too large\r\n");
+            c->closing = 1;
+            return;
+        }
+        if (0 == total || total > len) {
+            return;
+        }
+
+        char *buf = (char*)evbuffer_pullup(in, total);
+        if (verbose) {
+            printf("tcp request: %.*s\n", (int)(total < 64 ? total : 64), buf);
+        }
+        proto_process(&c->req, buf, total);
+        evbuffer_drain(in, total);
+    }
+}
+
+static void
+write_handle(struct bufferevent *bev, void *arg) {
+    struct tcp_conn *c = arg;
+
+    if (c->closing) {
+        release_conn(c);
+    }
+}
+
+static void
+event_handle(struct bufferevent *bev, short events, void *arg) {
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        release_conn(arg);
+    }
+}
+
+static void
+accept_handle(struct evconnlistener *listener, evutil_socket_t fd,
+        struct sockaddr *addr, int socklen, void *arg) {
+    struct tcp_conn *c = calloc(1, sizeof(struct tcp_conn));
+    if (!c) {
+        fprintf(stderr, "out of memory in accept_handle()\n");
+        evutil_closesocket(fd);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!c->bev) {
+        free(c);
+        evutil_closesocket(fd);
+        return;
+    }
+    c->req.tp = &tcp_transport;
+    c->req.conn = c;
+    c->req.rbuf = c->rbuf;
+    c->req.hashes_checked = &c->hashes_checked;
+
+    bufferevent_setcb(c->bev, read_handle, write_handle, event_handle, c);
+    bufferevent_enable(c->bev, EV_READ | EV_WRITE);
+    proto_conn_opened();
+}
+
+/***************************************************************************//**
+ * Return
+ * 0 on success, -1 on failure
+ *
+ * Description
+ * Listen on TCP in the event loop of base
+ *
+ ******************************************************************************/
+int
+tcp_transport_init(struct event_base *base, const char *port, int verbosity) {
+    struct addrinfo hints, *res = NULL;
+    struct evconnlistener *listener = NULL;
+
+    verbose = verbosity;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (0 != getaddrinfo(NULL, port, &hints, &res)) {
+        perror("getaddrinfo()");
+        return -1;
+    }
+
+    listener = evconnlistener_new_bind(base, accept_handle, NULL,
+            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, backlog, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (!listener) {
+        perror("evconnlistener_new_bind()");
+        return -1;
+    }
+
+    printf("Listening on TCP port %s\n", port);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+/*******************************************************************************/
+
+int trace_write(const char *path, struct trace_rec *recs, uint64_t count) {
+    struct trace_header h;
+    uint64_t i = 0, first = count ? recs[0].ns : 0;
+    FILE *f = fopen(path, "wb");
+
+    if (!f) {
+        perror("fopen()");
+        return -1;
+    }
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    h.count = count;
+    for (i = 0; i < count; ++i) {
+        recs[i].ns -= first;
+    }
+    if (1 != fwrite(&h, sizeof(h), 1, f)
+            || count != fwrite(recs, sizeof(struct trace_rec), count, f)) {
+        perror("fwrite()");
+        fclose(f);
+        return -1;
+    }
+    return 0 == fclose(f) ? 0 : -1;
+}
+
+int trace_open(struct trace *t, const char *path) {
+    const struct trace_header *h = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    memset(t, 0, sizeof(*t));
+    if (-1 == fd || 0 != fstat(fd, &st)) {
+        perror(path);
+        if (-1 != fd) close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        close(fd);
+        return -1;
+    }
+
+    t->size = st.st_size;
+    t->map = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == t->map) {
+        perror("mmap()");
+        t->map = NULL;
+        return -1;
+    }
+
+    h = t->map;
+    if (0 != memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic))
+            || h->count > (t->size - sizeof(*h)) / sizeof(struct trace_rec)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        trace_close(t);
+        return -1;
+    }
+    t->recs = (const struct trace_rec *)(h + 1);
+    t->count = h->count;
+    return 0;
+}
+
+void trace_close(struct trace *t) {
+    if (t->map) munmap(t->map, t->size);
+    memset(t, 0, sizeof(*t));
+}
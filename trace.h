@@ -0,0 +1,59 @@
+/*
+ * Description: a compact binary trace of requests, a header and then one
+ *              fixed-size record per request in the order sent. A key is kept
+ *              as its hash and length, so a trace holds no data of its own;
+ *              a replay makes a key of that length out of the hash. A trace
+ *              is read through mmap.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC     "MCTRACE1"
+
+struct trace_header {
+    char        magic[8];
+    uint64_t    count;
+};
+
+struct trace_rec {
+    uint64_t    ns;         /* since the first request */
+    uint64_t    key_hash;   /* hash64() of key */
+    uint32_t    nvalue;     /* the value of a set */
+    uint8_t     op;         /* WORKLOAD_GET or WORKLOAD_SET */
+    uint8_t     nkey;
+    uint16_t    reserved;
+};
+
+/* a trace mapped for reading */
+struct trace {
+    void                    *map;
+    size_t                  size;
+    const struct trace_rec  *recs;
+    uint64_t                count;
+};
+
+/***************************************************************************//**
+ * Write a trace, the records are made relative to the first one
+ *
+ * @param[in] path      the file
+ * @param[in] recs      the records, in the order sent
+ * @param[in] count     the number of records
+ * @return              0 on success, -1 on failure
+ *
+ ******************************************************************************/
+int trace_write(const char *path, struct trace_rec *recs, uint64_t count);
+
+/***************************************************************************//**
+ * Map a trace
+ *
+ * @param[out] t        the trace
+ * @param[in]  path     the file
+ * @return              0 on success, -1 if it cannot be read or is no trace
+ *
+ ******************************************************************************/
+int trace_open(struct trace *t, const char *path);
+
+void trace_close(struct trace *t);
@@ -0,0 +1,51 @@
+/*
+ * Description: the transports of server, each listens in the event loop and
+ *              feeds requests to the protocol engine. The state of a transport
+ *              is per thread, init it on the worker thread which runs base.
+ */
+
+#pragma once
+
+#include <event.h>
+
+#include "counters.h"
+#include "items.h"
+
+/***************************************************************************//**
+ * Listen on TCP
+ *
+ * @param[in] base      the event loop
+ * @param[in] port      the port
+ * @param[in] verbose   print requests
+ * @return              0 on success, -1 on failure
+ *
+ ******************************************************************************/
+int tcp_transport_init(struct event_base *base, const char *port, int verbose);
+
+/***************************************************************************//**
+ * Listen on rdma_cm, the arena of store is registered with the device, and
+ * the counters for remote atomics if there are
+ *
+ * @param[in] base      the event loop
+ * @param[in] store     the item store
+ * @param[in] counters  the counter region, NULL if disabled
+ * @param[in] port      the port
+ * @param[in] verbose   print requests
+ * @return              0 on success, -1 if RDMA is unavailable
+ *
+ ******************************************************************************/
+int rdma_transport_init(struct event_base *base, store_t *store, counters_t *counters,
+        const char *port, int verbose);
+
+/***************************************************************************//**
+ * Serve small requests over one UD QP, a request and its reply are single
+ * datagrams and the client retransmits on loss
+ *
+ * @param[in] base      the event loop
+ * @param[in] store     the item store
+ * @param[in] port      the rdma_cm port clients resolve the UD QP on
+ * @param[in] verbose   print requests
+ * @return              0 on success, -1 if RDMA is unavailable
+ *
+ ******************************************************************************/
+int ud_transport_init(struct event_base *base, store_t *store, const char *port, int verbose);
@@ -0,0 +1,28 @@
+/*
+ * Description: the datagrams of UD mode, a request or a reply is one datagram
+ *              holding the header and then the ASCII command or reply
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+#define UD_MTU_MAX      4096    /* the largest datagram of any port, buffers are this large */
+#define UD_GRH_SIZE     40      /* receive buffers start with room for the GRH */
+
+struct ud_hdr {
+    uint64_t    req_id;         /* chosen by the client, echoed in the reply */
+};
+
+/* the largest datagram the port carries, which is 256 bytes on some RoCE
+ * links, 0 if the port cannot be queried */
+static inline size_t ud_port_mtu(struct ibv_context *ctx, uint8_t port_num) {
+    struct ibv_port_attr attr;
+    if (0 != ibv_query_port(ctx, port_num, &attr)) return 0;
+
+    size_t mtu = (size_t)128 << attr.active_mtu;
+    return mtu < UD_MTU_MAX ? mtu : UD_MTU_MAX;
+}
+
+#define UD_PAYLOAD_MAX(mtu) ((mtu) - sizeof(struct ud_hdr))
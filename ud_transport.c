@@ -0,0 +1,550 @@
+/***************************************************************************//**
+ * @file ud_transport.c
+ * The UD transport, one unreliable datagram QP serves every client. A request
+ * is one datagram and so is its reply, the client sends a request again when
+ * its reply is lost. Values are sent in place from the registered arena.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netdb.h>
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+
+#include <event.h>
+
+#include "hash.h"
+#include "proto.h"
+#include "transport.h"
+#include "ud.h"
+#include "wr_id.h"
+
+/***************************************************************************//**
+ * Settings
+ *
+ ******************************************************************************/
+
+#define UD_BUFFERS      1024    /* receive buffers, requests in flight */
+#define POLL_WC_SIZE    128
+#define RECV_SIZE       (UD_GRH_SIZE + UD_MTU_MAX)
+#define SEND_SIZE       (sizeof(struct ud_hdr) + REPLY_SIZE)
+#define AH_CACHE_SIZE   4096    /* a power of 2, kept at most 3/4 full */
+
+/* a request remembers where its reply goes */
+struct ud_request {
+    struct request          req;
+    struct ud_hdr           *hdr;       /* sent ahead of the reply */
+    struct ibv_ah           *ah;
+    int                     own_ah;     /* not cached, destroyed with the request */
+    uint32_t                qpn;
+};
+
+/* a sender port is its source GID and LID, on RoCE every LID is 0 and
+ * without a GRH the GID is left 0 */
+struct ah_entry {
+    uint8_t                 gid[16];
+    uint16_t                lid;
+    struct ibv_ah           *ah;        /* NULL for a free entry */
+};
+
+struct ud_context {
+    struct ibv_context          **device_ctx_list;
+    struct ibv_context          *device_ctx;
+    struct ibv_comp_channel     *comp_channel;
+    struct ibv_pd               *pd;
+    struct ibv_cq               *cq;
+    struct ibv_qp               *qp;
+
+    struct rdma_event_channel   *cm_channel;
+    struct rdma_cm_id           *listen_id;
+
+    struct event_base           *base;
+    struct event                listen_event;
+    struct event                poll_event;
+
+    store_t                     *store;
+    struct ibv_mr               *arena_mr;  /* the whole slab arena */
+
+    char                        *rbuf;      /* UD_BUFFERS of RECV_SIZE */
+    struct ibv_mr               *rmr;
+    char                        *sbuf;      /* UD_BUFFERS of SEND_SIZE */
+    struct ibv_mr               *smr;
+    struct ud_request           *req_list;
+    size_t                      payload_max;    /* by the active MTU of port */
+
+    /* a address handle per client port, the QP number goes in every send */
+    struct ah_entry             *ah_cache;
+    size_t                      ah_count;
+};
+
+/* each worker has its own UD QP */
+static __thread struct ud_context ud_ctx;
+
+static int      backlog = 1024;
+static __thread const char *port = NULL;
+static int      verbose = 0;
+
+static const struct transport ud_transport;
+
+/***************************************************************************//**
+ * Description
+ * Post the receive buffer at index
+ *
+ ******************************************************************************/
+static void
+post_recv(uint32_t index) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)(ud_ctx.rbuf + (size_t)index * RECV_SIZE),
+        .length = RECV_SIZE,
+        .lkey = ud_ctx.rmr->lkey,
+    };
+    struct ibv_recv_wr wr = {
+        .wr_id = WR_ID_MAKE(WR_OP_RECV, 0, index),
+        .sg_list = &sge,
+        .num_sge = 1,
+    }, *bad = NULL;
+
+    if (0 != ibv_post_recv(ud_ctx.qp, &wr, &bad)) {
+        perror("ibv_post_recv()");
+    }
+}
+
+/***************************************************************************//**
+ * Description
+ * Move the UD QP to RTS, UD needs no remote attributes
+ *
+ ******************************************************************************/
+static int
+init_ud_qp() {
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.cap.max_send_wr = UD_BUFFERS;
+    init_attr.cap.max_recv_wr = UD_BUFFERS;
+    init_attr.cap.max_send_sge = REPLY_MAX_IOV + 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.sq_sig_all = 1;
+    init_attr.qp_type = IBV_QPT_UD;
+    init_attr.send_cq = ud_ctx.cq;
+    init_attr.recv_cq = ud_ctx.cq;
+
+    if ( !(ud_ctx.qp = ibv_create_qp(ud_ctx.pd, &init_attr)) ) {
+        perror("ibv_create_qp");
+        return -1;
+    }
+
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = 1;
+    attr.qkey = RDMA_UDP_QKEY;
+    if (0 != ibv_modify_qp(ud_ctx.qp, &attr,
+                IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY)) {
+        perror("ibv_modify_qp(INIT)");
+        return -1;
+    }
+
+    attr.qp_state = IBV_QPS_RTR;
+    if (0 != ibv_modify_qp(ud_ctx.qp, &attr, IBV_QP_STATE)) {
+        perror("ibv_modify_qp(RTR)");
+        return -1;
+    }
+
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = 0;
+    if (0 != ibv_modify_qp(ud_ctx.qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
+        perror("ibv_modify_qp(RTS)");
+        return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************//**
+ * Description
+ * Init the device, the UD QP and its buffers
+ *
+ ******************************************************************************/
+static int
+init_ud_resources() {
+    int num_device;
+    if ( !(ud_ctx.device_ctx_list = rdma_get_devices(&num_device)) ) {
+        perror("rdma_get_devices()");
+        return -1;
+    }
+    if (0 == num_device) {
+        fprintf(stderr, "no RDMA device found\n");
+        return -1;
+    }
+    ud_ctx.device_ctx = *ud_ctx.device_ctx_list;
+
+    if ( !(ud_ctx.comp_channel = ibv_create_comp_channel(ud_ctx.device_ctx)) ) {
+        perror("ibv_create_comp_channel");
+        return -1;
+    }
+
+    if ( !(ud_ctx.pd = ibv_alloc_pd(ud_ctx.device_ctx)) ) {
+        perror("ibv_alloc_pd");
+        return -1;
+    }
+
+    if ( !(ud_ctx.cq = ibv_create_cq(ud_ctx.device_ctx,
+                    2 * UD_BUFFERS, NULL, ud_ctx.comp_channel, 0)) ) {
+        perror("ibv_create_cq");
+        return -1;
+    }
+
+    if (0 != ibv_req_notify_cq(ud_ctx.cq, 0)) {
+        perror("ibv_req_notify_cq");
+        return -1;
+    }
+
+    if (0 != init_ud_qp()) return -1;
+
+    size_t mtu = ud_port_mtu(ud_ctx.device_ctx, 1);
+    if (mtu <= sizeof(struct ud_hdr)) {
+        fprintf(stderr, "failed to query the MTU of port 1\n");
+        return -1;
+    }
+    ud_ctx.payload_max = UD_PAYLOAD_MAX(mtu);
+
+    /* values are only sent, the arena is not open to remote access */
+    if ( !(ud_ctx.arena_mr = ibv_reg_mr(ud_ctx.pd, ud_ctx.store->slabs->base,
+                    ud_ctx.store->slabs->limit, IBV_ACCESS_LOCAL_WRITE)) ) {
+        perror("ibv_reg_mr");
+        return -1;
+    }
+
+    ud_ctx.rbuf = malloc((size_t)UD_BUFFERS * RECV_SIZE);
+    ud_ctx.sbuf = malloc((size_t)UD_BUFFERS * SEND_SIZE);
+    ud_ctx.req_list = calloc(UD_BUFFERS, sizeof(struct ud_request));
+    ud_ctx.ah_cache = calloc(AH_CACHE_SIZE, sizeof(struct ah_entry));
+    if (!ud_ctx.rbuf || !ud_ctx.sbuf || !ud_ctx.req_list || !ud_ctx.ah_cache) {
+        fprintf(stderr, "out of memory in init_ud_resources()\n");
+        return -1;
+    }
+
+    if ( !(ud_ctx.rmr = ibv_reg_mr(ud_ctx.pd, ud_ctx.rbuf, (size_t)UD_BUFFERS * RECV_SIZE,
+                    IBV_ACCESS_LOCAL_WRITE)) ||
+            !(ud_ctx.smr = ibv_reg_mr(ud_ctx.pd, ud_ctx.sbuf, (size_t)UD_BUFFERS * SEND_SIZE,
+                    IBV_ACCESS_LOCAL_WRITE)) ) {
+        perror("ibv_reg_mr");
+        return -1;
+    }
+
+    uint32_t i = 0;
+    for (i = 0; i < UD_BUFFERS; ++i) {
+        struct ud_request *r = &ud_ctx.req_list[i];
+        r->hdr = (struct ud_hdr *)(ud_ctx.sbuf + (size_t)i * SEND_SIZE);
+        r->req.tp = &ud_transport;
+        r->req.conn = r;
+        r->req.index = i;
+        r->req.rbuf = (char *)(r->hdr + 1);
+        post_recv(i);
+    }
+
+    return 0;
+}
+
+/***************************************************************************//**
+ * Description
+ * Listen on rdma_cm, a client connecting only learns the address of UD QP
+ *
+ ******************************************************************************/
+static int
+init_ud_listen() {
+    if ( !(ud_ctx.cm_channel = rdma_create_event_channel()) ) {
+        perror("rdma_create_event_channel");
+        return -1;
+    }
+
+    if (0 != rdma_create_id(ud_ctx.cm_channel, &ud_ctx.listen_id, NULL, RDMA_PS_UDP)) {
+        perror("rdma_create_id()");
+        return -1;
+    }
+
+    struct rdma_addrinfo    hints,
+                            *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = RAI_PASSIVE;
+    hints.ai_port_space = RDMA_PS_UDP;
+    if (0 != rdma_getaddrinfo(NULL, port, &hints, &res)) {
+        perror("rdma_getaddrinfo");
+        return -1;
+    }
+    int ret = rdma_bind_addr(ud_ctx.listen_id, res->ai_src_addr);
+    rdma_freeaddrinfo(res);
+    if (0 != ret) {
+        perror("rdma_bind_addr()");
+        return -1;
+    }
+
+    if (0 != rdma_listen(ud_ctx.listen_id, backlog)) {
+        perror("rdma_listen");
+        return -1;
+    }
+
+    printf("Listening on UD port %s, qp %u, payload %zu\n", port, ud_ctx.qp->qp_num,
+            ud_ctx.payload_max);
+    return 0;
+}
+
+/***************************************************************************//**
+ * The transport for the protocol engine, the reply is gathered behind the
+ * header into one datagram
+ *
+ ******************************************************************************/
+static void
+ud_finish(struct request *req) {
+    struct ud_request *r = req->conn;
+    if (r->own_ah) {
+        ibv_destroy_ah(r->ah);
+        r->own_ah = 0;
+    }
+    proto_release(req);
+    post_recv(req->index);
+}
+
+static uint32_t
+lkey_of(void *addr) {
+    return slabs_owns(ud_ctx.store->slabs, addr) ? ud_ctx.arena_mr->lkey : ud_ctx.smr->lkey;
+}
+
+static void
+ud_send_reply(struct request *req) {
+    struct ud_request *r = req->conn;
+    struct ibv_sge sge[REPLY_MAX_IOV + 1];
+    size_t total = 0;
+    int i = 0;
+
+    for (i = 0; i < req->niov; ++i) {
+        total += req->iov[i].iov_len;
+    }
+    if (total > ud_ctx.payload_max) {
+        proto_reply_too_large(req, "object too large for UD");
+    }
+
+    sge[0].addr = (uintptr_t)r->hdr;
+    sge[0].length = sizeof(struct ud_hdr);
+    sge[0].lkey = ud_ctx.smr->lkey;
+    for (i = 0; i < req->niov; ++i) {
+        sge[i + 1].addr = (uintptr_t)req->iov[i].iov_base;
+        sge[i + 1].length = req->iov[i].iov_len;
+        sge[i + 1].lkey = lkey_of(req->iov[i].iov_base);
+    }
+
+    struct ibv_send_wr wr, *bad = NULL;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = WR_ID_MAKE(WR_OP_SEND, 0, req->index);
+    wr.sg_list = sge;
+    wr.num_sge = req->niov + 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.wr.ud.ah = r->ah;
+    wr.wr.ud.remote_qpn = r->qpn;
+    wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
+
+    if (0 != ibv_post_send(ud_ctx.qp, &wr, &bad)) {
+        perror("ibv_post_send()");
+        ud_finish(req);
+    }
+}
+
+static const struct transport ud_transport = {
+    .name           = "ud",
+    .send_reply     = ud_send_reply,
+    .finish         = ud_finish,
+    .write_remote   = NULL,
+    .read_remote    = NULL,
+    .counters_rkey  = NULL,
+};
+
+/***************************************************************************//**
+ * Description
+ * The address handle of the client which sent wc into r, created once per
+ * client port. Once the cache is full a handle is made for the request alone.
+ *
+ ******************************************************************************/
+static struct ibv_ah *
+ah_of(struct ud_request *r, struct ibv_wc *wc, struct ibv_grh *grh) {
+    struct ah_entry key;
+    memset(&key, 0, sizeof(key));
+    if (wc->wc_flags & IBV_WC_GRH) {
+        memcpy(key.gid, &grh->sgid, sizeof(key.gid));
+    }
+    key.lid = wc->slid;
+
+    size_t i = hash64(&key, offsetof(struct ah_entry, ah)) & (AH_CACHE_SIZE - 1);
+    struct ah_entry *e = &ud_ctx.ah_cache[i];
+    while (e->ah) {
+        if (e->lid == key.lid && 0 == memcmp(e->gid, key.gid, sizeof(key.gid))) {
+            return e->ah;
+        }
+        i = (i + 1) & (AH_CACHE_SIZE - 1);
+        e = &ud_ctx.ah_cache[i];
+    }
+
+    struct ibv_ah *ah = ibv_create_ah_from_wc(ud_ctx.pd, wc, grh, 1);
+    if (!ah) {
+        perror("ibv_create_ah_from_wc()");
+    } else if (ud_ctx.ah_count < AH_CACHE_SIZE / 4 * 3) {
+        key.ah = ah;
+        *e = key;
+        ud_ctx.ah_count += 1;
+    } else {
+        r->own_ah = 1;
+    }
+    return ah;
+}
+
+/***************************************************************************//**
+ * Return
+ * the parsed request of a receive, NULL otherwise
+ *
+ * Description
+ * Handle "work complete"
+ *
+ ******************************************************************************/
+static struct request *
+handle_work_complete(struct ibv_wc *wc) {
+    int op = WR_ID_OP(wc->wr_id);
+    uint32_t index = WR_ID_INDEX(wc->wr_id);
+    struct ud_request *r = &ud_ctx.req_list[index];
+
+    if (WR_OP_SEND == op) {
+        if (IBV_WC_SUCCESS != wc->status) {
+            printf("BAD WC [%d], op: %d\n", (int)wc->status, op);
+        }
+        ud_finish(&r->req);
+        return NULL;
+    }
+
+    char *buf = ud_ctx.rbuf + (size_t)index * RECV_SIZE;
+    if (IBV_WC_SUCCESS != wc->status || wc->byte_len < UD_GRH_SIZE + sizeof(struct ud_hdr) ||
+            !(r->ah = ah_of(r, wc, (struct ibv_grh *)buf))) {
+        if (IBV_WC_SUCCESS != wc->status) {
+            printf("BAD WC [%d], op: %d\n", (int)wc->status, op);
+        }
+        post_recv(index);
+        return NULL;
+    }
+
+    r->qpn = wc->src_qp;
+    memcpy(r->hdr, buf + UD_GRH_SIZE, sizeof(struct ud_hdr));
+
+    char *data = buf + UD_GRH_SIZE + sizeof(struct ud_hdr);
+    size_t len = wc->byte_len - UD_GRH_SIZE - sizeof(struct ud_hdr);
+    if (verbose) {
+        printf("ud request from qp %u: %.*s\n", r->qpn, (int)(len < 64 ? len : 64), data);
+    }
+    proto_parse(&r->req, data, len);
+    return &r->req;
+}
+
+static void
+poll_event_handle(int fd, short lib_event, void *arg) {
+    struct ibv_cq           *cq = NULL;
+    struct ibv_wc           wc[POLL_WC_SIZE];
+    struct request          *batch[POLL_WC_SIZE], *req = NULL;
+    void                    *null = NULL;
+    int                     cqe = 0, i = 0, n = 0;
+
+    if (0 != ibv_get_cq_event(ud_ctx.comp_channel, &cq, &null)) {
+        perror("ibv_get_cq_event");
+        return;
+    }
+    ibv_ack_cq_events(cq, 1);
+
+    if (0 != ibv_req_notify_cq(cq, 0)) {
+        perror("ibv_req_notify_cq");
+        return;
+    }
+
+    do {
+        if ( -1 == (cqe = ibv_poll_cq(cq, POLL_WC_SIZE, wc)) ) {
+            perror("ibv_poll_cq");
+            return;
+        }
+
+        for (i = 0, n = 0; i < cqe; ++i) {
+            if ( (req = handle_work_complete(&wc[i])) ) {
+                batch[n++] = req;
+            }
+        }
+        proto_coalesce(batch, n);
+        for (i = 0; i < n; ++i) {
+            proto_prefetch_bucket(batch[i]);
+        }
+        for (i = 0; i < n; ++i) {
+            proto_prefetch_item(batch[i]);
+        }
+        for (i = 0; i < n; ++i) {
+            proto_execute(batch[i]);
+        }
+    } while (cqe == POLL_WC_SIZE);
+}
+
+/***************************************************************************//**
+ * Description
+ * Answer a connecting client with the UD QP, no state is kept for it
+ *
+ ******************************************************************************/
+static void
+cm_event_handle(int fd, short lib_event, void *arg) {
+    struct rdma_cm_event    *cm_event = NULL;
+    struct rdma_cm_id       *id = NULL;
+
+    if (0 != rdma_get_cm_event(ud_ctx.cm_channel, &cm_event)) {
+        perror("rdma_get_cm_event");
+        return;
+    }
+
+    if (RDMA_CM_EVENT_CONNECT_REQUEST == cm_event->event) {
+        struct rdma_conn_param param;
+        memset(&param, 0, sizeof(param));
+        param.qp_num = ud_ctx.qp->qp_num;
+
+        id = cm_event->id;
+        if (0 != rdma_accept(id, &param)) {
+            perror("rdma_accept");
+        }
+    } else if (verbose) {
+        printf("%s\n", rdma_event_str(cm_event->event));
+    }
+
+    rdma_ack_cm_event(cm_event);
+    if (id) rdma_destroy_id(id);
+}
+
+/***************************************************************************//**
+ * Return
+ * 0 on success, -1 if RDMA is unavailable
+ *
+ * Description
+ * Serve UD requests in the event loop of base
+ *
+ ******************************************************************************/
+int
+ud_transport_init(struct event_base *base, store_t *store, const char *ud_port, int verbosity) {
+    memset(&ud_ctx, 0, sizeof(struct ud_context));
+    ud_ctx.base = base;
+    ud_ctx.store = store;
+    port = ud_port;
+    verbose = verbosity;
+
+    if (0 != init_ud_resources()) return -1;
+    if (0 != init_ud_listen()) return -1;
+
+    event_set(&ud_ctx.listen_event, ud_ctx.cm_channel->fd, EV_READ | EV_PERSIST,
+            cm_event_handle, NULL);
+    event_base_set(base, &ud_ctx.listen_event);
+    event_add(&ud_ctx.listen_event, NULL);
+
+    event_set(&ud_ctx.poll_event, ud_ctx.comp_channel->fd, EV_READ | EV_PERSIST,
+            poll_event_handle, NULL);
+    event_base_set(base, &ud_ctx.poll_event);
+    event_add(&ud_ctx.poll_event, NULL);
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Description: 64-bit work request id encoding
+ *
+ * A wr_id carries everything the completion handler needs, so no per-buffer
+ * context has to be allocated and no lookup is needed to find the owner:
+ *
+ *  63      56 55                 32 31                              0
+ * +----------+---------------------+--------------------------------+
+ * |  op (8)  |  conn handle (24)   |  buffer index (32)             |
+ * +----------+---------------------+--------------------------------+
+ *
+ * The handle of a connection table is the slot in its low 16 bits and the
+ * generation of the slot above, so the flush completions of a destroyed QP
+ * do not reach the next connection in its slot (see conntable.h).
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* the operation a work request was posted for */
+enum wr_op {
+    WR_OP_RECV = 1,
+    WR_OP_SEND,
+    WR_OP_READ,
+    WR_OP_WRITE,
+    WR_OP_ATOMIC,
+};
+
+#define WR_ID_OP_SHIFT      56
+#define WR_ID_SLOT_SHIFT    32
+#define WR_ID_SLOT_MASK     0xffffffULL
+#define WR_ID_INDEX_MASK    0xffffffffULL
+
+/* the max number of connection handles a wr_id can address */
+#define WR_ID_MAX_SLOT      (1 << 24)
+
+#define WR_ID_MAKE(op, slot, index) \
+    (((uint64_t)(op) << WR_ID_OP_SHIFT) | \
+     (((uint64_t)(slot) & WR_ID_SLOT_MASK) << WR_ID_SLOT_SHIFT) | \
+     ((uint64_t)(index) & WR_ID_INDEX_MASK))
+
+#define WR_ID_OP(id)        ((int)((uint64_t)(id) >> WR_ID_OP_SHIFT))
+#define WR_ID_SLOT(id)      ((uint32_t)(((uint64_t)(id) >> WR_ID_SLOT_SHIFT) & WR_ID_SLOT_MASK))
+#define WR_ID_INDEX(id)     ((uint32_t)((uint64_t)(id) & WR_ID_INDEX_MASK))